@@ -0,0 +1,396 @@
+#include "../include/decode.hpp"
+#include "../include/decompression.h"
+#include "../include/logger.hpp"
+#include "../include/m3u8.hpp"
+#include "../include/macros.hpp"
+#include "../include/server/validate.hpp"
+#include "../include/zstd_archive.hpp"
+#include <algorithm>
+#include <archive.h>
+#include <benchmark/benchmark.h>
+#include <boost/log/expressions.hpp>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+#include <zstd.h>
+
+/*
+ * WAVY BENCH
+ *
+ * Microbenchmarks (Google Benchmark) of the per-file work on the hot paths, run over a track
+ * as hls_encoder wrote it (MPEG-TS or fMP4):
+ *
+ *   ./build/wavy_bench <track directory> [--benchmark_filter=<regex>] [--benchmark_format=json]
+ *
+ *   m3u8/parse               every playlist of the track, as the receiver and live server parse
+ *   validate/ts              the server's check of an uploaded segment (open + sync byte)
+ *   validate/m4s             the box walk of every .m4s and of the init.mp4
+ *   zstd/compress[/dict]     the dispatcher's per-file compression, without and with the
+ *                            dictionary it trains for the upload
+ *   zstd/decompress[/dict]   the server's streaming decompression on ingest (to /dev/null)
+ *   zstd/archive/<threads>   a whole upload archive through ZstdArchiver, gzip included
+ *   decode                   MediaDecoder::decode of the first variant, all of its segments
+ *
+ * Rates are bytes of input per second. Benchmarks with nothing to work on in the directory
+ * (validate/m4s on a TS track, say) are not registered.
+ */
+
+namespace
+{
+
+namespace fs = std::filesystem;
+
+struct Track
+{
+  std::vector<std::string>        playlists;  // contents
+  std::vector<std::string>        ts_paths;   // .ts segments
+  std::vector<std::string>        mp4_paths;  // .m4s segments and init.mp4
+  std::vector<std::string>        compressed; // contents the dispatcher compresses
+  std::vector<ZstdArchiver::File> files;      // what the dispatcher archives, by name
+  std::vector<std::string>        variant;    // first variant's init and segments, in order
+  std::uint64_t                   variant_bytes = 0;
+};
+
+auto read_file(const std::string& path) -> std::string
+{
+  std::ifstream in(path, std::ios::binary);
+  return {std::istreambuf_iterator<char>(in), {}};
+}
+
+auto total_size(const std::vector<std::string>& contents) -> std::int64_t
+{
+  std::int64_t size = 0;
+  for (const std::string& content : contents)
+  {
+    size += static_cast<std::int64_t>(content.size());
+  }
+  return size;
+}
+
+auto is_fmp4(const std::string& name) -> bool
+{
+  return name.ends_with(macros::M4S_FILE_EXT) || name.ends_with(macros::MP4_FILE_EXT);
+}
+
+auto load_track(const std::string& dir, Track& track) -> bool
+{
+  std::error_code ec;
+  for (const auto& entry : fs::directory_iterator(dir, ec))
+  {
+    const std::string name = entry.path().filename().string();
+    if (name.starts_with('.') || name.starts_with(macros::DISPATCH_ARCHIVE_NAME) ||
+        !entry.is_regular_file(ec))
+    {
+      continue;
+    }
+    track.files.push_back({entry.path().string(), name, !is_fmp4(name)});
+  }
+  if (ec || track.files.empty())
+  {
+    return false;
+  }
+  std::ranges::sort(track.files, {}, &ZstdArchiver::File::name);
+
+  std::string first_variant;
+  for (const ZstdArchiver::File& file : track.files)
+  {
+    if (file.name.ends_with(macros::PLAYLIST_EXT))
+    {
+      track.playlists.push_back(read_file(file.path));
+      if (first_variant.empty() && file.name != macros::MASTER_PLAYLIST)
+      {
+        first_variant = file.path;
+      }
+    }
+    else if (file.name.ends_with(macros::TRANSPORT_STREAM_EXT))
+    {
+      track.ts_paths.push_back(file.path);
+    }
+    else if (is_fmp4(file.name))
+    {
+      track.mp4_paths.push_back(file.path);
+    }
+    if (file.compress)
+    {
+      track.compressed.push_back(read_file(file.path));
+    }
+  }
+
+  // The receiver's input: init segment first, then the segments in playlist order
+  const std::string text = first_variant.empty() ? "" : read_file(first_variant);
+  m3u8::Playlist    playlist;
+  if (!text.empty() && m3u8::parse(text, playlist) && !playlist.is_master())
+  {
+    if (playlist.map)
+    {
+      track.variant.push_back(read_file(dir + "/" + std::string(playlist.map->uri)));
+    }
+    for (const m3u8::Segment& segment : playlist.segments)
+    {
+      if (!segment.range) // byte-range playlists are left out: one file, read once
+      {
+        track.variant.push_back(read_file(dir + "/" + std::string(segment.uri)));
+      }
+    }
+    track.variant_bytes = static_cast<std::uint64_t>(total_size(track.variant));
+  }
+  return true;
+}
+
+void bench_m3u8_parse(benchmark::State& state, const Track& track)
+{
+  m3u8::Playlist playlist;
+  for (auto _ : state)
+  {
+    for (const std::string& text : track.playlists)
+    {
+      playlist.clear();
+      benchmark::DoNotOptimize(m3u8::parse(text, playlist));
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * total_size(track.playlists));
+  state.SetItemsProcessed(state.iterations() * static_cast<std::int64_t>(track.playlists.size()));
+}
+
+void bench_validate_ts(benchmark::State& state, const Track& track)
+{
+  std::vector<uint8_t> head(1);
+  for (auto _ : state)
+  {
+    for (const std::string& path : track.ts_paths)
+    {
+      std::ifstream infile(path, std::ios::binary);
+      infile.read(reinterpret_cast<char*>(head.data()), 1);
+      benchmark::DoNotOptimize(validate_ts_file(head));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * static_cast<std::int64_t>(track.ts_paths.size()));
+}
+
+void bench_validate_m4s(benchmark::State& state, const Track& track)
+{
+  std::int64_t bytes = 0;
+  for (const std::string& path : track.mp4_paths)
+  {
+    bytes += static_cast<std::int64_t>(fs::file_size(path));
+  }
+  for (auto _ : state)
+  {
+    for (const std::string& path : track.mp4_paths)
+    {
+      benchmark::DoNotOptimize(validate_m4s(path));
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * bytes);
+  state.SetItemsProcessed(state.iterations() * static_cast<std::int64_t>(track.mp4_paths.size()));
+}
+
+void bench_zstd_compress(benchmark::State& state, const Track& track, const std::string& dictionary)
+{
+  using Context    = std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)>;
+  using Dictionary = std::unique_ptr<ZSTD_CDict, decltype(&ZSTD_freeCDict)>;
+
+  Context    cctx(ZSTD_createCCtx(), &ZSTD_freeCCtx);
+  Dictionary cdict(dictionary.empty() ? nullptr
+                                      : ZSTD_createCDict(dictionary.data(), dictionary.size(),
+                                                         WAVY_DISPATCH_ZSTD_LEVEL),
+                   &ZSTD_freeCDict);
+
+  std::string  output;
+  std::int64_t compressed = 0;
+  for (auto _ : state)
+  {
+    compressed = 0;
+    for (const std::string& input : track.compressed)
+    {
+      output.resize(ZSTD_compressBound(input.size()));
+      const std::size_t size =
+        cdict ? ZSTD_compress_usingCDict(cctx.get(), output.data(), output.size(), input.data(),
+                                         input.size(), cdict.get())
+              : ZSTD_compressCCtx(cctx.get(), output.data(), output.size(), input.data(),
+                                  input.size(), WAVY_DISPATCH_ZSTD_LEVEL);
+      if (ZSTD_isError(size))
+      {
+        state.SkipWithError(ZSTD_getErrorName(size));
+        return;
+      }
+      compressed += static_cast<std::int64_t>(size);
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * total_size(track.compressed));
+  state.counters["ratio"] =
+    compressed > 0 ? static_cast<double>(total_size(track.compressed)) / compressed : 0.0;
+}
+
+void bench_zstd_decompress(benchmark::State& state, const Track& track,
+                           const std::string& dictionary)
+{
+  using Context    = std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)>;
+  using Dictionary = std::unique_ptr<ZSTD_DDict, decltype(&ZSTD_freeDDict)>;
+
+  // Compressed once up front, the way the dispatcher sends them
+  std::vector<std::string> frames;
+  {
+    ZSTD_CCtx*  cctx  = ZSTD_createCCtx();
+    ZSTD_CDict* cdict = dictionary.empty() ? nullptr
+                                           : ZSTD_createCDict(dictionary.data(), dictionary.size(),
+                                                              WAVY_DISPATCH_ZSTD_LEVEL);
+    for (const std::string& input : track.compressed)
+    {
+      std::string frame(ZSTD_compressBound(input.size()), '\0');
+      const std::size_t size =
+        cdict ? ZSTD_compress_usingCDict(cctx, frame.data(), frame.size(), input.data(),
+                                         input.size(), cdict)
+              : ZSTD_compressCCtx(cctx, frame.data(), frame.size(), input.data(), input.size(),
+                                  WAVY_DISPATCH_ZSTD_LEVEL);
+      frame.resize(ZSTD_isError(size) ? 0 : size);
+      frames.push_back(std::move(frame));
+    }
+    ZSTD_freeCDict(cdict);
+    ZSTD_freeCCtx(cctx);
+  }
+
+  Context    dctx(ZSTD_createDCtx(), &ZSTD_freeDCtx);
+  Dictionary ddict(dictionary.empty() ? nullptr
+                                      : ZSTD_createDDict(dictionary.data(), dictionary.size()),
+                   &ZSTD_freeDDict);
+  for (auto _ : state)
+  {
+    for (const std::string& frame : frames)
+    {
+      ZSTD_FileSink sink;
+      if (!ZSTD_FileSink_open(&sink, dctx.get(), ddict.get(), "/dev/null"))
+      {
+        state.SkipWithError("Cannot open /dev/null");
+        return;
+      }
+      const bool written = ZSTD_FileSink_write(&sink, frame.data(), frame.size());
+      if (!ZSTD_FileSink_close(&sink) || !written)
+      {
+        state.SkipWithError("Decompression failed");
+        return;
+      }
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * total_size(track.compressed)); // decompressed
+}
+
+void bench_zstd_archive(benchmark::State& state, const Track& track, const std::string& dictionary)
+{
+  ZstdArchiver archiver(static_cast<std::size_t>(state.range(0)));
+  for (auto _ : state)
+  {
+    struct archive* archive = archive_write_new();
+    archive_write_add_filter_gzip(archive);
+    archive_write_set_format_pax_restricted(archive);
+    if (archive_write_open_filename(archive, "/dev/null") != ARCHIVE_OK ||
+        !archiver.write(archive, track.files, dictionary))
+    {
+      archive_write_free(archive);
+      state.SkipWithError("Archive failed");
+      return;
+    }
+    archive_write_close(archive);
+    archive_write_free(archive);
+  }
+
+  std::int64_t bytes = 0;
+  for (const ZstdArchiver::File& file : track.files)
+  {
+    bytes += static_cast<std::int64_t>(fs::file_size(file.path));
+  }
+  state.SetBytesProcessed(state.iterations() * bytes);
+}
+
+void bench_decode(benchmark::State& state, const Track& track)
+{
+  MediaDecoder               decoder;
+  std::vector<unsigned char> output;
+  std::vector<std::string>   segments = track.variant;
+  for (auto _ : state)
+  {
+    output.clear();
+    if (!decoder.decode(segments, output))
+    {
+      state.SkipWithError("Decoding failed");
+      return;
+    }
+    benchmark::DoNotOptimize(output.data());
+  }
+  state.SetBytesProcessed(state.iterations() * static_cast<std::int64_t>(track.variant_bytes));
+  state.counters["segments/s"] =
+    benchmark::Counter(static_cast<double>(state.iterations() * segments.size()),
+                       benchmark::Counter::kIsRate);
+}
+
+} // namespace
+
+auto main(int argc, char** argv) -> int
+{
+  benchmark::Initialize(&argc, argv); // takes the --benchmark_* flags out of argv
+  if (argc < 2)
+  {
+    std::cerr << "Usage: " << argv[0] << " <track directory> [--benchmark_filter=<regex>]\n";
+    return 1;
+  }
+
+  // Only what goes wrong is worth a line in between the results
+  logger::init_logging();
+  boost::log::core::get()->set_filter(boost::log::trivial::severity >=
+                                      boost::log::trivial::warning);
+  av_log_set_level(AV_LOG_ERROR);
+
+  static Track track;
+  if (!load_track(argv[1], track))
+  {
+    std::cerr << "No encoded track in " << argv[1] << "\n";
+    return 1;
+  }
+  static const std::string dictionary = ZstdArchiver::train_dictionary(track.files);
+
+  if (!track.playlists.empty())
+  {
+    benchmark::RegisterBenchmark("m3u8/parse", bench_m3u8_parse, std::cref(track));
+  }
+  if (!track.ts_paths.empty())
+  {
+    benchmark::RegisterBenchmark("validate/ts", bench_validate_ts, std::cref(track));
+  }
+  if (!track.mp4_paths.empty())
+  {
+    benchmark::RegisterBenchmark("validate/m4s", bench_validate_m4s, std::cref(track));
+  }
+  if (!track.compressed.empty())
+  {
+    benchmark::RegisterBenchmark("zstd/compress", bench_zstd_compress, std::cref(track),
+                                 std::string());
+    benchmark::RegisterBenchmark("zstd/decompress", bench_zstd_decompress, std::cref(track),
+                                 std::string());
+    if (!dictionary.empty())
+    {
+      benchmark::RegisterBenchmark("zstd/compress/dict", bench_zstd_compress, std::cref(track),
+                                   dictionary);
+      benchmark::RegisterBenchmark("zstd/decompress/dict", bench_zstd_decompress,
+                                   std::cref(track), dictionary);
+    }
+  }
+  benchmark::RegisterBenchmark("zstd/archive", bench_zstd_archive, std::cref(track), dictionary)
+    ->RangeMultiplier(2)
+    ->Range(1, std::max(1U, std::thread::hardware_concurrency()))
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+  if (!track.variant.empty())
+  {
+    benchmark::RegisterBenchmark("decode", bench_decode, std::cref(track))
+      ->Unit(benchmark::kMillisecond);
+  }
+
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
@@ -0,0 +1,748 @@
+#include "../include/m3u8.hpp"
+#include "../include/macros.hpp"
+#include <algorithm>
+#include <atomic>
+#include <boost/asio/connect.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/beast.hpp>
+#include <boost/beast/ssl.hpp>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <dirent.h>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <sys/resource.h>
+#include <thread>
+#include <vector>
+
+/*
+ * WAVY LOADGEN
+ *
+ * Drives a running hls_server with many concurrent TLS clients and reports what they saw:
+ *
+ *   ./build/wavy_loadgen <server> [port] [--receivers <n>] [--uploaders <n>]
+ *                        [--payload <hls_data.tar.gz>] [--duration <s>] [--threads <n>]
+ *                        [--tracks <n>] [--server-pid <pid>]
+ *
+ * -> Receivers each keep one persistent connection. On it they fetch a stored track the way a
+ *    receiver does: master playlist, first variant, then its segments in order. After that they
+ *    start over with another track picked at random. They read as fast as the server sends: this
+ *    measures the server, not playback. Tracks come from /hls/clients at startup (the first
+ *    --tracks of them), so the server needs some uploads first.
+ *
+ * -> Uploaders POST the payload archive (the dispatcher's payload/hls_data.tar.gz) through the
+ *    streaming upload path, one upload at a time per connection, in a loop. Every upload is
+ *    stored as a new audio-id: point the server at a scratch storage directory.
+ *
+ * -> TTFB runs from the request being written to its response header being read, and is
+ *    reported as p50/p99 per kind of request. An upload's response header only comes once the
+ *    upload is stored, so for uploads that is their whole latency.
+ *
+ * -> The server's RSS (found by name unless --server-pid is given) is sampled every second,
+ *    together with the running counts. The peak is in the final report.
+ *
+ * Clients start spread over the first second, and a client whose connection fails reconnects
+ * after a short pause. Both keep thousands of handshakes from arriving at the same instant.
+ * Requests still in flight at the end get kGrace to finish, and are then abandoned; what their
+ * clients measured before is still in the report.
+ */
+
+namespace
+{
+
+namespace beast = boost::beast;
+namespace http  = beast::http;
+namespace net   = boost::asio;
+namespace ssl   = net::ssl;
+using tcp       = net::ip::tcp;
+using Clock     = std::chrono::steady_clock;
+using Stream    = beast::ssl_stream<beast::tcp_stream>;
+
+constexpr auto kTimeout = std::chrono::seconds(30);
+constexpr auto kRetry   = std::chrono::milliseconds(100);
+constexpr auto kGrace   = std::chrono::seconds(10); // for requests still in flight at the end
+
+struct Options
+{
+  std::string server;
+  std::string port       = WAVY_SERVER_PORT_NO_STR;
+  std::size_t receivers  = 100;
+  std::size_t uploaders  = 0;
+  std::size_t threads    = std::max(1U, std::thread::hardware_concurrency());
+  std::size_t tracks     = 64;
+  int         duration_s = 30;
+  int         server_pid = 0;
+  std::string payload;
+};
+
+// Latencies of one kind of request, in microseconds
+struct Samples
+{
+  std::vector<std::uint32_t> us;
+
+  void add(Clock::duration elapsed)
+  {
+    us.push_back(static_cast<std::uint32_t>(
+      std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count()));
+  }
+
+  void merge(const Samples& other) { us.insert(us.end(), other.us.begin(), other.us.end()); }
+
+  // In milliseconds; sorts the samples
+  auto percentile(double p) -> double
+  {
+    if (us.empty())
+    {
+      return 0.0;
+    }
+    const auto rank = static_cast<std::size_t>(p * static_cast<double>(us.size() - 1));
+    std::nth_element(us.begin(), us.begin() + static_cast<std::ptrdiff_t>(rank), us.end());
+    return us[rank] / 1000.0;
+  }
+};
+
+struct Report
+{
+  std::atomic<std::uint64_t> playlists{0};
+  std::atomic<std::uint64_t> segments{0};
+  std::atomic<std::uint64_t> segment_bytes{0};
+  std::atomic<std::uint64_t> uploads{0};
+  std::atomic<std::uint64_t> rejected{0}; // non-200 answers
+  std::atomic<std::uint64_t> errors{0};   // failed connections and requests
+  std::atomic<std::size_t>   active{0};   // clients not done yet
+
+  std::mutex mutex; // the samples, merged by every client when it is done
+  Samples    playlist_ttfb;
+  Samples    segment_ttfb;
+  Samples    upload_latency;
+};
+
+// The requests of one pass over a track; the first `playlists` of them are playlists
+struct Track
+{
+  std::vector<std::string> targets;
+  std::size_t              playlists = 0;
+};
+
+struct Shared
+{
+  Options                            options;
+  ssl::context                       ctx{ssl::context::tlsv12_client};
+  tcp::resolver::results_type        endpoints;
+  std::vector<Track>                 tracks;
+  std::shared_ptr<const std::string> payload;
+  Clock::time_point                  deadline;
+  Report                             report;
+};
+
+/*
+ * One receiver or uploader. Every handler runs on the client's strand, and the client is kept
+ * alive by the handler in flight; it is done once it stops issuing them (past the deadline),
+ * and its destructor hands its samples to the report.
+ */
+class Client : public std::enable_shared_from_this<Client>
+{
+public:
+  enum class Role
+  {
+    Receiver,
+    Uploader
+  };
+
+  Client(net::io_context& io, Shared& shared, Role role, std::uint64_t seed)
+      : shared_(shared), role_(role), strand_(net::make_strand(io)), timer_(strand_), rng_(seed)
+  {
+    ++shared_.report.active;
+  }
+
+  Client(const Client&)                    = delete;
+  auto operator=(const Client&) -> Client& = delete;
+
+  ~Client()
+  {
+    std::lock_guard lock(shared_.report.mutex);
+    shared_.report.playlist_ttfb.merge(playlist_ttfb_);
+    shared_.report.segment_ttfb.merge(segment_ttfb_);
+    shared_.report.upload_latency.merge(upload_latency_);
+    --shared_.report.active;
+  }
+
+  void start(Clock::duration delay)
+  {
+    timer_.expires_after(delay);
+    timer_.async_wait([self = shared_from_this()](beast::error_code) { self->connect(); });
+  }
+
+private:
+  using Parser = http::response_parser<http::string_body>;
+
+  Shared&                                     shared_;
+  const Role                                  role_;
+  net::strand<net::io_context::executor_type> strand_;
+  net::steady_timer                           timer_;
+  std::mt19937_64                             rng_;
+  std::optional<Stream>                       stream_;
+  beast::flat_buffer                          buffer_;
+  std::optional<Parser>                       parser_;
+  http::request<http::empty_body>             get_;
+  http::request<http::span_body<const char>>  post_;
+  Clock::time_point                           sent_at_;
+
+  const Track* track_    = nullptr;
+  std::size_t  position_ = 0; // next target of track_
+
+  Samples playlist_ttfb_;
+  Samples segment_ttfb_;
+  Samples upload_latency_;
+
+  void connect()
+  {
+    if (Clock::now() >= shared_.deadline)
+    {
+      return;
+    }
+    stream_.emplace(strand_, shared_.ctx);
+    buffer_.clear();
+
+    beast::get_lowest_layer(*stream_).expires_after(kTimeout);
+    beast::get_lowest_layer(*stream_).async_connect(
+      shared_.endpoints,
+      [self = shared_from_this()](beast::error_code ec, const tcp::endpoint&)
+      {
+        if (ec)
+        {
+          self->fail();
+          return;
+        }
+        self->stream_->async_handshake(ssl::stream_base::client,
+                                       [self](beast::error_code ec)
+                                       {
+                                         if (ec)
+                                         {
+                                           self->fail();
+                                           return;
+                                         }
+                                         self->send();
+                                       });
+      });
+  }
+
+  void send()
+  {
+    if (Clock::now() >= shared_.deadline)
+    {
+      close();
+      return;
+    }
+
+    auto on_written = [self = shared_from_this()](beast::error_code ec, std::size_t)
+    {
+      if (ec)
+      {
+        self->fail();
+        return;
+      }
+      self->read_response();
+    };
+
+    beast::get_lowest_layer(*stream_).expires_after(kTimeout);
+    sent_at_ = Clock::now();
+    if (role_ == Role::Uploader)
+    {
+      post_ = {http::verb::post, "/", 11};
+      post_.set(http::field::host, shared_.options.server);
+      post_.set(http::field::content_type, macros::to_string(macros::CONTENT_TYPE_COMPRESSION));
+      post_.keep_alive(true);
+      post_.body() = {shared_.payload->data(), shared_.payload->size()};
+      post_.prepare_payload();
+      http::async_write(*stream_, post_, std::move(on_written));
+      return;
+    }
+
+    if (!track_ || position_ == track_->targets.size())
+    {
+      track_    = &shared_.tracks[rng_() % shared_.tracks.size()];
+      position_ = 0;
+    }
+    get_ = {http::verb::get, track_->targets[position_], 11};
+    get_.set(http::field::host, shared_.options.server);
+    get_.keep_alive(true);
+    http::async_write(*stream_, get_, std::move(on_written));
+  }
+
+  void read_response()
+  {
+    parser_.emplace();
+    parser_->body_limit(std::numeric_limits<std::uint64_t>::max());
+    http::async_read_header(
+      *stream_, buffer_, *parser_,
+      [self = shared_from_this()](beast::error_code ec, std::size_t)
+      {
+        if (ec)
+        {
+          self->fail();
+          return;
+        }
+        const Clock::duration ttfb = Clock::now() - self->sent_at_;
+        http::async_read(*self->stream_, self->buffer_, *self->parser_,
+                         [self, ttfb](beast::error_code ec, std::size_t)
+                         {
+                           if (ec)
+                           {
+                             self->fail();
+                             return;
+                           }
+                           self->record(ttfb);
+                         });
+      });
+  }
+
+  void record(Clock::duration ttfb)
+  {
+    Report&                                   report   = shared_.report;
+    const http::response<http::string_body>& response = parser_->get();
+    const bool                                ok       = response.result() == http::status::ok;
+
+    if (!ok)
+    {
+      ++report.rejected;
+    }
+    else if (role_ == Role::Uploader)
+    {
+      ++report.uploads;
+      upload_latency_.add(ttfb);
+    }
+    else if (position_ < track_->playlists)
+    {
+      ++report.playlists;
+      playlist_ttfb_.add(ttfb);
+    }
+    else
+    {
+      ++report.segments;
+      report.segment_bytes += response.body().size();
+      segment_ttfb_.add(ttfb);
+    }
+    if (role_ == Role::Receiver)
+    {
+      ++position_;
+    }
+
+    if (!response.keep_alive())
+    {
+      stream_.reset();
+      connect();
+      return;
+    }
+    send();
+  }
+
+  void fail()
+  {
+    ++shared_.report.errors;
+    stream_.reset();
+    timer_.expires_after(kRetry);
+    timer_.async_wait([self = shared_from_this()](beast::error_code) { self->connect(); });
+  }
+
+  void close()
+  {
+    beast::get_lowest_layer(*stream_).expires_after(std::chrono::seconds(5));
+    stream_->async_shutdown([self = shared_from_this()](beast::error_code) {});
+  }
+};
+
+// Blocking connection for the startup requests; reconnects whenever the server closes it
+class Probe
+{
+public:
+  Probe(net::io_context& io, Shared& shared) : io_(io), shared_(shared) {}
+
+  Probe(const Probe&)                    = delete;
+  auto operator=(const Probe&) -> Probe& = delete;
+
+  ~Probe()
+  {
+    beast::error_code ec;
+    if (stream_)
+    {
+      stream_->shutdown(ec);
+    }
+  }
+
+  // One GET; false unless it is answered with a 200
+  auto get(const std::string& target, std::string& body) -> bool
+  {
+    try
+    {
+      if (!stream_)
+      {
+        stream_.emplace(io_, shared_.ctx);
+        beast::get_lowest_layer(*stream_).connect(shared_.endpoints);
+        stream_->handshake(ssl::stream_base::client);
+      }
+
+      http::request<http::empty_body> request{http::verb::get, target, 11};
+      request.set(http::field::host, shared_.options.server);
+      request.keep_alive(true);
+      http::write(*stream_, request);
+
+      beast::flat_buffer                buffer;
+      http::response<http::string_body> response;
+      http::read(*stream_, buffer, response);
+      if (!response.keep_alive())
+      {
+        stream_.reset();
+      }
+      if (response.result() != http::status::ok)
+      {
+        return false;
+      }
+      body = std::move(response.body());
+      return true;
+    }
+    catch (const std::exception& e)
+    {
+      error_ = e.what();
+      stream_.reset();
+      return false;
+    }
+  }
+
+  [[nodiscard]] auto error() const -> const std::string& { return error_; }
+
+private:
+  net::io_context&      io_;
+  Shared&               shared_;
+  std::optional<Stream> stream_;
+  std::string           error_; // of the last request that failed to complete
+};
+
+/*
+ * Lists the stored tracks and plans one pass over each of the first --tracks: master playlist,
+ * first variant, init segment and segments. Byte-range tracks (one media file) are planned as
+ * one request for the file.
+ */
+auto discover_tracks(net::io_context& io, Shared& shared) -> bool
+{
+  Probe       probe(io, shared);
+  std::string listing;
+  if (!probe.get(macros::to_string(macros::SERVER_PATH_HLS_CLIENTS), listing))
+  {
+    if (!probe.error().empty())
+    {
+      std::cerr << "Cannot reach " << shared.options.server << ":" << shared.options.port << ": "
+                << probe.error() << "\n";
+    }
+    else
+    {
+      std::cerr << "No stored tracks to receive (upload some first)\n";
+    }
+    return false;
+  }
+
+  // "<ip>:\n  - <audio-id>\n"
+  std::istringstream lines(listing);
+  std::string        line;
+  std::string        ip;
+  while (std::getline(lines, line) && shared.tracks.size() < shared.options.tracks)
+  {
+    if (line.ends_with(':'))
+    {
+      ip = line.substr(0, line.size() - 1);
+      continue;
+    }
+    if (!line.starts_with("  - ") || ip.empty())
+    {
+      continue;
+    }
+
+    const std::string base = "/hls/" + ip + "/" + line.substr(4) + "/";
+    Track             track;
+    std::string       master_text;
+    std::string       variant_text;
+    m3u8::Playlist    master;
+    m3u8::Playlist    variant;
+    track.targets.push_back(base + macros::to_string(macros::MASTER_PLAYLIST));
+    if (!probe.get(track.targets.back(), master_text) || !m3u8::parse(master_text, master))
+    {
+      continue;
+    }
+    if (master.is_master())
+    {
+      track.targets.push_back(base + std::string(master.variants.front().uri));
+      if (!probe.get(track.targets.back(), variant_text) || !m3u8::parse(variant_text, variant))
+      {
+        continue;
+      }
+    }
+    else
+    {
+      variant = master;
+    }
+    track.playlists = track.targets.size();
+
+    if (variant.map)
+    {
+      track.targets.push_back(base + std::string(variant.map->uri));
+    }
+    for (const m3u8::Segment& segment : variant.segments)
+    {
+      const std::string target = base + std::string(segment.uri);
+      if (track.targets.back() != target)
+      {
+        track.targets.push_back(target);
+      }
+    }
+    if (track.targets.size() > track.playlists)
+    {
+      shared.tracks.push_back(std::move(track));
+    }
+  }
+
+  if (shared.tracks.empty())
+  {
+    std::cerr << "No stored track has a playable playlist\n";
+    return false;
+  }
+  return true;
+}
+
+auto find_pid(std::string_view name) -> int
+{
+  DIR* proc = ::opendir("/proc");
+  if (!proc)
+  {
+    return 0;
+  }
+  int pid = 0;
+  while (const struct dirent* entry = ::readdir(proc))
+  {
+    std::string   comm;
+    std::ifstream in(std::string("/proc/") + entry->d_name + "/comm");
+    if (std::getline(in, comm) && comm == name)
+    {
+      pid = std::atoi(entry->d_name);
+      break;
+    }
+  }
+  ::closedir(proc);
+  return pid;
+}
+
+// VmRSS of a process, in KiB; 0 if it cannot be read
+auto rss_kib(int pid) -> std::uint64_t
+{
+  std::ifstream in(pid > 0 ? "/proc/" + std::to_string(pid) + "/status" : "/proc/self/status");
+  std::string   line;
+  while (std::getline(in, line))
+  {
+    if (line.starts_with("VmRSS:"))
+    {
+      return std::strtoull(line.c_str() + 6, nullptr, 10);
+    }
+  }
+  return 0;
+}
+
+template <typename T> auto parse_number(std::string_view text, T& out) -> bool
+{
+  const auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), out);
+  return !text.empty() && ec == std::errc{} && end == text.data() + text.size();
+}
+
+auto parse_options(int argc, char* argv[], Options& options) -> bool
+{
+  if (argc < 2)
+  {
+    return false;
+  }
+  options.server = argv[1];
+
+  int i = 2;
+  if (i < argc && !std::string_view(argv[i]).starts_with("--"))
+  {
+    options.port = argv[i++];
+  }
+  for (; i < argc; ++i)
+  {
+    const std::string_view flag  = argv[i];
+    const std::string_view value = i + 1 < argc ? argv[i + 1] : "";
+    bool                   ok    = true;
+    if (flag == "--receivers")
+      ok = parse_number(value, options.receivers);
+    else if (flag == "--uploaders")
+      ok = parse_number(value, options.uploaders);
+    else if (flag == "--threads")
+      ok = parse_number(value, options.threads) && options.threads > 0;
+    else if (flag == "--tracks")
+      ok = parse_number(value, options.tracks) && options.tracks > 0;
+    else if (flag == "--duration")
+      ok = parse_number(value, options.duration_s) && options.duration_s > 0;
+    else if (flag == "--server-pid")
+      ok = parse_number(value, options.server_pid);
+    else if (flag == "--payload")
+      options.payload = value;
+    else
+      ok = false;
+
+    if (!ok || value.empty())
+    {
+      std::cerr << "Invalid option: " << flag << " " << value << "\n";
+      return false;
+    }
+    ++i;
+  }
+  return options.receivers + options.uploaders > 0 &&
+         (options.uploaders == 0 || !options.payload.empty());
+}
+
+// Thousands of connections need more descriptors than the usual soft limit
+void raise_fd_limit()
+{
+  struct rlimit limit{};
+  if (::getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+  {
+    limit.rlim_cur = limit.rlim_max;
+    ::setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
+
+auto mib(std::uint64_t kib) -> double { return static_cast<double>(kib) / 1024.0; }
+
+} // namespace
+
+auto main(int argc, char* argv[]) -> int
+{
+  Shared shared;
+  if (!parse_options(argc, argv, shared.options))
+  {
+    std::cerr << "Usage: " << argv[0]
+              << " <server> [port] [--receivers <n>] [--uploaders <n>] [--payload <archive>]"
+                 " [--duration <s>] [--threads <n>] [--tracks <n>] [--server-pid <pid>]\n";
+    return 1;
+  }
+  const Options& options = shared.options;
+  raise_fd_limit();
+
+  auto  context = std::make_unique<net::io_context>();
+  auto& io      = *context;
+  shared.ctx.set_verify_mode(ssl::verify_none);
+  try
+  {
+    shared.endpoints = tcp::resolver(io).resolve(options.server, options.port);
+  }
+  catch (const std::exception& e)
+  {
+    std::cerr << "Cannot resolve " << options.server << ": " << e.what() << "\n";
+    return 1;
+  }
+
+  if (options.receivers > 0 && !discover_tracks(io, shared))
+  {
+    return 1;
+  }
+  if (options.uploaders > 0)
+  {
+    std::ifstream in(options.payload, std::ios::binary);
+    shared.payload = std::make_shared<const std::string>(std::istreambuf_iterator<char>(in),
+                                                         std::istreambuf_iterator<char>());
+    if (shared.payload->empty())
+    {
+      std::cerr << "Cannot read payload " << options.payload << "\n";
+      return 1;
+    }
+  }
+
+  const int server_pid = options.server_pid > 0 ? options.server_pid : find_pid("hls_server");
+  std::cout << "Load: " << options.receivers << " receiver(s) over " << shared.tracks.size()
+            << " track(s), " << options.uploaders << " uploader(s), " << options.duration_s
+            << " s, " << options.threads << " thread(s)\n";
+
+  // Every client stays alive through its own handlers, so the threads end with the last one
+  const Clock::time_point start = Clock::now();
+  shared.deadline               = start + std::chrono::seconds(options.duration_s);
+  const std::size_t clients     = options.receivers + options.uploaders;
+  for (std::size_t i = 0; i < clients; ++i)
+  {
+    const auto role  = i < options.receivers ? Client::Role::Receiver : Client::Role::Uploader;
+    const auto delay = std::chrono::microseconds(1000000 * i / clients);
+    std::make_shared<Client>(io, shared, role, i)->start(delay);
+  }
+
+  std::vector<std::thread> threads;
+  for (std::size_t i = 0; i < options.threads; ++i)
+  {
+    threads.emplace_back([&io] { io.run(); });
+  }
+
+  // Once a second: progress, and the server's RSS
+  std::uint64_t peak_rss = 0;
+  std::uint64_t last     = 0;
+  while (Clock::now() < shared.deadline)
+  {
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    const std::uint64_t segments = shared.report.segments;
+    const std::uint64_t rss      = server_pid > 0 ? rss_kib(server_pid) : 0;
+    peak_rss                     = std::max(peak_rss, rss);
+    std::cout << "  " << std::setw(4)
+              << std::chrono::duration_cast<std::chrono::seconds>(Clock::now() - start).count()
+              << " s  " << std::setw(8) << segments - last << " segments/s  " << std::setw(6)
+              << shared.report.uploads << " uploads  " << std::setw(6) << shared.report.errors
+              << " errors  server RSS " << std::fixed << std::setprecision(1) << mib(rss)
+              << " MiB\n";
+    last = segments;
+  }
+
+  const Clock::time_point end = Clock::now() + kGrace;
+  while (shared.report.active > 0 && Clock::now() < end)
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  const std::size_t abandoned = shared.report.active;
+  io.stop();
+  for (std::thread& thread : threads)
+  {
+    thread.join();
+  }
+  context.reset(); // destroys the abandoned clients' handlers, and with them the clients
+  const double elapsed = options.duration_s; // what finishes in the grace period is not a rate
+
+  Report& report = shared.report;
+  std::cout << std::fixed << std::setprecision(2) << "\n"
+            << "Playlists   : " << report.playlists << ", TTFB p50 "
+            << report.playlist_ttfb.percentile(0.50) << " ms, p99 "
+            << report.playlist_ttfb.percentile(0.99) << " ms\n"
+            << "Segments    : " << report.segments << " ("
+            << static_cast<double>(report.segments) / elapsed << " segments/s, "
+            << mib(report.segment_bytes / 1024) / elapsed << " MiB/s), TTFB p50 "
+            << report.segment_ttfb.percentile(0.50) << " ms, p99 "
+            << report.segment_ttfb.percentile(0.99) << " ms\n"
+            << "Uploads     : " << report.uploads << " ("
+            << static_cast<double>(report.uploads) / elapsed << " uploads/s), latency p50 "
+            << report.upload_latency.percentile(0.50) << " ms, p99 "
+            << report.upload_latency.percentile(0.99) << " ms\n"
+            << "Rejected    : " << report.rejected << " (non-200), errors: " << report.errors
+            << ", abandoned: " << abandoned << "\n";
+  if (server_pid > 0)
+  {
+    std::cout << "Server RSS  : peak " << mib(peak_rss) << " MiB, now "
+              << mib(rss_kib(server_pid)) << " MiB (pid " << server_pid << ")\n";
+  }
+  std::cout << "Loadgen RSS : " << mib(rss_kib(0)) << " MiB\n";
+  return 0;
+}
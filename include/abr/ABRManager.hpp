@@ -1,90 +1,134 @@
 #pragma once
 
-#include "PlaylistParser.hpp"
-#include "NetworkDiagnoser.hpp"
-#include <vector>
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
 
-class ABRManager {
+/*
+ * ABR MANAGER
+ *
+ * Picks the variant of every next segment from the throughput the receiver actually measured
+ * while downloading the previous ones, and from how much audio it has buffered.
+ *
+ * -> Throughput is tracked by two EWMAs over download time (fast and slow half-lives), and the
+ *    lower of the two is used, so a sudden drop is followed almost at once while a burst of
+ *    speed only counts once it lasts. Tiny downloads are ignored: their time is all latency.
+ *
+ * -> The throughput rule picks the highest variant whose bandwidth fits in kSafety of the
+ *    estimate. Buffer occupancy then gates it, like the buffer-based part of BOLA:
+ *      - below kPanicBuffer, drop straight to the lowest variant (a stall is imminent),
+ *      - switch up only with at least kSwitchUpBuffer of audio buffered,
+ *      - above kComfortBuffer, a lower estimate does not force a switch down yet.
+ *
+ * -> Until the first sample arrives the lowest variant is used, so playback starts fast on any
+ *    link and climbs from there.
+ *
+ * There's no I/O in here: the client feeds it samples from its segment fetcher.
+ */
+
+class ABRManager
+{
 public:
-    ABRManager(boost::asio::io_context &ioc, const std::string &master_url)
-        : ioc_(ioc),
-          ssl_ctx_(boost::asio::ssl::context::sslv23),
-          parser_(ioc, ssl_ctx_, master_url),
-          network_(ioc, master_url) {}
+  static constexpr double kSafety           = 0.8;  // share of the estimate a variant may use
+  static constexpr double kPanicBuffer      = 3.0;  // seconds
+  static constexpr double kSwitchUpBuffer   = 8.0;  // seconds
+  static constexpr double kComfortBuffer    = 20.0; // seconds
+  static constexpr double kFastHalfLife     = 2.0;  // seconds of download time
+  static constexpr double kSlowHalfLife     = 8.0;  // seconds of download time
+  static constexpr double kMinSampleBytes   = 16 * 1024;
+  static constexpr double kMinSampleSeconds = 0.005;
 
-    void selectBestBitrate() {
-        if (!parser_.fetchMasterPlaylist()) {
-            std::cerr << "[ERROR] Failed to fetch master playlist.\n";
-            return;
-        }
+  // Bandwidths (bits/s) of the variants, in ascending order; select() returns indices into it
+  explicit ABRManager(std::vector<std::uint64_t> bandwidths)
+      : bandwidths_(std::move(bandwidths))
+  {
+  }
 
-        NetworkStats stats = network_.diagnoseNetworkSpeed();
-        if (stats.latency < 0) {
-            std::cerr << "[ERROR] Network diagnosis failed.\n";
-            return;
-        }
+  // One finished download: its size and time on the wire
+  void record_download(std::size_t bytes, std::chrono::steady_clock::duration elapsed)
+  {
+    const double seconds = std::chrono::duration<double>(elapsed).count();
+    if (bytes < kMinSampleBytes || seconds < kMinSampleSeconds)
+    {
+      return;
+    }
 
-        std::map<int, std::string> playlists = parser_.getBitratePlaylists();
-        if (playlists.empty()) {
-            std::cerr << "[ERROR] No available bitrates in playlist.\n";
-            return;
-        }
+    const double bps = static_cast<double>(bytes) * 8.0 / seconds;
+    fast_.add(bps, seconds, kFastHalfLife);
+    slow_.add(bps, seconds, kSlowHalfLife);
+  }
 
-        // Extract bitrates and sort them in ascending order
-        std::vector<int> available_bitrates;
-        for (const auto &[bitrate, _] : playlists) {
-            available_bitrates.push_back(bitrate);
-        }
-        std::sort(available_bitrates.begin(), available_bitrates.end());
+  // Estimated throughput in bits/s; 0 until the first usable sample
+  [[nodiscard]] auto estimate() const -> double { return std::min(fast_.value(), slow_.value()); }
 
-        int selected_bitrate = determineBestBitrate(stats, available_bitrates);
-        std::cout << "[INFO] Selected Best Bitrate: " << selected_bitrate << " kbps\n";
+  // Variant for the next segment, given the seconds of audio buffered ahead of the device
+  auto select(double buffer_seconds) -> std::size_t
+  {
+    if (bandwidths_.empty() || estimate() <= 0.0)
+    {
+      return current_;
     }
 
-private:
-    boost::asio::io_context &ioc_;
-    boost::asio::ssl::context ssl_ctx_;
-    PlaylistParser parser_;
-    NetworkDiagnoser network_;
-
-    /**
-     * Determines the best bitrate based on network statistics.
-     */
-    int determineBestBitrate(const NetworkStats &stats, const std::vector<int> &bitrates) {
-        if (bitrates.empty()) return 64000; // Default minimum bitrate
+    std::size_t target = 0;
+    for (std::size_t i = 0; i < bandwidths_.size(); ++i)
+    {
+      if (static_cast<double>(bandwidths_[i]) <= estimate() * kSafety)
+      {
+        target = i;
+      }
+    }
 
-        // Define network thresholds
-        constexpr int LOW_LATENCY = 80;
-        constexpr int MEDIUM_LATENCY = 150;
-        constexpr int HIGH_LATENCY = 250;
-        constexpr double MAX_PACKET_LOSS = 20.0;
-        constexpr double MAX_JITTER = 50.0;
+    if (buffer_seconds < kPanicBuffer)
+    {
+      current_ = 0;
+    }
+    else if (target > current_ && buffer_seconds >= kSwitchUpBuffer)
+    {
+      current_ = target;
+    }
+    else if (target < current_ && buffer_seconds < kComfortBuffer)
+    {
+      current_ = target;
+    }
+    return current_;
+  }
 
-        int selected_bitrate = bitrates.front(); // Start with the lowest bitrate
+  [[nodiscard]] auto current() const -> std::size_t { return current_; }
 
-        for (int bitrate : bitrates) {
-            if (stats.packet_loss > MAX_PACKET_LOSS || stats.jitter > MAX_JITTER) {
-                // High packet loss or jitter -> stick to lowest bitrate
-                break;
-            }
-            if (stats.latency < LOW_LATENCY) {
-                // Low latency -> Choose highest available bitrate
-                selected_bitrate = bitrate;
-            }
-            else if (stats.latency < MEDIUM_LATENCY) {
-                // Medium latency -> Choose medium bitrate
-                if (bitrate <= bitrates[bitrates.size() / 2]) {
-                    selected_bitrate = bitrate;
-                }
-            }
-            else if (stats.latency < HIGH_LATENCY) {
-                // High latency -> Choose lowest available bitrate
-                selected_bitrate = bitrates.front();
-                break;
-            }
-        }
+private:
+  // EWMA weighted by sample duration, with the zero start corrected away
+  class Ewma
+  {
+  public:
+    void add(double value, double weight, double half_life)
+    {
+      const double alpha = std::pow(0.5, weight / half_life);
+      estimate_          = alpha * estimate_ + (1.0 - alpha) * value;
+      total_weight_ += weight;
+      half_life_ = half_life;
+    }
 
-        return selected_bitrate;
+    [[nodiscard]] auto value() const -> double
+    {
+      if (total_weight_ <= 0.0)
+      {
+        return 0.0;
+      }
+      return estimate_ / (1.0 - std::pow(0.5, total_weight_ / half_life_));
     }
+
+  private:
+    double estimate_     = 0.0;
+    double total_weight_ = 0.0;
+    double half_life_    = 1.0;
+  };
+
+  std::vector<std::uint64_t> bandwidths_;
+  std::size_t                current_ = 0;
+  Ewma                       fast_;
+  Ewma                       slow_;
 };
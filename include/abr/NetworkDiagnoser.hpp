@@ -3,7 +3,7 @@
 #include <boost/asio.hpp>
 #include <iostream>
 #include <chrono>
-#include <random>
+#include <vector>
 
 namespace net = boost::asio;
 using tcp = net::ip::tcp;
@@ -31,19 +31,25 @@ public:
             auto const results = resolver_.resolve(host, port);
             
             std::vector<int> latencies;
+            constexpr int probes = 5;
 
-            for (int i = 0; i < 5; ++i) { // Send 5 probes to calculate jitter
+            for (int i = 0; i < probes; ++i) { // Send 5 probes to calculate jitter
                 auto start = high_resolution_clock::now();
-                socket_.connect(*results.begin());
+                boost::system::error_code ec;
+                socket_.connect(*results.begin(), ec);
                 auto end = high_resolution_clock::now();
+                socket_.close();
+                if (ec) {
+                    continue; // a failed probe counts towards the loss rate below
+                }
                 int ping_time = duration_cast<milliseconds>(end - start).count();
                 latencies.push_back(ping_time);
-                socket_.close();
             }
 
             stats.latency = calculateAverage(latencies);
             stats.jitter = calculateJitter(latencies);
-            stats.packet_loss = simulatePacketLoss(); // Simulating packet loss
+            // Probes that never connected, not a real ICMP loss rate
+            stats.packet_loss = 100.0 * (probes - static_cast<int>(latencies.size())) / probes;
 
             std::cout << "[INFO] Network Latency: " << stats.latency << " ms\n";
             std::cout << "[INFO] Network Jitter: " << stats.jitter << " ms\n";
@@ -95,11 +101,4 @@ private:
         }
         return sum / (latencies.size() - 1);
     }
-
-    double simulatePacketLoss() {
-        std::random_device rd;
-        std::mt19937 gen(rd());
-        std::uniform_real_distribution<> dist(0.0, 10.0); // Simulating 0-10% loss
-        return dist(gen);
-    }
 };
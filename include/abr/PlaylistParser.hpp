@@ -1,11 +1,11 @@
 #pragma once
 
+#include "../m3u8.hpp"
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
 #include <boost/beast.hpp>
 #include <iostream>
 #include <map>
-#include <sstream>
 #include <string>
 
 namespace beast = boost::beast;
@@ -92,46 +92,20 @@ private:
     }
 
     void parsePlaylist(const std::string &playlist) {
-        std::istringstream ss(playlist);
-        std::string line;
-        int current_bitrate = 0;
-
-        while (std::getline(ss, line)) {
-            if (line.find("#EXT-X-STREAM-INF") != std::string::npos) {
-                size_t bitrate_pos = line.find("BANDWIDTH=");
-                if (bitrate_pos != std::string::npos) {
-                    size_t start = bitrate_pos + 9;  // Position after "BANDWIDTH="
-                    size_t end = line.find(',', start); // Find next comma
-                    
-                    std::string bitrate_str = line.substr(start, end - start);
-                    
-                    // Remove any '=' sign if it appears (edge case)
-                    bitrate_str.erase(std::remove(bitrate_str.begin(), bitrate_str.end(), '='), bitrate_str.end());
-
-                    std::cout << "[DEBUG] Extracted Bitrate String: '" << bitrate_str << "'\n";
-
-                    // Ensure it's numeric
-                    if (!bitrate_str.empty() && std::all_of(bitrate_str.begin(), bitrate_str.end(), ::isdigit)) {
-                        try {
-                            current_bitrate = std::stoi(bitrate_str);
-                            std::cout << "[INFO] Parsed Bitrate: " << current_bitrate << " kbps\n";
-                        } catch (const std::exception &e) {
-                            std::cerr << "[ERROR] Failed to parse bitrate: " << e.what() << "\n";
-                            continue;
-                        }
-                    } else {
-                        std::cerr << "[ERROR] Invalid bitrate format: '" << bitrate_str << "'\n";
-                        continue;
-                    }
-                }
-            } else if (!line.empty() && line[0] != '#') {
-                if (current_bitrate > 0) {
-                    bitrate_playlists_[current_bitrate] = line;
-                    std::cout << "[INFO] Added bitrate playlist: " << current_bitrate << " -> " << line << "\n";
-                } else {
-                    std::cerr << "[ERROR] Playlist URL found but no valid bitrate!\n";
-                }
+        m3u8::Playlist parsed;
+        if (!m3u8::parse(playlist, parsed)) {
+            std::cerr << "[ERROR] Not an M3U8 playlist!\n";
+            return;
+        }
+
+        for (const m3u8::Variant &variant : parsed.variants) {
+            if (variant.bandwidth == 0 || variant.uri.empty()) {
+                std::cerr << "[ERROR] Variant without a valid bitrate or playlist URL!\n";
+                continue;
             }
+            bitrate_playlists_[static_cast<int>(variant.bandwidth)] = std::string(variant.uri);
+            std::cout << "[INFO] Added bitrate playlist: " << variant.bandwidth << " -> "
+                      << variant.uri << "\n";
         }
     }
 };
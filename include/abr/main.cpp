@@ -1,6 +1,15 @@
 #include "ABRManager.hpp"
+#include "NetworkDiagnoser.hpp"
+#include "PlaylistParser.hpp"
 #include <boost/asio.hpp>
 
+/*
+ * Probes a master playlist the way the client would before streaming it: lists its variants,
+ * reports connection latency/jitter/probe loss, and shows the variant ABRManager starts on.
+ *
+ * The real switching happens in the client, per segment, from measured throughput.
+ */
+
 auto main(int argc, char* argv[]) -> int
 {
   if (argc != 2)
@@ -11,12 +20,41 @@ auto main(int argc, char* argv[]) -> int
   try
   {
     boost::asio::io_context ioc;
+    ssl::context            ssl_ctx(ssl::context::tlsv12_client);
 
     // Replace with your HLS master playlist URL
     std::string master_url = argv[1];
 
-    ABRManager abr_manager(ioc, master_url);
-    abr_manager.selectBestBitrate();
+    PlaylistParser parser(ioc, ssl_ctx, master_url);
+    if (!parser.fetchMasterPlaylist())
+    {
+      std::cerr << "[ERROR] Failed to fetch master playlist.\n";
+      return EXIT_FAILURE;
+    }
+
+    NetworkDiagnoser network(ioc, master_url);
+    NetworkStats     stats = network.diagnoseNetworkSpeed();
+    if (stats.latency < 0)
+    {
+      std::cerr << "[WARN] Network diagnosis failed.\n";
+    }
+
+    // getBitratePlaylists() is keyed by bandwidth, so it is already ascending
+    std::vector<std::uint64_t> bandwidths;
+    for (const auto& [bandwidth, playlist] : parser.getBitratePlaylists())
+    {
+      bandwidths.push_back(static_cast<std::uint64_t>(bandwidth));
+      std::cout << "[INFO] Variant " << bandwidth << " bps -> " << playlist << "\n";
+    }
+    if (bandwidths.empty())
+    {
+      std::cerr << "[ERROR] No available bitrates in playlist.\n";
+      return EXIT_FAILURE;
+    }
+
+    ABRManager abr(bandwidths);
+    std::cout << "[INFO] Starting variant: " << bandwidths[abr.current()]
+              << " bps (switches follow measured segment throughput)\n";
   }
   catch (const std::exception& e)
   {
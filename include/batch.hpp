@@ -0,0 +1,294 @@
+#pragma once
+
+#include "logger.hpp"
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <fcntl.h>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/*
+ * BATCH INGESTION
+ *
+ * Shared by `hls_encoder --batch` and `hls_dispatcher --batch`, which onboard a whole library in
+ * two long-running processes instead of one encoder and one dispatcher launch per track.
+ *
+ * -> WorkStealingPool runs the tracks. Every worker has its own deque; submit() deals tasks out
+ *    round-robin, a worker takes from the front of its own deque and, once that is empty, steals
+ *    from the back of the others. A worker stuck on a long track does not hold back the short
+ *    ones dealt to it, and no core idles while any track is left.
+ *
+ * -> BatchJournal is the progress log, an append-only file in the library's output directory.
+ *    The encoder appends a record when a track is encoded, the dispatcher one when it has been
+ *    uploaded. A rerun after a crash skips what the journal already records, and the dispatcher
+ *    tails the file while the encoder is still running, so uploads overlap encoding.
+ *
+ * Journal records are one line each, "<state>\t<key>\t<value>\n", written with a single
+ * O_APPEND write() and an fdatasync(), so lines from both processes never interleave and a
+ * recorded state survives a crash. A torn last line (a crash mid-write) is ignored when reading,
+ * and the first append after it ends it with a newline first, so the record is not glued to it.
+ */
+
+class WorkStealingPool
+{
+public:
+  using Task = std::function<void(std::size_t worker)>; // index of the worker running it
+
+  explicit WorkStealingPool(std::size_t workers)
+  {
+    for (std::size_t i = 0; i < std::max<std::size_t>(1, workers); ++i)
+    {
+      queues_.push_back(std::make_unique<Queue>());
+    }
+    for (std::size_t i = 0; i < queues_.size(); ++i)
+    {
+      threads_.emplace_back([this, i] { work(i); });
+    }
+  }
+
+  WorkStealingPool(const WorkStealingPool&)                    = delete;
+  auto operator=(const WorkStealingPool&) -> WorkStealingPool& = delete;
+
+  // Runs what is still queued, then joins
+  ~WorkStealingPool()
+  {
+    wait();
+    {
+      std::lock_guard lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread& thread : threads_)
+    {
+      thread.join();
+    }
+  }
+
+  [[nodiscard]] auto size() const -> std::size_t { return queues_.size(); }
+
+  void submit(Task task)
+  {
+    Queue& queue = *queues_[next_++ % queues_.size()];
+    {
+      std::lock_guard lock(queue.mutex);
+      queue.tasks.push_back(std::move(task));
+    }
+    {
+      std::lock_guard lock(mutex_);
+      ++queued_;
+      ++unfinished_;
+    }
+    wake_.notify_one();
+  }
+
+  // Blocks until every task submitted so far has finished
+  void wait()
+  {
+    std::unique_lock lock(mutex_);
+    idle_.wait(lock, [this] { return unfinished_ == 0; });
+  }
+
+  [[nodiscard]] auto idle() -> bool
+  {
+    std::lock_guard lock(mutex_);
+    return unfinished_ == 0;
+  }
+
+private:
+  struct Queue
+  {
+    std::mutex       mutex;
+    std::deque<Task> tasks;
+  };
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread>            threads_;
+  std::size_t                         next_ = 0; // queue the next submit() goes to
+  std::mutex                          mutex_;
+  std::condition_variable             wake_;
+  std::condition_variable             idle_;
+  std::size_t                         queued_     = 0; // in a deque, not taken yet
+  std::size_t                         unfinished_ = 0; // queued or running
+  bool                                stopping_   = false;
+
+  auto take(std::size_t self, Task& task) -> bool
+  {
+    {
+      Queue& own = *queues_[self];
+      std::lock_guard lock(own.mutex);
+      if (!own.tasks.empty())
+      {
+        task = std::move(own.tasks.front());
+        own.tasks.pop_front();
+        return true;
+      }
+    }
+
+    for (std::size_t i = 1; i < queues_.size(); ++i)
+    {
+      Queue&          victim = *queues_[(self + i) % queues_.size()];
+      std::lock_guard lock(victim.mutex);
+      if (!victim.tasks.empty())
+      {
+        task = std::move(victim.tasks.back());
+        victim.tasks.pop_back();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void work(std::size_t self)
+  {
+    for (;;)
+    {
+      {
+        std::unique_lock lock(mutex_);
+        wake_.wait(lock, [this] { return queued_ > 0 || stopping_; });
+        if (queued_ == 0)
+        {
+          return; // stopping, and nothing is left
+        }
+      }
+
+      Task task;
+      if (!take(self, task))
+      {
+        std::this_thread::yield(); // another worker took it and has yet to count it
+        continue;
+      }
+      {
+        std::lock_guard lock(mutex_);
+        --queued_;
+      }
+
+      task(self);
+
+      std::lock_guard lock(mutex_);
+      if (--unfinished_ == 0)
+      {
+        idle_.notify_all();
+      }
+    }
+  }
+};
+
+class BatchJournal
+{
+public:
+  struct Record
+  {
+    std::string state; // "start", "encoded", "failed", "dispatched", "end"
+    std::string key;   // track directory, relative to the library's output directory
+    std::string value; // "start": encoder pid, "encoded": source file, "dispatched": audio-id
+  };
+
+  explicit BatchJournal(std::filesystem::path path) : path_(std::move(path)) {}
+
+  BatchJournal(const BatchJournal&)                    = delete;
+  auto operator=(const BatchJournal&) -> BatchJournal& = delete;
+
+  ~BatchJournal()
+  {
+    if (fd_ >= 0)
+    {
+      ::close(fd_);
+    }
+  }
+
+  // Durably appends one record; false if it could not be written
+  auto append(std::string_view state, std::string_view key, std::string_view value) -> bool
+  {
+    std::string line;
+    line.append(state).append("\t").append(key).append("\t").append(value).append("\n");
+
+    std::lock_guard lock(mutex_);
+    if (fd_ < 0)
+    {
+      fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+      if (fd_ >= 0 && is_torn(fd_))
+      {
+        line.insert(0, "\n"); // one write still: the fragment becomes a line of its own
+      }
+    }
+    if (fd_ < 0 || ::write(fd_, line.data(), line.size()) != static_cast<ssize_t>(line.size()) ||
+        ::fdatasync(fd_) != 0)
+    {
+      LOG_ERROR << "Failed to write to batch journal " << path_;
+      return false;
+    }
+    return true;
+  }
+
+  /*
+   * Hands every complete record appended since the previous call (the whole journal on the
+   * first) to `visit`, in file order. Returns the number of records read.
+   */
+  auto poll(const std::function<void(const Record&)>& visit) -> std::size_t
+  {
+    std::lock_guard lock(mutex_);
+    const int       fd = ::open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+      return 0; // nothing recorded yet
+    }
+
+    std::string text;
+    char        buffer[64 * 1024];
+    for (;;)
+    {
+      const off_t   offset = read_offset_ + static_cast<off_t>(text.size());
+      const ssize_t n      = ::pread(fd, buffer, sizeof(buffer), offset);
+      if (n <= 0)
+      {
+        break;
+      }
+      text.append(buffer, static_cast<std::size_t>(n));
+    }
+    ::close(fd);
+
+    std::size_t records = 0;
+    std::size_t begin   = 0;
+    for (std::size_t end; (end = text.find('\n', begin)) != std::string::npos; begin = end + 1)
+    {
+      const std::string_view line(text.data() + begin, end - begin);
+      const std::size_t      first  = line.find('\t');
+      const std::size_t      second = line.find('\t', first + 1);
+      if (first == std::string_view::npos || second == std::string_view::npos)
+      {
+        continue;
+      }
+      visit({std::string(line.substr(0, first)),
+             std::string(line.substr(first + 1, second - first - 1)),
+             std::string(line.substr(second + 1))});
+      ++records;
+    }
+    read_offset_ += static_cast<off_t>(begin); // a line without its newline is read next time
+    return records;
+  }
+
+private:
+  std::filesystem::path path_;
+  std::mutex            mutex_;
+  int                   fd_          = -1;
+  off_t                 read_offset_ = 0;
+
+  // Whether the journal ends in the middle of a line
+  static auto is_torn(int fd) -> bool
+  {
+    struct stat st{};
+    char        last = '\n';
+    return ::fstat(fd, &st) == 0 && st.st_size > 0 && ::pread(fd, &last, 1, st.st_size - 1) == 1 &&
+           last != '\n';
+  }
+};
@@ -2,8 +2,16 @@
 
 #include "logger.hpp"
 #include "macros.hpp"
-#include <fstream>
+#include "pcm_converter.hpp"
+#include "ring_buffer.hpp"
+#include "segment_queue.hpp"
+#include "trace.hpp"
+#include <cerrno>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <optional>
+#include <string_view>
 #include <vector>
 
 extern "C"
@@ -15,75 +23,183 @@ extern "C"
 #include <libavutil/opt.h>
 }
 
-auto DBG_WriteTransportSegmentsToFile(const std::vector<std::string>& transport_segments,
-                                      const std::string&              filename) -> bool
+/*
+ * AVIO source over a segmented buffer. Every decoder owns one and passes it as `opaque`, so any
+ * number of streams can be decoded at the same time, on any threads.
+ *
+ * -> Over segments that are all in memory (a vector) it is fully seekable, AVSEEK_SIZE included,
+ *    so libavformat seeks while probing instead of reading ahead and buffering.
+ *
+ * -> Over a SegmentQueue, segments are popped as reading reaches them and the last
+ *    kRetainedSegments stay addressable. The context is marked non-seekable and its size is
+ *    unknown, so demuxers only seek back into data they recently read, and forward seeks read
+ *    through.
+ */
+class SegmentedReader
 {
-  std::ofstream output_file(filename, std::ios::binary);
-  if (!output_file)
+public:
+  static constexpr std::size_t kRetainedSegments = 2;
+
+  explicit SegmentedReader(const std::vector<std::string>& segments)
   {
-    LOG_ERROR << "Failed to open output file: " << filename;
-    return false;
+    for (const std::string& segment : segments)
+    {
+      append(segment);
+    }
   }
 
-  for (const auto& segment : transport_segments)
+  explicit SegmentedReader(SegmentQueue& queue) : queue_(&queue) {}
+
+  SegmentedReader(const SegmentedReader&)                    = delete;
+  auto operator=(const SegmentedReader&) -> SegmentedReader& = delete;
+
+  // Queue mode: called with consumed() every time a segment is taken off the queue
+  std::function<void(std::size_t)> on_segment;
+
+  [[nodiscard]] auto seekable() const -> bool { return queue_ == nullptr; }
+  [[nodiscard]] auto consumed() const -> std::size_t { return consumed_; }
+
+  static int read_packet(void* opaque, uint8_t* buf, int buf_size)
   {
-    output_file.write(segment.data(), segment.size());
+    return static_cast<SegmentedReader*>(opaque)->read(buf, buf_size);
   }
 
-  output_file.close();
-  LOG_INFO << "Successfully wrote transport streams to " << filename;
-  return true;
-}
-
-auto DBG_WriteDecodedAudioToFile(const std::vector<unsigned char>& transport_segment,
-                                 const std::string&                filename) -> bool
-{
-  std::ofstream output_file(filename, std::ios::binary);
-  if (!output_file)
+  static int64_t seek(void* opaque, int64_t offset, int whence)
   {
-    LOG_ERROR << "Failed to open output file: " << filename << std::endl;
-    return false;
+    return static_cast<SegmentedReader*>(opaque)->seek_to(offset, whence);
   }
 
-  output_file.write(reinterpret_cast<const char*>(transport_segment.data()),
-                    transport_segment.size());
+private:
+  struct Segment
+  {
+    std::string_view data;
+    int64_t          start; // stream position of data[0]
 
-  output_file.close();
-  LOG_INFO << "Successfully wrote decoded audio stream to " << filename << std::endl;
-  return true;
-}
+    [[nodiscard]] auto end() const -> int64_t { return start + static_cast<int64_t>(data.size()); }
+  };
 
-// Custom AVIO read function
-static int custom_read_packet(void* opaque, uint8_t* buf, int buf_size)
-{
-  auto*         segments      = static_cast<std::vector<std::string>*>(opaque);
-  static size_t segment_index = 0;
-  static size_t read_offset   = 0;
+  SegmentQueue*           queue_ = nullptr;
+  std::deque<std::string> owned_;    // queue mode: bytes behind the retained segments
+  std::deque<Segment>     segments_; // addressable segments in stream order
+  std::size_t             current_  = 0; // segments_ index last read from
+  int64_t                 pos_      = 0;
+  int64_t                 end_      = 0; // stream position just past the last segment
+  std::size_t             consumed_ = 0;
 
-  if (segment_index >= segments->size())
+  void append(std::string_view data)
   {
-    return AVERROR_EOF; // No more data
+    segments_.push_back({data, end_});
+    end_ += static_cast<int64_t>(data.size());
   }
 
-  size_t segment_size  = (*segments)[segment_index].size();
-  size_t bytes_to_copy = std::min(static_cast<size_t>(buf_size), segment_size - read_offset);
+  // Queue mode: blocks for the next segment and forgets the oldest one past the window
+  auto pull() -> bool
+  {
+    std::optional<std::string> next = queue_ ? queue_->pop() : std::nullopt;
+    if (!next)
+    {
+      return false;
+    }
+
+    owned_.push_back(std::move(*next));
+    append(owned_.back());
+    if (segments_.size() > kRetainedSegments)
+    {
+      segments_.pop_front();
+      owned_.pop_front();
+      current_ = current_ > 0 ? current_ - 1 : 0;
+    }
+
+    ++consumed_;
+    if (on_segment)
+    {
+      on_segment(consumed_);
+    }
+    return true;
+  }
+
+  auto read(uint8_t* buf, int buf_size) -> int
+  {
+    while (pos_ >= end_)
+    {
+      if (!pull())
+      {
+        return AVERROR_EOF;
+      }
+    }
+
+    // A handful of steps at most: reads are sequential and seeks stay within the window
+    while (pos_ < segments_[current_].start)
+    {
+      --current_;
+    }
+    while (pos_ >= segments_[current_].end())
+    {
+      ++current_;
+    }
+
+    const Segment& segment = segments_[current_];
+    const size_t   offset  = static_cast<size_t>(pos_ - segment.start);
+    const size_t   n       = std::min(static_cast<size_t>(buf_size), segment.data.size() - offset);
 
-  memcpy(buf, (*segments)[segment_index].data() + read_offset, bytes_to_copy);
-  read_offset += bytes_to_copy;
+    memcpy(buf, segment.data.data() + offset, n);
+    pos_ += static_cast<int64_t>(n);
+    return static_cast<int>(n);
+  }
 
-  if (read_offset >= segment_size)
+  auto seek_to(int64_t offset, int whence) -> int64_t
   {
-    // Move to the next segment
-    segment_index++;
-    read_offset = 0;
+    whence &= ~AVSEEK_FORCE;
+    if (whence == AVSEEK_SIZE)
+    {
+      return seekable() ? end_ : AVERROR(ENOSYS);
+    }
+
+    int64_t target;
+    switch (whence)
+    {
+      case SEEK_SET:
+        target = offset;
+        break;
+      case SEEK_CUR:
+        target = pos_ + offset;
+        break;
+      case SEEK_END:
+        if (!seekable())
+        {
+          return AVERROR(ENOSYS);
+        }
+        target = end_ + offset;
+        break;
+      default:
+        return AVERROR(EINVAL);
+    }
+
+    // Queue mode may seek forward past what has arrived: read() pulls up to it
+    const int64_t window_start = segments_.empty() ? end_ : segments_.front().start;
+    if (target < window_start || (seekable() && target > end_))
+    {
+      return AVERROR(EINVAL);
+    }
+
+    pos_ = target;
+    return pos_;
   }
+};
 
-  return bytes_to_copy;
-}
+// Interleaved PCM layout of a decoded stream
+struct PcmFormat
+{
+  AVSampleFormat sample_fmt  = AV_SAMPLE_FMT_NONE; // one of PcmConverter's output formats
+  int            channels    = 0;
+  int            sample_rate = 0;
+
+  auto operator==(const PcmFormat&) const -> bool = default;
+};
 
 /**
  * @class MediaDecoder
- * @brief Decodes transport stream audio for playback from a vector
+ * @brief Decodes transport stream audio for playback, from a vector or a segment queue
  */
 class MediaDecoder
 {
@@ -119,43 +235,311 @@ public:
   /**
    * @brief Decodes TS content to raw audio output
    * @param ts_segments Vector of transport stream segments
+   * @param pcm_format Set to the interleaved PCM layout of output_audio when the stream is
+   *                   decoded (FLAC); left alone when the bitstream is copied through (MP3)
    * @return true if successful, false otherwise
    */
-  bool decode(std::vector<std::string>& ts_segments, std::vector<unsigned char>& output_audio)
+  bool decode(std::vector<std::string>& ts_segments, std::vector<unsigned char>& output_audio,
+              PcmFormat* pcm_format = nullptr)
   {
     avformat_network_init();
+    SegmentedReader  reader(ts_segments);
+    AVFormatContext* input_ctx = avformat_alloc_context();
+    AVIOContext*     avio_ctx  = open_avio(reader);
+    if (!input_ctx || !avio_ctx)
+    {
+      av_log(nullptr, AV_LOG_ERROR, "Failed to allocate AVIO context\n");
+      avformat_free_context(input_ctx);
+      close_avio(avio_ctx);
+      return false;
+    }
+
+    input_ctx->pb = avio_ctx;
+
+    int             audio_stream_idx = -1;
+    AVCodecContext* codec_ctx        = nullptr;
+    if (!open_audio(input_ctx, codec_ctx, audio_stream_idx, false))
+    {
+      close_avio(avio_ctx);
+      return false;
+    }
+
+    bool         is_flac = (codec_ctx->codec_id == AV_CODEC_ID_FLAC);
+    PcmConverter converter;
+    if (is_flac && !converter.init(codec_ctx))
+    {
+      av_log(nullptr, AV_LOG_ERROR, "Cannot convert decoded samples for playback\n");
+      close_audio(input_ctx, codec_ctx, avio_ctx);
+      return false;
+    }
+    if (is_flac && pcm_format)
+    {
+      *pcm_format = {converter.format(), codec_ctx->ch_layout.nb_channels, codec_ctx->sample_rate};
+    }
+
+    // One allocation up front instead of a reallocation (and full copy) every time it grows
+    output_audio.reserve(output_audio.size() +
+                         estimate_output_size(input_ctx, codec_ctx, audio_stream_idx,
+                                              is_flac ? converter.frame_bytes() : 0));
+
+    // Extract raw audio data
+    AVPacket* packet = av_packet_alloc();
+    AVFrame*  frame  = av_frame_alloc();
+
+    while (av_read_frame(input_ctx, packet) >= 0)
+    {
+      if (packet->stream_index == audio_stream_idx)
+      {
+        if (!is_flac)
+        {
+          // Directly append MP3/AAC data
+          output_audio.insert(output_audio.end(), packet->data, packet->data + packet->size);
+          trace::dump("final.pcm", packet->data, packet->size);
+        }
+        else
+        {
+          // Decode FLAC to PCM
+          if (avcodec_send_packet(codec_ctx, packet) == 0)
+          {
+            while (avcodec_receive_frame(codec_ctx, frame) == 0)
+            {
+              // Interleaved in the device format, whatever layout the decoder used
+              const std::span<const uint8_t> pcm = converter.convert(frame);
+              output_audio.insert(output_audio.end(), pcm.begin(), pcm.end());
+              trace::dump("final.pcm", pcm.data(), pcm.size());
+            }
+          }
+        }
+      }
+      av_packet_unref(packet);
+    }
+
+    // Cleanup
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    close_audio(input_ctx, codec_ctx, avio_ctx);
+
+    return true;
+  }
+
+  /**
+   * @brief Decodes segments to interleaved PCM while they are still being fetched
+   * @param segments Queue filled by the fetcher, init segment first for fMP4
+   * @param open_output Called once the PCM format is known; returns the ring drained by the
+   *                    audio device, or nullptr to stop. The ring is not finished here, so
+   *                    consecutive tracks of one format can follow each other in it gaplessly.
+   * @param prebuffer Segments to decode before playback may start
+   * @param on_ready Called once: with the PCM format when `prebuffer` segments are decoded (or
+   *                 the ring fills up, or the stream ends first), with nullptr if decoding
+   *                 failed before any audio was produced
+   * @return true if the whole stream was decoded
+   */
+  bool decode_stream(SegmentQueue& segments,
+                     const std::function<SpscRingBuffer*(const PcmFormat&)>& open_output,
+                     std::size_t prebuffer, const std::function<void(const PcmFormat*)>& on_ready)
+  {
+    PcmFormat  format;
+    bool       have_format = false;
+    bool       notified    = false;
+    const auto ready       = [&](const PcmFormat* pcm)
+    {
+      if (!notified)
+      {
+        notified = true;
+        on_ready(pcm);
+      }
+    };
+
+    SegmentedReader reader(segments);
+    reader.on_segment = [&](std::size_t consumed)
+    {
+      // Taking segment N + 1 means the first N have been handed to the demuxer
+      if (have_format && consumed > prebuffer)
+      {
+        ready(&format);
+      }
+    };
+
     AVFormatContext* input_ctx = avformat_alloc_context();
-    AVIOContext*     avio_ctx  = nullptr;
-    int              ret;
-    size_t           avio_buf = 32768;
+    AVIOContext*     avio_ctx  = open_avio(reader);
+    if (!input_ctx || !avio_ctx)
+    {
+      av_log(nullptr, AV_LOG_ERROR, "Failed to allocate AVIO context\n");
+      avformat_free_context(input_ctx);
+      close_avio(avio_ctx);
+      ready(nullptr);
+      return false;
+    }
+    input_ctx->pb = avio_ctx;
+
+    int             audio_stream_idx = -1;
+    AVCodecContext* codec_ctx        = nullptr;
+    if (!open_audio(input_ctx, codec_ctx, audio_stream_idx, true))
+    {
+      close_avio(avio_ctx);
+      segments.cancel();
+      ready(nullptr);
+      return false;
+    }
+
+    PcmConverter converter;
+    if (!converter.init(codec_ctx))
+    {
+      LOG_ERROR << DECODER_LOG << "Cannot convert "
+                << av_get_sample_fmt_name(codec_ctx->sample_fmt) << " samples for playback";
+      close_audio(input_ctx, codec_ctx, avio_ctx);
+      segments.cancel();
+      ready(nullptr);
+      return false;
+    }
+
+    format.sample_fmt  = converter.format();
+    format.channels    = codec_ctx->ch_layout.nb_channels;
+    format.sample_rate = codec_ctx->sample_rate;
+
+    SpscRingBuffer* pcm_out = open_output(format);
+    if (!pcm_out)
+    {
+      close_audio(input_ctx, codec_ctx, avio_ctx);
+      segments.cancel();
+      ready(nullptr);
+      return false;
+    }
+    have_format = true;
+
+    AVPacket* packet    = av_packet_alloc();
+    AVFrame*  frame     = av_frame_alloc();
+    bool      cancelled = false;
+    int       ret       = 0;
+
+    // Hands every decoded frame to the ring; false once playback went away
+    const auto drain = [&]() -> bool
+    {
+      while (avcodec_receive_frame(codec_ctx, frame) == 0)
+      {
+        const std::span<const uint8_t> pcm = converter.convert(frame);
+        if (pcm_out->capacity() - pcm_out->available() < pcm.size())
+        {
+          ready(&format); // the ring is full, so waiting for more segments would deadlock
+        }
+        trace::dump("final.pcm", pcm.data(), pcm.size());
+        if (!pcm_out->write(pcm.data(), pcm.size()))
+        {
+          return false;
+        }
+      }
+      return true;
+    };
+
+    while (!cancelled && (ret = av_read_frame(input_ctx, packet)) >= 0)
+    {
+      if (packet->stream_index == audio_stream_idx && avcodec_send_packet(codec_ctx, packet) == 0)
+      {
+        cancelled = !drain();
+      }
+      av_packet_unref(packet);
+    }
+
+    if (!cancelled)
+    {
+      // Flush the frames the decoder still holds back
+      avcodec_send_packet(codec_ctx, nullptr);
+      cancelled = !drain();
+    }
+
+    const bool complete = !cancelled && ret == AVERROR_EOF;
+    if (!cancelled && !complete)
+    {
+      LOG_ERROR << DECODER_LOG << "Stream ended with a read error, " << reader.consumed()
+                << " segments decoded";
+    }
+    if (cancelled)
+    {
+      segments.cancel();
+    }
+
+    ready(&format); // streams shorter than the prebuffer start now
+
+    LOG_DEBUG << DECODER_LOG << "Decoded " << reader.consumed() << " streamed segments";
+
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    close_audio(input_ctx, codec_ctx, avio_ctx);
+    return complete;
+  }
+
+private:
+  // Bytes decode() is expected to produce, from the stream duration: the PCM size when the
+  // stream is decoded to frames of pcm_frame_bytes, the bitstream size when packets are copied
+  // through (pcm_frame_bytes = 0). 0 if unknown.
+  static auto estimate_output_size(const AVFormatContext* input_ctx,
+                                   const AVCodecContext* codec_ctx, int audio_stream_idx,
+                                   size_t pcm_frame_bytes) -> size_t
+  {
+    constexpr double kMaxReserve = 2.0 * 1024 * 1024 * 1024; // a broken duration stops here
+
+    const AVStream* stream  = input_ctx->streams[audio_stream_idx];
+    double          seconds = 0.0;
+    if (stream->duration != AV_NOPTS_VALUE && stream->duration > 0)
+    {
+      seconds = static_cast<double>(stream->duration) * av_q2d(stream->time_base);
+    }
+    else if (input_ctx->duration != AV_NOPTS_VALUE && input_ctx->duration > 0)
+    {
+      seconds = static_cast<double>(input_ctx->duration) / AV_TIME_BASE;
+    }
+
+    double bytes_per_second = 0.0;
+    if (pcm_frame_bytes > 0)
+    {
+      bytes_per_second =
+        static_cast<double>(codec_ctx->sample_rate) * static_cast<double>(pcm_frame_bytes);
+    }
+    else
+    {
+      const int64_t bit_rate = codec_ctx->bit_rate > 0 ? codec_ctx->bit_rate : input_ctx->bit_rate;
+      bytes_per_second       = static_cast<double>(bit_rate) / 8.0;
+    }
 
-    // Buffer for custom AVIO
+    // 2% headroom: falling just short would still cost a doubling reallocation at the very end
+    const double estimate = seconds * bytes_per_second * 1.02;
+    return estimate > 0.0 ? static_cast<size_t>(std::min(estimate, kMaxReserve)) : 0;
+  }
+
+  // AVIO context reading from `reader`, with a buffer of its own; nullptr if out of memory
+  static auto open_avio(SegmentedReader& reader) -> AVIOContext*
+  {
+    constexpr int  avio_buf    = 32768;
     unsigned char* avio_buffer = static_cast<unsigned char*>(av_malloc(avio_buf));
     if (!avio_buffer)
     {
-      av_log(nullptr, AV_LOG_ERROR, "Failed to allocate AVIO buffer\n");
-      return false;
+      return nullptr;
     }
 
-    // Select appropriate custom reader
-    avio_ctx = avio_alloc_context(avio_buffer, avio_buf, 0, &ts_segments, &custom_read_packet,
-                                  nullptr, nullptr);
+    AVIOContext* avio_ctx = avio_alloc_context(avio_buffer, avio_buf, 0, &reader,
+                                               &SegmentedReader::read_packet, nullptr,
+                                               &SegmentedReader::seek);
     if (!avio_ctx)
     {
-      av_log(nullptr, AV_LOG_ERROR, "Failed to allocate AVIO context\n");
       av_free(avio_buffer);
-      return false;
+      return nullptr;
     }
 
-    input_ctx->pb = avio_ctx;
+    avio_ctx->seekable = reader.seekable() ? AVIO_SEEKABLE_NORMAL : 0;
+    return avio_ctx;
+  }
+
+  // Opens the demuxer on input_ctx->pb and a decoder for its first audio stream. With
+  // `packed` the decoder is asked for interleaved samples.
+  bool open_audio(AVFormatContext*& input_ctx, AVCodecContext*& codec_ctx, int& audio_stream_idx,
+                  bool packed)
+  {
+    int ret;
 
     // Open input
     if ((ret = avformat_open_input(&input_ctx, nullptr, nullptr, nullptr)) < 0)
     {
       av_log(nullptr, AV_LOG_ERROR, "Cannot open input from memory buffer\n");
-      av_free(avio_ctx->buffer);
-      avio_context_free(&avio_ctx);
-      avformat_free_context(input_ctx);
       return false;
     }
 
@@ -185,8 +569,7 @@ public:
     }
 
     // Find audio stream
-    int                audio_stream_idx = -1;
-    AVCodecParameters* codec_params     = nullptr;
+    AVCodecParameters* codec_params = nullptr;
 
     for (unsigned int i = 0; i < input_ctx->nb_streams; i++)
     {
@@ -222,7 +605,7 @@ public:
       return false;
     }
 
-    AVCodecContext* codec_ctx = avcodec_alloc_context3(codec);
+    codec_ctx = avcodec_alloc_context3(codec);
     if (!codec_ctx)
     {
       av_log(nullptr, AV_LOG_ERROR, "Failed to allocate codec context\n");
@@ -230,14 +613,6 @@ public:
       return false;
     }
 
-    if (codec_params->extradata_size > 0)
-    {
-      codec_ctx->extradata = static_cast<uint8_t*>(
-        av_malloc(codec_params->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE));
-      memcpy(codec_ctx->extradata, codec_params->extradata, codec_params->extradata_size);
-      codec_ctx->extradata_size = codec_params->extradata_size;
-    }
-
     if ((ret = avcodec_parameters_to_context(codec_ctx, codec_params)) < 0)
     {
       av_log(nullptr, AV_LOG_ERROR, "Failed to copy codec parameters to context\n");
@@ -246,6 +621,12 @@ public:
       return false;
     }
 
+    if (packed)
+    {
+      // MP3 and FLAC decoders honour this, which leaves the converter a plain copy
+      codec_ctx->request_sample_fmt = av_get_packed_sample_fmt(codec_ctx->sample_fmt);
+    }
+
     if ((ret = avcodec_open2(codec_ctx, codec, nullptr)) < 0)
     {
       av_log(nullptr, AV_LOG_ERROR, "Failed to open codec\n");
@@ -254,56 +635,24 @@ public:
       return false;
     }
 
-    // Extract raw audio data
-    AVPacket* packet = av_packet_alloc();
-    AVFrame*  frame  = av_frame_alloc();
-
-    while (av_read_frame(input_ctx, packet) >= 0)
-    {
-      if (packet->stream_index == audio_stream_idx)
-      {
-        if (!is_flac)
-        {
-          // Directly append MP3/AAC data
-          output_audio.insert(output_audio.end(), packet->data, packet->data + packet->size);
-        }
-        else
-        {
-          // Decode FLAC to PCM
-          if (avcodec_send_packet(codec_ctx, packet) == 0)
-          {
-            while (avcodec_receive_frame(codec_ctx, frame) == 0)
-            {
-              int    sampleSize = av_get_bytes_per_sample(codec_ctx->sample_fmt);
-              size_t dataSize   = frame->nb_samples * codec_ctx->ch_layout.nb_channels * sampleSize;
-              output_audio.insert(output_audio.end(), frame->data[0], frame->data[0] + dataSize);
-            }
-          }
-        }
-      }
-      av_packet_unref(packet);
-    }
-
-    // Debugging: Write PCM output
-    if (!DBG_WriteDecodedAudioToFile(output_audio, "final.pcm"))
-    {
-      LOG_ERROR << "Error writing decoded stream to file";
-      return false;
-    }
+    return true;
+  }
 
-    // Cleanup
-    av_frame_free(&frame);
-    av_packet_free(&packet);
+  // The AVIO context is ours (custom IO), so avformat_close_input leaves it alone
+  static void close_audio(AVFormatContext*& input_ctx, AVCodecContext*& codec_ctx,
+                          AVIOContext*& avio_ctx)
+  {
     avcodec_free_context(&codec_ctx);
-    if (input_ctx)
+    avformat_close_input(&input_ctx);
+    close_avio(avio_ctx);
+  }
+
+  static void close_avio(AVIOContext*& avio_ctx)
+  {
+    if (avio_ctx)
     {
-      avformat_close_input(&input_ctx);
-    }
-    if (avio_ctx && !(input_ctx && input_ctx->pb == avio_ctx))
-    { // Ensure it's not freed twice
+      av_freep(&avio_ctx->buffer);
       avio_context_free(&avio_ctx);
     }
-
-    return true;
   }
 };
@@ -102,6 +102,103 @@ extern "C"
     return true; // Return true if everything was successful
   }
 
+  /*
+   * Streaming decompression into a file.
+   *
+   * Unlike ZSTD_decompress_file() this never holds the whole frame (compressed or decompressed)
+   * in memory: compressed bytes are pushed in as they arrive and every decoded block is written
+   * out straight away. The DCtx is borrowed, so one context can be reused across many files, and
+   * so is the DDict: frames compressed against a dictionary need it, NULL for the others.
+   *
+   *   ZSTD_FileSink sink;
+   *   ZSTD_FileSink_open(&sink, dctx, ddict, "out.ts");
+   *   while (...) ZSTD_FileSink_write(&sink, chunk, chunkSize);
+   *   ZSTD_FileSink_close(&sink); // false if the frame was truncated or a write failed
+   */
+  typedef struct
+  {
+    ZSTD_DCtx* dctx;
+    FILE*      outFile;
+    void*      outBuff;
+    size_t     outSize;
+    size_t     lastRet; // 0 once a frame has been fully decoded and flushed
+    size_t     written;
+  } ZSTD_FileSink;
+
+  static bool ZSTD_FileSink_open(ZSTD_FileSink* sink, ZSTD_DCtx* dctx, const ZSTD_DDict* ddict,
+                                 const char* outputFilename)
+  {
+    sink->dctx    = dctx;
+    sink->outSize = ZSTD_DStreamOutSize();
+    sink->outBuff = malloc(sink->outSize);
+    sink->lastRet = 0;
+    sink->written = 0;
+    sink->outFile = NULL;
+
+    if (!sink->outBuff)
+    {
+      fprintf(stderr, "Failed to allocate memory for decompression buffer\n");
+      return false;
+    }
+
+    ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+    ZSTD_DCtx_refDDict(dctx, ddict); // replaces (or with NULL drops) the previous file's
+
+    sink->outFile = fopen(outputFilename, "wb");
+    if (!sink->outFile)
+    {
+      fprintf(stderr, "Failed to open file for writing: %s\n", outputFilename);
+      free(sink->outBuff);
+      sink->outBuff = NULL;
+      return false;
+    }
+
+    return true;
+  }
+
+  static bool ZSTD_FileSink_write(ZSTD_FileSink* sink, const void* src, size_t srcSize)
+  {
+    ZSTD_inBuffer input = {src, srcSize, 0};
+    while (input.pos < input.size)
+    {
+      ZSTD_outBuffer output = {sink->outBuff, sink->outSize, 0};
+      size_t const   ret    = ZSTD_decompressStream(sink->dctx, &output, &input);
+      if (ZSTD_isError(ret))
+      {
+        fprintf(stderr, "Decompression failed: %s\n", ZSTD_getErrorName(ret));
+        return false;
+      }
+      if (fwrite(sink->outBuff, 1, output.pos, sink->outFile) != output.pos)
+      {
+        fprintf(stderr, "Failed to write all decompressed data\n");
+        return false;
+      }
+      sink->written += output.pos;
+      sink->lastRet = ret;
+    }
+    return true;
+  }
+
+  static bool ZSTD_FileSink_close(ZSTD_FileSink* sink)
+  {
+    bool ok = true;
+
+    if (sink->lastRet != 0)
+    {
+      fprintf(stderr, "Truncated zstd frame (%zu bytes decoded)\n", sink->written);
+      ok = false;
+    }
+    if (sink->outFile && fclose(sink->outFile) != 0)
+    {
+      ok = false;
+    }
+
+    free(sink->outBuff);
+    sink->outFile = NULL;
+    sink->outBuff = NULL;
+    return ok;
+  }
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+#include <memory>
+#include <openssl/evp.h>
+#include <string>
+
+/*
+ * DIGESTS
+ *
+ * Lowercase hex digests through OpenSSL's EVP interface, which the dispatcher and the server
+ * already link for TLS. Empty if OpenSSL fails.
+ */
+
+namespace digest
+{
+
+inline auto to_hex(const unsigned char* digest, unsigned int length) -> std::string
+{
+  static constexpr char kDigits[] = "0123456789abcdef";
+  std::string           text;
+  text.reserve(length * 2);
+  for (unsigned int i = 0; i < length; ++i)
+  {
+    text.push_back(kDigits[digest[i] >> 4]);
+    text.push_back(kDigits[digest[i] & 0x0f]);
+  }
+  return text;
+}
+
+inline auto hex(const EVP_MD* md, const void* data, std::size_t size) -> std::string
+{
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int  length = 0;
+  if (EVP_Digest(data, size, digest, &length, md, nullptr) != 1)
+  {
+    return {};
+  }
+  return to_hex(digest, length);
+}
+
+// Same, of a whole file read in blocks; also empty if it cannot be read
+inline auto file_hex(const EVP_MD* md, const std::string& path) -> std::string
+{
+  using File    = std::unique_ptr<FILE, decltype(&std::fclose)>;
+  using Context = std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)>;
+
+  File    file(std::fopen(path.c_str(), "rb"), &std::fclose);
+  Context ctx(EVP_MD_CTX_new(), &EVP_MD_CTX_free);
+  if (!file || !ctx || EVP_DigestInit_ex(ctx.get(), md, nullptr) != 1)
+  {
+    return {};
+  }
+
+  unsigned char buffer[64 * 1024];
+  std::size_t   read;
+  while ((read = std::fread(buffer, 1, sizeof(buffer), file.get())) > 0)
+  {
+    if (EVP_DigestUpdate(ctx.get(), buffer, read) != 1)
+    {
+      return {};
+    }
+  }
+
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int  length = 0;
+  if (std::ferror(file.get()) || EVP_DigestFinal_ex(ctx.get(), digest, &length) != 1)
+  {
+    return {};
+  }
+  return to_hex(digest, length);
+}
+
+// Checksum of every chunk of a chunked upload (Upload-Checksum)
+inline auto sha256(const void* data, std::size_t size) -> std::string
+{
+  return hex(EVP_sha256(), data, size);
+}
+
+// Content address of a stored file (see blob_store.hpp)
+inline auto blake2s256_file(const std::string& path) -> std::string
+{
+  return file_hex(EVP_blake2s256(), path);
+}
+
+} // namespace digest
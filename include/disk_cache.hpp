@@ -0,0 +1,336 @@
+#pragma once
+
+#include "logger.hpp"
+#include "macros.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fcntl.h>
+#include <filesystem>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * RECEIVER DISK CACHE
+ *
+ * Keeps every file the receiver fetched from the server under
+ * `$XDG_CACHE_HOME/wavy/<ip>/<audio_id>/` (`~/.cache/wavy/...` by default), so replaying a track
+ * or switching back to a bitrate does not fetch its segments again.
+ *
+ * -> Entries are the raw response bodies, one file each (a #EXT-X-BYTERANGE slice is stored
+ *    as "<file>.<offset>-<length>"), so they can be mmap()ed directly; lookup() maps them
+ *    instead of streaming them through an ifstream. The server's ETag sits next to each entry
+ *    in a "<entry>.etag" sidecar.
+ *
+ * -> Segments and init segments are immutable: every upload gets a fresh audio-id, so a cached
+ *    segment is served without asking the server at all. Playlists are revalidated with
+ *    If-None-Match and cost one bodiless 304 when unchanged.
+ *
+ * -> The cache is bounded by `byte_budget` and evicts least-recently-used entries. Recency is
+ *    the entry's mtime, refreshed on every hit, so the LRU order survives across runs: it is
+ *    rebuilt from one directory walk when the cache is opened.
+ *
+ * Entries are written to a temporary file and renamed into place, so a crashed or concurrent
+ * client never reads a partial entry.
+ */
+
+class DiskCache
+{
+public:
+  struct Entry
+  {
+    std::string body;
+    std::string etag;          // empty if the server sent none
+    bool        fresh = false; // usable without revalidation
+  };
+
+  // $XDG_CACHE_HOME/wavy, else $HOME/.cache/wavy; empty if neither is set
+  static auto default_root() -> std::filesystem::path
+  {
+    if (const char* xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg)
+    {
+      return std::filesystem::path(xdg) / "wavy";
+    }
+    if (const char* home = std::getenv("HOME"); home && *home)
+    {
+      return std::filesystem::path(home) / ".cache" / "wavy";
+    }
+    return {};
+  }
+
+  DiskCache(std::filesystem::path root, std::uint64_t byte_budget)
+      : root_(std::move(root)), budget_(byte_budget)
+  {
+    if (!root_.empty())
+    {
+      load_index();
+    }
+  }
+
+  DiskCache(const DiskCache&)                    = delete;
+  auto operator=(const DiskCache&) -> DiskCache& = delete;
+
+  [[nodiscard]] auto enabled() const -> bool { return !root_.empty() && budget_ > 0; }
+
+  /*
+   * Cache key of a server path "/hls/<ip>/<audio_id>/<file>" (plus the byte range it asks
+   * for, if any); empty for anything else, which is never cached.
+   */
+  static auto key_for(std::string_view target, std::uint64_t offset = 0, std::uint64_t length = 0)
+    -> std::string
+  {
+    constexpr std::string_view prefix = "/hls/";
+    if (!target.starts_with(prefix) || target.find("..") != std::string_view::npos ||
+        target.find_first_of("?#") != std::string_view::npos)
+    {
+      return {};
+    }
+    target.remove_prefix(prefix.size());
+    if (std::count(target.begin(), target.end(), '/') != 2 || target.ends_with('/'))
+    {
+      return {};
+    }
+
+    std::string key(target);
+    if (length > 0)
+    {
+      key.append(".").append(std::to_string(offset)).append("-").append(std::to_string(length));
+    }
+    return key;
+  }
+
+  auto lookup(const std::string& key) -> std::optional<Entry>
+  {
+    if (!enabled() || key.empty())
+    {
+      return std::nullopt;
+    }
+
+    std::lock_guard lock(mutex_);
+    const std::filesystem::path path = root_ / key;
+
+    Entry entry;
+    entry.fresh = !key.ends_with(macros::PLAYLIST_EXT);
+    read_small_file(etag_path(path), entry.etag);
+    if (!entry.fresh && entry.etag.empty())
+    {
+      return std::nullopt; // a playlist we could not revalidate is of no use
+    }
+
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+      forget(key);
+      return std::nullopt;
+    }
+
+    struct stat st{};
+    bool        ok = ::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0;
+    if (ok)
+    {
+      const auto  size = static_cast<std::size_t>(st.st_size);
+      void* const data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      ok               = data != MAP_FAILED;
+      if (ok)
+      {
+        entry.body.assign(static_cast<const char*>(data), size);
+        ::munmap(data, size);
+        ::futimens(fd, nullptr); // most recently used, also for the next run
+        touch(key, size);
+      }
+    }
+    ::close(fd);
+
+    if (!ok)
+    {
+      return std::nullopt;
+    }
+    return entry;
+  }
+
+  void store(const std::string& key, std::string_view body, std::string_view etag)
+  {
+    if (!enabled() || key.empty() || body.empty() || body.size() > budget_)
+    {
+      return;
+    }
+
+    std::lock_guard             lock(mutex_);
+    const std::filesystem::path path = root_ / key;
+
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+    if (ec || !write_file(path, body))
+    {
+      LOG_WARNING << RECEIVER_LOG << "Failed to cache " << key;
+      return;
+    }
+    if (etag.empty())
+    {
+      std::filesystem::remove(etag_path(path), ec);
+    }
+    else
+    {
+      write_file(etag_path(path), etag);
+    }
+
+    touch(key, body.size());
+    evict();
+  }
+
+  [[nodiscard]] auto bytes() const -> std::uint64_t { return bytes_; }
+
+private:
+  using Lru = std::list<std::pair<std::string, std::uint64_t>>; // key, size; front is newest
+
+  std::filesystem::path                          root_;
+  std::uint64_t                                  budget_;
+  std::uint64_t                                  bytes_ = 0;
+  std::mutex                                     mutex_;
+  Lru                                            lru_;
+  std::unordered_map<std::string, Lru::iterator> index_;
+
+  static auto etag_path(const std::filesystem::path& path) -> std::filesystem::path
+  {
+    return std::filesystem::path(path).concat(".etag");
+  }
+
+  static auto read_small_file(const std::filesystem::path& path, std::string& out) -> bool
+  {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+      return false;
+    }
+    char          buffer[256];
+    const ssize_t n = ::read(fd, buffer, sizeof(buffer));
+    ::close(fd);
+    if (n <= 0)
+    {
+      return false;
+    }
+    out.assign(buffer, static_cast<std::size_t>(n));
+    return true;
+  }
+
+  // Written beside the target and renamed over it, so readers see all of it or nothing
+  static auto write_file(const std::filesystem::path& path, std::string_view data) -> bool
+  {
+    std::filesystem::path tmp = path;
+    tmp.concat(".tmp." + std::to_string(::getpid()));
+
+    const int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+      return false;
+    }
+
+    bool        ok   = true;
+    const char* next = data.data();
+    std::size_t left = data.size();
+    while (left > 0)
+    {
+      const ssize_t n = ::write(fd, next, left);
+      if (n <= 0)
+      {
+        ok = false;
+        break;
+      }
+      next += n;
+      left -= static_cast<std::size_t>(n);
+    }
+    ok = ::close(fd) == 0 && ok && ::rename(tmp.c_str(), path.c_str()) == 0;
+
+    if (!ok)
+    {
+      ::unlink(tmp.c_str());
+    }
+    return ok;
+  }
+
+  void touch(const std::string& key, std::uint64_t size)
+  {
+    if (auto it = index_.find(key); it != index_.end())
+    {
+      bytes_ -= it->second->second;
+      it->second->second = size;
+      lru_.splice(lru_.begin(), lru_, it->second);
+    }
+    else
+    {
+      lru_.emplace_front(key, size);
+      index_.emplace(key, lru_.begin());
+    }
+    bytes_ += size;
+  }
+
+  void forget(const std::string& key)
+  {
+    if (auto it = index_.find(key); it != index_.end())
+    {
+      bytes_ -= it->second->second;
+      lru_.erase(it->second);
+      index_.erase(it);
+    }
+  }
+
+  void evict()
+  {
+    while (bytes_ > budget_ && !lru_.empty())
+    {
+      const std::filesystem::path path = root_ / lru_.back().first;
+      std::error_code             ec;
+      std::filesystem::remove(path, ec);
+      std::filesystem::remove(etag_path(path), ec);
+      std::filesystem::remove(path.parent_path(), ec); // only goes if that was its last entry
+
+      index_.erase(lru_.back().first);
+      bytes_ -= lru_.back().second;
+      lru_.pop_back();
+    }
+  }
+
+  // One walk of the cache directory, ordered by mtime: the LRU order of the previous runs
+  void load_index()
+  {
+    struct Found
+    {
+      std::filesystem::file_time_type used;
+      std::string                     key;
+      std::uint64_t                   size;
+    };
+    std::vector<Found> found;
+
+    std::error_code ec;
+    for (auto it = std::filesystem::recursive_directory_iterator(root_, ec);
+         !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec))
+    {
+      const std::filesystem::path& path = it->path();
+      if (!it->is_regular_file(ec) || path.extension() == ".etag" ||
+          path.filename().string().find(".tmp.") != std::string::npos)
+      {
+        continue;
+      }
+      found.push_back({it->last_write_time(ec), path.lexically_relative(root_).string(),
+                       static_cast<std::uint64_t>(it->file_size(ec))});
+    }
+
+    std::ranges::sort(found, {}, &Found::used);
+    for (Found& file : found)
+    {
+      touch(file.key, file.size); // oldest first, so the newest ends up at the front
+    }
+    evict();
+
+    LOG_DEBUG << RECEIVER_LOG << "Disk cache " << root_ << ": " << lru_.size() << " entries, "
+              << bytes_ << " bytes";
+  }
+};
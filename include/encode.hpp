@@ -2,373 +2,908 @@
 
 #include "../include/logger.hpp"
 #include "../include/macros.hpp"
+#include "../include/registry.hpp"
+#include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
 #include <vector>
 extern "C"
 {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <libavutil/audio_fifo.h>
+#include <libavutil/channel_layout.h>
 #include <libavutil/opt.h>
+#include <libswresample/swresample.h>
 }
 
-/**
- * @class HLS_Encoder
- * @brief Encodes an input audio file into HLS segments with Adaptive Bitrate (ABR) support.
+namespace fs = std::filesystem;
+
+// Reference handling of the two kinds of items a RefQueue carries
+template <typename T> struct AvRef;
+
+template <> struct AvRef<AVFrame>
+{
+  static auto alloc() -> AVFrame* { return av_frame_alloc(); }
+  static auto ref(AVFrame* dst, const AVFrame* src) -> int { return av_frame_ref(dst, src); }
+  static void move(AVFrame* dst, AVFrame* src) { av_frame_move_ref(dst, src); }
+  static void unref(AVFrame* item) { av_frame_unref(item); }
+  static void free(AVFrame* item) { av_frame_free(&item); }
+};
+
+template <> struct AvRef<AVPacket>
+{
+  static auto alloc() -> AVPacket* { return av_packet_alloc(); }
+  static auto ref(AVPacket* dst, const AVPacket* src) -> int { return av_packet_ref(dst, src); }
+  static void move(AVPacket* dst, AVPacket* src) { av_packet_move_ref(dst, src); }
+  static void unref(AVPacket* item) { av_packet_unref(item); }
+  static void free(AVPacket* item) { av_packet_free(&item); }
+};
+
+/*
+ * Bounded hand-off of frames (or packets) from the demux thread to one rendition thread.
  *
- * The HLS_Encoder class handles the process of encoding an input audio file into multiple
- * HLS segments, supporting multiple bitrates for Adaptive Bitrate (ABR) streaming.
+ * -> push() queues a new reference to the item's buffers, not a copy: every rendition reads the
+ *    same decoded samples, and the buffers go back to the decoder's pool when the last
+ *    rendition has unref'd them.
  *
- * ## **Concepts**
- * - **HLS (HTTP Live Streaming)**: A protocol used for streaming media over the web.
- * - **ABR (Adaptive Bitrate Streaming)**: A technique where multiple bitrate versions of a media
- * file are created, allowing the player to switch based on network conditions.
- * - **M3U8 Playlist**: A playlist format used by HLS, consisting of a **master playlist** and
- * **variant playlists**.
+ * -> The AVFrame/AVPacket shells are recycled through a spare list, so once the queue has been
+ *    full once, moving items through it allocates nothing.
  *
- * ## **How It Works**
- * - The class extracts the audio stream from the input file.
- * - It transcodes the audio to different bitrates.
- * - Each bitrate has its own HLS playlist.
- * - A **master playlist** (`index.m3u8`) is generated, referencing all variant playlists.
+ * -> close() is the end of the input: pop() drains what is left, then returns false. cancel()
+ *    is the rendition giving up: push() returns false from then on.
  */
-
-namespace fs = std::filesystem;
-class HLS_Encoder
+template <typename T> class RefQueue
 {
 public:
-  /**
-   * @brief Initializes the HLS encoder.
-   *
-   * This constructor initializes the FFmpeg network stack and sets the log level for debugging.
-   */
-  HLS_Encoder() { avformat_network_init(); }
+  explicit RefQueue(std::size_t capacity) : capacity_(capacity > 0 ? capacity : 1) {}
 
-  /**
-   * @brief Cleans up resources and deinitializes FFmpeg network stack.
-   */
-  ~HLS_Encoder() { avformat_network_deinit(); }
-  /**
-   * @brief Creates HLS segments for multiple bitrates.
-   *
-   * @param input_file The path to the input audio file.
-   * @param bitrates A vector of bitrates (in kbps) for encoding.
-   * @param output_dir The directory where HLS playlists and segments will be stored.
-   *
-   * This function iterates over the provided bitrates, encoding each into an HLS playlist.
-   * It then generates a master playlist linking all variant playlists.
-   */
-  void create_hls_segments(const char* input_file, const std::vector<int>& bitrates,
-                           const char* output_dir, bool use_flac = false)
-  {
-    std::vector<std::string> playlist_files;
+  RefQueue(const RefQueue&)                    = delete;
+  auto operator=(const RefQueue&) -> RefQueue& = delete;
 
-    for (int bitrate : bitrates)
+  ~RefQueue()
+  {
+    for (T* item : items_)
     {
-      std::string codec_prefix    = use_flac ? "flac" : "mp3";
-      std::string output_playlist = std::string(output_dir) + "/hls_" + codec_prefix + "_" +
-                                    std::to_string(bitrate) +
-                                    macros::to_string(macros::PLAYLIST_EXT);
-      playlist_files.push_back(output_playlist);
+      AvRef<T>::free(item);
+    }
+    for (T* item : spare_)
+    {
+      AvRef<T>::free(item);
+    }
+  }
 
-      bool success = use_flac ? encode_flac_variant(input_file, output_playlist.c_str(), bitrate)
-                              : encode_variant(input_file, output_playlist.c_str(), bitrate);
+  // False once cancelled, or if the reference could not be taken
+  auto push(const T* item) -> bool
+  {
+    std::unique_lock lock(mutex_);
+    not_full_.wait(lock, [this] { return items_.size() < capacity_ || cancelled_; });
+    if (cancelled_)
+    {
+      return false;
+    }
 
-      if (!success)
+    T* shell = nullptr;
+    if (spare_.empty())
+    {
+      shell = AvRef<T>::alloc();
+    }
+    else
+    {
+      shell = spare_.back();
+      spare_.pop_back();
+    }
+    if (!shell || AvRef<T>::ref(shell, item) < 0)
+    {
+      if (shell)
       {
-        av_log(nullptr, AV_LOG_ERROR, "Encoding failed for bitrate: %d\n", bitrate);
-        return;
+        spare_.push_back(shell);
       }
+      return false;
+    }
+
+    items_.push_back(shell);
+    not_empty_.notify_one();
+    return true;
+  }
+
+  // Moves the next item into `out`; false at the end of the input or once cancelled
+  auto pop(T* out) -> bool
+  {
+    std::unique_lock lock(mutex_);
+    not_empty_.wait(lock, [this] { return !items_.empty() || closed_ || cancelled_; });
+    if (cancelled_ || items_.empty())
+    {
+      return false;
     }
+    T* shell = items_.front();
+    items_.pop_front();
+    AvRef<T>::move(out, shell);
+    spare_.push_back(shell);
+    not_full_.notify_one();
+    return true;
+  }
+
+  void close()
+  {
+    std::lock_guard lock(mutex_);
+    closed_ = true;
+    not_empty_.notify_all();
+  }
 
-    create_master_playlist(playlist_files, bitrates, output_dir, use_flac);
+  void cancel()
+  {
+    std::lock_guard lock(mutex_);
+    cancelled_ = true;
+    for (T* item : items_)
+    {
+      AvRef<T>::unref(item);
+      spare_.push_back(item);
+    }
+    items_.clear();
+    not_empty_.notify_all();
+    not_full_.notify_all();
   }
 
 private:
+  const std::size_t       capacity_;
+  std::mutex              mutex_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+  std::deque<T*>          items_;
+  std::vector<T*>         spare_;
+  bool                    closed_    = false;
+  bool                    cancelled_ = false;
+};
+
+/*
+ * One rendition of the ladder: its encoder, the HLS muxer writing its playlist and segments, and
+ * the thread body that drives them.
+ *
+ * -> Transcoding: decoded frames are converted by libswresample to what the encoder takes,
+ *    collected in an AVAudioFifo and cut into frames of the encoder's frame size.
+ *
+ * -> Copying (no encoder): demuxed packets are only re-timed into the output stream.
+ *
+ * open() runs on the caller's thread, run() on the rendition's own thread.
+ */
+class HLS_Rendition
+{
+public:
+  HLS_Rendition(int bitrate, std::string playlist)
+      : bitrate_(bitrate), playlist_(std::move(playlist))
+  {
+  }
+
+  HLS_Rendition(const HLS_Rendition&)                    = delete;
+  auto operator=(const HLS_Rendition&) -> HLS_Rendition& = delete;
+
+  ~HLS_Rendition()
+  {
+    av_frame_free(&input_);
+    av_frame_free(&converted_);
+    av_frame_free(&frame_);
+    av_packet_free(&packet_);
+    if (fifo_)
+    {
+      av_audio_fifo_free(fifo_);
+    }
+    swr_free(&swr_);
+    avcodec_free_context(&encoder_);
+    if (output_ctx_)
+    {
+      if (!(output_ctx_->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&output_ctx_->pb);
+      avformat_free_context(output_ctx_);
+    }
+  }
+
   /**
-   * @brief Encodes an audio file into HLS format at a specific bitrate.
+   * @brief Sets up the muxer and writes its header.
    *
-   * @param input_file The input audio file.
-   * @param output_playlist The output HLS playlist (.m3u8 file).
-   * @param bitrate The target bitrate (in kbps).
-   * @return `true` on success, `false` on failure.
-   *
-   * This function extracts the audio stream, sets the encoding bitrate, and writes HLS segments.
+   * @param input The demuxed audio stream.
+   * @param codec Encoder to transcode with, or nullptr to copy the input's packets.
+   * @param options HLS muxer options; consumed ones are removed.
    */
-  auto encode_variant(const char* input_file, const char* output_playlist, int bitrate) -> bool
+  auto open(const AVStream* input, const AVCodec* codec, AVDictionary** options) -> bool
   {
-    AVFormatContext* input_ctx          = nullptr;
-    AVFormatContext* output_ctx         = nullptr;
-    AVStream*        audio_stream       = nullptr;
-    int              audio_stream_index = -1;
-    bool             is_flac            = false;
-    AVDictionary*    options            = nullptr;
+    if (avformat_alloc_output_context2(&output_ctx_, nullptr, "hls", playlist_.c_str()) < 0)
+    {
+      av_log(nullptr, AV_LOG_ERROR, "Failed to allocate output context\n");
+      return false;
+    }
 
-    if (avformat_open_input(&input_ctx, input_file, nullptr, nullptr) < 0)
+    stream_ = avformat_new_stream(output_ctx_, nullptr);
+    packet_ = av_packet_alloc();
+    if (!stream_ || !packet_)
     {
-      av_log(nullptr, AV_LOG_ERROR, "Failed to open input file: %s\n", input_file);
+      av_log(nullptr, AV_LOG_ERROR, "Failed to create new stream\n");
       return false;
     }
 
-    if (avformat_find_stream_info(input_ctx, nullptr) < 0)
+    in_time_base_ = input->time_base;
+    if (codec ? !open_encoder(input, codec)
+              : avcodec_parameters_copy(stream_->codecpar, input->codecpar) < 0)
     {
-      av_log(nullptr, AV_LOG_ERROR, "Failed to retrieve stream info\n");
-      avformat_close_input(&input_ctx);
       return false;
     }
 
-    // Find audio stream and detect if input is FLAC
-    for (unsigned int i = 0; i < input_ctx->nb_streams; i++)
+    if (avformat_write_header(output_ctx_, options) < 0)
+    {
+      av_log(nullptr, AV_LOG_ERROR, "Error occurred while writing header\n");
+      return false;
+    }
+    return true;
+  }
+
+  // Demux side: queues a reference to a decoded frame or a (copied) packet
+  auto push(const AVFrame* frame) -> bool { return frames_.push(frame); }
+  auto push(const AVPacket* packet) -> bool { return packets_.push(packet); }
+
+  // Demux side: the input is over
+  void close()
+  {
+    frames_.close();
+    packets_.close();
+  }
+
+  // Thread body: everything queued, then the encoder's delay and the trailer
+  void run()
+  {
+    ok_ = encoder_ ? transcode() : copy();
+    if (ok_)
+    {
+      ok_ = av_write_trailer(output_ctx_) >= 0;
+    }
+    else
+    {
+      frames_.cancel(); // the demuxer stops feeding us
+      packets_.cancel();
+    }
+  }
+
+  [[nodiscard]] auto ok() const -> bool { return ok_; }
+  [[nodiscard]] auto bitrate() const -> int { return bitrate_; }
+  [[nodiscard]] auto playlist() const -> const std::string& { return playlist_; }
+
+private:
+  static constexpr int kVariableFrameSize = 4096; // samples per frame if the encoder takes any
+
+  int                bitrate_; // kbps
+  std::string        playlist_;
+  RefQueue<AVFrame>  frames_{WAVY_ENCODER_QUEUE_ITEMS};
+  RefQueue<AVPacket> packets_{WAVY_ENCODER_QUEUE_ITEMS};
+  AVFormatContext*   output_ctx_   = nullptr;
+  AVStream*          stream_       = nullptr;
+  AVRational         in_time_base_ = {1, 1};
+  AVCodecContext*    encoder_      = nullptr;
+  SwrContext*        swr_          = nullptr;
+  AVAudioFifo*       fifo_         = nullptr;
+  AVFrame*           input_        = nullptr; // frame popped off the queue
+  AVFrame*           converted_    = nullptr; // resampler output, grown as needed
+  AVFrame*           frame_        = nullptr; // encoder input, frame_size_ samples
+  AVPacket*          packet_       = nullptr;
+  int                frame_size_   = 0;
+  int                capacity_     = 0; // samples converted_ can hold
+  int64_t            next_pts_     = 0;
+  bool               ok_           = false;
+
+  // Closest sample rate the encoder supports
+  static auto supported_rate(const AVCodec* codec, int rate) -> int
+  {
+    if (!codec->supported_samplerates)
     {
-      if (input_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+      return rate;
+    }
+    int best = codec->supported_samplerates[0];
+    for (const int* candidate = codec->supported_samplerates; *candidate; ++candidate)
+    {
+      if (std::abs(*candidate - rate) < std::abs(best - rate))
       {
-        audio_stream_index = i;
-        if (input_ctx->streams[i]->codecpar->codec_id == AV_CODEC_ID_FLAC)
-          is_flac = true;
-        break;
+        best = *candidate;
       }
     }
+    return best;
+  }
 
-    if (audio_stream_index == -1)
+  // The input's own sample format if the encoder takes it, so FLAC keeps 24-bit sources intact
+  static auto supported_format(const AVCodec* codec, int format) -> AVSampleFormat
+  {
+    const auto packed = av_get_packed_sample_fmt(static_cast<AVSampleFormat>(format));
+    if (!codec->sample_fmts)
     {
-      av_log(nullptr, AV_LOG_ERROR, "No audio stream found\n");
-      avformat_close_input(&input_ctx);
-      return false;
+      return packed;
     }
+    for (const AVSampleFormat* candidate = codec->sample_fmts; *candidate != AV_SAMPLE_FMT_NONE;
+         ++candidate)
+    {
+      if (av_get_packed_sample_fmt(*candidate) == packed)
+      {
+        return *candidate;
+      }
+    }
+    return codec->sample_fmts[0];
+  }
 
-    // Allocate output context for HLS (do not change the muxer later)
-    if (avformat_alloc_output_context2(&output_ctx, nullptr, "hls", output_playlist) < 0)
+  auto open_encoder(const AVStream* input, const AVCodec* codec) -> bool
+  {
+    encoder_ = avcodec_alloc_context3(codec);
+    if (!encoder_)
     {
-      av_log(nullptr, AV_LOG_ERROR, "Failed to allocate output context\n");
-      avformat_close_input(&input_ctx);
+      av_log(nullptr, AV_LOG_ERROR, "Failed to allocate encoder\n");
       return false;
     }
 
-    // Create new stream in output context
-    audio_stream = avformat_new_stream(output_ctx, nullptr);
-    if (!audio_stream)
+    // MP3 carries at most two channels; FLAC up to eight
+    const int max_channels = codec->id == AV_CODEC_ID_MP3 ? 2 : 8;
+    av_channel_layout_default(&encoder_->ch_layout,
+                              std::min(input->codecpar->ch_layout.nb_channels, max_channels));
+    encoder_->sample_fmt  = supported_format(codec, input->codecpar->format);
+    encoder_->sample_rate = supported_rate(codec, input->codecpar->sample_rate);
+    encoder_->time_base   = {1, encoder_->sample_rate};
+    if (codec->id == AV_CODEC_ID_FLAC)
     {
-      av_log(nullptr, AV_LOG_ERROR, "Failed to create new stream\n");
-      avformat_close_input(&input_ctx);
-      avformat_free_context(output_ctx);
+      encoder_->bits_per_raw_sample = input->codecpar->bits_per_raw_sample;
+    }
+    else
+    {
+      encoder_->bit_rate = static_cast<int64_t>(bitrate_) * 1000; // kbps to bps conversion
+    }
+    if (output_ctx_->oformat->flags & AVFMT_GLOBALHEADER)
+    {
+      encoder_->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    if (avcodec_open2(encoder_, codec, nullptr) < 0 ||
+        avcodec_parameters_from_context(stream_->codecpar, encoder_) < 0)
+    {
+      av_log(nullptr, AV_LOG_ERROR, "Failed to open the %s encoder at %d kbps\n", codec->name,
+             bitrate_);
+      return false;
+    }
+    stream_->time_base = encoder_->time_base;
+
+    frame_size_ = encoder_->frame_size > 0 &&
+                      !(codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE)
+                    ? encoder_->frame_size
+                    : kVariableFrameSize;
+
+    input_     = av_frame_alloc();
+    converted_ = av_frame_alloc();
+    frame_     = av_frame_alloc();
+    fifo_      = av_audio_fifo_alloc(encoder_->sample_fmt, encoder_->ch_layout.nb_channels,
+                                     frame_size_);
+    if (!input_ || !converted_ || !frame_ || !fifo_)
+    {
+      av_log(nullptr, AV_LOG_ERROR, "Failed to allocate encoder buffers\n");
       return false;
     }
 
-    if (avcodec_parameters_copy(audio_stream->codecpar,
-                                input_ctx->streams[audio_stream_index]->codecpar) < 0)
+    frame_->nb_samples  = frame_size_;
+    frame_->format      = encoder_->sample_fmt;
+    frame_->sample_rate = encoder_->sample_rate;
+    av_channel_layout_copy(&frame_->ch_layout, &encoder_->ch_layout);
+    if (av_frame_get_buffer(frame_, 0) < 0)
     {
-      av_log(nullptr, AV_LOG_ERROR, "Failed to copy codec parameters\n");
-      avformat_close_input(&input_ctx);
-      avformat_free_context(output_ctx);
+      av_log(nullptr, AV_LOG_ERROR, "Failed to allocate encoder frame\n");
       return false;
     }
+    return true;
+  }
 
-    audio_stream->codecpar->bit_rate = bitrate * 1000; // kbps to bps conversion
+  // The decoder's output format is only certain once it produced a frame, so this waits for one
+  auto open_resampler(const AVFrame* frame) -> bool
+  {
+    AVChannelLayout in_layout{};
+    if (frame->ch_layout.order == AV_CHANNEL_ORDER_UNSPEC)
+    {
+      av_channel_layout_default(&in_layout, frame->ch_layout.nb_channels);
+    }
+    else
+    {
+      av_channel_layout_copy(&in_layout, &frame->ch_layout);
+    }
 
-    // Prepare segment filename
-    std::string output_playlist_str = output_playlist;
-    size_t      last_slash          = output_playlist_str.find_last_of('/');
-    std::string out_dir =
-      (last_slash != std::string::npos) ? output_playlist_str.substr(0, last_slash) : ".";
-    std::string segment_filename_format =
-      out_dir + "/hls_mp3_" + std::to_string(bitrate) + "_%d.ts";
+    const int ret = swr_alloc_set_opts2(&swr_, &encoder_->ch_layout, encoder_->sample_fmt,
+                                        encoder_->sample_rate, &in_layout,
+                                        static_cast<AVSampleFormat>(frame->format),
+                                        frame->sample_rate, 0, nullptr);
+    av_channel_layout_uninit(&in_layout);
+    if (ret < 0 || swr_init(swr_) < 0)
+    {
+      av_log(nullptr, AV_LOG_ERROR, "Failed to set up the resampler\n");
+      return false;
+    }
+    return true;
+  }
 
-    // Set HLS options common to both cases
-    av_dict_set(&options, macros::to_string(macros::CODEC_HLS_TIME_FIELD).c_str(), "10", 0);
-    av_dict_set(&options, macros::to_string(macros::CODEC_HLS_LIST_SIZE_FIELD).c_str(), "0", 0);
-    av_dict_set(&options, macros::to_string(macros::CODEC_HLS_FLAGS_FIELD).c_str(),
-                "independent_segments", 0);
-    av_dict_set(&options, macros::to_string(macros::CODEC_HLS_SEGMENT_FILENAME_FIELD).c_str(),
-                segment_filename_format.c_str(), 0);
+  // Makes converted_ hold at least `samples`
+  auto reserve(int samples) -> bool
+  {
+    if (samples <= capacity_)
+    {
+      return true;
+    }
+    av_frame_unref(converted_);
+    converted_->nb_samples  = samples;
+    converted_->format      = encoder_->sample_fmt;
+    converted_->sample_rate = encoder_->sample_rate;
+    av_channel_layout_copy(&converted_->ch_layout, &encoder_->ch_layout);
+    if (av_frame_get_buffer(converted_, 0) < 0)
+    {
+      capacity_ = 0;
+      return false;
+    }
+    capacity_ = samples;
+    return true;
+  }
 
-    // Write header (after all options and codec parameter changes)
-    if (avformat_write_header(output_ctx, &options) < 0)
+  // Resamples one frame (nullptr: what the resampler still holds) into the FIFO
+  auto resample(const AVFrame* frame) -> bool
+  {
+    const int in_samples = frame ? frame->nb_samples : 0;
+    const int room       = swr_get_out_samples(swr_, in_samples);
+    if (room <= 0)
     {
-      av_log(nullptr, AV_LOG_ERROR, "Error occurred while writing header\n");
-      av_dict_free(&options);
-      avformat_close_input(&input_ctx);
-      avformat_free_context(output_ctx);
+      return room == 0;
+    }
+    if (!reserve(room))
+    {
+      av_log(nullptr, AV_LOG_ERROR, "Failed to allocate resampler output\n");
       return false;
     }
 
-    // Packet processing loop
-    AVPacket pkt;
-    while (av_read_frame(input_ctx, &pkt) >= 0)
+    const int samples =
+      swr_convert(swr_, converted_->extended_data, room,
+                  frame ? const_cast<const uint8_t**>(frame->extended_data) : nullptr, in_samples);
+    return samples >= 0 &&
+           av_audio_fifo_write(fifo_, reinterpret_cast<void**>(converted_->extended_data),
+                               samples) == samples;
+  }
+
+  // Encodes whole frames from the FIFO; with `last`, the short final frame as well
+  auto drain(bool last) -> bool
+  {
+    while (av_audio_fifo_size(fifo_) >= frame_size_ || (last && av_audio_fifo_size(fifo_) > 0))
     {
-      if (pkt.stream_index == audio_stream_index)
+      if (av_frame_make_writable(frame_) < 0)
+      {
+        return false;
+      }
+      frame_->nb_samples = std::min(av_audio_fifo_size(fifo_), frame_size_);
+      if (av_audio_fifo_read(fifo_, reinterpret_cast<void**>(frame_->extended_data),
+                             frame_->nb_samples) < frame_->nb_samples)
       {
-        pkt.stream_index = audio_stream->index;
-        pkt.pts          = av_rescale_q(pkt.pts, input_ctx->streams[audio_stream_index]->time_base,
-                                        audio_stream->time_base);
-        pkt.dts          = av_rescale_q(pkt.dts, input_ctx->streams[audio_stream_index]->time_base,
-                                        audio_stream->time_base);
-        pkt.duration = av_rescale_q(pkt.duration, input_ctx->streams[audio_stream_index]->time_base,
-                                    audio_stream->time_base);
-
-        if (av_interleaved_write_frame(output_ctx, &pkt) < 0)
-        {
-          av_log(nullptr, AV_LOG_ERROR, "Error writing frame\n");
-          av_packet_unref(&pkt);
-          break;
-        }
+        return false;
+      }
+      frame_->pts = next_pts_;
+      next_pts_ += frame_->nb_samples;
+
+      if (!encode(frame_))
+      {
+        return false;
       }
-      av_packet_unref(&pkt);
     }
+    return true;
+  }
 
-    av_write_trailer(output_ctx);
+  // Sends a frame (nullptr: end of stream) and writes every packet the encoder has ready
+  auto encode(const AVFrame* frame) -> bool
+  {
+    int ret = avcodec_send_frame(encoder_, frame);
+    if (ret < 0)
+    {
+      av_log(nullptr, AV_LOG_ERROR, "Error encoding frame for bitrate: %d\n", bitrate_);
+      return false;
+    }
 
-    av_dict_free(&options);
-    avformat_close_input(&input_ctx);
-    if (output_ctx)
+    while ((ret = avcodec_receive_packet(encoder_, packet_)) >= 0)
+    {
+      av_packet_rescale_ts(packet_, encoder_->time_base, stream_->time_base);
+      packet_->stream_index = stream_->index;
+      if (av_interleaved_write_frame(output_ctx_, packet_) < 0)
+      {
+        av_log(nullptr, AV_LOG_ERROR, "Error writing frame\n");
+        return false;
+      }
+    }
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF;
+  }
+
+  auto transcode() -> bool
+  {
+    while (frames_.pop(input_))
     {
-      if (!(output_ctx->oformat->flags & AVFMT_NOFILE))
-        avio_closep(&output_ctx->pb);
-      avformat_free_context(output_ctx);
+      const bool ok = (swr_ || open_resampler(input_)) && resample(input_) && drain(false);
+      av_frame_unref(input_);
+      if (!ok)
+      {
+        return false;
+      }
     }
 
+    // Input is over: flush the resampler, the short last frame, then the encoder's delay
+    return (!swr_ || resample(nullptr)) && drain(true) && encode(nullptr);
+  }
+
+  auto copy() -> bool
+  {
+    while (packets_.pop(packet_))
+    {
+      av_packet_rescale_ts(packet_, in_time_base_, stream_->time_base);
+      packet_->pos          = -1;
+      packet_->stream_index = stream_->index;
+
+      if (av_interleaved_write_frame(output_ctx_, packet_) < 0)
+      {
+        av_log(nullptr, AV_LOG_ERROR, "Error writing packet.\n");
+        av_packet_unref(packet_);
+        return false;
+      }
+    }
     return true;
   }
+};
+
+/*
+ * The single demux (and decode) pass over the input. Every packet of the audio stream is read
+ * once; decoded frames, or the packets themselves when copying, go to every rendition.
+ */
+class HLS_Source
+{
+public:
+  using Renditions = std::vector<std::unique_ptr<HLS_Rendition>>;
+
+  HLS_Source() = default;
+
+  HLS_Source(const HLS_Source&)                    = delete;
+  auto operator=(const HLS_Source&) -> HLS_Source& = delete;
+
+  ~HLS_Source()
+  {
+    av_frame_free(&frame_);
+    av_packet_free(&packet_);
+    avcodec_free_context(&decoder_);
+    if (input_ctx_)
+      avformat_close_input(&input_ctx_);
+  }
 
-  auto encode_flac_variant(const char* input_file, const char* output_playlist, int bitrate) -> bool
+  auto open(const char* input_file) -> bool
   {
-    AVFormatContext *input_ctx = nullptr, *output_ctx = nullptr;
-    AVStream *       in_stream = nullptr, *out_stream = nullptr;
-    AVPacket*        pkt = nullptr;
-    int              ret, audio_stream_idx = -1;
-    std::string      output_playlist_str = output_playlist;
-    size_t           last_slash          = output_playlist_str.find_last_of('/');
-    std::string      out_dir =
-      (last_slash != std::string::npos) ? output_playlist_str.substr(0, last_slash) : ".";
-    std::string segment_filename_format =
-      out_dir + "/hls_flac_" + std::to_string(bitrate) + "_%d.m4s";
+    if (avformat_open_input(&input_ctx_, input_file, nullptr, nullptr) < 0)
+    {
+      av_log(nullptr, AV_LOG_ERROR, "Failed to open input file: %s\n", input_file);
+      return false;
+    }
+
+    if (avformat_find_stream_info(input_ctx_, nullptr) < 0)
+    {
+      av_log(nullptr, AV_LOG_ERROR, "Failed to retrieve stream info\n");
+      return false;
+    }
+
+    stream_index_ = av_find_best_stream(input_ctx_, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+    if (stream_index_ < 0)
+    {
+      av_log(nullptr, AV_LOG_ERROR, "No audio stream found\n");
+      return false;
+    }
 
-    // Open input file
-    if ((ret = avformat_open_input(&input_ctx, input_file, nullptr, nullptr)) < 0)
+    packet_ = av_packet_alloc();
+    if (!packet_)
     {
-      av_log(nullptr, AV_LOG_ERROR, "Error opening input file.\n");
-      return ret;
+      av_log(nullptr, AV_LOG_ERROR, "Error allocating packet\n");
+      return false;
     }
+    return true;
+  }
+
+  [[nodiscard]] auto stream() const -> const AVStream*
+  {
+    return input_ctx_->streams[stream_index_];
+  }
+
+  [[nodiscard]] auto format() const -> const AVFormatContext* { return input_ctx_; }
 
-    if ((ret = avformat_find_stream_info(input_ctx, nullptr)) < 0)
+  // Makes run() hand out decoded frames instead of packets
+  auto open_decoder() -> bool
+  {
+    const AVCodec* codec = avcodec_find_decoder(stream()->codecpar->codec_id);
+    decoder_             = codec ? avcodec_alloc_context3(codec) : nullptr;
+    frame_               = av_frame_alloc();
+    if (!decoder_ || !frame_ ||
+        avcodec_parameters_to_context(decoder_, stream()->codecpar) < 0 ||
+        avcodec_open2(decoder_, codec, nullptr) < 0)
     {
-      av_log(nullptr, AV_LOG_ERROR, "Error finding stream info.\n");
-      goto cleanup;
+      av_log(nullptr, AV_LOG_ERROR, "Failed to open the decoder\n");
+      return false;
     }
+    return true;
+  }
 
-    // Find audio stream
-    for (int i = 0; i < input_ctx->nb_streams; i++)
+  // Feeds the whole input to `renditions`, then closes them; false if it had to stop early
+  auto run(const Renditions& renditions) -> bool
+  {
+    bool ok = true;
+    while (ok && av_read_frame(input_ctx_, packet_) >= 0)
     {
-      if (input_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+      if (packet_->stream_index == stream_index_)
       {
-        audio_stream_idx = i;
-        break;
+        ok = decoder_ ? decode(packet_, renditions) : fan_out(packet_, renditions);
       }
+      av_packet_unref(packet_);
+    }
+    if (ok && decoder_)
+    {
+      ok = decode(nullptr, renditions); // drain the decoder
+    }
+
+    for (const auto& rendition : renditions)
+    {
+      rendition->close();
+    }
+    return ok;
+  }
+
+private:
+  AVFormatContext* input_ctx_    = nullptr;
+  AVCodecContext*  decoder_      = nullptr;
+  AVPacket*        packet_       = nullptr;
+  AVFrame*         frame_        = nullptr;
+  int              stream_index_ = -1;
+
+  // False once no rendition takes items any more
+  template <typename T> static auto fan_out(const T* item, const Renditions& renditions) -> bool
+  {
+    bool taken = false;
+    for (const auto& rendition : renditions)
+    {
+      taken = rendition->push(item) || taken;
     }
+    return taken;
+  }
 
-    if (audio_stream_idx == -1)
+  auto decode(const AVPacket* packet, const Renditions& renditions) -> bool
+  {
+    int ret = avcodec_send_packet(decoder_, packet);
+    if (ret == AVERROR_INVALIDDATA)
     {
-      av_log(nullptr, AV_LOG_ERROR, "No audio stream found.\n");
-      ret = AVERROR(EINVAL);
-      goto cleanup;
+      av_log(nullptr, AV_LOG_WARNING, "Skipping a corrupt packet\n");
+      return true;
+    }
+    if (ret < 0)
+    {
+      av_log(nullptr, AV_LOG_ERROR, "Error decoding input\n");
+      return false;
     }
 
-    // Create output context
-    avformat_alloc_output_context2(&output_ctx, nullptr, "hls", output_playlist);
-    if (!output_ctx)
+    while ((ret = avcodec_receive_frame(decoder_, frame_)) >= 0)
     {
-      fprintf(stderr, "Error creating output context\n");
-      ret = AVERROR_UNKNOWN;
-      goto cleanup;
+      const bool taken = fan_out(frame_, renditions);
+      av_frame_unref(frame_);
+      if (!taken)
+      {
+        return false;
+      }
     }
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF;
+  }
+};
 
-    // Set HLS muxer options
-    av_opt_set(output_ctx->priv_data, "hls_segment_type", "fmp4", 0);
-    av_opt_set(output_ctx->priv_data, "hls_playlist_type", "vod", 0);
-    av_opt_set(output_ctx->priv_data,
-               macros::to_string(macros::CODEC_HLS_SEGMENT_FILENAME_FIELD).c_str(),
-               segment_filename_format.c_str(), 0);
-    av_opt_set(output_ctx->priv_data, "master_pl_name",
-               macros::to_string(macros::MASTER_PLAYLIST).c_str(), 0);
+/**
+ * @class HLS_Encoder
+ * @brief Encodes an input audio file into HLS segments with Adaptive Bitrate (ABR) support.
+ *
+ * The HLS_Encoder class handles the process of encoding an input audio file into multiple
+ * HLS segments, supporting multiple bitrates for Adaptive Bitrate (ABR) streaming.
+ *
+ * ## **Concepts**
+ * - **HLS (HTTP Live Streaming)**: A protocol used for streaming media over the web.
+ * - **ABR (Adaptive Bitrate Streaming)**: A technique where multiple bitrate versions of a media
+ * file are created, allowing the player to switch based on network conditions.
+ * - **M3U8 Playlist**: A playlist format used by HLS, consisting of a **master playlist** and
+ * **variant playlists**.
+ *
+ * ## **How It Works**
+ * - The input is opened, probed, demuxed and decoded **once**, whatever the number of bitrates.
+ * - Every bitrate is a rendition (HLS_Rendition) with its own encoder, HLS muxer and thread.
+ *   Decoded frames are fanned out to all of them as new references to the same buffers, so
+ *   the ladder costs one decode plus the slowest encode instead of one full pass per bitrate.
+ * - A FLAC input segmented as FLAC is not decoded at all: its packets are fanned out instead.
+ * - A **master playlist** (`index.m3u8`) is generated, referencing all variant playlists.
+ */
+class HLS_Encoder
+{
+public:
+  /**
+   * @brief Initializes the HLS encoder.
+   *
+   * This constructor initializes the FFmpeg network stack and sets the log level for debugging.
+   */
+  HLS_Encoder() { avformat_network_init(); }
 
-    // Create output stream
-    out_stream = avformat_new_stream(output_ctx, nullptr);
-    if (!out_stream)
+  /**
+   * @brief Cleans up resources and deinitializes FFmpeg network stack.
+   */
+  ~HLS_Encoder() { avformat_network_deinit(); }
+  /**
+   * @brief Creates HLS segments for multiple bitrates.
+   *
+   * @param input_file The path to the input audio file.
+   * @param bitrates A vector of bitrates (in kbps) for encoding.
+   * @param output_dir The directory where HLS playlists and segments will be stored.
+   * @param use_flac Segment losslessly into fMP4 instead of MPEG-TS.
+   * @param single_file Write each variant as one media file addressed by #EXT-X-BYTERANGE
+   *        instead of one file per segment.
+   * @param live `output_dir` is a server's /live/<audio-id> URL: every file is PUT there as soon
+   *        as it is written, and the variants are EVENT playlists until they end.
+   *
+   * The input is decoded once and every bitrate is encoded into its HLS playlist on its own
+   * thread. It then generates a master playlist linking all variant playlists; a live track
+   * gets it first, so receivers can find the variants while they are being encoded.
+   *
+   * @return `true` once every variant and the master playlist are written.
+   */
+  auto create_hls_segments(const char* input_file, const std::vector<int>& bitrates,
+                           const char* output_dir, bool use_flac = false, bool single_file = false,
+                           bool live = false) -> bool
+  {
+    HLS_Source source;
+    if (!source.open(input_file))
+    {
+      return false;
+    }
+    if (!live) // uploaded with the track, and indexed by the server (see track_metadata.hpp)
     {
-      fprintf(stderr, "Error creating output stream\n");
-      ret = AVERROR_UNKNOWN;
-      goto cleanup;
+      AudioParser::exportToTOML(source.format(), input_file,
+                                std::string(output_dir) + "/" +
+                                  macros::to_string(macros::METADATA_FILE));
     }
 
-    // Copy codec parameters
-    in_stream = input_ctx->streams[audio_stream_idx];
-    if ((ret = avcodec_parameters_copy(out_stream->codecpar, in_stream->codecpar)) < 0)
+    // FLAC is segmented as it is; anything else is decoded once and encoded per bitrate
+    const bool     copy  = use_flac && source.stream()->codecpar->codec_id == AV_CODEC_ID_FLAC;
+    const AVCodec* codec = nullptr;
+    if (!copy)
     {
-      av_log(nullptr, AV_LOG_ERROR, "Error copying codec parameters.\n");
-      goto cleanup;
+      codec = avcodec_find_encoder(use_flac ? AV_CODEC_ID_FLAC : AV_CODEC_ID_MP3);
+      if (!codec)
+      {
+        av_log(nullptr, AV_LOG_ERROR, "No %s encoder in this FFmpeg build\n",
+               use_flac ? "FLAC" : "MP3");
+        return false;
+      }
+      if (!source.open_decoder())
+      {
+        return false;
+      }
     }
 
-    // Open output file
-    if (!(output_ctx->oformat->flags & AVFMT_NOFILE))
+    HLS_Source::Renditions   renditions;
+    std::vector<std::string> playlist_files;
+    for (int bitrate : bitrates)
     {
-      if ((ret = avio_open(&output_ctx->pb, output_ctx->url, AVIO_FLAG_WRITE)) < 0)
+      std::string codec_prefix    = use_flac ? "flac" : "mp3";
+      std::string output_playlist = std::string(output_dir) + "/hls_" + codec_prefix + "_" +
+                                    std::to_string(bitrate) +
+                                    macros::to_string(macros::PLAYLIST_EXT);
+      playlist_files.push_back(output_playlist);
+
+      AVDictionary* options   = muxer_options(output_dir, bitrate, use_flac, single_file, live);
+      auto          rendition = std::make_unique<HLS_Rendition>(bitrate, output_playlist);
+      const bool    opened    = rendition->open(source.stream(), codec, &options);
+      av_dict_free(&options);
+
+      if (!opened)
       {
-        av_log(nullptr, AV_LOG_ERROR, "Error opening output file.\n");
-        goto cleanup;
+        av_log(nullptr, AV_LOG_ERROR, "Encoding failed for bitrate: %d\n", bitrate);
+        return false;
       }
+      renditions.push_back(std::move(rendition));
     }
 
-    // Write header
-    if ((ret = avformat_write_header(output_ctx, nullptr)) < 0)
+    if (live && !create_master_playlist(playlist_files, bitrates, output_dir, use_flac, live))
     {
-      av_log(nullptr, AV_LOG_ERROR, "Error writing header.\n");
-      goto cleanup;
+      return false;
     }
 
-    // Allocate packet
-    pkt = av_packet_alloc();
-    if (!pkt)
+    std::vector<std::thread> workers;
+    workers.reserve(renditions.size());
+    for (const auto& rendition : renditions)
     {
-      av_log(nullptr, AV_LOG_ERROR, "Error allocating packet\n");
-      ret = AVERROR(ENOMEM);
-      goto cleanup;
+      workers.emplace_back([&rendition = *rendition] { rendition.run(); });
+    }
+
+    const bool demuxed = source.run(renditions);
+    for (std::thread& worker : workers)
+    {
+      worker.join();
     }
 
-    while (av_read_frame(input_ctx, pkt) >= 0)
+    bool success = demuxed;
+    for (const auto& rendition : renditions)
     {
-      if (pkt->stream_index == audio_stream_idx)
+      if (!rendition->ok())
       {
-        // Rescale timestamps
-        pkt->pts      = av_rescale_q_rnd(pkt->pts, in_stream->time_base, out_stream->time_base,
-                                         AV_ROUND_NEAR_INF);
-        pkt->dts      = av_rescale_q_rnd(pkt->dts, in_stream->time_base, out_stream->time_base,
-                                         AV_ROUND_NEAR_INF);
-        pkt->duration = av_rescale_q(pkt->duration, in_stream->time_base, out_stream->time_base);
-        pkt->pos      = -1;
-        pkt->stream_index = 0;
-
-        if ((ret = av_interleaved_write_frame(output_ctx, pkt)) < 0)
-        {
-          av_log(nullptr, AV_LOG_ERROR, "Error writing packet.\n");
-          break;
-        }
+        av_log(nullptr, AV_LOG_ERROR, "Encoding failed for bitrate: %d\n", rendition->bitrate());
+        success = false;
       }
-      av_packet_unref(pkt);
+    }
+    if (!success)
+    {
+      return false;
+    }
+
+    return live || create_master_playlist(playlist_files, bitrates, output_dir, use_flac, live);
+  }
+
+private:
+  /**
+   * @brief HLS muxer options of one bitrate.
+   *
+   * @param output_dir The directory of the playlists and segments.
+   * @param bitrate The target bitrate (in kbps), which names the segment files.
+   * @param use_flac fMP4 segments (`hls_flac_<bitrate>_%d.m4s`) instead of MPEG-TS
+   *        (`hls_mp3_<bitrate>_%d.ts`).
+   * @param single_file All segments in one `hls_<codec>_<bitrate>.<ext>` (byte-range playlist).
+   * @param live PUT every file to `output_dir`, a URL, over one kept-alive connection.
+   */
+  static auto muxer_options(const char* output_dir, int bitrate, bool use_flac, bool single_file,
+                            bool live) -> AVDictionary*
+  {
+    AVDictionary*     options = nullptr;
+    const std::string name    = (use_flac ? "hls_flac_" : "hls_mp3_") + std::to_string(bitrate);
+    const std::string ext     = macros::to_string(use_flac ? macros::M4S_FILE_EXT
+                                                           : macros::TRANSPORT_STREAM_EXT);
+    const std::string segment_filename_format =
+      std::string(output_dir) + "/" + name + (single_file ? ext : "_%d" + ext);
+
+    av_dict_set(&options, macros::to_string(macros::CODEC_HLS_SEGMENT_FILENAME_FIELD).c_str(),
+                segment_filename_format.c_str(), 0);
+
+    if (live)
+    {
+      // The playlist is rewritten and PUT again after every segment, listing all of them so far
+      av_dict_set(&options, "method", "PUT", 0);
+      av_dict_set(&options, "http_persistent", "1", 0);
+      av_dict_set(&options, "hls_playlist_type", "event", 0);
     }
 
-    // Write trailer
-    av_write_trailer(output_ctx);
+    if (!use_flac)
+    {
+      av_dict_set(&options, macros::to_string(macros::CODEC_HLS_TIME_FIELD).c_str(), "10", 0);
+      av_dict_set(&options, macros::to_string(macros::CODEC_HLS_LIST_SIZE_FIELD).c_str(), "0", 0);
+      av_dict_set(&options, macros::to_string(macros::CODEC_HLS_FLAGS_FIELD).c_str(),
+                  single_file ? "independent_segments+single_file" : "independent_segments", 0);
+      return options;
+    }
 
-  cleanup:
-    if (pkt)
-      av_packet_free(&pkt);
-    if (output_ctx && !(output_ctx->oformat->flags & AVFMT_NOFILE))
-      avio_closep(&output_ctx->pb);
-    if (output_ctx)
-      avformat_free_context(output_ctx);
-    if (input_ctx)
-      avformat_close_input(&input_ctx);
-    return ret < 0 ? false : true;
+    av_dict_set(&options, "hls_segment_type", "fmp4", 0);
+    if (!live)
+    {
+      av_dict_set(&options, "hls_playlist_type", "vod", 0);
+    }
+    if (single_file)
+    {
+      // Init section and every fragment go into the one .m4s; the playlist addresses them via
+      // EXT-X-MAP/EXT-X-BYTERANGE offsets into it
+      av_dict_set(&options, macros::to_string(macros::CODEC_HLS_FLAGS_FIELD).c_str(),
+                  "single_file", 0);
+    }
+    else
+    {
+      // Renditions are written at the same time, so each needs an init segment of its own
+      av_dict_set(&options, macros::to_string(macros::CODEC_HLS_INIT_FILENAME_FIELD).c_str(),
+                  (name + "_init" + macros::to_string(macros::MP4_FILE_EXT)).c_str(), 0);
+    }
+    return options;
   }
 
   /**
@@ -377,10 +912,11 @@ private:
    * @param playlists The list of variant playlists.
    * @param bitrates The corresponding bitrates.
    * @param output_dir The directory to save the master playlist.
+   * @param live `output_dir` is a URL, the master playlist is PUT there.
    */
-  void create_master_playlist(const std::vector<std::string>& playlists,
+  auto create_master_playlist(const std::vector<std::string>& playlists,
                               const std::vector<int>& bitrates, const char* output_dir,
-                              bool use_flac)
+                              bool use_flac, bool live) -> bool
   {
     bool is_flac = false;
     if (!playlists.empty())
@@ -389,13 +925,7 @@ private:
     }
     std::string master_playlist =
       std::string(output_dir) + "/" + macros::to_string(macros::MASTER_PLAYLIST);
-    std::ofstream m3u8(master_playlist);
-
-    if (!m3u8)
-    {
-      av_log(nullptr, AV_LOG_ERROR, "Failed to create master playlist\n");
-      return;
-    }
+    std::ostringstream m3u8;
 
     m3u8 << "#EXTM3U\n";
     m3u8 << "#EXT-X-VERSION:3\n";
@@ -403,16 +933,48 @@ private:
     for (size_t i = 0; i < playlists.size(); i++)
     {
       m3u8 << "#EXT-X-STREAM-INF:BANDWIDTH=" << (bitrates[i] * 1000) << ",CODECS=\""
-           << (use_flac ? "fLaC" : "mp4a.40.2") << "\"\n";
+           << (use_flac ? "fLaC" : "mp4a.40.34") << "\"\n"; // RFC 6381 name of MP3
       m3u8 << playlists[i].substr(strlen(output_dir) + 1) << "\n";
     }
 
-    m3u8.close();
+    if (!(live ? put_file(master_playlist, m3u8.str()) : write_file(master_playlist, m3u8.str())))
+    {
+      av_log(nullptr, AV_LOG_ERROR, "Failed to create master playlist\n");
+      return false;
+    }
     if (use_flac)
       LOG_INFO << "Created HLS segments for FLAC with references written to: "
                << macros::to_string(macros::MASTER_PLAYLIST);
     else
       LOG_INFO << "Created HLS segments for LOSSY with references written to master playlist: "
                << macros::to_string(macros::MASTER_PLAYLIST);
+    return true;
+  }
+
+  static auto write_file(const std::string& path, const std::string& content) -> bool
+  {
+    std::ofstream out(path);
+    out << content;
+    out.close();
+    return static_cast<bool>(out);
+  }
+
+  // The same PUT the muxer makes for the files it writes (see muxer_options)
+  static auto put_file(const std::string& url, const std::string& content) -> bool
+  {
+    AVDictionary* options = nullptr;
+    av_dict_set(&options, "method", "PUT", 0);
+
+    AVIOContext* out = nullptr;
+    const int    ret = avio_open2(&out, url.c_str(), AVIO_FLAG_WRITE, nullptr, &options);
+    av_dict_free(&options);
+    if (ret < 0)
+    {
+      return false;
+    }
+
+    avio_write(out, reinterpret_cast<const unsigned char*>(content.data()),
+               static_cast<int>(content.size()));
+    return avio_closep(&out) >= 0; // also the server's answer to the PUT
   }
 };
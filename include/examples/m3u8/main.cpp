@@ -0,0 +1,124 @@
+#include "../../m3u8.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+
+/*
+ * Microbenchmark of m3u8::parse against the istringstream + getline + substr + stoi parsing it
+ * replaced, on large generated playlists. It also counts heap allocations per parse.
+ *
+ * Usage: ./m3u8-bench [segments] [iterations]
+ */
+
+static std::size_t allocations = 0;
+
+auto operator new(std::size_t size) -> void*
+{
+  ++allocations;
+  if (void* ptr = std::malloc(size))
+  {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
+
+auto make_media_playlist(std::size_t segments) -> std::string
+{
+  std::string text = "#EXTM3U\n#EXT-X-VERSION:7\n#EXT-X-TARGETDURATION:10\n"
+                     "#EXT-X-MAP:URI=\"init.mp4\"\n";
+  for (std::size_t i = 0; i < segments; ++i)
+  {
+    text += "#EXTINF:10.005333,\n#EXT-X-BYTERANGE:160512@" + std::to_string(i * 160512) +
+            "\nhls_flac_320.m4s\n";
+  }
+  return text + "#EXT-X-ENDLIST\n";
+}
+
+auto make_master_playlist(std::size_t variants) -> std::string
+{
+  std::string text = "#EXTM3U\n";
+  for (std::size_t i = 0; i < variants; ++i)
+  {
+    text += "#EXT-X-STREAM-INF:BANDWIDTH=" + std::to_string(64000 + i * 1000) +
+            ",CODECS=\"mp4a.40.34\"\nhls_mp3_" + std::to_string(i) + ".m3u8\n";
+  }
+  return text;
+}
+
+// What the client and dispatcher used to do: a string per line, numbers through stoi/stod
+auto baseline_parse(const std::string& text) -> std::size_t
+{
+  std::istringstream       iss(text);
+  std::string              line;
+  std::vector<std::string> uris;
+  std::vector<double>      durations;
+  std::vector<int>         bandwidths;
+
+  while (std::getline(iss, line))
+  {
+    if (line.find("#EXT-X-STREAM-INF:") != std::string::npos)
+    {
+      const std::size_t pos = line.find("BANDWIDTH=") + 10;
+      bandwidths.push_back(std::stoi(line.substr(pos, line.find_first_of(", ", pos) - pos)));
+    }
+    else if (line.starts_with("#EXTINF:"))
+    {
+      durations.push_back(std::stod(line.substr(8)));
+    }
+    else if (!line.empty() && line[0] != '#')
+    {
+      uris.push_back(line);
+    }
+  }
+  return uris.size() + bandwidths.size();
+}
+
+template <typename Parse>
+void run(const char* name, const std::string& text, int iterations, Parse&& parse)
+{
+  std::size_t entries = parse(); // warm up, and let reused buffers reach their size
+
+  const std::size_t allocations_before = allocations;
+  const auto        start              = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i)
+  {
+    entries = parse();
+  }
+  const double seconds =
+    std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::cout << "  " << name << ": " << seconds * 1e3 / iterations << " ms/parse, "
+            << text.size() * iterations / seconds / (1024 * 1024) << " MiB/s, "
+            << (allocations - allocations_before) / iterations << " allocations/parse ("
+            << entries << " entries)\n";
+}
+
+void bench(const char* title, const std::string& text, int iterations)
+{
+  std::cout << title << " (" << text.size() / 1024 << " KiB)\n";
+
+  m3u8::Playlist playlist;
+  run("m3u8::parse", text, iterations,
+      [&]
+      {
+        m3u8::parse(text, playlist);
+        return playlist.segments.size() + playlist.variants.size();
+      });
+  run("getline    ", text, iterations, [&] { return baseline_parse(text); });
+}
+
+auto main(int argc, char* argv[]) -> int
+{
+  const std::size_t segments   = argc > 1 ? std::stoul(argv[1]) : 100000;
+  const int         iterations = argc > 2 ? std::stoi(argv[2]) : 20;
+
+  bench("Media playlist", make_media_playlist(segments), iterations);
+  bench("Master playlist", make_master_playlist(segments / 10), iterations);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,525 @@
+#pragma once
+
+#include "disk_cache.hpp"
+#include "logger.hpp"
+#include "macros.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/ssl.hpp>
+#include <openssl/ssl.h>
+
+/*
+ * SEGMENT FETCHER
+ *
+ * Fetches playlists and segments from the server over a small pool of persistent TLS
+ * connections, instead of a fresh resolve + TCP connect + TLS handshake per file.
+ *
+ * -> The server name is resolved once per fetcher.
+ *
+ * -> Connections are kept alive between requests (the server allows
+ *    WAVY_SERVER_KEEPALIVE_MAX_REQUESTS per connection). When the server closes one, or a reused
+ *    connection turns out to be dead, the request is retried once on a fresh connection.
+ *
+ * -> The TLS session of the first handshake is kept and offered on every later connection, so
+ *    only the first handshake is a full one; the rest are resumptions from the session ticket.
+ *
+ * -> fetch_all() keeps up to `ahead` requests in flight over up to `connections` connections,
+ *    but hands the bodies to the caller strictly in request order. A segment that arrives early
+ *    waits in memory, and nothing more than `ahead` past the oldest undelivered one is requested,
+ *    so memory stays bounded however long the playlist is.
+ *
+ * -> Requests can also be resolved lazily, right before they are issued, and every completed
+ *    one reports its size and time on the wire. That is what lets ABR pick the variant of each
+ *    segment from the throughput of the ones before it. Time the caller spends blocked inside
+ *    Deliver is not counted against the requests that were in flight meanwhile.
+ *
+ * -> With a DiskCache attached, immutable files are answered from disk without a request, and
+ *    cached playlists are revalidated with If-None-Match (a 304 delivers the cached copy).
+ *    Everything fetched with a 200/206 is stored for the next run.
+ *
+ * Everything runs on the fetcher's own io_context, driven by the calling thread for the
+ * duration of fetch_all() or get().
+ */
+
+namespace fetcher
+{
+
+namespace net   = boost::asio;
+namespace ssl   = boost::asio::ssl;
+namespace beast = boost::beast;
+namespace http  = beast::http;
+using tcp       = net::ip::tcp;
+
+// One segment of a single-file rendition: [offset, offset + length) of the named file
+struct SegmentRange
+{
+  std::uint64_t offset = 0;
+  std::uint64_t length = 0;
+};
+
+struct FetchRequest
+{
+  std::string                 target;
+  std::optional<SegmentRange> range;
+};
+
+class SegmentFetcher
+{
+public:
+  // Receives each body in request order; an empty body means that request failed.
+  // Returning false stops the batch.
+  using Deliver = std::function<bool(std::size_t index, std::string body)>;
+
+  // Builds request `index` just before it is issued
+  using Resolve = std::function<FetchRequest(std::size_t index)>;
+
+  // Reports a successful request when it completes (in completion order)
+  using Observe = std::function<void(std::size_t index, std::size_t bytes,
+                                     std::chrono::steady_clock::duration elapsed)>;
+
+  SegmentFetcher(std::string server, std::size_t connections = WAVY_CLIENT_FETCH_CONNECTIONS,
+                 std::size_t ahead = WAVY_CLIENT_FETCH_AHEAD)
+      : server_(std::move(server)), ctx_(ssl::context::tlsv12_client),
+        ahead_(std::max<std::size_t>(1, ahead))
+  {
+    ctx_.set_verify_mode(ssl::verify_none);
+    // We keep the one session we need ourselves (see store_session)
+    SSL_CTX_set_session_cache_mode(ctx_.native_handle(),
+                                   SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+
+    connections_.resize(std::max<std::size_t>(1, connections));
+  }
+
+  SegmentFetcher(const SegmentFetcher&)                    = delete;
+  auto operator=(const SegmentFetcher&) -> SegmentFetcher& = delete;
+
+  ~SegmentFetcher()
+  {
+    for (Connection& conn : connections_)
+    {
+      close(conn);
+    }
+    if (session_)
+    {
+      SSL_SESSION_free(session_);
+    }
+  }
+
+  // Single request on a pooled connection; empty on failure
+  auto get(std::string_view target, const std::optional<SegmentRange>& range = std::nullopt)
+    -> std::string
+  {
+    std::string body;
+    fetch_all({FetchRequest{std::string(target), range}},
+              [&body](std::size_t, std::string data)
+              {
+                body = std::move(data);
+                return true;
+              });
+    return body;
+  }
+
+  // Returns false if any request failed or the caller stopped the batch
+  auto fetch_all(const std::vector<FetchRequest>& requests, const Deliver& deliver) -> bool
+  {
+    return fetch_all(
+      requests.size(), [&requests](std::size_t index) { return requests[index]; }, deliver);
+  }
+
+  // Same, for `count` requests built by `resolve` as the window reaches them
+  auto fetch_all(std::size_t count, const Resolve& resolve, const Deliver& deliver,
+                 const Observe& observe = {}) -> bool
+  {
+    if (count == 0)
+    {
+      return true;
+    }
+
+    if (!resolve_server())
+    {
+      for (std::size_t i = 0; i < count; ++i)
+      {
+        if (!deliver(i, {}))
+        {
+          break;
+        }
+      }
+      return false;
+    }
+
+    batch_ = Batch{count, &resolve, &deliver, &observe};
+    pump();
+    ioc_.restart();
+    ioc_.run();
+
+    const bool ok = !batch_.failed && !batch_.stopped;
+    batch_        = {};
+    return ok;
+  }
+
+  // Answers requests from `cache` where it can and stores what is fetched; nullptr detaches it
+  void set_cache(DiskCache* cache) { cache_ = cache && cache->enabled() ? cache : nullptr; }
+
+  // Requests answered from disk, and cached copies the server confirmed with a 304
+  [[nodiscard]] auto cache_hits() const -> std::size_t { return cache_hits_; }
+  [[nodiscard]] auto revalidated() const -> std::size_t { return revalidated_; }
+
+  // Full handshakes vs. resumed ones so far (for diagnostics)
+  [[nodiscard]] auto handshakes() const -> std::size_t { return handshakes_; }
+  [[nodiscard]] auto resumed_handshakes() const -> std::size_t { return resumed_; }
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Connection
+  {
+    std::unique_ptr<beast::ssl_stream<beast::tcp_stream>>     stream;
+    beast::flat_buffer                                        buffer;
+    FetchRequest                                              target;
+    http::request<http::empty_body>                           request;
+    std::unique_ptr<http::response_parser<http::string_body>> parser;
+    bool                                                      open  = false;
+    bool                                                      busy  = false;
+    std::size_t                                               index = 0;
+    bool                                                      retry = false; // already retried
+    Clock::time_point                                         issued_at;
+    Clock::duration                                           stalled_at_issue{};
+    std::string                                               cache_key; // empty: not cached
+    std::optional<DiskCache::Entry>                           cached;    // being revalidated
+  };
+
+  struct Batch
+  {
+    std::size_t                        count        = 0;
+    const Resolve*                     resolve      = nullptr;
+    const Deliver*                     deliver      = nullptr;
+    const Observe*                     observe      = nullptr;
+    std::size_t                        next_issue   = 0;
+    std::size_t                        next_deliver = 0;
+    std::map<std::size_t, std::string> arrived; // completed but not yet deliverable
+    Clock::duration                    stalled{}; // spent inside Deliver so far
+    bool                               failed  = false;
+    bool                               stopped = false;
+  };
+
+  std::string                 server_;
+  net::io_context             ioc_;
+  ssl::context                ctx_;
+  std::size_t                 ahead_;
+  tcp::resolver::results_type endpoints_;
+  std::vector<Connection>     connections_;
+  SSL_SESSION*                session_     = nullptr;
+  std::size_t                 handshakes_  = 0;
+  std::size_t                 resumed_     = 0;
+  DiskCache*                  cache_       = nullptr;
+  std::size_t                 cache_hits_  = 0;
+  std::size_t                 revalidated_ = 0;
+  Batch                       batch_;
+
+  auto resolve_server() -> bool
+  {
+    if (!endpoints_.empty())
+    {
+      return true;
+    }
+
+    boost::system::error_code ec;
+    tcp::resolver             resolver(ioc_);
+    endpoints_ = resolver.resolve(server_, WAVY_SERVER_PORT_NO_STR, ec);
+    if (ec)
+    {
+      LOG_ERROR << RECEIVER_LOG << "Failed to resolve " << server_ << ": " << ec.message();
+      return false;
+    }
+    return true;
+  }
+
+  // Hands idle connections the next requests the window allows
+  void pump()
+  {
+    for (Connection& conn : connections_)
+    {
+      if (batch_.stopped || batch_.next_issue >= batch_.count ||
+          batch_.next_issue >= batch_.next_deliver + ahead_)
+      {
+        return;
+      }
+      if (!conn.busy)
+      {
+        conn.busy             = true;
+        conn.index            = batch_.next_issue++;
+        conn.retry            = false;
+        conn.target           = (*batch_.resolve)(conn.index);
+        conn.issued_at        = Clock::now();
+        conn.stalled_at_issue = batch_.stalled;
+        if (!serve_cached(conn))
+        {
+          issue(conn);
+        }
+      }
+    }
+  }
+
+  // Completes the request from a fresh cache entry; a stale one is kept for revalidation
+  auto serve_cached(Connection& conn) -> bool
+  {
+    conn.cached.reset();
+    conn.cache_key.clear();
+    if (!cache_ || conn.target.target.find('?') != std::string::npos)
+    {
+      return false; // blocking playlist reloads (live tracks) are not worth keeping
+    }
+
+    const FetchRequest& req = conn.target;
+    conn.cache_key          = req.range ? DiskCache::key_for(req.target, req.range->offset,
+                                                             req.range->length)
+                                        : DiskCache::key_for(req.target);
+
+    conn.cached = cache_->lookup(conn.cache_key);
+    if (!conn.cached || !conn.cached->fresh)
+    {
+      return false;
+    }
+
+    ++cache_hits_;
+    std::string body = std::move(conn.cached->body);
+    conn.cached.reset();
+    conn.cache_key.clear(); // nothing to store again
+    // Posted rather than completed here: complete() pumps, and we are inside pump()
+    net::post(ioc_, [this, &conn, body = std::move(body)]() mutable
+              { complete(conn, std::move(body)); });
+    return true;
+  }
+
+  void issue(Connection& conn)
+  {
+    const FetchRequest& req = conn.target;
+
+    conn.request = {http::verb::get, req.target, 11};
+    conn.request.set(http::field::host, server_);
+    conn.request.set(http::field::user_agent, "WavyClient");
+    conn.request.keep_alive(true);
+    if (req.range)
+    {
+      conn.request.set(http::field::range,
+                       "bytes=" + std::to_string(req.range->offset) + "-" +
+                         std::to_string(req.range->offset + req.range->length - 1));
+    }
+    if (conn.cached && !conn.cached->etag.empty())
+    {
+      conn.request.set(http::field::if_none_match, conn.cached->etag);
+    }
+
+    if (conn.open)
+    {
+      send(conn);
+      return;
+    }
+    connect(conn);
+  }
+
+  void connect(Connection& conn)
+  {
+    close(conn);
+    conn.stream = std::make_unique<beast::ssl_stream<beast::tcp_stream>>(ioc_, ctx_);
+    conn.buffer.clear();
+
+    // Offer the saved session: the server resumes it and skips the full handshake
+    if (session_)
+    {
+      SSL_set_session(conn.stream->native_handle(), session_);
+    }
+
+    beast::get_lowest_layer(*conn.stream).expires_after(std::chrono::seconds(30));
+    beast::get_lowest_layer(*conn.stream)
+      .async_connect(endpoints_,
+                     [this, &conn](beast::error_code ec, const tcp::endpoint&)
+                     {
+                       if (ec)
+                       {
+                         fail(conn, "connect", ec);
+                         return;
+                       }
+                       conn.stream->async_handshake(
+                         ssl::stream_base::client,
+                         [this, &conn](beast::error_code ec)
+                         {
+                           if (ec)
+                           {
+                             fail(conn, "handshake", ec);
+                             return;
+                           }
+                           ++handshakes_;
+                           if (SSL_session_reused(conn.stream->native_handle()))
+                           {
+                             ++resumed_;
+                           }
+                           conn.open = true;
+                           send(conn);
+                         });
+                     });
+  }
+
+  void send(Connection& conn)
+  {
+    conn.parser = std::make_unique<http::response_parser<http::string_body>>();
+    conn.parser->body_limit(static_cast<std::uint64_t>(WAVY_SERVER_AUDIO_SIZE_LIMIT) * 1024 *
+                            1024);
+
+    beast::get_lowest_layer(*conn.stream).expires_after(std::chrono::seconds(30));
+    http::async_write(*conn.stream, conn.request,
+                      [this, &conn](beast::error_code ec, std::size_t)
+                      {
+                        if (ec)
+                        {
+                          fail(conn, "write", ec);
+                          return;
+                        }
+                        http::async_read(*conn.stream, conn.buffer, *conn.parser,
+                                         [this, &conn](beast::error_code ec, std::size_t)
+                                         { on_response(conn, ec); });
+                      });
+  }
+
+  void on_response(Connection& conn, beast::error_code ec)
+  {
+    if (ec)
+    {
+      fail(conn, "read", ec);
+      return;
+    }
+
+    store_session(conn);
+
+    http::response<http::string_body> response = conn.parser->release();
+    if (!response.keep_alive())
+    {
+      close(conn); // server is done with this connection, the next request reconnects
+    }
+
+    const FetchRequest& req  = conn.target;
+    std::string         body = std::move(response.body());
+    const unsigned int  code = response.result_int();
+
+    if (code == 304 && conn.cached)
+    {
+      // Our copy is current: only headers came over the wire, so this is no throughput sample
+      ++revalidated_;
+      complete(conn, std::move(conn.cached->body));
+      return;
+    }
+
+    if (code == 200 && req.range)
+    {
+      // Server ignored the Range and sent the whole file: cut our part out of it
+      body = req.range->offset < body.size() ? body.substr(req.range->offset, req.range->length)
+                                             : std::string{};
+    }
+    else if (code != 200 && code != 206)
+    {
+      LOG_WARNING << RECEIVER_LOG << "GET " << req.target << " returned " << code;
+      body.clear();
+      batch_.failed = true;
+    }
+    else if (*batch_.observe)
+    {
+      const Clock::duration stalled = batch_.stalled - conn.stalled_at_issue;
+      (*batch_.observe)(conn.index, body.size(), Clock::now() - conn.issued_at - stalled);
+    }
+
+    if (cache_ && !conn.cache_key.empty() && !body.empty() && (code == 200 || code == 206))
+    {
+      const std::string_view etag = response[http::field::etag];
+      cache_->store(conn.cache_key, body, etag);
+    }
+
+    complete(conn, std::move(body));
+  }
+
+  void fail(Connection& conn, std::string_view stage, beast::error_code ec)
+  {
+    const bool was_reused = conn.open;
+    close(conn);
+
+    // A kept-alive connection may have been closed by the server in the meantime
+    if (was_reused && !conn.retry)
+    {
+      conn.retry = true;
+      connect(conn);
+      return;
+    }
+
+    LOG_ERROR << RECEIVER_LOG << "HTTPS " << stage << " failed for " << conn.target.target
+              << ": " << ec.message();
+    batch_.failed = true;
+    complete(conn, {});
+  }
+
+  void complete(Connection& conn, std::string body)
+  {
+    conn.busy = false;
+    conn.cached.reset();
+    batch_.arrived.emplace(conn.index, std::move(body));
+
+    // Deliver everything that is now contiguous from the front
+    for (auto it = batch_.arrived.find(batch_.next_deliver);
+         it != batch_.arrived.end() && !batch_.stopped;
+         it = batch_.arrived.find(batch_.next_deliver))
+    {
+      const Clock::time_point started = Clock::now();
+      if (!(*batch_.deliver)(it->first, std::move(it->second)))
+      {
+        batch_.stopped = true;
+      }
+      batch_.stalled += Clock::now() - started;
+      batch_.arrived.erase(it);
+      ++batch_.next_deliver;
+    }
+
+    pump();
+  }
+
+  // TLS 1.3 tickets arrive after the handshake, so the session is taken after the first read
+  void store_session(Connection& conn)
+  {
+    if (session_)
+    {
+      return;
+    }
+    SSL_SESSION* session = SSL_get1_session(conn.stream->native_handle());
+    if (session && SSL_SESSION_is_resumable(session))
+    {
+      session_ = session;
+      return;
+    }
+    if (session)
+    {
+      SSL_SESSION_free(session);
+    }
+  }
+
+  static void close(Connection& conn)
+  {
+    if (conn.stream)
+    {
+      beast::error_code ec;
+      beast::get_lowest_layer(*conn.stream).socket().close(ec);
+    }
+    conn.open = false;
+  }
+};
+
+} // namespace fetcher
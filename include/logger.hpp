@@ -1,19 +1,27 @@
 #pragma once
 
+#include <atomic>
 #include <boost/log/core.hpp>
 #include <boost/log/expressions.hpp>
 #include <boost/log/sinks.hpp>
 #include <boost/log/sinks/text_file_backend.hpp>
 #include <boost/log/sources/logger.hpp>
 #include <boost/log/sources/severity_logger.hpp>
+#include <boost/log/support/date_time.hpp>
 #include <boost/log/trivial.hpp>
 #include <boost/log/utility/setup/common_attributes.hpp>
 #include <boost/log/utility/setup/console.hpp>
 #include <boost/log/utility/setup/file.hpp>
-#include <chrono>
-#include <iomanip>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <memory>
 #include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
 
 /*
  * LOGGER
@@ -22,8 +30,22 @@
  *
  * Gives up-to-date logs with SeverityLevel and time information
  *
- * Can also in the future write these to a file
+ * -> Logging never waits on the terminal. A LOG_* statement formats its message and pushes the
+ *    record onto a bounded lock-free queue (RecordQueue, WAVY_LOG_QUEUE_RECORDS records); one
+ *    background thread formats the lines and writes them in batches, one write per wakeup.
+ *    When the queue is full, records are dropped and counted rather than block the caller.
  *
+ * -> The time is taken when the record is made (Boost.Log's TimeStamp attribute), so it is the
+ *    time of the event, not of the write.
+ *
+ * -> LOG_DEBUG is compiled out where NDEBUG is defined (the Release build), arguments and all.
+ *    Define WAVY_LOG_DEBUG=1 to keep it.
+ *
+ * -> Set WAVY_LOG_JSON=<file> to also append every record to that file as one JSON object per
+ *    line, without the terminal colors, for log collectors.
+ *
+ * Records still queued are written when the process exits normally. After a crash, the last
+ * ones may be missing.
  */
 
 // Force ANSI Colors (Ignoring Terminal Themes)
@@ -64,50 +86,407 @@ enum SeverityLevel
   DEBUG
 };
 
-inline auto get_current_timestamp() -> std::string
+#define WAVY_LOG_QUEUE_RECORDS 16384 // records waiting for the writer thread, a power of two
+
+/*
+ * Queueing strategy of the asynchronous sink: a bounded ring (Vyukov's MPMC queue, used with a
+ * single consumer). Producers claim a slot with one CAS and publish it with a release store, and
+ * only touch the futex when the writer is asleep.
+ */
+template <std::size_t Capacity> class RecordQueue
 {
-  using namespace std::chrono;
+  static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0);
 
-  auto now      = system_clock::now();
-  auto now_time = system_clock::to_time_t(now);
-  auto now_ms   = duration_cast<milliseconds>(now.time_since_epoch()) % 1000;
+public:
+  // Blocks the writer until a record is queued or interrupt() is called
+  void wait()
+  {
+    while (!ready())
+    {
+      sleeping_.store(true, std::memory_order_relaxed);
+      const std::uint32_t seen = wakeups_.load(std::memory_order_acquire);
+      std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with the one in publish()
+      // Only looked at here: clearing it is left to the exchange below, or it would be lost
+      if (!ready() && !interrupted_.load(std::memory_order_acquire))
+      {
+        wakeups_.wait(seen, std::memory_order_acquire);
+      }
+      sleeping_.store(false, std::memory_order_relaxed);
+      if (interrupted_.exchange(false, std::memory_order_acq_rel))
+      {
+        return;
+      }
+    }
+  }
 
-  std::ostringstream oss;
-  oss << std::put_time(std::localtime(&now_time), "%H:%M:%S") << "." << std::setw(3)
-      << std::setfill('0') << now_ms.count();
-  return oss.str();
-}
+  void interrupt()
+  {
+    interrupted_.store(true, std::memory_order_release);
+    wakeups_.fetch_add(1, std::memory_order_release);
+    wakeups_.notify_one();
+  }
 
-inline void init_logging()
+  // Records dropped because the queue was full, since the previous call
+  auto take_dropped() -> std::size_t { return dropped_.exchange(0, std::memory_order_relaxed); }
+
+protected:
+  RecordQueue() = default;
+  template <typename ArgsT> explicit RecordQueue(const ArgsT&) {}
+
+  void enqueue(const boost::log::record_view& rec)
+  {
+    if (!try_enqueue(rec))
+    {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  auto try_enqueue(const boost::log::record_view& rec) -> bool
+  {
+    std::size_t pos = tail_.load(std::memory_order_relaxed);
+    for (;;)
+    {
+      Slot&             slot = slots_[pos & (Capacity - 1)];
+      const std::size_t seq  = slot.sequence.load(std::memory_order_acquire);
+      if (seq == pos)
+      {
+        if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        {
+          slot.record = rec;
+          slot.sequence.store(pos + 1, std::memory_order_release);
+          publish();
+          return true;
+        }
+      }
+      else if (seq < pos)
+      {
+        return false; // full: the slot still holds the record of the previous lap
+      }
+      else
+      {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  auto try_dequeue_ready(boost::log::record_view& rec) -> bool { return try_dequeue(rec); }
+
+  // Only ever called by the one thread feeding the sink
+  auto try_dequeue(boost::log::record_view& rec) -> bool
+  {
+    if (!ready())
+    {
+      return false;
+    }
+    Slot& slot = slots_[head_ & (Capacity - 1)];
+    rec.swap(slot.record);
+    slot.record.reset();
+    slot.sequence.store(head_ + Capacity, std::memory_order_release);
+    ++head_;
+    return true;
+  }
+
+  auto dequeue_ready(boost::log::record_view& rec) -> bool
+  {
+    wait();
+    return try_dequeue(rec); // false if interrupted
+  }
+
+  void interrupt_dequeue() { interrupt(); }
+
+private:
+  struct Slot
+  {
+    std::atomic<std::size_t> sequence;
+    boost::log::record_view  record;
+  };
+
+  std::unique_ptr<Slot[]>              slots_ = make_slots();
+  alignas(64) std::atomic<std::size_t> tail_{0};         // next slot a producer claims
+  alignas(64) std::size_t              head_ = 0;        // next slot the writer reads
+  std::atomic<bool>                    sleeping_{false}; // the writer is in wait()
+  std::atomic<std::uint32_t>           wakeups_{0};
+  std::atomic<bool>                    interrupted_{false};
+  std::atomic<std::size_t>             dropped_{0};
+
+  static auto make_slots() -> std::unique_ptr<Slot[]>
+  {
+    auto slots = std::make_unique<Slot[]>(Capacity);
+    for (std::size_t i = 0; i < Capacity; ++i)
+    {
+      slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    return slots;
+  }
+
+  [[nodiscard]] auto ready() const -> bool
+  {
+    return slots_[head_ & (Capacity - 1)].sequence.load(std::memory_order_acquire) == head_ + 1;
+  }
+
+  void publish()
+  {
+    std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with the one in wait()
+    if (sleeping_.load(std::memory_order_relaxed))
+    {
+      wakeups_.fetch_add(1, std::memory_order_release);
+      wakeups_.notify_one();
+    }
+  }
+};
+
+/*
+ * Collects the formatted lines of one batch and writes them with a single write per
+ * destination when the batch is flushed.
+ */
+class BatchBackend : public boost::log::sinks::basic_sink_backend<
+                       boost::log::sinks::combine_requirements<
+                         boost::log::sinks::synchronized_feeding,
+                         boost::log::sinks::flushing>::type>
 {
-  namespace sinks    = boost::log::sinks;
-  namespace expr     = boost::log::expressions;
-  namespace keywords = boost::log::keywords;
-
-  // Console logging with color
-  boost::log::add_console_log(
-    std::cout,
-    keywords::format =
-      expr::stream << BOLD << "[" << get_current_timestamp()
-                   << "] " // boost posix time header is weird
-                   << expr::if_(expr::attr<boost::log::trivial::severity_level>("Severity") ==
-                                boost::log::trivial::info)[expr::stream << GREEN << "[INFO]    "]
-                   << expr::if_(
-                        expr::attr<boost::log::trivial::severity_level>("Severity") ==
+public:
+  explicit BatchBackend(const char* json_path) : console_format_(make_console_format())
+  {
+    if (json_path && *json_path)
+    {
+      json_.open(json_path, std::ios::app | std::ios::binary);
+    }
+  }
+
+  [[nodiscard]] auto json_open() const -> bool { return json_.is_open(); }
+
+  void consume(const boost::log::record_view& rec)
+  {
+    boost::log::formatting_ostream console(console_batch_);
+    console_format_(rec, console);
+    console << "\n";
+    console.flush();
+
+    if (json_.is_open())
+    {
+      append_json(rec, json_batch_);
+    }
+  }
+
+  // Reported by the writer itself, which must not log: it may run after Boost.Log's statics
+  void report_dropped(std::size_t dropped)
+  {
+    const boost::posix_time::ptime now = boost::posix_time::microsec_clock::local_time();
+    const std::string message = "Log queue full, " + std::to_string(dropped) + " records dropped";
+
+    console_batch_ += BOLD "[" + boost::posix_time::to_simple_string(now.time_of_day()) +
+                      "] " YELLOW "[WARNING] " RESET + message + "\n";
+    if (json_.is_open())
+    {
+      json_batch_ += R"({"time":")" + boost::posix_time::to_iso_extended_string(now) +
+                     R"(","level":"warning","thread":"","message":")" + message + "\"}\n";
+    }
+    flush();
+  }
+
+  void flush()
+  {
+    if (!console_batch_.empty())
+    {
+      std::cout.write(console_batch_.data(), static_cast<std::streamsize>(console_batch_.size()));
+      std::cout.flush();
+      console_batch_.clear();
+    }
+    if (!json_batch_.empty())
+    {
+      json_.write(json_batch_.data(), static_cast<std::streamsize>(json_batch_.size()));
+      json_.flush();
+      json_batch_.clear();
+    }
+  }
+
+private:
+  boost::log::formatter console_format_;
+  std::string           console_batch_;
+  std::ofstream         json_;
+  std::string           json_batch_;
+
+  static auto make_console_format() -> boost::log::formatter
+  {
+    namespace expr = boost::log::expressions;
+
+    // Console logging with color
+    return expr::stream
+           << BOLD << "["
+           << expr::format_date_time<boost::posix_time::ptime>("TimeStamp", "%H:%M:%S.%f") << "] "
+           << expr::if_(expr::attr<boost::log::trivial::severity_level>("Severity") ==
+                        boost::log::trivial::info)[expr::stream << GREEN << "[INFO]    "]
+           << expr::if_(expr::attr<boost::log::trivial::severity_level>("Severity") ==
                         boost::log::trivial::warning)[expr::stream << YELLOW << "[WARNING] "]
-                   << expr::if_(expr::attr<boost::log::trivial::severity_level>("Severity") ==
-                                boost::log::trivial::error)[expr::stream << RED << "[ERROR]   "]
-                   << expr::if_(expr::attr<boost::log::trivial::severity_level>("Severity") ==
-                                boost::log::trivial::debug)[expr::stream << BLUE << "[DEBUG]   "]
-                   << RESET << expr::smessage);
+           << expr::if_(expr::attr<boost::log::trivial::severity_level>("Severity") ==
+                        boost::log::trivial::error)[expr::stream << RED << "[ERROR]   "]
+           << expr::if_(expr::attr<boost::log::trivial::severity_level>("Severity") ==
+                        boost::log::trivial::debug)[expr::stream << BLUE << "[DEBUG]   "]
+           << RESET << expr::smessage;
+  }
+
+  // {"time":"2026-01-31T12:00:00.123456","level":"info","thread":"0x7f...","message":"..."}
+  static void append_json(const boost::log::record_view& rec, std::string& out)
+  {
+    namespace attrs = boost::log::attributes;
+
+    out += R"({"time":")";
+    if (auto time = boost::log::extract<boost::posix_time::ptime>("TimeStamp", rec))
+    {
+      out += boost::posix_time::to_iso_extended_string(*time);
+    }
+    out += R"(","level":")";
+    if (auto level = boost::log::extract<boost::log::trivial::severity_level>("Severity", rec))
+    {
+      out += boost::log::trivial::to_string(*level);
+    }
+    out += R"(","thread":")";
+    if (auto thread = boost::log::extract<attrs::current_thread_id::value_type>("ThreadID", rec))
+    {
+      std::ostringstream id;
+      id << *thread;
+      out += id.str();
+    }
+    out += R"(","message":")";
+    if (auto message = boost::log::extract<std::string>("Message", rec))
+    {
+      append_escaped(*message, out);
+    }
+    out += "\"}\n";
+  }
+
+  // JSON string escaping; ANSI escape sequences (the category tags) are left out
+  static void append_escaped(const std::string& text, std::string& out)
+  {
+    static constexpr char kDigits[] = "0123456789abcdef";
+    for (std::size_t i = 0; i < text.size(); ++i)
+    {
+      const char c = text[i];
+      if (c == '\033' && i + 1 < text.size() && text[i + 1] == '[')
+      {
+        i += 2;
+        while (i < text.size() && (text[i] < '@' || text[i] > '~'))
+        {
+          ++i; // parameters up to the final byte of the sequence
+        }
+        continue;
+      }
+      switch (c)
+      {
+        case '"':
+          out += "\\\"";
+          break;
+        case '\\':
+          out += "\\\\";
+          break;
+        case '\n':
+          out += "\\n";
+          break;
+        case '\t':
+          out += "\\t";
+          break;
+        default:
+          if (static_cast<unsigned char>(c) < 0x20)
+          {
+            out += "\\u00";
+            out += kDigits[(c >> 4) & 0x0f];
+            out += kDigits[c & 0x0f];
+          }
+          else
+          {
+            out += c;
+          }
+      }
+    }
+  }
+};
+
+/*
+ * The sink and its writer thread. The writer sleeps on the queue, and on every wakeup drains
+ * it through the backend and flushes (asynchronous_sink::flush), so a burst of records costs
+ * one write.
+ */
+class AsyncLog
+{
+public:
+  using Queue = RecordQueue<WAVY_LOG_QUEUE_RECORDS>;
+  using Sink  = boost::log::sinks::asynchronous_sink<BatchBackend, Queue>;
+
+  AsyncLog()
+  {
+    const char* json_path = std::getenv("WAVY_LOG_JSON");
+    auto        backend   = boost::make_shared<BatchBackend>(json_path);
+    sink_ = boost::make_shared<Sink>(backend, boost::log::keywords::start_thread = false);
+    boost::log::core::get()->add_sink(sink_);
+    thread_ = std::thread([this] { run(); });
+
+    if (json_path && *json_path && !backend->json_open())
+    {
+      BOOST_LOG_TRIVIAL(warning) << "Failed to open log file " << json_path;
+    }
+  }
+
+  AsyncLog(const AsyncLog&)                    = delete;
+  auto operator=(const AsyncLog&) -> AsyncLog& = delete;
+
+  // Writes everything still queued
+  ~AsyncLog()
+  {
+    stopping_.store(true, std::memory_order_release);
+    sink_->interrupt();
+    thread_.join();
+    drain();
+    boost::log::core::get()->remove_sink(sink_);
+  }
+
+private:
+  boost::shared_ptr<Sink> sink_;
+  std::thread             thread_;
+  std::atomic<bool>       stopping_{false};
 
+  void run()
+  {
+    while (!stopping_.load(std::memory_order_acquire))
+    {
+      sink_->wait();
+      drain();
+    }
+  }
+
+  void drain()
+  {
+    sink_->flush();
+    if (const std::size_t dropped = sink_->take_dropped())
+    {
+      sink_->locked_backend()->report_dropped(dropped);
+    }
+  }
+};
+
+inline void init_logging()
+{
   boost::log::add_common_attributes();
+  static AsyncLog log; // once per process, torn down (and drained) at exit
 }
 
+#ifndef WAVY_LOG_DEBUG
+#ifdef NDEBUG
+#define WAVY_LOG_DEBUG 0
+#else
+#define WAVY_LOG_DEBUG 1
+#endif
+#endif
+
 // Macros for logging
 #define LOG_INFO    BOOST_LOG_TRIVIAL(info)
 #define LOG_WARNING BOOST_LOG_TRIVIAL(warning)
 #define LOG_ERROR   BOOST_LOG_TRIVIAL(error)
-#define LOG_DEBUG   BOOST_LOG_TRIVIAL(debug)
+#if WAVY_LOG_DEBUG
+#define LOG_DEBUG BOOST_LOG_TRIVIAL(debug)
+#else
+#define LOG_DEBUG \
+  while (false)   \
+  BOOST_LOG_TRIVIAL(debug) // never runs; the compiler drops the statement
+#endif
 
 } // namespace logger
@@ -0,0 +1,269 @@
+#pragma once
+
+#include "macros.hpp"
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+/*
+ * M3U8 TOKENIZER
+ *
+ * One parser for every HLS playlist wavy reads: the client (master and media playlists from
+ * the server), the dispatcher (verifying the encoder's output before upload) and the ABR probe.
+ *
+ * -> A single pass over the text. Lines are found with string_view::find, never copied, and
+ *    numbers are read in place with std::from_chars.
+ *
+ * -> The result is flat: one vector of variants and one of segments, each a small POD whose
+ *    strings are views into the parsed text. The text must outlive the Playlist.
+ *
+ * -> parse() clears the Playlist but keeps its capacity, so a Playlist reused across parses
+ *    stops allocating once it has seen its largest playlist. Nothing is allocated per line.
+ *
+ * Only what wavy uses is understood (RFC 8216):
+ *   #EXTM3U, #EXT-X-STREAM-INF (BANDWIDTH, CODECS), #EXT-X-MAP (URI, BYTERANGE),
+ *   #EXTINF, #EXT-X-BYTERANGE, #EXT-X-TARGETDURATION, #EXT-X-MEDIA-SEQUENCE, #EXT-X-ENDLIST.
+ * Other tags are skipped.
+ */
+
+namespace m3u8
+{
+
+// [offset, offset + length) of a media file, from #EXT-X-BYTERANGE or the BYTERANGE attribute
+struct ByteRange
+{
+  std::uint64_t offset = 0;
+  std::uint64_t length = 0;
+};
+
+// #EXT-X-STREAM-INF and the URI line after it
+struct Variant
+{
+  std::uint64_t    bandwidth = 0; // bits/s
+  std::string_view codecs;        // without the quotes
+  std::string_view uri;
+};
+
+struct Segment
+{
+  std::string_view         uri;
+  double                   duration = 0.0; // #EXTINF, seconds
+  std::optional<ByteRange> range;
+};
+
+// #EXT-X-MAP: the init segment of an fMP4 rendition
+struct Map
+{
+  std::string_view         uri;
+  std::optional<ByteRange> range;
+};
+
+struct Playlist
+{
+  bool                 header          = false; // #EXTM3U seen
+  bool                 end_list        = false; // #EXT-X-ENDLIST seen
+  double               target_duration = 0.0;
+  std::uint64_t        media_sequence  = 0; // of the first segment
+  std::vector<Variant> variants;            // master playlist
+  std::vector<Segment> segments;            // media playlist, in playback order
+  std::optional<Map>   map;                 // first #EXT-X-MAP
+
+  [[nodiscard]] auto is_master() const -> bool { return !variants.empty(); }
+
+  // Media sequence number the next segment added to the playlist will have
+  [[nodiscard]] auto next_sequence() const -> std::uint64_t
+  {
+    return media_sequence + segments.size();
+  }
+
+  // Empties the playlist, keeping the capacity for the next parse
+  void clear()
+  {
+    header          = false;
+    end_list        = false;
+    target_duration = 0.0;
+    media_sequence  = 0;
+    variants.clear();
+    segments.clear();
+    map.reset();
+  }
+};
+
+template <typename T> auto parse_number(std::string_view digits, T& out) -> bool
+{
+  const auto [end, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), out);
+  return !digits.empty() && ec == std::errc{} && end == digits.data() + digits.size();
+}
+
+/*
+ * Parses "<length>[@<offset>]" as used by #EXT-X-BYTERANGE and the BYTERANGE attribute of
+ * #EXT-X-MAP. Without an offset the sub-range starts where the previous one ended.
+ */
+inline auto parse_byterange(std::string_view value, std::uint64_t next_offset)
+  -> std::optional<ByteRange>
+{
+  ByteRange         range{next_offset, 0};
+  const std::size_t at = value.find('@');
+
+  if (!parse_number(value.substr(0, at), range.length) || range.length == 0)
+  {
+    return std::nullopt;
+  }
+  if (at != std::string_view::npos && !parse_number(value.substr(at + 1), range.offset))
+  {
+    return std::nullopt;
+  }
+  return range;
+}
+
+// Value of `name` in an attribute list (NAME=value,NAME="quoted, value"); quotes are stripped
+inline auto attribute(std::string_view list, std::string_view name) -> std::string_view
+{
+  while (!list.empty())
+  {
+    const std::size_t eq = list.find('=');
+    if (eq == std::string_view::npos)
+    {
+      return {};
+    }
+    const std::string_view key = list.substr(0, eq);
+    list.remove_prefix(eq + 1);
+
+    std::string_view value;
+    if (list.starts_with('"'))
+    {
+      const std::size_t close = list.find('"', 1);
+      value                   = list.substr(1, close == std::string_view::npos ? close : close - 1);
+      list.remove_prefix(close == std::string_view::npos ? list.size() : close + 1);
+    }
+    else
+    {
+      value = list.substr(0, list.find(','));
+      list.remove_prefix(value.size());
+    }
+
+    if (key == name)
+    {
+      return value;
+    }
+    if (list.starts_with(','))
+    {
+      list.remove_prefix(1);
+    }
+  }
+  return {};
+}
+
+// Fills `playlist` from `text`; false if it is not an M3U8 playlist (no #EXTM3U)
+inline auto parse(std::string_view text, Playlist& playlist) -> bool
+{
+  playlist.clear();
+
+  std::optional<ByteRange> segment_range; // set by #EXT-X-BYTERANGE for the next URI line
+  std::uint64_t            next_offset = 0;
+  double                   duration    = 0.0;   // set by #EXTINF for the next URI line
+  bool                     variant     = false; // #EXT-X-STREAM-INF waiting for its URI
+
+  while (!text.empty())
+  {
+    const std::size_t newline = text.find('\n');
+    std::string_view  line    = text.substr(0, newline);
+    text.remove_prefix(newline == std::string_view::npos ? text.size() : newline + 1);
+
+    if (line.ends_with('\r'))
+    {
+      line.remove_suffix(1);
+    }
+    if (line.empty())
+    {
+      continue;
+    }
+
+    if (line[0] != '#')
+    {
+      if (variant)
+      {
+        playlist.variants.back().uri = line;
+        variant                      = false;
+      }
+      else
+      {
+        playlist.segments.push_back({line, duration, segment_range});
+        duration      = 0.0;
+        segment_range = std::nullopt;
+      }
+    }
+    else if (line.starts_with(macros::PLAYLIST_SEGMENT_INFO_TAG))
+    {
+      // #EXTINF:<duration>,[<title>]
+      line.remove_prefix(macros::PLAYLIST_SEGMENT_INFO_TAG.size());
+      if (!parse_number(line.substr(0, line.find(',')), duration))
+      {
+        duration = 0.0;
+      }
+    }
+    else if (line.starts_with(macros::PLAYLIST_BYTERANGE_TAG))
+    {
+      segment_range =
+        parse_byterange(line.substr(macros::PLAYLIST_BYTERANGE_TAG.size()), next_offset);
+      if (segment_range)
+      {
+        next_offset = segment_range->offset + segment_range->length;
+      }
+    }
+    else if (line.starts_with(macros::PLAYLIST_VARIANT_TAG))
+    {
+      const std::string_view attributes = line.substr(macros::PLAYLIST_VARIANT_TAG.size());
+      Variant&               entry      = playlist.variants.emplace_back();
+      if (!parse_number(attribute(attributes, "BANDWIDTH"), entry.bandwidth))
+      {
+        entry.bandwidth = 0;
+      }
+      entry.codecs = attribute(attributes, "CODECS");
+      variant      = true;
+    }
+    else if (line.starts_with(macros::PLAYLIST_MAP_TAG))
+    {
+      // #EXT-X-MAP:URI="<file>"[,BYTERANGE="<length>@<offset>"]
+      if (!playlist.map)
+      {
+        const std::string_view attributes = line.substr(macros::PLAYLIST_MAP_TAG.size());
+        const std::string_view byterange  = attribute(attributes, "BYTERANGE");
+        playlist.map = Map{attribute(attributes, "URI"),
+                           byterange.empty() ? std::nullopt : parse_byterange(byterange, 0)};
+      }
+    }
+    else if (line.starts_with(macros::PLAYLIST_TARGET_DURATION_TAG))
+    {
+      if (!parse_number(line.substr(macros::PLAYLIST_TARGET_DURATION_TAG.size()),
+                        playlist.target_duration))
+      {
+        playlist.target_duration = 0.0;
+      }
+    }
+    else if (line.starts_with(macros::PLAYLIST_MEDIA_SEQUENCE_TAG))
+    {
+      if (!parse_number(line.substr(macros::PLAYLIST_MEDIA_SEQUENCE_TAG.size()),
+                        playlist.media_sequence))
+      {
+        playlist.media_sequence = 0;
+      }
+    }
+    else if (line == macros::PLAYLIST_END_TAG)
+    {
+      playlist.end_list = true;
+    }
+    else if (line == macros::PLAYLIST_GLOBAL_HEADER)
+    {
+      playlist.header = true;
+    }
+  }
+
+  return playlist.header;
+}
+
+} // namespace m3u8
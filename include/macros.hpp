@@ -8,30 +8,99 @@
 #define WAVY_SERVER_AUDIO_SIZE_LIMIT 200 // in MiBs
 #define WAVY_SERVER_PORT_NO_STR      "8080"
 
+#define WAVY_SERVER_KEEPALIVE_TIMEOUT_S    15  // idle seconds before a persistent connection is dropped
+#define WAVY_SERVER_KEEPALIVE_MAX_REQUESTS 1000 // requests served on one connection before closing
+#define WAVY_SERVER_ACCEPT_BACKOFF_MS      100  // pause before accepting again after a failure
+
+#define WAVY_SERVER_CACHE_SIZE_MIB      256 // in-memory segment cache budget
+#define WAVY_SERVER_CACHE_MAX_ENTRY_MIB 8   // larger files are always streamed from disk
+
+#define WAVY_SERVER_INGEST_CHUNK_KIB 64   // upload body is read off the socket in chunks this big
+#define WAVY_SERVER_INGEST_QUEUE_KIB 1024 // chunks buffered ahead of extraction before reads pause
+
+#define WAVY_SERVER_WORKER_QUEUE_SIZE       64 // pending extraction jobs before uploads get a 503
+#define WAVY_SERVER_MAX_UPLOADS             16 // uploads extracted at once; as many more may queue
+#define WAVY_SERVER_INGEST_MAX_INFLIGHT     4  // entries of one upload being processed in parallel
+#define WAVY_SERVER_INGEST_POOLED_ENTRY_MIB 16 // larger entries are streamed by the upload itself
+
+#define WAVY_SERVER_UPLOAD_LIMIT_MIB   16384 // largest chunked upload (see chunked_upload.hpp)
+#define WAVY_SERVER_UPLOAD_CHUNK_MIB   4     // size of every chunk but the last
+#define WAVY_SERVER_UPLOAD_MAX_PENDING 8     // chunks of one upload held ahead of a gap
+#define WAVY_SERVER_UPLOAD_EXPIRY_S    600   // idle seconds before a chunked upload is forgotten
+
+#define WAVY_SERVER_LIVE_HOLD_MAX_S   20 // longest a blocking playlist reload is held
+#define WAVY_SERVER_LIVE_IDLE_TARGETS 10 // target durations idle before a live playlist is dropped
+
+#define WAVY_CLIENT_FETCH_CONNECTIONS 4 // persistent TLS connections per segment fetcher
+#define WAVY_CLIENT_FETCH_AHEAD       8 // segments requested past the oldest undelivered one
+#define WAVY_CLIENT_ABR_FETCH_AHEAD   2 // same while streaming, where each request picks a variant
+#define WAVY_CLIENT_LIVE_MAX_STALLS   3 // blocking reloads without a new segment before giving up
+
+#define WAVY_CLIENT_PREBUFFER_SEGMENTS 2   // segments decoded before streaming playback starts
+#define WAVY_CLIENT_SEGMENT_QUEUE_SIZE 4   // fetched segments waiting for the decoder
+#define WAVY_CLIENT_PCM_RING_MIB       8   // decoded audio buffered ahead of the device
+#define WAVY_CLIENT_CACHE_MIB          512 // on-disk cache of fetched playlists and segments
+
+#define WAVY_ENCODER_QUEUE_ITEMS 32 // decoded frames (or packets) queued ahead of each rendition
+
+#define WAVY_BATCH_UPLOADS      4   // tracks uploaded at once (see WAVY_DISPATCH_UPLOAD_STREAMS)
+#define WAVY_BATCH_POLL_MS      500 // how often the dispatcher reads the journal for encoded tracks
+#define WAVY_BATCH_START_WAIT_S 30  // how long the dispatcher waits for an encoder run to start
+
+#define WAVY_DISPATCH_UPLOAD_STREAMS       4  // connections sending chunks of one upload
+#define WAVY_DISPATCH_ZSTD_LEVEL           1  // level of the compressed segments and playlists
+#define WAVY_DISPATCH_ZSTD_WINDOW          4  // files held in memory per compression thread
+#define WAVY_DISPATCH_ZSTD_DICT_KIB        16 // largest dictionary trained for one upload
+#define WAVY_DISPATCH_ZSTD_DICT_TS_PACKETS 4  // leading packets of each segment it is trained on
+
 #define STRING_CONSTANTS(X)                                   \
   X(PLAYLIST_EXT, ".m3u8")                                    \
   X(PLAYLIST_GLOBAL_HEADER, "#EXTM3U")                        \
   X(MASTER_PLAYLIST, "index.m3u8")                            \
+  X(METADATA_FILE, "metadata.toml")                           \
   X(TRANSPORT_STREAM_EXT, ".ts")                              \
   X(MP4_FILE_EXT, ".mp4")                                     \
   X(M4S_FILE_EXT, ".m4s")                                     \
   X(ZSTD_FILE_EXT, "zst")                                     \
+  X(ZSTD_DICT_ENTRY, ".zstd.dict")                            \
   X(FLAC_CODEC, "CODECS=\"fLaC\"")                            \
   X(COMPRESSED_ARCHIVE_EXT, ".tar.gz")                        \
   X(DISPATCH_ARCHIVE_REL_PATH, "payload")                     \
   X(DISPATCH_ARCHIVE_NAME, "hls_data.tar.gz")                 \
+  X(BATCH_JOURNAL, ".journal")                                \
   X(CODEC_HLS_TIME_FIELD, "hls_time")                         \
   X(CODEC_HLS_LIST_SIZE_FIELD, "hls_list_size")               \
   X(CODEC_HLS_SEGMENT_FILENAME_FIELD, "hls_segment_filename") \
   X(CODEC_HLS_FLAGS_FIELD, "hls_flags")                       \
+  X(CODEC_HLS_INIT_FILENAME_FIELD, "hls_fmp4_init_filename")  \
   X(CONTENT_TYPE_COMPRESSION, "application/gzip")             \
   X(CONTENT_TYPE_OCTET_STREAM, "application/octet-stream")    \
   X(PLAYLIST_VARIANT_TAG, "#EXT-X-STREAM-INF:")               \
+  X(PLAYLIST_MAP_TAG, "#EXT-X-MAP:")                          \
+  X(PLAYLIST_BYTERANGE_TAG, "#EXT-X-BYTERANGE:")              \
+  X(PLAYLIST_SEGMENT_INFO_TAG, "#EXTINF:")                    \
+  X(PLAYLIST_TARGET_DURATION_TAG, "#EXT-X-TARGETDURATION:")   \
+  X(PLAYLIST_END_TAG, "#EXT-X-ENDLIST")                       \
+  X(PLAYLIST_MEDIA_SEQUENCE_TAG, "#EXT-X-MEDIA-SEQUENCE:")    \
+  X(PLAYLIST_RELOAD_PARAM, "_HLS_msn")                        \
   X(SERVER_PATH_HLS_CLIENTS, "/hls/clients")                  \
+  X(SERVER_PATH_METRICS, "/metrics")                           \
+  X(SERVER_PATH_UPLOAD, "/upload")                            \
+  X(SERVER_PATH_LIVE, "/live")                                \
+  X(SERVER_PATH_TOML_UPLOAD, "/toml/upload")                  \
+  X(SERVER_PATH_META, "meta")                                 \
+  X(UPLOAD_HEADER_ID, "Upload-ID")                            \
+  X(UPLOAD_HEADER_LENGTH, "Upload-Length")                    \
+  X(UPLOAD_HEADER_OFFSET, "Upload-Offset")                    \
+  X(UPLOAD_HEADER_CHUNK_SIZE, "Upload-Chunk-Size")            \
+  X(UPLOAD_HEADER_CHECKSUM, "Upload-Checksum")                \
   X(SERVER_LOCK_FILE, "/tmp/hls_server.lock")                 \
   X(NETWORK_TEXT_DELIM, "\r\n\r\n")                           \
   X(SERVER_CERT, "server.crt")                                \
   X(SERVER_PRIVATE_KEY, "server.key")                         \
+  X(SERVER_MANIFEST_FILE, ".manifest")                        \
+  X(SERVER_META_JSON_FILE, ".meta.json")                      \
+  X(SERVER_INCOMPLETE_FILE, ".incomplete")                    \
   X(SERVER_TEMP_STORAGE_DIR, "/tmp/hls_temp")                 \
   X(SERVER_STORAGE_DIR, "/tmp/hls_storage") // this will use /tmp of the server's filesystem
 
@@ -41,7 +110,8 @@
     "HTTP/1.1 500 Internal Server Error\r\n\r\nUnable to read file (or) File write error") \
   X(SERVER_ERROR_400, "HTTP/1.1 400 Bad Request\r\n\r\nInvalid request format")            \
   X(SERVER_ERROR_405, "HTTP/1.1 405 Method Not Allowed\r\n\r\n")                           \
-  X(SERVER_ERROR_413, "HTTP/1.1 413 Payload Too Large\r\n\r\n")
+  X(SERVER_ERROR_413, "HTTP/1.1 413 Payload Too Large\r\n\r\n")                            \
+  X(SERVER_ERROR_503, "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\n\r\nServer busy")
 
 namespace macros
 {
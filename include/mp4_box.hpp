@@ -0,0 +1,475 @@
+#pragma once
+
+#include <cstdint>
+#include <fcntl.h>
+#include <optional>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+/*
+ * ISO-BMFF BOX WALKER
+ *
+ * Structural validation of fMP4 files (init.mp4 and the .m4s media segments of HLS FLAC
+ * streams), shared by the dispatcher (before upload) and the server (after extraction).
+ *
+ * The walker hops from box header to box header using the 32-bit size (or the 64-bit
+ * `largesize` when size == 1, or "to end of file" when size == 0), reading only the 8/16 byte
+ * headers with pread(). The only boxes read in full are `moof` and `moov`, which are tiny next
+ * to the `mdat` payload they describe, so the cost is proportional to the number of boxes and
+ * samples, never to the size of the audio data.
+ *
+ * What is checked:
+ *
+ * -> Every top level box lies inside the file (no truncation, no size overruns)
+ * -> Init segments: `ftyp` and a `moov` (with `mvex/trex` defaults picked up if present)
+ * -> Media segments: every `moof` is followed by an `mdat`, and carries `mfhd` plus a `traf`
+ *    whose `tfdt` base media decode time and total sample duration (from `trun`, the `tfhd`
+ *    default or the init segment's `trex` default) are extracted
+ *
+ * mp4::Timeline then checks that consecutive fragments are contiguous: each fragment's `tfdt`
+ * must equal the previous fragment's `tfdt` plus its duration.
+ *
+ * Reference: ISO/IEC 14496-12 (boxes `ftyp`, `moov`, `mvex`, `trex`, `moof`, `mfhd`, `traf`,
+ * `tfhd`, `tfdt`, `trun`, `mdat`)
+ */
+
+namespace mp4
+{
+
+constexpr auto fourcc(const char (&name)[5]) -> std::uint32_t
+{
+  return (static_cast<std::uint32_t>(static_cast<unsigned char>(name[0])) << 24) |
+         (static_cast<std::uint32_t>(static_cast<unsigned char>(name[1])) << 16) |
+         (static_cast<std::uint32_t>(static_cast<unsigned char>(name[2])) << 8) |
+         static_cast<std::uint32_t>(static_cast<unsigned char>(name[3]));
+}
+
+// Fully read container/full boxes are bounded, anything larger is not a sane audio fragment
+constexpr std::uint64_t kMaxMetadataBoxBytes = 4 * 1024 * 1024;
+
+struct BoxHeader
+{
+  std::uint32_t type;
+  std::uint64_t offset; // of the header, from the start of the enclosing buffer or file
+  std::uint64_t size;   // including the header
+  std::uint32_t header_size;
+};
+
+struct FragmentInfo
+{
+  std::uint32_t sequence_number  = 0;
+  std::uint64_t base_decode_time = 0;
+  std::uint64_t duration         = 0;
+  bool          has_tfdt         = false;
+  bool          duration_known   = false;
+};
+
+struct FileInfo
+{
+  bool                      has_ftyp              = false;
+  bool                      has_moov              = false;
+  std::uint32_t             trex_default_duration = 0; // 0 if the init segment has no trex
+  std::vector<FragmentInfo> fragments;
+
+  [[nodiscard]] auto is_init_segment() const -> bool { return has_ftyp && has_moov; }
+};
+
+inline auto read_u32(const std::uint8_t* p) -> std::uint32_t
+{
+  return (static_cast<std::uint32_t>(p[0]) << 24) | (static_cast<std::uint32_t>(p[1]) << 16) |
+         (static_cast<std::uint32_t>(p[2]) << 8) | static_cast<std::uint32_t>(p[3]);
+}
+
+inline auto read_u64(const std::uint8_t* p) -> std::uint64_t
+{
+  return (static_cast<std::uint64_t>(read_u32(p)) << 32) | read_u32(p + 4);
+}
+
+/*
+ * Parses the box header at `offset` of a region of `limit` bytes, given (at least) its first
+ * 16 bytes (or however many remain). Returns std::nullopt if the header is malformed or the box
+ * does not fit.
+ */
+inline auto parse_header(const std::uint8_t* p, std::uint64_t available, std::uint64_t offset,
+                         std::uint64_t limit) -> std::optional<BoxHeader>
+{
+  if (available < 8)
+  {
+    return std::nullopt;
+  }
+
+  BoxHeader header{read_u32(p + 4), offset, read_u32(p), 8};
+  if (header.size == 1)
+  {
+    if (available < 16)
+    {
+      return std::nullopt;
+    }
+    header.size        = read_u64(p + 8);
+    header.header_size = 16;
+  }
+  else if (header.size == 0)
+  {
+    header.size = limit - offset; // extends to the end of the enclosing region
+  }
+
+  if (header.size < header.header_size || header.size > limit - offset)
+  {
+    return std::nullopt;
+  }
+  return header;
+}
+
+// Children of an in-memory container box body
+class BoxCursor
+{
+public:
+  BoxCursor(const std::uint8_t* data, std::uint64_t size) : data_(data), size_(size) {}
+
+  auto next() -> std::optional<BoxHeader>
+  {
+    if (offset_ >= size_)
+    {
+      return std::nullopt;
+    }
+    auto header = parse_header(data_ + offset_, size_ - offset_, offset_, size_);
+    if (!header)
+    {
+      malformed_ = true;
+      return std::nullopt;
+    }
+    offset_ += header->size;
+    return header;
+  }
+
+  [[nodiscard]] auto body(const BoxHeader& box) const -> const std::uint8_t*
+  {
+    return data_ + box.offset + box.header_size;
+  }
+
+  [[nodiscard]] static auto body_size(const BoxHeader& box) -> std::uint64_t
+  {
+    return box.size - box.header_size;
+  }
+
+  [[nodiscard]] auto malformed() const -> bool { return malformed_; }
+
+private:
+  const std::uint8_t* data_;
+  std::uint64_t       size_;
+  std::uint64_t       offset_    = 0;
+  bool                malformed_ = false;
+};
+
+// First trex default_sample_duration inside a moov body (0 if there is none)
+inline auto parse_trex_default(const std::uint8_t* moov, std::uint64_t size) -> std::uint32_t
+{
+  BoxCursor root(moov, size);
+  while (auto box = root.next())
+  {
+    if (box->type != fourcc("mvex"))
+    {
+      continue;
+    }
+    BoxCursor mvex(root.body(*box), BoxCursor::body_size(*box));
+    while (auto child = mvex.next())
+    {
+      // version/flags(4) track_ID(4) default_sample_description_index(4) default_duration(4)
+      if (child->type == fourcc("trex") && BoxCursor::body_size(*child) >= 16)
+      {
+        return read_u32(mvex.body(*child) + 12);
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+ * Extracts sequence number, tfdt and duration from a moof body. Only the first traf is looked
+ * at: every Wavy stream carries exactly one (audio) track.
+ */
+inline auto parse_moof(const std::uint8_t* moof, std::uint64_t size, std::uint32_t trex_default,
+                       std::string& error) -> std::optional<FragmentInfo>
+{
+  FragmentInfo fragment;
+  bool         has_mfhd = false;
+  bool         has_traf = false;
+
+  BoxCursor root(moof, size);
+  while (auto box = root.next())
+  {
+    const std::uint8_t* body      = root.body(*box);
+    const std::uint64_t body_size = BoxCursor::body_size(*box);
+
+    if (box->type == fourcc("mfhd") && body_size >= 8)
+    {
+      fragment.sequence_number = read_u32(body + 4);
+      has_mfhd                 = true;
+    }
+    else if (box->type == fourcc("traf") && !has_traf)
+    {
+      has_traf = true;
+
+      std::uint32_t default_duration = trex_default;
+      std::uint64_t duration         = 0;
+      bool          have_samples     = true;
+
+      BoxCursor traf(body, body_size);
+      while (auto child = traf.next())
+      {
+        const std::uint8_t* p = traf.body(*child);
+        const std::uint64_t n = BoxCursor::body_size(*child);
+        if (n < 4)
+        {
+          continue;
+        }
+        const std::uint8_t  version = p[0];
+        const std::uint32_t flags   = read_u32(p) & 0xFFFFFF;
+
+        if (child->type == fourcc("tfhd"))
+        {
+          // track_ID, then optional fields in flag order
+          std::uint64_t at = 8;
+          at += (flags & 0x01) ? 8 : 0; // base_data_offset
+          at += (flags & 0x02) ? 4 : 0; // sample_description_index
+          if ((flags & 0x08) && at + 4 <= n)
+          {
+            default_duration = read_u32(p + at);
+          }
+        }
+        else if (child->type == fourcc("tfdt"))
+        {
+          if (version == 1 && n >= 12)
+          {
+            fragment.base_decode_time = read_u64(p + 4);
+          }
+          else if (n >= 8)
+          {
+            fragment.base_decode_time = read_u32(p + 4);
+          }
+          fragment.has_tfdt = true;
+        }
+        else if (child->type == fourcc("trun") && n >= 8)
+        {
+          const std::uint32_t samples = read_u32(p + 4);
+          std::uint64_t       at      = 8;
+          at += (flags & 0x001) ? 4 : 0; // data_offset
+          at += (flags & 0x004) ? 4 : 0; // first_sample_flags
+
+          const std::uint64_t entry = ((flags & 0x100) ? 4 : 0) + ((flags & 0x200) ? 4 : 0) +
+                                      ((flags & 0x400) ? 4 : 0) + ((flags & 0x800) ? 4 : 0);
+          if (at + entry * samples > n)
+          {
+            error = "trun sample table overruns its box";
+            return std::nullopt;
+          }
+
+          if (flags & 0x100) // sample_duration present: it is the first field of every entry
+          {
+            for (std::uint32_t i = 0; i < samples; ++i)
+            {
+              duration += read_u32(p + at + i * entry);
+            }
+          }
+          else if (default_duration != 0)
+          {
+            duration += static_cast<std::uint64_t>(samples) * default_duration;
+          }
+          else
+          {
+            have_samples = false;
+          }
+        }
+      }
+
+      if (traf.malformed())
+      {
+        error = "malformed box inside traf";
+        return std::nullopt;
+      }
+
+      fragment.duration       = duration;
+      fragment.duration_known = have_samples;
+    }
+  }
+
+  if (root.malformed())
+  {
+    error = "malformed box inside moof";
+    return std::nullopt;
+  }
+  if (!has_mfhd || !has_traf)
+  {
+    error = "moof without mfhd/traf";
+    return std::nullopt;
+  }
+  return fragment;
+}
+
+/*
+ * Walks the top level boxes of an fMP4 file. `trex_default` is the default sample duration from
+ * the matching init segment (if the caller has it). Returns std::nullopt and sets `error` if the
+ * file is not a structurally valid init or media segment.
+ */
+inline auto parse_file(const std::string& path, std::string& error, std::uint32_t trex_default = 0)
+  -> std::optional<FileInfo>
+{
+  const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    error = "cannot open file";
+    return std::nullopt;
+  }
+
+  struct FdGuard
+  {
+    int fd;
+    ~FdGuard() { ::close(fd); }
+  } guard{fd};
+
+  struct stat st{};
+  if (::fstat(fd, &st) != 0)
+  {
+    error = "cannot stat file";
+    return std::nullopt;
+  }
+
+  const auto                file_size = static_cast<std::uint64_t>(st.st_size);
+  FileInfo                  info;
+  std::uint64_t             offset        = 0;
+  bool                      awaiting_mdat = false;
+  std::vector<std::uint8_t> buffer;
+  std::uint8_t              head[16];
+
+  auto read_body = [&](const BoxHeader& box) -> bool
+  {
+    const std::uint64_t body_size = box.size - box.header_size;
+    if (body_size > kMaxMetadataBoxBytes)
+    {
+      error = "metadata box too large";
+      return false;
+    }
+    buffer.resize(body_size);
+    return ::pread(fd, buffer.data(), body_size,
+                   static_cast<off_t>(box.offset + box.header_size)) ==
+           static_cast<ssize_t>(body_size);
+  };
+
+  while (offset < file_size)
+  {
+    const ssize_t got = ::pread(fd, head, sizeof(head), static_cast<off_t>(offset));
+    auto          box = got > 0 ? parse_header(head, static_cast<std::uint64_t>(got), offset,
+                                               file_size)
+                                : std::nullopt;
+    if (!box)
+    {
+      error = "truncated or oversized box at offset " + std::to_string(offset);
+      return std::nullopt;
+    }
+
+    if (box->type == fourcc("ftyp"))
+    {
+      info.has_ftyp = true;
+    }
+    else if (box->type == fourcc("moov"))
+    {
+      if (!read_body(*box))
+      {
+        return std::nullopt;
+      }
+      info.has_moov              = true;
+      info.trex_default_duration = parse_trex_default(buffer.data(), buffer.size());
+    }
+    else if (box->type == fourcc("moof"))
+    {
+      if (awaiting_mdat)
+      {
+        error = "moof without mdat";
+        return std::nullopt;
+      }
+      if (!read_body(*box))
+      {
+        return std::nullopt;
+      }
+      const std::uint32_t defaults = trex_default ? trex_default : info.trex_default_duration;
+      auto                fragment = parse_moof(buffer.data(), buffer.size(), defaults, error);
+      if (!fragment)
+      {
+        return std::nullopt;
+      }
+      info.fragments.push_back(*fragment);
+      awaiting_mdat = true;
+    }
+    else if (box->type == fourcc("mdat"))
+    {
+      awaiting_mdat = false;
+    }
+
+    offset += box->size;
+  }
+
+  if (awaiting_mdat)
+  {
+    error = "moof without mdat";
+    return std::nullopt;
+  }
+  if (!info.is_init_segment() && info.fragments.empty())
+  {
+    error = "neither an init segment (ftyp+moov) nor a media segment (moof+mdat)";
+    return std::nullopt;
+  }
+  return info;
+}
+
+/*
+ * Checks that fragments follow each other without gaps or overlaps in decode time. Fed in
+ * playback order (segment by segment, as listed in the playlist).
+ */
+class Timeline
+{
+public:
+  // False (with `error` set) if fragment does not start where the previous one ended
+  auto append(const FragmentInfo& fragment, std::string& error) -> bool
+  {
+    if (!fragment.has_tfdt)
+    {
+      expected_.reset(); // nothing to compare against from here on
+      return true;
+    }
+
+    const bool ok = !expected_ || *expected_ == fragment.base_decode_time;
+    if (!ok)
+    {
+      error = "tfdt " + std::to_string(fragment.base_decode_time) + " where " +
+              std::to_string(*expected_) + " was expected (fragment " +
+              std::to_string(fragment.sequence_number) + ")";
+    }
+
+    if (fragment.duration_known)
+    {
+      expected_ = fragment.base_decode_time + fragment.duration;
+    }
+    else
+    {
+      expected_.reset();
+    }
+    return ok;
+  }
+
+  auto append(const FileInfo& file, std::string& error) -> bool
+  {
+    bool ok = true;
+    for (const FragmentInfo& fragment : file.fragments)
+    {
+      ok = append(fragment, error) && ok;
+    }
+    return ok;
+  }
+
+private:
+  std::optional<std::uint64_t> expected_;
+};
+
+} // namespace mp4
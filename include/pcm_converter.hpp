@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+#include <libavutil/samplefmt.h>
+#include <libswresample/swresample.h>
+}
+
+/*
+ * PCM CONVERTER
+ *
+ * Turns decoded frames into interleaved samples the audio device can take (u8, s16, s32 or f32),
+ * whatever layout the decoder produced: planar s16p/s32p/fltp, doubles, 64-bit integers.
+ *
+ * -> Frames that are already interleaved in the output format pass straight through as one
+ *    view of the frame, with no copy at all.
+ *
+ * -> Everything else goes through libswresample, one swr_convert per frame, which picks its
+ *    SSE2/AVX2/NEON kernels at runtime (scalar elsewhere). Nothing is converted sample by sample
+ *    here. Sample rate and channel layout are left alone, so swr never buffers samples between
+ *    calls.
+ *
+ * -> The conversion buffer is reused across frames and only grows, so steady-state decoding
+ *    does not allocate.
+ */
+
+class PcmConverter
+{
+public:
+  // Interleaved device format for samples decoded as `fmt`. 24-bit FLAC decodes to s32 and stays
+  // there, so no precision is lost.
+  static auto output_format(AVSampleFormat fmt) -> AVSampleFormat
+  {
+    switch (av_get_packed_sample_fmt(fmt))
+    {
+      case AV_SAMPLE_FMT_U8:
+        return AV_SAMPLE_FMT_U8;
+      case AV_SAMPLE_FMT_S16:
+        return AV_SAMPLE_FMT_S16;
+      case AV_SAMPLE_FMT_S32:
+      case AV_SAMPLE_FMT_S64:
+        return AV_SAMPLE_FMT_S32;
+      default:
+        return AV_SAMPLE_FMT_FLT;
+    }
+  }
+
+  PcmConverter() = default;
+
+  PcmConverter(const PcmConverter&)                    = delete;
+  auto operator=(const PcmConverter&) -> PcmConverter& = delete;
+
+  ~PcmConverter() { swr_free(&swr_); }
+
+  // Sets up conversion of what codec_ctx decodes to; false if libswresample refuses it
+  auto init(const AVCodecContext* codec_ctx) -> bool
+  {
+    swr_free(&swr_);
+    in_fmt_      = codec_ctx->sample_fmt;
+    out_fmt_     = output_format(in_fmt_);
+    frame_bytes_ = static_cast<std::size_t>(av_get_bytes_per_sample(out_fmt_)) *
+                   codec_ctx->ch_layout.nb_channels;
+
+    if (in_fmt_ == out_fmt_)
+    {
+      return true;
+    }
+
+    if (swr_alloc_set_opts2(&swr_, &codec_ctx->ch_layout, out_fmt_, codec_ctx->sample_rate,
+                            &codec_ctx->ch_layout, in_fmt_, codec_ctx->sample_rate, 0,
+                            nullptr) < 0 ||
+        swr_init(swr_) < 0)
+    {
+      swr_free(&swr_);
+      return false;
+    }
+    return true;
+  }
+
+  [[nodiscard]] auto format() const -> AVSampleFormat { return out_fmt_; }
+  [[nodiscard]] auto frame_bytes() const -> std::size_t { return frame_bytes_; }
+
+  // Interleaved samples of one frame; valid until the next call, empty if conversion failed
+  auto convert(const AVFrame* frame) -> std::span<const std::uint8_t>
+  {
+    const std::size_t size = static_cast<std::size_t>(frame->nb_samples) * frame_bytes_;
+    if (!swr_)
+    {
+      return {frame->data[0], size};
+    }
+
+    if (buffer_.size() < size)
+    {
+      buffer_.resize(size);
+    }
+
+    std::uint8_t* out     = buffer_.data();
+    const int     samples = swr_convert(swr_, &out, frame->nb_samples,
+                                        const_cast<const std::uint8_t**>(frame->extended_data),
+                                        frame->nb_samples);
+    if (samples < 0)
+    {
+      return {};
+    }
+    return {buffer_.data(), static_cast<std::size_t>(samples) * frame_bytes_};
+  }
+
+private:
+  SwrContext*               swr_         = nullptr;
+  AVSampleFormat            in_fmt_      = AV_SAMPLE_FMT_NONE;
+  AVSampleFormat            out_fmt_     = AV_SAMPLE_FMT_NONE;
+  std::size_t               frame_bytes_ = 0;
+  std::vector<std::uint8_t> buffer_;
+};
@@ -1,9 +1,13 @@
 #define MINIAUDIO_IMPLEMENTATION
 #include "logger.hpp"
 #include "miniaudio.h"
+#include "ring_buffer.hpp"
+#include <atomic>
+#include <cstdint>
 #include <cstring>
 #include <iomanip> // for std::fixed and std::setprecision
 #include <stdexcept>
+#include <utility>
 #include <vector>
 
 #define SAMPLE_RATE 44100
@@ -15,6 +19,11 @@
  * MP3 -> No issues
  * FLAC -> s16, s24, s32
  *
+ * Device callbacks run on miniaudio's real-time thread: they only
+ * copy, count and signal. No allocation, lock or logging happens
+ * there, and all their state lives in the player (no statics),
+ * so several players can exist in one process.
+ *
  *****************************************************************/
 
 class AudioPlayer
@@ -22,9 +31,21 @@ class AudioPlayer
 private:
   ma_device                  device;
   ma_decoder                 decoder;
+  bool                       hasDecoder = false;
   std::vector<unsigned char> audioMemory;
-  bool                       isPlaying;
+  std::atomic<bool>          isPlaying;
   bool                       flac_stream;
+  size_t                     playOffset = 0;       // next byte of audioMemory, callback only
+  SpscRingBuffer*            pcmRing    = nullptr; // streaming mode only
+  size_t                     frameBytes = 0;
+  std::atomic<std::uint64_t> underrunCount{0};
+
+  // Wakes play(); a futex wake at most, safe from the device callback
+  void finish()
+  {
+    isPlaying.store(false, std::memory_order_release);
+    isPlaying.notify_all();
+  }
 
   static void lossyDataCallback(ma_device* pDevice, void* pOutput, const void* pInput,
                                 ma_uint32 frameCount)
@@ -39,44 +60,101 @@ private:
     {
       ma_silence_pcm_frames(output + (framesRead * CHANNELS), frameCount - framesRead,
                             ma_format_f32, CHANNELS);
-      player->isPlaying = false;
+      player->finish();
     }
   }
 
   static void flacDataCallback(ma_device* pDevice, void* pOutput, const void* pInput,
                                ma_uint32 frameCount)
   {
-    static size_t offset      = 0;
-    auto*         player      = (AudioPlayer*)pDevice->pUserData;
-    size_t        bytesToCopy = frameCount * pDevice->playback.channels * 2; // 16-bit FLAC
+    auto*   player = (AudioPlayer*)pDevice->pUserData;
+    size_t& offset = player->playOffset;
+    size_t  bytesToCopy =
+      frameCount * ma_get_bytes_per_frame(pDevice->playback.format, pDevice->playback.channels);
 
     if (offset + bytesToCopy > player->audioMemory.size())
     {
       bytesToCopy = player->audioMemory.size() - offset;
     }
 
-    std::memcpy(pOutput, &player->audioMemory[offset], bytesToCopy);
+    std::memcpy(pOutput, player->audioMemory.data() + offset, bytesToCopy);
     offset += bytesToCopy;
 
     if (offset >= player->audioMemory.size())
     {
-      player->isPlaying = false;
+      player->finish();
     }
 
     (void)pInput;
   }
 
+  // Real-time side of streaming playback: never waits for the decoder, plays silence instead
+  static void streamDataCallback(ma_device* pDevice, void* pOutput, const void* pInput,
+                                 ma_uint32 frameCount)
+  {
+    auto*        player = (AudioPlayer*)pDevice->pUserData;
+    auto*        output = static_cast<unsigned char*>(pOutput);
+    const size_t wanted = frameCount * player->frameBytes;
+
+    // Whole frames only, so an underrun never shifts the channel order
+    const size_t ready = player->pcmRing->available() / player->frameBytes * player->frameBytes;
+    const size_t got   = player->pcmRing->try_read(output, std::min(wanted, ready));
+
+    if (got < wanted)
+    {
+      ma_silence_pcm_frames(output + got, (wanted - got) / player->frameBytes,
+                            pDevice->playback.format, pDevice->playback.channels);
+      if (player->pcmRing->drained())
+      {
+        player->finish();
+      }
+      else
+      {
+        // The decoder fell behind: counted here, reported by play()
+        player->underrunCount.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+
+    (void)pInput;
+  }
+
+  // Device fed straight from PCM the decoder already produced in the final format
+  void initPcmDevice(ma_device_data_proc callback, ma_format format, ma_uint32 channels,
+                     ma_uint32 sampleRate)
+  {
+    ma_device_config config  = ma_device_config_init(ma_device_type_playback);
+    config.pUserData         = this;
+    config.dataCallback      = callback;
+    config.playback.format   = format;
+    config.playback.channels = channels;
+    config.sampleRate        = sampleRate;
+
+    LOG_INFO << "Playback Configuration - Format: " << config.playback.format
+             << ", Channels: " << config.playback.channels
+             << ", Sample Rate: " << config.sampleRate;
+
+    if (frameBytes == 0 || ma_device_init(nullptr, &config, &device) != MA_SUCCESS)
+    {
+      LOG_ERROR << "Failed to initialize audio device.";
+      throw std::runtime_error("Failed to initialize audio device");
+    }
+
+    LOG_INFO << "Audio device initialized successfully.";
+  }
+
 public:
-  AudioPlayer(const std::vector<unsigned char>& audioInput, const bool flac_found)
-      : audioMemory(audioInput), isPlaying(false), flac_stream(flac_found)
+  // Takes the decoded track by value: pass it with std::move to play it without a copy
+  AudioPlayer(std::vector<unsigned char> audioInput, const bool flac_found)
+      : audioMemory(std::move(audioInput)), isPlaying(false), flac_stream(flac_found)
   {
     LOG_INFO << "Initializing AudioPlayer with " << audioMemory.size() << " bytes of audio data.";
 
     // First, probe the format by initializing the decoder without a predefined format.
     ma_decoder_config decoderConfig = ma_decoder_config_init_default();
 
-    if (ma_decoder_init_memory(audioMemory.data(), audioMemory.size(), &decoderConfig, &decoder) !=
-        MA_SUCCESS)
+    hasDecoder = ma_decoder_init_memory(audioMemory.data(), audioMemory.size(), &decoderConfig,
+                                        &decoder) == MA_SUCCESS;
+    if (!hasDecoder)
     {
       LOG_ERROR << "Failed to initialize decoder from memory.";
       LOG_WARNING << "Still proceeding to attempt playback...";
@@ -179,36 +257,69 @@ public:
     if (ma_device_init(nullptr, &config, &device) != MA_SUCCESS)
     {
       LOG_ERROR << "Failed to initialize audio device.";
-      ma_decoder_uninit(&decoder);
+      if (hasDecoder)
+      {
+        ma_decoder_uninit(&decoder);
+      }
       throw std::runtime_error("Failed to initialize audio device");
     }
 
     LOG_INFO << "Audio device initialized successfully.";
   }
 
+  // Plays interleaved PCM decoded up front (in the format the decoder reported)
+  AudioPlayer(std::vector<unsigned char> pcm, ma_format format, ma_uint32 channels,
+              ma_uint32 sampleRate)
+      : audioMemory(std::move(pcm)), isPlaying(false), flac_stream(true),
+        frameBytes(ma_get_bytes_per_frame(format, channels))
+  {
+    LOG_INFO << "Initializing AudioPlayer with " << audioMemory.size() << " bytes of PCM.";
+    initPcmDevice(flacDataCallback, format, channels, sampleRate);
+  }
+
+  // Streaming playback of interleaved PCM that a decoder thread keeps writing into `pcm`
+  AudioPlayer(SpscRingBuffer& pcm, ma_format format, ma_uint32 channels, ma_uint32 sampleRate)
+      : isPlaying(false), flac_stream(false), pcmRing(&pcm),
+        frameBytes(ma_get_bytes_per_frame(format, channels))
+  {
+    initPcmDevice(streamDataCallback, format, channels, sampleRate);
+  }
+
   ~AudioPlayer()
   {
     LOG_INFO << "Shutting down AudioPlayer.";
     ma_device_uninit(&device);
-    ma_decoder_uninit(&decoder);
+    if (hasDecoder)
+    {
+      ma_decoder_uninit(&decoder);
+    }
   }
 
   void play()
   {
     LOG_INFO << "Starting playback.";
+
+    // Set before the device starts: a short track may end in its very first callback
+    isPlaying.store(true, std::memory_order_release);
     if (ma_device_start(&device) != MA_SUCCESS)
     {
       LOG_ERROR << "Failed to start audio device.";
       throw std::runtime_error("Failed to start audio device");
     }
 
-    isPlaying = true;
+    // Sleeps until a callback signals the end, instead of polling
+    isPlaying.wait(true, std::memory_order_acquire);
 
-    while (isPlaying)
+    if (underruns() > 0)
     {
-      ma_sleep(100);
+      LOG_WARNING << "Playback had " << underruns() << " underruns (decoder fell behind).";
     }
-
     LOG_INFO << "Playback completed.";
   }
+
+  // Device callbacks that found the ring empty before the end of the stream
+  [[nodiscard]] auto underruns() const -> std::uint64_t
+  {
+    return underrunCount.load(std::memory_order_relaxed);
+  }
 };
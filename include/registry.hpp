@@ -1,3 +1,5 @@
+#pragma once
+
 #include <fstream>
 #include <iostream>
 #include <string>
@@ -45,6 +47,13 @@ public:
   }
 
   void exportToTOML(const std::string& outputFile) const
+  {
+    exportToTOML(fmt_ctx, filePath, outputFile);
+  }
+
+  // Same, of an input someone else already opened (the encoder writes it next to its playlists)
+  static void exportToTOML(const AVFormatContext* fmt_ctx, const std::string& filePath,
+                           const std::string& outputFile)
   {
     TomlGenerator tomlGen;
 
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+/*
+ * SPSC RING BUFFER
+ *
+ * Byte ring between exactly one producer (the decoder thread) and one consumer (the audio
+ * device callback).
+ *
+ * -> The consumer side never blocks, locks or allocates: try_read() copies what is there and
+ *    returns, so it is safe to call from the real-time callback.
+ *
+ * -> The producer side may block in write() while the ring is full. It sleeps on a wakeup
+ *    counter (std::atomic::wait) that the consumer bumps whenever it frees space.
+ *
+ * -> Head and tail only ever grow; the capacity is a power of two so positions map to slots
+ *    with a mask, and the fill level is simply head - tail.
+ */
+
+class SpscRingBuffer
+{
+public:
+  explicit SpscRingBuffer(std::size_t min_capacity)
+      : capacity_(std::bit_ceil(std::max<std::size_t>(min_capacity, 2))), mask_(capacity_ - 1),
+        data_(std::make_unique<unsigned char[]>(capacity_))
+  {
+  }
+
+  SpscRingBuffer(const SpscRingBuffer&)                    = delete;
+  auto operator=(const SpscRingBuffer&) -> SpscRingBuffer& = delete;
+
+  /* Producer */
+
+  // Copies as much of src as fits right now
+  auto try_write(const unsigned char* src, std::size_t size) -> std::size_t
+  {
+    const std::size_t head = head_.load(std::memory_order_relaxed);
+    const std::size_t tail = tail_.load(std::memory_order_acquire);
+    const std::size_t n    = std::min(size, capacity_ - (head - tail));
+
+    const std::size_t slot  = head & mask_;
+    const std::size_t first = std::min(n, capacity_ - slot);
+    std::memcpy(data_.get() + slot, src, first);
+    std::memcpy(data_.get(), src + first, n - first);
+
+    head_.store(head + n, std::memory_order_release);
+    return n;
+  }
+
+  // Copies all of src, waiting for space; false if the consumer cancelled meanwhile
+  auto write(const unsigned char* src, std::size_t size) -> bool
+  {
+    while (size > 0)
+    {
+      if (cancelled_.load(std::memory_order_acquire))
+      {
+        return false;
+      }
+
+      const std::size_t n = try_write(src, size);
+      src += n;
+      size -= n;
+
+      if (size > 0)
+      {
+        // Taken before the check, so a read in between makes the wait return immediately
+        const std::uint32_t wakeups = wakeups_.load(std::memory_order_acquire);
+        if (full() && !cancelled_.load(std::memory_order_acquire))
+        {
+          wakeups_.wait(wakeups, std::memory_order_acquire);
+        }
+      }
+    }
+    return true;
+  }
+
+  // No more data will be written; the consumer drains what is left
+  void finish() { finished_.store(true, std::memory_order_release); }
+
+  /* Consumer */
+
+  auto try_read(unsigned char* dst, std::size_t size) -> std::size_t
+  {
+    const std::size_t tail = tail_.load(std::memory_order_relaxed);
+    const std::size_t head = head_.load(std::memory_order_acquire);
+    const std::size_t n    = std::min(size, head - tail);
+
+    const std::size_t slot  = tail & mask_;
+    const std::size_t first = std::min(n, capacity_ - slot);
+    std::memcpy(dst, data_.get() + slot, first);
+    std::memcpy(dst + first, data_.get(), n - first);
+
+    if (n > 0)
+    {
+      tail_.store(tail + n, std::memory_order_release);
+      wakeups_.fetch_add(1, std::memory_order_release);
+      wakeups_.notify_one(); // no syscall unless the producer is actually waiting
+    }
+    return n;
+  }
+
+  // Stops the producer: a blocked or later write() returns false
+  void cancel()
+  {
+    cancelled_.store(true, std::memory_order_release);
+    wakeups_.fetch_add(1, std::memory_order_release);
+    wakeups_.notify_all();
+  }
+
+  /* Either side */
+
+  [[nodiscard]] auto available() const -> std::size_t
+  {
+    return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+  }
+
+  [[nodiscard]] auto capacity() const -> std::size_t { return capacity_; }
+
+  [[nodiscard]] auto full() const -> bool { return available() == capacity_; }
+
+  // Finished and fully read
+  [[nodiscard]] auto drained() const -> bool
+  {
+    return finished_.load(std::memory_order_acquire) && available() == 0;
+  }
+
+private:
+  const std::size_t                capacity_;
+  const std::size_t                mask_;
+  std::unique_ptr<unsigned char[]> data_;
+
+  alignas(64) std::atomic<std::size_t> head_{0}; // written by the producer only
+  alignas(64) std::atomic<std::size_t> tail_{0}; // written by the consumer only
+  std::atomic<std::uint32_t> wakeups_{0};
+  std::atomic<bool>          finished_{false};
+  std::atomic<bool>          cancelled_{false};
+};
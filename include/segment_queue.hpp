@@ -0,0 +1,92 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <string>
+
+/*
+ * SEGMENT QUEUE
+ *
+ * Bounded blocking queue of fetched segments between the fetcher thread and the decoder
+ * thread. Neither side is real-time, so a mutex and two condition variables are enough.
+ *
+ * -> push() waits while `capacity` segments are queued, which is what stops the fetcher from
+ *    running arbitrarily far ahead of playback.
+ *
+ * -> close() is the producer's end of stream: pop() drains what is left, then returns nullopt.
+ *    cancel() is the consumer giving up: both sides return immediately from then on.
+ */
+
+class SegmentQueue
+{
+public:
+  explicit SegmentQueue(std::size_t capacity) : capacity_(capacity > 0 ? capacity : 1) {}
+
+  SegmentQueue(const SegmentQueue&)                    = delete;
+  auto operator=(const SegmentQueue&) -> SegmentQueue& = delete;
+
+  // False once the queue was closed or cancelled
+  auto push(std::string segment) -> bool
+  {
+    std::unique_lock lock(mutex_);
+    not_full_.wait(lock, [this] { return segments_.size() < capacity_ || closed_ || cancelled_; });
+    if (closed_ || cancelled_)
+    {
+      return false;
+    }
+    segments_.push_back(std::move(segment));
+    not_empty_.notify_one();
+    return true;
+  }
+
+  // Next segment in order; nullopt at the end of the stream or once cancelled
+  auto pop() -> std::optional<std::string>
+  {
+    std::unique_lock lock(mutex_);
+    not_empty_.wait(lock, [this] { return !segments_.empty() || closed_ || cancelled_; });
+    if (cancelled_ || segments_.empty())
+    {
+      return std::nullopt;
+    }
+    std::string segment = std::move(segments_.front());
+    segments_.pop_front();
+    not_full_.notify_one();
+    return segment;
+  }
+
+  // Segments waiting for the decoder right now
+  [[nodiscard]] auto size() -> std::size_t
+  {
+    std::lock_guard lock(mutex_);
+    return segments_.size();
+  }
+
+  void close()
+  {
+    std::lock_guard lock(mutex_);
+    closed_ = true;
+    not_empty_.notify_all();
+    not_full_.notify_all();
+  }
+
+  void cancel()
+  {
+    std::lock_guard lock(mutex_);
+    cancelled_ = true;
+    segments_.clear();
+    not_empty_.notify_all();
+    not_full_.notify_all();
+  }
+
+private:
+  const std::size_t       capacity_;
+  std::mutex              mutex_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+  std::deque<std::string> segments_;
+  bool                    closed_    = false;
+  bool                    cancelled_ = false;
+};
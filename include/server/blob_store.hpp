@@ -0,0 +1,209 @@
+#pragma once
+
+#include "../digest.hpp"
+#include "../logger.hpp"
+#include "../macros.hpp"
+#include <boost/filesystem.hpp>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+/*
+ * BLOB STORE
+ *
+ * Content-addressed storage of uploaded files, so a track that is uploaded again, by the same
+ * owner or by another one, takes its space on disk and in memory only once:
+ *
+ *   hls_storage/.blobs/<ab>/<ab...>      one file per distinct content, named by its hash
+ *   hls_storage/<ip>/<audio-id>/<file>   a hard link to its blob
+ *   hls_storage/<ip>/<audio-id>/.manifest
+ *                                        "<hash> <size> <file>" for every file of the upload
+ *
+ * -> Stored files are hard links, so downloads, listings and range requests read a path the way
+ *    they always have. Identical files share one inode, and with it one ETag and one copy in
+ *    the page cache. The segment cache keys them by hash too (SegmentCache::make_blob_key), so
+ *    a hit on one upload is a hit on all of its duplicates.
+ *
+ * -> A blob's reference count is its link count, less the store's own name; nothing else has to
+ *    be kept in sync with the audio-id directories. collect() unlinks every blob with no other
+ *    name left, and remove_audio() does the same for the blobs of one audio-id.
+ *
+ * -> A new file is linked under its audio-id before it is renamed into the store, so a concurrent
+ *    collect() never sees it with a single link.
+ *
+ * -> Hashes are BLAKE2s-256 (see digest.hpp), computed by the pool thread that extracted and
+ *    validated the file, while it is still in the page cache.
+ */
+
+class BlobStore
+{
+public:
+  struct Entry
+  {
+    std::string   hash;
+    std::uint64_t size = 0;
+    std::string   name;
+  };
+
+  explicit BlobStore(const std::string& storage_root) : root_(storage_root + "/.blobs") {}
+
+  BlobStore(const BlobStore&)                    = delete;
+  auto operator=(const BlobStore&) -> BlobStore& = delete;
+
+  /*
+   * Moves the file at `temp_path` to `<dir>/<name>`, as a link to the blob of an identical file
+   * if one is stored already. std::nullopt if it could not be stored.
+   */
+  auto store(const std::string& temp_path, const std::string& dir, const std::string& name)
+    -> std::optional<Entry>
+  {
+    struct stat st{};
+    Entry       entry{digest::blake2s256_file(temp_path), 0, name};
+    if (entry.hash.empty() || ::stat(temp_path.c_str(), &st) != 0)
+    {
+      LOG_ERROR << SERVER_EXTRACT_LOG << "Failed to hash " << temp_path;
+      return std::nullopt;
+    }
+    entry.size = static_cast<std::uint64_t>(st.st_size);
+
+    const std::string blob = path_of(entry.hash);
+    const std::string dest = dir + "/" + name;
+    ::unlink(dest.c_str()); // replaced, as a rename would
+
+    if (::link(blob.c_str(), dest.c_str()) == 0)
+    {
+      LOG_DEBUG << SERVER_EXTRACT_LOG << "Deduplicated " << name << " (" << entry.hash << ")";
+      ::unlink(temp_path.c_str());
+      return entry;
+    }
+    if (errno != ENOENT)
+    {
+      LOG_ERROR << SERVER_EXTRACT_LOG << "Failed to link " << dest << ": " << std::strerror(errno);
+      return std::nullopt;
+    }
+
+    // The first copy of this content becomes its blob
+    boost::system::error_code ec;
+    boost::filesystem::create_directories(root_ + "/" + entry.hash.substr(0, 2), ec);
+    if (::link(temp_path.c_str(), dest.c_str()) != 0)
+    {
+      LOG_ERROR << SERVER_EXTRACT_LOG << "Failed to store " << dest << ": " << std::strerror(errno);
+      return std::nullopt;
+    }
+    if (::rename(temp_path.c_str(), blob.c_str()) != 0)
+    {
+      LOG_WARNING << SERVER_EXTRACT_LOG << "Stored " << name << " without a blob: "
+                  << std::strerror(errno);
+    }
+    return entry;
+  }
+
+  // Removes a stored audio-id directory and every blob nothing else links to
+  void remove_audio(const std::string& dir)
+  {
+    const std::vector<Entry>  entries = read_manifest(dir);
+    boost::system::error_code ec;
+    boost::filesystem::remove_all(dir, ec);
+    for (const Entry& entry : entries)
+    {
+      release(entry.hash);
+    }
+  }
+
+  // Unlinks every unreferenced blob (say after audio-ids were deleted by hand); returns how many
+  auto collect() -> std::size_t
+  {
+    namespace bfs = boost::filesystem;
+
+    std::size_t               removed = 0;
+    std::uint64_t             bytes   = 0;
+    boost::system::error_code ec;
+    for (bfs::directory_iterator dir(root_, ec), end; !ec && dir != end; dir.increment(ec))
+    {
+      boost::system::error_code inner;
+      for (bfs::directory_iterator it(dir->path(), inner); !inner && it != end; it.increment(inner))
+      {
+        struct stat st{};
+        if (::lstat(it->path().c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink == 1 &&
+            ::unlink(it->path().c_str()) == 0)
+        {
+          ++removed;
+          bytes += static_cast<std::uint64_t>(st.st_size);
+        }
+      }
+    }
+
+    if (removed > 0)
+    {
+      LOG_INFO << SERVER_LOG << "Collected " << removed << " unreferenced blob(s), " << bytes
+               << " bytes";
+    }
+    return removed;
+  }
+
+  // Written once the upload's files are stored, under a name neither catalog nor receivers use
+  static auto write_manifest(const std::string& dir, const std::vector<Entry>& entries) -> bool
+  {
+    const std::string path     = dir + "/" + macros::to_string(macros::SERVER_MANIFEST_FILE);
+    const std::string tmp_path = path + ".tmp";
+    {
+      std::ofstream out(tmp_path, std::ios::trunc);
+      for (const Entry& entry : entries)
+      {
+        out << entry.hash << " " << entry.size << " " << entry.name << "\n";
+      }
+      if (!out.good())
+      {
+        return false;
+      }
+    }
+    return std::rename(tmp_path.c_str(), path.c_str()) == 0;
+  }
+
+  // Empty for an audio-id stored without one (older uploads, live tracks)
+  static auto read_manifest(const std::string& dir) -> std::vector<Entry>
+  {
+    std::vector<Entry> entries;
+    std::ifstream      in(dir + "/" + macros::to_string(macros::SERVER_MANIFEST_FILE));
+    std::string        line;
+    while (std::getline(in, line))
+    {
+      std::istringstream fields(line);
+      Entry              entry;
+      fields >> entry.hash >> entry.size;
+      fields.get(); // separator; the name is the rest of the line
+      std::getline(fields, entry.name);
+      if (!fields.fail() && !entry.hash.empty() && !entry.name.empty())
+      {
+        entries.push_back(std::move(entry));
+      }
+    }
+    return entries;
+  }
+
+private:
+  std::string root_;
+
+  [[nodiscard]] auto path_of(const std::string& hash) const -> std::string
+  {
+    return root_ + "/" + hash.substr(0, 2) + "/" + hash;
+  }
+
+  // Unlinks the blob once the store's own name is the last one left
+  void release(const std::string& hash)
+  {
+    const std::string blob = path_of(hash);
+    struct stat       st{};
+    if (::lstat(blob.c_str(), &st) == 0 && st.st_nlink == 1)
+    {
+      ::unlink(blob.c_str());
+    }
+  }
+};
@@ -0,0 +1,359 @@
+#pragma once
+
+#include "../logger.hpp"
+#include "../macros.hpp"
+#include "upload_ingest.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * CHUNKED UPLOADS
+ *
+ * Resumable uploads that arrive in fixed-size pieces, possibly several at a time over separate
+ * connections, instead of as one POST body:
+ *
+ *   POST /upload            Upload-Length: <bytes>
+ *     201, Upload-ID: <id>, Upload-Chunk-Size: <bytes>
+ *   PUT  /upload/<id>       Upload-Offset: <offset>, Upload-Checksum: <sha256 of the body>
+ *     204, Upload-Offset: <bytes received>   the chunk is in; send more
+ *     200, Client-ID: <audio-id>             it was the last one and the payload is stored
+ *   GET  /upload/<id>
+ *     204, Upload-Offset: <bytes received>   resume from there (with Upload-Length and
+ *                                            Upload-Chunk-Size)
+ *     200, Client-ID: <audio-id>             already stored
+ *
+ * Every chunk but the last is exactly Upload-Chunk-Size bytes, at a multiple of it. The id of an
+ * upload is the audio-id it is stored under.
+ *
+ * -> Chunks are appended in order to the same streaming UploadIngest a single POST feeds, so
+ *    extraction runs while the rest of the payload is still arriving. Chunks that arrive ahead
+ *    of a gap wait in memory, at most WAVY_SERVER_UPLOAD_MAX_PENDING of them per upload; past
+ *    that a chunk gets a 503 and is sent again.
+ *
+ * -> A chunk is only answered once it has been handed to the ingest, and the ingest only takes
+ *    more when extraction has caught up. That answer is the acknowledgement the client resumes
+ *    from, and holding it back is what paces the client's chunks in flight to extraction.
+ *
+ * -> A chunk below the received offset is a retransmission (its answer was lost) and is
+ *    acknowledged again without being appended. So is one of the chunk being handed to the
+ *    ingest, once that chunk has been taken. Once every chunk is in, any PUT of the upload
+ *    is answered with the outcome of the extraction.
+ *
+ * -> Uploads untouched for WAVY_SERVER_UPLOAD_EXPIRY_S are forgotten the next time any upload
+ *    is looked up: unfinished ones are aborted, finished ones can no longer be queried.
+ */
+
+class ChunkedUpload : public std::enable_shared_from_this<ChunkedUpload>
+{
+public:
+  enum class Status
+  {
+    Received, // 204: chunk appended (or already had it)
+    Stored,   // 200: payload extracted and stored
+    Failed,   // 400: extraction or validation failed
+    Invalid,  // 400: offset or size do not fit the upload
+    Busy,     // 503: too many chunks waiting ahead of a gap
+  };
+
+  // Answer to one PUT; can be called from any thread
+  using Reply = std::function<void(Status status, std::uint64_t received)>;
+
+  struct Progress
+  {
+    Status        status; // Received while chunks are still expected
+    std::uint64_t received;
+  };
+
+  static constexpr std::uint64_t kChunkSize = WAVY_SERVER_UPLOAD_CHUNK_MIB * 1024 * 1024;
+
+  ChunkedUpload(std::string id, std::string ip, std::uint64_t length)
+      : id_(std::move(id)), ip_(std::move(ip)), length_(length), touched_(Clock::now())
+  {
+  }
+
+  ChunkedUpload(const ChunkedUpload&)                    = delete;
+  auto operator=(const ChunkedUpload&) -> ChunkedUpload& = delete;
+
+  [[nodiscard]] auto id() const -> const std::string& { return id_; }
+  [[nodiscard]] auto ip() const -> const std::string& { return ip_; }
+  [[nodiscard]] auto length() const -> std::uint64_t { return length_; }
+
+  // The ingest the chunks go to; its completion has to call finished()
+  void attach(std::shared_ptr<UploadIngest> ingest) { ingest_ = std::move(ingest); }
+
+  [[nodiscard]] auto progress() -> Progress
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    touched_ = Clock::now();
+    return {status_, received_};
+  }
+
+  void put(std::uint64_t offset, std::string data, Reply reply)
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    touched_ = Clock::now();
+
+    if (status_ != Status::Received)
+    {
+      const Status        status   = status_;
+      const std::uint64_t received = received_;
+      lock.unlock();
+      reply(status, received);
+      return;
+    }
+
+    if (offset % kChunkSize != 0 || offset >= length_ ||
+        data.size() != std::min(kChunkSize, length_ - offset))
+    {
+      lock.unlock();
+      reply(Status::Invalid, 0);
+      return;
+    }
+
+    if (offset < received_)
+    {
+      if (received_ == length_)
+      {
+        finals_.push_back(std::move(reply)); // the outcome is what the client is after
+        return;
+      }
+      const std::uint64_t received = received_;
+      lock.unlock();
+      reply(Status::Received, received);
+      return;
+    }
+    if (offset < received_ + feeding_)
+    {
+      resent_.push_back(std::move(reply)); // answered with the first copy
+      return;
+    }
+
+    auto it = pending_.find(offset);
+    if (it == pending_.end() && pending_.size() >= WAVY_SERVER_UPLOAD_MAX_PENDING)
+    {
+      lock.unlock();
+      reply(Status::Busy, 0);
+      return;
+    }
+
+    Reply replaced;
+    if (it != pending_.end())
+    {
+      replaced = std::move(it->second.reply); // sent again, the first request gave up on it
+    }
+    pending_[offset] = {std::move(data), std::move(reply)};
+    feed(lock);
+
+    if (replaced)
+    {
+      replaced(Status::Busy, 0);
+    }
+  }
+
+  // Completion of the ingest
+  void finished(bool success)
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    status_ = success ? Status::Stored : Status::Failed;
+
+    std::vector<Reply> replies = std::move(finals_);
+    finals_.clear();
+    std::ranges::move(resent_, std::back_inserter(replies));
+    resent_.clear();
+    for (auto& [offset, chunk] : pending_)
+    {
+      replies.push_back(std::move(chunk.reply)); // only there if the ingest failed early
+    }
+    pending_.clear();
+    const Status status = status_;
+    lock.unlock();
+
+    for (Reply& reply : replies)
+    {
+      reply(status, length_);
+    }
+  }
+
+  // Gives up on an unfinished upload; true if there was one to give up on
+  auto abort() -> bool
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (status_ != Status::Received)
+    {
+      return false;
+    }
+    status_ = Status::Failed;
+
+    std::vector<Reply> replies = std::move(finals_);
+    finals_.clear();
+    std::ranges::move(resent_, std::back_inserter(replies));
+    resent_.clear();
+    for (auto& [offset, chunk] : pending_)
+    {
+      replies.push_back(std::move(chunk.reply));
+    }
+    pending_.clear();
+    lock.unlock();
+
+    if (ingest_)
+    {
+      ingest_->abort();
+    }
+    for (Reply& reply : replies)
+    {
+      reply(Status::Failed, 0);
+    }
+    return true;
+  }
+
+  [[nodiscard]] auto idle_for() -> std::chrono::steady_clock::duration
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return Clock::now() - touched_;
+  }
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Chunk
+  {
+    std::string data;
+    Reply       reply;
+  };
+
+  const std::string   id_;
+  const std::string   ip_;
+  const std::uint64_t length_;
+
+  std::shared_ptr<UploadIngest>  ingest_;
+  std::mutex                     mutex_;
+  Status                         status_   = Status::Received;
+  std::uint64_t                  received_ = 0; // bytes handed to the ingest
+  std::uint64_t                  feeding_  = 0; // size of the chunk in UploadIngest::push, if any
+  std::map<std::uint64_t, Chunk> pending_;      // arrived ahead of received_, by offset
+  std::vector<Reply>             resent_;       // copies of the chunk being fed
+  std::vector<Reply>             finals_;       // waiting for the outcome of extraction
+  Clock::time_point              touched_;
+
+  /*
+   * Hands the next chunk in order to the ingest if it is there and the previous one has been
+   * taken. UploadIngest holds at most one resume callback, so only one push is ever open.
+   */
+  void feed(std::unique_lock<std::mutex>& lock)
+  {
+    if (feeding_ > 0 || pending_.empty() || pending_.begin()->first != received_)
+    {
+      return;
+    }
+
+    auto                node = pending_.extract(pending_.begin());
+    const std::uint64_t size = node.mapped().data.size();
+    feeding_                 = size;
+    lock.unlock();
+
+    ingest_->push(std::move(node.mapped().data),
+                  [self = shared_from_this(), size, reply = std::move(node.mapped().reply)]
+                  { self->taken(size, reply); });
+    lock.lock();
+  }
+
+  // The ingest took a chunk and has room for the next
+  void taken(std::uint64_t size, const Reply& reply)
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    feeding_ = 0;
+    received_ += size;
+
+    // Its own answer, its resends', and those of copies that arrived ahead of it
+    std::vector<Reply> replies = std::move(resent_);
+    resent_.clear();
+    replies.push_back(reply);
+    while (!pending_.empty() && pending_.begin()->first < received_)
+    {
+      replies.push_back(std::move(pending_.begin()->second.reply));
+      pending_.erase(pending_.begin());
+    }
+
+    if (status_ != Status::Received)
+    {
+      const Status status = status_; // aborted while the chunk was being pushed
+      lock.unlock();
+      for (const Reply& r : replies)
+      {
+        r(status, 0);
+      }
+      return;
+    }
+    if (received_ == length_)
+    {
+      std::ranges::move(replies, std::back_inserter(finals_));
+      lock.unlock();
+      ingest_->finish(); // its completion calls finished()
+      return;
+    }
+
+    const std::uint64_t received = received_;
+    feed(lock);
+    lock.unlock();
+    for (const Reply& r : replies)
+    {
+      r(Status::Received, received);
+    }
+  }
+};
+
+class ChunkedUploads
+{
+public:
+  void add(const std::shared_ptr<ChunkedUpload>& upload)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uploads_[upload->id()] = upload;
+  }
+
+  // The upload `id` of owner `ip`, after forgetting every expired upload
+  auto find(const std::string& id, const std::string& ip) -> std::shared_ptr<ChunkedUpload>
+  {
+    std::vector<std::shared_ptr<ChunkedUpload>> expired;
+    std::shared_ptr<ChunkedUpload>              found;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (auto it = uploads_.begin(); it != uploads_.end();)
+      {
+        if (it->second->idle_for() > std::chrono::seconds(WAVY_SERVER_UPLOAD_EXPIRY_S))
+        {
+          expired.push_back(std::move(it->second));
+          it = uploads_.erase(it);
+          continue;
+        }
+        ++it;
+      }
+      if (auto it = uploads_.find(id); it != uploads_.end() && it->second->ip() == ip)
+      {
+        found = it->second;
+      }
+    }
+
+    for (const std::shared_ptr<ChunkedUpload>& upload : expired)
+    {
+      if (upload->abort())
+      {
+        LOG_WARNING << SERVER_UPLD_LOG << "Chunked upload " << upload->id() << " expired";
+      }
+    }
+    return found;
+  }
+
+private:
+  std::mutex                                                      mutex_;
+  std::unordered_map<std::string, std::shared_ptr<ChunkedUpload>> uploads_;
+};
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <algorithm>
+#include <boost/asio/buffer.hpp>
+#include <boost/beast/core/error.hpp>
+#include <boost/beast/core/file.hpp>
+#include <boost/beast/http/error.hpp>
+#include <boost/beast/http/message.hpp>
+#include <boost/optional.hpp>
+#include <cstdint>
+#include <utility>
+
+/*
+ * FILE RANGE BODY
+ *
+ * Beast body that streams one byte range [offset, offset + length) of an open file. It replaces
+ * http::file_body on the download path, which can only ever send a whole file (its size is
+ * the file size and it always reads from the start).
+ *
+ * -> The same body serves plain 200 responses (range = the whole file) and 206 Partial Content
+ *    responses, so a single-file HLS rendition (#EXT-X-BYTERANGE playlists) is served straight
+ *    from the one large file with a seek per request.
+ *
+ * -> Reads go through a fixed-size buffer, like file_body: one bounded buffer per response no
+ *    matter how large the range is, sized to a full TLS record. The kernel page cache keeps
+ *    hot ranges in memory.
+ */
+
+struct file_range_body
+{
+  struct value_type
+  {
+    boost::beast::file file;
+    std::uint64_t      offset = 0;
+    std::uint64_t      length = 0;
+
+    // Opens path for reading and selects [first, first + count) as the body
+    void open(const char* path, std::uint64_t first, std::uint64_t count,
+              boost::beast::error_code& ec)
+    {
+      file.open(path, boost::beast::file_mode::scan, ec);
+      offset = first;
+      length = count;
+    }
+
+    [[nodiscard]] auto is_open() const -> bool { return file.is_open(); }
+  };
+
+  static auto size(const value_type& body) -> std::uint64_t { return body.length; }
+
+  class writer
+  {
+  public:
+    using const_buffers_type = boost::asio::const_buffer;
+
+    template <bool isRequest, class Fields>
+    writer(boost::beast::http::header<isRequest, Fields>&, value_type& body)
+        : body_(body), remaining_(body.length)
+    {
+    }
+
+    void init(boost::beast::error_code& ec) { body_.file.seek(body_.offset, ec); }
+
+    auto get(boost::beast::error_code& ec)
+      -> boost::optional<std::pair<const_buffers_type, bool>>
+    {
+      if (remaining_ == 0)
+      {
+        ec = {};
+        return boost::none;
+      }
+
+      const std::size_t amount =
+        static_cast<std::size_t>(std::min<std::uint64_t>(remaining_, sizeof(buffer_)));
+      const std::size_t n = body_.file.read(buffer_, amount, ec);
+      if (ec)
+      {
+        return boost::none;
+      }
+      if (n == 0)
+      {
+        // The file shrank underneath us; never send fewer bytes than Content-Length promised
+        ec = boost::beast::http::error::short_read;
+        return boost::none;
+      }
+
+      remaining_ -= n;
+      return {{const_buffers_type{buffer_, n}, remaining_ > 0}};
+    }
+
+  private:
+    value_type&   body_;
+    std::uint64_t remaining_;
+    char          buffer_[16 * 1024]; // one full TLS record per read
+  };
+};
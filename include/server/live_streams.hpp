@@ -0,0 +1,189 @@
+#pragma once
+
+#include "../m3u8.hpp"
+#include "../macros.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * LIVE STREAMS
+ *
+ * Tracks that are still being encoded. Instead of an archive at the end, the encoder's HLS
+ * muxer PUTs every file as soon as it is finished:
+ *
+ *   PUT /live/<audio-id>/<file>   a segment, an init segment, or a rewritten playlist
+ *     204                         stored, and listed under /hls/<owner>/<audio-id>/<file>
+ *
+ * The media playlists are EVENT playlists: every PUT of one lists the segments of the one
+ * before plus the segments finished since, and the last one ends with #EXT-X-ENDLIST.
+ *
+ * -> Receivers reload a live playlist with `?_HLS_msn=<n>` (LL-HLS blocking playlist reload).
+ *    The request is held until the playlist lists media sequence number n, so a receiver learns
+ *    about a new segment the moment its playlist update arrives instead of polling for it.
+ *
+ * -> A request is held for at most three target durations (WAVY_SERVER_LIVE_HOLD_MAX_S at
+ *    most) and is then answered with the playlist as it is. One asking for a number past the
+ *    last listed one plus two is rejected, as LL-HLS has it.
+ *
+ * -> Only playlists are tracked here, from their first PUT until they end. Segments need no
+ *    bookkeeping: a playlist only lists them once they are stored. A playlist whose encoder
+ *    went away without ending it is dropped after WAVY_SERVER_LIVE_IDLE_TARGETS target
+ *    durations without a PUT; reloads still held on it are answered by their timeout.
+ */
+
+class LiveStreams
+{
+public:
+  using Waiter = std::function<void()>;
+
+  struct Hold
+  {
+    enum class Kind
+    {
+      Now,    // listed already, or not a live playlist: answer right away
+      Held,   // `waiter` is called once it is listed, unless cancel(key, id) comes first
+      TooFar, // past the last listed number plus two: 400
+    };
+    Kind                      kind = Kind::Now;
+    std::uint64_t             id   = 0;
+    std::chrono::milliseconds timeout{0};
+  };
+
+  // Records a stored playlist (key as in SegmentCache::make_key) and wakes what it lists
+  void published(const std::string& key, const m3u8::Playlist& playlist)
+  {
+    std::vector<Waiter> ready;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      prune();
+      auto it = playlists_.find(key);
+      if (playlist.end_list)
+      {
+        if (it == playlists_.end())
+        {
+          return; // ended with its first PUT, nobody is waiting
+        }
+        for (Waiting& waiting : it->second.waiting)
+        {
+          ready.push_back(std::move(waiting.waiter));
+        }
+        playlists_.erase(it);
+      }
+      else
+      {
+        Playlist& entry       = it != playlists_.end() ? it->second : playlists_[key];
+        entry.next_sequence   = playlist.next_sequence();
+        entry.target_duration = playlist.target_duration;
+        entry.published_at    = Clock::now();
+
+        auto listed = std::stable_partition(entry.waiting.begin(), entry.waiting.end(),
+                                            [&](const Waiting& waiting)
+                                            { return waiting.sequence >= entry.next_sequence; });
+        for (auto w = listed; w != entry.waiting.end(); ++w)
+        {
+          ready.push_back(std::move(w->waiter));
+        }
+        entry.waiting.erase(listed, entry.waiting.end());
+      }
+    }
+
+    for (Waiter& waiter : ready)
+    {
+      waiter();
+    }
+  }
+
+  // Holds a reload of `key` until it lists media sequence number `sequence`
+  auto hold(const std::string& key, std::uint64_t sequence, Waiter waiter) -> Hold
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    prune();
+    auto it = playlists_.find(key);
+    if (it == playlists_.end() || sequence < it->second.next_sequence)
+    {
+      return {};
+    }
+
+    Playlist& entry = it->second;
+    if (sequence > entry.next_sequence + 1) // next_sequence is one past the last listed
+    {
+      return {Hold::Kind::TooFar};
+    }
+
+    const auto limit   = std::chrono::seconds(WAVY_SERVER_LIVE_HOLD_MAX_S);
+    const auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::min<std::chrono::duration<double>>(
+        limit, std::chrono::duration<double>(3 * std::max(entry.target_duration, 1.0))));
+
+    const std::uint64_t id = ++last_id_;
+    entry.waiting.push_back({id, sequence, std::move(waiter)});
+    return {Hold::Kind::Held, id, timeout};
+  }
+
+  // Drops a held reload that timed out; its waiter is not called
+  void cancel(const std::string& key, std::uint64_t id)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (auto it = playlists_.find(key); it != playlists_.end())
+    {
+      std::erase_if(it->second.waiting, [id](const Waiting& waiting) { return waiting.id == id; });
+    }
+  }
+
+  // Whether `key` is a playlist still being written (not to be cached)
+  [[nodiscard]] auto is_live(const std::string& key) -> bool
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    prune();
+    return playlists_.contains(key);
+  }
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Waiting
+  {
+    std::uint64_t id;
+    std::uint64_t sequence;
+    Waiter        waiter;
+  };
+
+  struct Playlist
+  {
+    std::uint64_t        next_sequence   = 0;
+    double               target_duration = 0.0;
+    Clock::time_point    published_at;
+    std::vector<Waiting> waiting;
+  };
+
+  std::mutex                                mutex_;
+  std::unordered_map<std::string, Playlist> playlists_;
+  std::uint64_t                             last_id_ = 0;
+  Clock::time_point                         pruned_at_;
+
+  // Drops abandoned playlists; at most once a second, called with the lock held
+  void prune()
+  {
+    const Clock::time_point now = Clock::now();
+    if (now - pruned_at_ < std::chrono::seconds(1))
+    {
+      return;
+    }
+    pruned_at_ = now;
+
+    std::erase_if(playlists_,
+                  [now](const auto& item)
+                  {
+                    const Playlist& entry = item.second;
+                    const auto      idle  = std::chrono::duration<double>(
+                      WAVY_SERVER_LIVE_IDLE_TARGETS * std::max(entry.target_duration, 1.0));
+                    return now - entry.published_at > idle;
+                  });
+  }
+};
@@ -0,0 +1,300 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+#include "segment_cache.hpp"
+
+/*
+ * SERVER METRICS
+ *
+ * Lock-free counters and latency histograms for the hot paths, rendered on GET /metrics in the
+ * Prometheus text exposition format.
+ *
+ * -> Recording is one relaxed fetch_add on a cache-line aligned shard picked once per thread, so
+ *    io_context threads and extraction workers never share a line while counting. Only a scrape
+ *    walks (and sums) every shard.
+ *
+ * -> Histograms are log-linear (HDR style): every power of two of microseconds is split into
+ *    kSubBuckets equal buckets, which bounds the relative error of any bucket to 1 / kSubBuckets
+ *    (12.5%) from 1us up to 2^28us (~4.5 minutes) with a fixed number of buckets.
+ *
+ * -> Nothing here formats a string or takes a lock on the recording side, unlike a log line.
+ */
+
+namespace metrics
+{
+
+enum class Counter : std::size_t
+{
+  Requests,
+  BytesServed,
+  Responses2xx,
+  Responses3xx,
+  Responses4xx,
+  Responses5xx,
+  SessionsOpened,
+  SessionsClosed,
+  HandshakeFailures,
+  UploadsStored,
+  UploadsFailed,
+  UploadsRejected,
+  Count
+};
+
+enum class Histogram : std::size_t
+{
+  Handshake,       // accept -> TLS handshake done
+  RequestHeader,   // handshake done -> first request header parsed
+  TimeToFirstByte, // request parsed -> response write started
+  UploadExtract,   // upload header -> every entry extracted and stored
+  UploadValidate,  // validation of one extracted entry
+  Count
+};
+
+struct Family
+{
+  std::string_view name;
+  std::string_view labels; // "" or `key="value"`
+  std::string_view help;
+};
+
+inline constexpr std::array<Family, static_cast<std::size_t>(Counter::Count)>
+  kCounterFamilies{{
+  {"wavy_requests_total", "", "HTTP requests parsed."},
+  {"wavy_served_bytes_total", "", "Response bytes written to clients (headers included)."},
+  {"wavy_responses_total", "code=\"2xx\"", "HTTP responses by status class."},
+  {"wavy_responses_total", "code=\"3xx\"", ""},
+  {"wavy_responses_total", "code=\"4xx\"", ""},
+  {"wavy_responses_total", "code=\"5xx\"", ""},
+  {"wavy_sessions_opened_total", "", "Accepted connections."},
+  {"wavy_sessions_closed_total", "", "Connections that ended."},
+  {"wavy_tls_handshake_failures_total", "", "Connections dropped during the TLS handshake."},
+  {"wavy_uploads_total", "result=\"stored\"", "Payload uploads by outcome."},
+  {"wavy_uploads_total", "result=\"failed\"", ""},
+  {"wavy_uploads_total", "result=\"rejected\"", ""},
+}};
+
+inline constexpr std::array<Family, static_cast<std::size_t>(Histogram::Count)>
+  kHistogramFamilies{{
+  {"wavy_tls_handshake_seconds", "", "Time from accept to a completed TLS handshake."},
+  {"wavy_request_header_seconds", "",
+   "Time from the handshake to the first parsed request header of a connection."},
+  {"wavy_time_to_first_byte_seconds", "",
+   "Time from a parsed request to the start of its response write."},
+  {"wavy_upload_extract_seconds", "", "Time to receive, extract and store a whole upload."},
+  {"wavy_upload_validate_seconds", "", "Time to validate one extracted upload entry."},
+}};
+
+// Log-linear bucketing of microsecond values
+inline constexpr unsigned int  kSubBucketBits = 3; // 8 buckets per power of two, 12.5% error
+inline constexpr std::uint64_t kSubBuckets    = 1ULL << kSubBucketBits;
+inline constexpr unsigned int  kMaxShift      = 27 - kSubBucketBits; // top bucket ends at 2^28us
+inline constexpr std::size_t   kBuckets       = (kMaxShift + 2) * kSubBuckets + 1; // +overflow
+
+inline auto bucket_index(std::uint64_t us) -> std::size_t
+{
+  if (us < kSubBuckets)
+  {
+    return static_cast<std::size_t>(us);
+  }
+  const unsigned int shift = static_cast<unsigned int>(std::bit_width(us)) - 1 - kSubBucketBits;
+  if (shift > kMaxShift)
+  {
+    return kBuckets - 1;
+  }
+  return (shift + 1) * kSubBuckets + static_cast<std::size_t>((us >> shift) - kSubBuckets);
+}
+
+// Exclusive upper bound (in us) of a bucket that is not the overflow bucket
+inline auto bucket_upper_bound(std::size_t index) -> std::uint64_t
+{
+  if (index < kSubBuckets)
+  {
+    return index + 1;
+  }
+  const std::size_t shift = index / kSubBuckets - 1;
+  return (index % kSubBuckets + kSubBuckets + 1) << shift;
+}
+
+class Registry
+{
+public:
+  Registry()                                   = default;
+  Registry(const Registry&)                    = delete;
+  auto operator=(const Registry&) -> Registry& = delete;
+
+  void add(Counter counter, std::uint64_t n = 1)
+  {
+    local().counters[static_cast<std::size_t>(counter)].fetch_add(n, std::memory_order_relaxed);
+  }
+
+  void observe(Histogram histogram, std::chrono::steady_clock::duration elapsed)
+  {
+    using std::chrono::microseconds;
+    const std::int64_t  us    = std::chrono::duration_cast<microseconds>(elapsed).count();
+    const std::uint64_t value = us < 0 ? 0 : static_cast<std::uint64_t>(us);
+
+    HistogramShard& shard = local().histograms[static_cast<std::size_t>(histogram)];
+    shard.buckets[bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+    shard.sum_us.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  // Counts a response by its status code
+  void add_response(unsigned int status)
+  {
+    switch (status / 100)
+    {
+      case 2:
+        add(Counter::Responses2xx);
+        break;
+      case 3:
+        add(Counter::Responses3xx);
+        break;
+      case 4:
+        add(Counter::Responses4xx);
+        break;
+      default:
+        add(Counter::Responses5xx);
+        break;
+    }
+  }
+
+  // Prometheus text format (version 0.0.4) of everything, plus the segment cache's own counters
+  [[nodiscard]] auto render(const SegmentCacheStats& cache) const -> std::string
+  {
+    std::string out;
+    out.reserve(8192);
+
+    std::string_view previous;
+    for (std::size_t i = 0; i < kCounterFamilies.size(); ++i)
+    {
+      const Family& family = kCounterFamilies[i];
+      if (family.name != previous)
+      {
+        write_meta(out, family, "counter");
+        previous = family.name;
+      }
+      write_sample(out, family.name, "", family.labels, total(static_cast<Counter>(i)));
+    }
+
+    const std::uint64_t opened = total(Counter::SessionsOpened);
+    const std::uint64_t closed = total(Counter::SessionsClosed);
+    write_meta(out, {"wavy_active_sessions", "", "Connections currently open."}, "gauge");
+    write_sample(out, "wavy_active_sessions", "", "", opened > closed ? opened - closed : 0);
+
+    write_meta(out, {"wavy_cache_hits_total", "", "Segment cache hits."}, "counter");
+    write_sample(out, "wavy_cache_hits_total", "", "", cache.hits);
+    write_meta(out, {"wavy_cache_misses_total", "", "Segment cache misses."}, "counter");
+    write_sample(out, "wavy_cache_misses_total", "", "", cache.misses);
+    write_meta(out, {"wavy_cache_evictions_total", "", "Segment cache evictions."}, "counter");
+    write_sample(out, "wavy_cache_evictions_total", "", "", cache.evictions);
+    write_meta(out, {"wavy_cache_bytes", "", "Bytes held by the segment cache."}, "gauge");
+    write_sample(out, "wavy_cache_bytes", "", "", cache.bytes);
+    write_meta(out, {"wavy_cache_entries", "", "Entries held by the segment cache."}, "gauge");
+    write_sample(out, "wavy_cache_entries", "", "", cache.entries);
+
+    for (std::size_t h = 0; h < kHistogramFamilies.size(); ++h)
+    {
+      write_histogram(out, kHistogramFamilies[h], h);
+    }
+
+    return out;
+  }
+
+private:
+  static constexpr std::size_t kShards = 32;
+
+  struct HistogramShard
+  {
+    std::array<std::atomic<std::uint64_t>, kBuckets> buckets{};
+    std::atomic<std::uint64_t>                       sum_us{0};
+  };
+
+  struct alignas(64) Shard
+  {
+    std::array<std::atomic<std::uint64_t>, static_cast<std::size_t>(Counter::Count)> counters{};
+    std::array<HistogramShard, static_cast<std::size_t>(Histogram::Count)>          histograms{};
+  };
+
+  std::array<Shard, kShards> shards_{};
+  std::atomic<std::size_t>   next_shard_{0};
+
+  // Every thread is pinned to one shard the first time it records anything
+  auto local() -> Shard&
+  {
+    thread_local const std::size_t index =
+      next_shard_.fetch_add(1, std::memory_order_relaxed) % kShards;
+    return shards_[index];
+  }
+
+  [[nodiscard]] auto total(Counter counter) const -> std::uint64_t
+  {
+    std::uint64_t sum = 0;
+    for (const Shard& shard : shards_)
+    {
+      sum += shard.counters[static_cast<std::size_t>(counter)].load(std::memory_order_relaxed);
+    }
+    return sum;
+  }
+
+  static void write_meta(std::string& out, const Family& family, std::string_view type)
+  {
+    out.append("# HELP ").append(family.name).append(" ").append(family.help).append("\n");
+    out.append("# TYPE ").append(family.name).append(" ").append(type).append("\n");
+  }
+
+  static void write_sample(std::string& out, std::string_view name, std::string_view suffix,
+                           std::string_view labels, std::uint64_t value)
+  {
+    out.append(name).append(suffix);
+    if (!labels.empty())
+    {
+      out.append("{").append(labels).append("}");
+    }
+    out.append(" ").append(std::to_string(value)).append("\n");
+  }
+
+  void write_histogram(std::string& out, const Family& family, std::size_t index) const
+  {
+    std::array<std::uint64_t, kBuckets> buckets{};
+    std::uint64_t                       sum_us = 0;
+    for (const Shard& shard : shards_)
+    {
+      const HistogramShard& histogram = shard.histograms[index];
+      for (std::size_t b = 0; b < kBuckets; ++b)
+      {
+        buckets[b] += histogram.buckets[b].load(std::memory_order_relaxed);
+      }
+      sum_us += histogram.sum_us.load(std::memory_order_relaxed);
+    }
+
+    write_meta(out, family, "histogram");
+
+    // Values are whole microseconds, so "< upper" is the same as "<= upper - 1us"
+    std::uint64_t cumulative = 0;
+    char          le[32];
+    for (std::size_t b = 0; b + 1 < kBuckets; ++b)
+    {
+      cumulative += buckets[b];
+      std::snprintf(le, sizeof(le), "le=\"%.6f\"",
+                    static_cast<double>(bucket_upper_bound(b) - 1) / 1e6);
+      write_sample(out, family.name, "_bucket", le, cumulative);
+    }
+    cumulative += buckets[kBuckets - 1];
+    write_sample(out, family.name, "_bucket", "le=\"+Inf\"", cumulative);
+
+    char sum[32];
+    std::snprintf(sum, sizeof(sum), "%.6f", static_cast<double>(sum_us) / 1e6);
+    out.append(family.name).append("_sum ").append(sum).append("\n");
+    write_sample(out, family.name, "_count", "", cumulative);
+  }
+};
+
+} // namespace metrics
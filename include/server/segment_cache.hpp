@@ -0,0 +1,223 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * SEGMENT CACHE
+ *
+ * In-memory, size-bounded LRU cache of served HLS files (playlists, transport streams, fMP4
+ * fragments) keyed by "<ip>/<audio_id>/<filename>", or by ".blobs/<hash>" for files stored in
+ * the blob store, so one entry serves every upload of the same content.
+ *
+ * Popular audio-ids are requested by many receivers at once, and nearly all of them start at the
+ * same index.m3u8 and the first few segments. Keeping those in memory means a hit costs no stat,
+ * no open and no read.
+ *
+ * -> Entries are immutable and handed out as shared_ptr<const CachedSegment>, so a session keeps
+ *    its entry alive for the whole async write even if it gets evicted in the meantime.
+ *
+ * -> Every entry carries a preformatted header block (Content-Type, Content-Length, ETag), so a
+ *    hit is written out as raw buffers without going through Beast's serializer at all. A Range
+ *    hit reuses the same lines minus Content-Length and is sliced straight out of the body.
+ *
+ * -> The key space is split over independently locked shards so worker threads rarely contend.
+ *    Each shard gets an equal part of the byte budget and evicts its own least-recently-used
+ *    entries.
+ *
+ * Uploaded content never changes once stored (every upload gets a fresh audio-id), so there is no
+ * revalidation; invalidate_prefix() is called whenever an audio-id is (re)written. Blob keys
+ * never need it: different content is a different hash.
+ */
+
+struct CachedSegment
+{
+  std::string body;
+  std::string etag;
+  std::string common_headers; // Server, Content-Type, ETag and Accept-Ranges lines
+  std::string header_block;   // common_headers followed by the full Content-Length
+
+  CachedSegment(std::string data, std::string_view content_type, std::string entity_tag)
+      : body(std::move(data)), etag(std::move(entity_tag))
+  {
+    common_headers.reserve(128);
+    common_headers.append("Server: Wavy Server\r\nContent-Type: ")
+      .append(content_type)
+      .append("\r\nETag: ")
+      .append(etag)
+      .append("\r\nAccept-Ranges: bytes\r\n");
+    header_block = common_headers + "Content-Length: " + std::to_string(body.size()) + "\r\n";
+  }
+
+  [[nodiscard]] auto footprint() const -> std::size_t
+  {
+    return body.size() + common_headers.size() + header_block.size() + etag.size() +
+           sizeof(CachedSegment);
+  }
+};
+
+using CachedSegmentPtr = std::shared_ptr<const CachedSegment>;
+
+struct SegmentCacheStats
+{
+  std::uint64_t hits;
+  std::uint64_t misses;
+  std::uint64_t evictions;
+  std::size_t   bytes;
+  std::size_t   entries;
+};
+
+class SegmentCache
+{
+public:
+  SegmentCache(std::size_t byte_budget, std::size_t max_entry_bytes, std::size_t shard_count = 16)
+      : max_entry_bytes_(max_entry_bytes), shards_(std::max<std::size_t>(1, shard_count))
+  {
+    shard_budget_ = byte_budget / shards_.size();
+  }
+
+  SegmentCache(const SegmentCache&)                    = delete;
+  auto operator=(const SegmentCache&) -> SegmentCache& = delete;
+
+  // Build the cache key of a stored file
+  static auto make_key(std::string_view ip, std::string_view audio_id, std::string_view filename)
+    -> std::string
+  {
+    std::string key;
+    key.reserve(ip.size() + audio_id.size() + filename.size() + 2);
+    key.append(ip).append("/").append(audio_id).append("/").append(filename);
+    return key;
+  }
+
+  // Cache key of a file stored under content hash `hash` (see blob_store.hpp)
+  static auto make_blob_key(std::string_view hash) -> std::string
+  {
+    return std::string(".blobs/").append(hash);
+  }
+
+  // Whether a file of this size is worth caching at all (large fragments are streamed instead)
+  [[nodiscard]] auto admits(std::size_t size) const -> bool
+  {
+    return size <= max_entry_bytes_ && size <= shard_budget_;
+  }
+
+  auto find(const std::string& key) -> CachedSegmentPtr
+  {
+    Shard&                      shard = shard_for(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    auto it = shard.index.find(key);
+    if (it == shard.index.end())
+    {
+      misses_.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+
+    // Move to the front: most recently used
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    hits_.fetch_add(1, std::memory_order_relaxed);
+    return it->second->second;
+  }
+
+  void insert(const std::string& key, CachedSegmentPtr segment)
+  {
+    if (!segment || !admits(segment->body.size()))
+    {
+      return;
+    }
+
+    Shard&                      shard = shard_for(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    if (auto it = shard.index.find(key); it != shard.index.end())
+    {
+      shard.bytes -= it->second->second->footprint();
+      shard.lru.erase(it->second);
+      shard.index.erase(it);
+    }
+
+    shard.bytes += segment->footprint();
+    shard.lru.emplace_front(key, std::move(segment));
+    shard.index[key] = shard.lru.begin();
+
+    while (shard.bytes > shard_budget_ && shard.lru.size() > 1)
+    {
+      auto& victim = shard.lru.back();
+      shard.bytes -= victim.second->footprint();
+      shard.index.erase(victim.first);
+      shard.lru.pop_back();
+      evictions_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  // Drop every entry whose key starts with prefix (e.g. "<ip>/<audio_id>/")
+  void invalidate_prefix(std::string_view prefix)
+  {
+    for (Shard& shard : shards_)
+    {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      for (auto it = shard.lru.begin(); it != shard.lru.end();)
+      {
+        if (std::string_view(it->first).starts_with(prefix))
+        {
+          shard.bytes -= it->second->footprint();
+          shard.index.erase(it->first);
+          it = shard.lru.erase(it);
+        }
+        else
+        {
+          ++it;
+        }
+      }
+    }
+  }
+
+  [[nodiscard]] auto stats() -> SegmentCacheStats
+  {
+    SegmentCacheStats result{hits_.load(std::memory_order_relaxed),
+                             misses_.load(std::memory_order_relaxed),
+                             evictions_.load(std::memory_order_relaxed), 0, 0};
+
+    for (Shard& shard : shards_)
+    {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      result.bytes += shard.bytes;
+      result.entries += shard.lru.size();
+    }
+
+    return result;
+  }
+
+private:
+  using Entry = std::pair<std::string, CachedSegmentPtr>;
+
+  struct Shard
+  {
+    std::mutex                                                  mutex;
+    std::list<Entry>                                            lru;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    std::size_t                                                 bytes = 0;
+  };
+
+  std::size_t        max_entry_bytes_;
+  std::size_t        shard_budget_ = 0;
+  std::vector<Shard> shards_;
+
+  std::atomic<std::uint64_t> hits_{0};
+  std::atomic<std::uint64_t> misses_{0};
+  std::atomic<std::uint64_t> evictions_{0};
+
+  auto shard_for(const std::string& key) -> Shard&
+  {
+    return shards_[std::hash<std::string>{}(key) % shards_.size()];
+  }
+};
@@ -0,0 +1,542 @@
+#pragma once
+
+#include "../logger.hpp"
+#include "../macros.hpp"
+#include "blob_store.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <dirent.h>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <vector>
+
+/*
+ * STORAGE CATALOG
+ *
+ * In-memory index of hls_storage/ (owner ip -> audio-id -> stored files with size and mtime).
+ *
+ * Listing requests used to walk the whole storage tree with a stat per directory, so their cost
+ * grew with every upload. The catalog is built once at startup and then kept up to date by the
+ * upload path (add_audio()), so a listing never touches the filesystem.
+ *
+ * -> Startup: the snapshot file (hls_storage/.catalog) written at the previous shutdown is
+ *    loaded and checked against the mtime of every owner directory currently on disk.
+ *    Only owner directories whose mtime changed (or that are new) are rescanned, so a restart
+ *    costs one stat per owner instead of a full tree walk. Stored audio directories are never
+ *    modified after their upload, so the owner directory mtime is enough to catch changes.
+ *
+ * -> Listing: the text reply ("<ip>:\n  - <audio-id>\n") for the whole catalog and for each
+ *    owner is serialized once and kept until the next change, so the common requests are
+ *    served from a shared string. Paginated requests are rendered from the index directly.
+ *
+ * -> Every file carries the content hash its upload's manifest gives it (see blob_store.hpp),
+ *    which blob_of() looks up for the download path.
+ *
+ * -> Every audio-id with a metadata.toml carries its JSON projection (see track_metadata.hpp),
+ *    which metadata() hands out as a shared string. Storing metadata for an audio-id stored
+ *    earlier touches its owner directory, so the snapshot check still catches it.
+ *
+ * -> An upload's audio-id directory holds an .incomplete marker until the upload has been
+ *    stored. Marked directories are never indexed; load() hands back the ones it finds (left
+ *    by a crash mid-upload) so the caller can remove them.
+ *
+ * -> Readers take a shared lock, add_audio() an exclusive one; both are short.
+ */
+
+struct CatalogFile
+{
+  std::string   name;
+  std::uint64_t size;
+  std::int64_t  mtime;
+  std::string   blob; // content hash, empty if stored without one
+};
+
+struct CatalogAudio
+{
+  std::vector<CatalogFile>           files; // by name
+  std::shared_ptr<const std::string> meta;  // JSON projection of its metadata.toml, if any
+};
+
+struct CatalogOwner
+{
+  std::int64_t                        mtime = 0; // of the owner directory when it was scanned
+  std::map<std::string, CatalogAudio> audios;
+
+  mutable std::shared_ptr<const std::string> listing; // serialized reply, built on demand
+};
+
+// One page of the listing
+struct CatalogPage
+{
+  std::shared_ptr<const std::string> body;
+  std::size_t                        total; // audio-ids matching the filter, across all pages
+};
+
+class StorageCatalog
+{
+public:
+  explicit StorageCatalog(std::string root)
+      : root_(std::move(root)), snapshot_path_(root_ + "/.catalog")
+  {
+  }
+
+  StorageCatalog(const StorageCatalog&)                    = delete;
+  auto operator=(const StorageCatalog&) -> StorageCatalog& = delete;
+
+  /*
+   * Populates the catalog from the snapshot, rescanning whatever changed since it was written.
+   * Returns the directories of unfinished uploads found while rescanning.
+   */
+  auto load() -> std::vector<std::string>
+  {
+    std::vector<std::string> unfinished;
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+
+    std::map<std::string, CatalogOwner> snapshot;
+    const bool                          have_snapshot = read_snapshot(snapshot);
+    std::size_t                         rescanned     = 0;
+
+    owners_.clear();
+    for (const std::string& ip : list_dirs(root_))
+    {
+      const std::string path  = root_ + "/" + ip;
+      const auto        mtime = mtime_of(path);
+      auto              it    = snapshot.find(ip);
+
+      if (it != snapshot.end() && mtime && it->second.mtime == *mtime)
+      {
+        owners_.emplace(ip, std::move(it->second));
+        continue;
+      }
+
+      CatalogOwner owner;
+      owner.mtime = mtime.value_or(0);
+      for (const std::string& audio_id : list_dirs(path))
+      {
+        if (is_unfinished(path + "/" + audio_id))
+        {
+          unfinished.push_back(path + "/" + audio_id);
+          continue;
+        }
+        owner.audios.emplace(audio_id, scan_audio(path + "/" + audio_id));
+      }
+      owners_.emplace(ip, std::move(owner));
+      ++rescanned;
+    }
+
+    invalidate_listings();
+    dirty_ = rescanned > 0 || !have_snapshot;
+
+    LOG_INFO << "[Catalog] Indexed " << owners_.size() << " owner(s) ("
+             << (have_snapshot ? "snapshot" : "no snapshot") << ", " << rescanned
+             << " rescanned)";
+    return unfinished;
+  }
+
+  // Writes the snapshot if anything changed since it was loaded
+  auto persist() -> bool
+  {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    if (!dirty_)
+    {
+      return true;
+    }
+
+    const std::string tmp_path = snapshot_path_ + ".tmp";
+    {
+      std::ofstream out(tmp_path, std::ios::trunc);
+      out << kSnapshotMagic << "\n";
+      for (const auto& [ip, owner] : owners_)
+      {
+        out << "I " << owner.mtime << " " << ip << "\n";
+        for (const auto& [audio_id, audio] : owner.audios)
+        {
+          out << "A " << audio_id << "\n";
+          if (audio.meta)
+          {
+            out << "M " << *audio.meta << "\n";
+          }
+          for (const CatalogFile& file : audio.files)
+          {
+            out << "F " << file.size << " " << file.mtime << " "
+                << (file.blob.empty() ? "-" : file.blob) << " " << file.name << "\n";
+          }
+        }
+      }
+      if (!out.good())
+      {
+        LOG_ERROR << "[Catalog] Failed to write snapshot: " << tmp_path;
+        return false;
+      }
+    }
+
+    if (std::rename(tmp_path.c_str(), snapshot_path_.c_str()) != 0)
+    {
+      LOG_ERROR << "[Catalog] Failed to replace snapshot: " << snapshot_path_;
+      return false;
+    }
+
+    dirty_ = false;
+    return true;
+  }
+
+  // Records a freshly stored audio-id (scans only that one directory)
+  void add_audio(const std::string& ip, const std::string& audio_id)
+  {
+    const std::string owner_path = root_ + "/" + ip;
+    if (is_unfinished(owner_path + "/" + audio_id))
+    {
+      return;
+    }
+    CatalogAudio      audio      = scan_audio(owner_path + "/" + audio_id);
+    const auto        mtime      = mtime_of(owner_path);
+
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    CatalogOwner&                       owner = owners_[ip];
+    owner.mtime                               = mtime.value_or(0);
+    owner.audios[audio_id]                    = std::move(audio);
+    owner.listing.reset();
+    invalidate_listings();
+    dirty_ = true;
+  }
+
+  // Content hash of a stored file; empty if it is not in the catalog or has none
+  auto blob_of(const std::string& ip, const std::string& audio_id, std::string_view name) const
+    -> std::string
+  {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto                                owner = owners_.find(ip);
+    if (owner == owners_.end())
+    {
+      return {};
+    }
+    auto audio = owner->second.audios.find(audio_id);
+    if (audio == owner->second.audios.end())
+    {
+      return {};
+    }
+
+    const std::vector<CatalogFile>& files = audio->second.files;
+
+    auto file = std::ranges::lower_bound(files, name, {}, &CatalogFile::name);
+    return file != files.end() && file->name == name ? file->blob : std::string{};
+  }
+
+  // JSON projection of an audio-id's metadata; nullptr if it has none
+  auto metadata(const std::string& ip, const std::string& audio_id) const
+    -> std::shared_ptr<const std::string>
+  {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto                                owner = owners_.find(ip);
+    if (owner == owners_.end())
+    {
+      return nullptr;
+    }
+    auto audio = owner->second.audios.find(audio_id);
+    return audio != owner->second.audios.end() ? audio->second.meta : nullptr;
+  }
+
+  /*
+   * Renders the listing, optionally restricted to one owner and paginated over audio-ids.
+   * Returns std::nullopt if the catalog (or the requested owner) is empty.
+   */
+  auto listing(const std::optional<std::string>& ip, std::size_t offset,
+               std::optional<std::size_t> limit) const -> std::optional<CatalogPage>
+  {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+
+    if (ip)
+    {
+      auto it = owners_.find(*ip);
+      if (it == owners_.end())
+      {
+        return std::nullopt;
+      }
+
+      const CatalogOwner& owner = it->second;
+      if (offset == 0 && !limit)
+      {
+        std::lock_guard<std::mutex> render_lock(render_mutex_);
+        if (!owner.listing)
+        {
+          owner.listing = std::make_shared<const std::string>(render_owner(*ip, owner, 0, {}));
+        }
+        return CatalogPage{owner.listing, owner.audios.size()};
+      }
+
+      auto page = std::make_shared<const std::string>(render_owner(*ip, owner, offset, limit));
+      return CatalogPage{std::move(page), owner.audios.size()};
+    }
+
+    if (owners_.empty())
+    {
+      return std::nullopt;
+    }
+
+    std::size_t total = 0;
+    for (const auto& [owner_ip, owner] : owners_)
+    {
+      total += owner.audios.size();
+    }
+
+    if (offset == 0 && !limit)
+    {
+      std::lock_guard<std::mutex> render_lock(render_mutex_);
+      if (!full_listing_)
+      {
+        std::string body;
+        for (const auto& [owner_ip, owner] : owners_)
+        {
+          body += render_owner(owner_ip, owner, 0, {});
+        }
+        full_listing_ = std::make_shared<const std::string>(std::move(body));
+      }
+      return CatalogPage{full_listing_, total};
+    }
+
+    // Pagination runs over (owner, audio-id) pairs in catalog order
+    std::string body;
+    std::size_t skip = offset;
+    std::size_t left = limit.value_or(total);
+    for (const auto& [owner_ip, owner] : owners_)
+    {
+      if (left == 0)
+      {
+        break;
+      }
+      if (owner.audios.empty())
+      {
+        continue;
+      }
+      if (skip >= owner.audios.size())
+      {
+        skip -= owner.audios.size();
+        continue;
+      }
+      const std::size_t take = std::min(left, owner.audios.size() - skip);
+      body += render_owner(owner_ip, owner, skip, take);
+      left -= take;
+      skip = 0;
+    }
+
+    return CatalogPage{std::make_shared<const std::string>(std::move(body)), total};
+  }
+
+private:
+  static constexpr std::string_view kSnapshotMagic = "WAVY-CATALOG 3";
+
+  std::string                         root_;
+  std::string                         snapshot_path_;
+  mutable std::shared_mutex           mutex_;
+  std::map<std::string, CatalogOwner> owners_;
+  bool                                dirty_ = false;
+
+  // Serialized replies are built lazily under a shared lock, hence their own mutex
+  mutable std::mutex                         render_mutex_;
+  mutable std::shared_ptr<const std::string> full_listing_;
+
+  void invalidate_listings()
+  {
+    std::lock_guard<std::mutex> render_lock(render_mutex_);
+    full_listing_.reset();
+  }
+
+  static auto render_owner(const std::string& ip, const CatalogOwner& owner, std::size_t offset,
+                           std::optional<std::size_t> limit) -> std::string
+  {
+    std::string body = ip + ":\n"; // IP-ID Header
+    if (owner.audios.empty())
+    {
+      body += "  (No audio IDs found)\n";
+      return body;
+    }
+
+    std::size_t index = 0;
+    std::size_t taken = 0;
+    for (const auto& [audio_id, audio] : owner.audios)
+    {
+      if (index++ < offset)
+      {
+        continue;
+      }
+      if (limit && taken++ >= *limit)
+      {
+        break;
+      }
+      body.append("  - ").append(audio_id).append("\n"); // Audio-ID
+    }
+    return body;
+  }
+
+  static auto mtime_of(const std::string& path) -> std::optional<std::int64_t>
+  {
+    struct stat st{};
+    if (::stat(path.c_str(), &st) != 0)
+    {
+      return std::nullopt;
+    }
+    return static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec;
+  }
+
+  // Subdirectory names of path (d_type avoids a stat per entry on every common filesystem)
+  static auto list_dirs(const std::string& path) -> std::vector<std::string>
+  {
+    std::vector<std::string> dirs;
+    DIR*                     dir = ::opendir(path.c_str());
+    if (!dir)
+    {
+      return dirs;
+    }
+
+    while (const struct dirent* entry = ::readdir(dir))
+    {
+      const std::string_view name = entry->d_name;
+      if (name.starts_with("."))
+      {
+        continue;
+      }
+
+      bool is_dir = entry->d_type == DT_DIR;
+      if (entry->d_type == DT_UNKNOWN)
+      {
+        struct stat st{};
+        is_dir = ::stat((path + "/" + entry->d_name).c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+      }
+      if (is_dir)
+      {
+        dirs.emplace_back(name);
+      }
+    }
+
+    ::closedir(dir);
+    return dirs;
+  }
+
+  static auto is_unfinished(const std::string& path) -> bool
+  {
+    const std::string marker = path + "/" + macros::to_string(macros::SERVER_INCOMPLETE_FILE);
+    struct stat       st{};
+    return ::stat(marker.c_str(), &st) == 0;
+  }
+
+  static auto scan_audio(const std::string& path) -> CatalogAudio
+  {
+    CatalogAudio audio;
+    DIR*         dir = ::opendir(path.c_str());
+    if (!dir)
+    {
+      return audio;
+    }
+
+    std::map<std::string, std::string> blobs;
+    for (BlobStore::Entry& entry : BlobStore::read_manifest(path))
+    {
+      blobs[std::move(entry.name)] = std::move(entry.hash);
+    }
+
+    while (const struct dirent* entry = ::readdir(dir))
+    {
+      if (entry->d_name[0] == '.')
+      {
+        continue;
+      }
+
+      struct stat st{};
+      if (::stat((path + "/" + entry->d_name).c_str(), &st) == 0 && S_ISREG(st.st_mode))
+      {
+        auto blob = blobs.find(entry->d_name);
+        audio.files.push_back({entry->d_name, static_cast<std::uint64_t>(st.st_size),
+                               static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000LL +
+                                 st.st_mtim.tv_nsec,
+                               blob != blobs.end() ? std::move(blob->second) : std::string{}});
+      }
+    }
+
+    ::closedir(dir);
+    std::ranges::sort(audio.files, {}, &CatalogFile::name);
+
+    if (std::ifstream meta(path + "/" + macros::to_string(macros::SERVER_META_JSON_FILE)); meta)
+    {
+      audio.meta = std::make_shared<const std::string>(std::istreambuf_iterator<char>(meta),
+                                                       std::istreambuf_iterator<char>());
+    }
+    return audio;
+  }
+
+  auto read_snapshot(std::map<std::string, CatalogOwner>& snapshot) const -> bool
+  {
+    std::ifstream in(snapshot_path_);
+    std::string   line;
+    if (!in || !std::getline(in, line) || line != kSnapshotMagic)
+    {
+      return false;
+    }
+
+    CatalogOwner* owner = nullptr;
+    CatalogAudio* audio = nullptr;
+    while (std::getline(in, line))
+    {
+      std::istringstream fields(line);
+      char               kind = 0;
+      fields >> kind;
+
+      if (kind == 'I')
+      {
+        std::int64_t mtime = 0;
+        std::string  ip;
+        fields >> mtime >> ip;
+        owner        = &snapshot[ip];
+        owner->mtime = mtime;
+        audio        = nullptr;
+      }
+      else if (kind == 'A' && owner)
+      {
+        std::string audio_id;
+        fields >> audio_id;
+        audio = &owner->audios[audio_id];
+      }
+      else if (kind == 'F' && audio)
+      {
+        CatalogFile file{};
+        fields >> file.size >> file.mtime >> file.blob;
+        fields.get(); // separator; the name is the rest of the line
+        std::getline(fields, file.name);
+        if (file.blob == "-")
+        {
+          file.blob.clear();
+        }
+        audio->files.push_back(std::move(file));
+      }
+      else if (kind == 'M' && audio)
+      {
+        std::string meta;
+        fields.get(); // separator; the JSON is the rest of the line
+        std::getline(fields, meta);
+        audio->meta = std::make_shared<const std::string>(std::move(meta));
+      }
+      else
+      {
+        LOG_WARNING << "[Catalog] Ignoring malformed snapshot, rescanning storage";
+        snapshot.clear();
+        return false;
+      }
+
+      if (fields.fail())
+      {
+        snapshot.clear();
+        return false;
+      }
+    }
+
+    return true;
+  }
+};
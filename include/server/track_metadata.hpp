@@ -0,0 +1,188 @@
+#pragma once
+
+#include "../logger.hpp"
+#include "../macros.hpp"
+#include "../toml/toml_parser.hpp"
+#include <cstdio>
+#include <exception>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <string_view>
+
+/*
+ * TRACK METADATA
+ *
+ * The metadata.toml the encoder writes next to a track's playlists (see registry.hpp), and the
+ * JSON projection of it the server keeps in the catalog:
+ *
+ *   hls_storage/<ip>/<audio-id>/metadata.toml   as uploaded, downloadable like any other file
+ *   hls_storage/<ip>/<audio-id>/.meta.json      {"title":"...","artist":"...",...}
+ *
+ *   GET /hls/<ip>/<audio-id>/meta               the JSON, from memory
+ *
+ * -> The TOML is parsed once, when it is stored, instead of by every receiver that wants to show
+ *    a library: the projection has the fields a listing needs and nothing else, and is served
+ *    as one shared string per track.
+ *
+ * -> Fields that are empty (or -1) in the TOML are left out of the JSON.
+ */
+
+namespace track_metadata
+{
+
+// Parses a metadata.toml; std::nullopt if it is not one
+inline auto parse(std::string_view text) -> std::optional<AudioMetadata>
+{
+  try
+  {
+    AudioMetadata metadata = parseAudioMetadataFromDataString(text);
+    if (metadata.path.empty())
+    {
+      return std::nullopt;
+    }
+    return metadata;
+  }
+  catch (const std::exception& e)
+  {
+    LOG_WARNING << "[TOML] Failed to parse metadata: " << e.what();
+    return std::nullopt;
+  }
+}
+
+// One JSON object, built up field by field
+class JsonObject
+{
+public:
+  void add(std::string_view key, std::string_view value)
+  {
+    if (value.empty())
+    {
+      return;
+    }
+    append_key(key);
+    append_string(value);
+  }
+
+  void add(std::string_view key, int value)
+  {
+    if (value < 0)
+    {
+      return;
+    }
+    append_key(key);
+    text_ += std::to_string(value);
+  }
+
+  // "n/total" fields (track, disc) as [n, total]; total is 0 when the TOML has none
+  void add(std::string_view key, const std::pair<int, int>& value)
+  {
+    if (value.first <= 0)
+    {
+      return;
+    }
+    append_key(key);
+    text_ += "[" + std::to_string(value.first) + "," + std::to_string(value.second) + "]";
+  }
+
+  auto str() && -> std::string
+  {
+    text_ += "}";
+    return std::move(text_);
+  }
+
+private:
+  std::string text_ = "{";
+
+  void append_key(std::string_view key)
+  {
+    if (text_.size() > 1)
+    {
+      text_ += ",";
+    }
+    append_string(key);
+    text_ += ":";
+  }
+
+  // Control characters are escaped too, so the projection always stays on one line
+  void append_string(std::string_view value)
+  {
+    text_ += '"';
+    for (const char c : value)
+    {
+      if (c == '"' || c == '\\')
+      {
+        text_ += '\\';
+        text_ += c;
+      }
+      else if (static_cast<unsigned char>(c) < 0x20)
+      {
+        char escaped[8];
+        std::snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned>(c));
+        text_ += escaped;
+      }
+      else
+      {
+        text_ += c;
+      }
+    }
+    text_ += '"';
+  }
+};
+
+inline auto to_json(const AudioMetadata& metadata) -> std::string
+{
+  JsonObject json;
+  json.add("title", metadata.title);
+  json.add("artist", metadata.artist);
+  json.add("album", metadata.album);
+  json.add("album_artist", metadata.album_artist);
+  json.add("genre", metadata.genre);
+  json.add("date", metadata.date);
+  json.add("track", metadata.track);
+  json.add("disc", metadata.disc);
+  json.add("duration", metadata.duration);
+  json.add("bitrate", metadata.bitrate);
+  json.add("format", metadata.file_format);
+  json.add("codec", metadata.audio_stream.codec);
+  json.add("sample_rate", metadata.audio_stream.sample_rate);
+  json.add("channels", metadata.audio_stream.channels);
+  json.add("channel_layout", metadata.audio_stream.channel_layout);
+  json.add("cover", metadata.video_stream.codec); // codec of the attached picture, if any
+  return std::move(json).str();
+}
+
+/*
+ * Renders <dir>/.meta.json from <dir>/metadata.toml, replacing it atomically. False if the
+ * directory has no parsable metadata.toml, in which case it is left as it was.
+ */
+inline auto render(const std::string& dir) -> bool
+{
+  std::ifstream in(dir + "/" + macros::to_string(macros::METADATA_FILE));
+  if (!in)
+  {
+    return false;
+  }
+  const std::string                  text((std::istreambuf_iterator<char>(in)), {});
+  const std::optional<AudioMetadata> metadata = parse(text);
+  if (!metadata)
+  {
+    return false;
+  }
+
+  const std::string path     = dir + "/" + macros::to_string(macros::SERVER_META_JSON_FILE);
+  const std::string tmp_path = path + ".tmp";
+  {
+    std::ofstream out(tmp_path, std::ios::trunc);
+    out << to_json(*metadata);
+    if (!out.good())
+    {
+      LOG_ERROR << "[TOML] Failed to write " << tmp_path;
+      return false;
+    }
+  }
+  return std::rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+} // namespace track_metadata
@@ -0,0 +1,578 @@
+#pragma once
+
+#include "../decompression.h"
+#include "../logger.hpp"
+#include "../macros.hpp"
+#include "blob_store.hpp"
+#include "worker_pool.hpp"
+#include <archive.h>
+#include <archive_entry.h>
+#include <atomic>
+#include <boost/filesystem.hpp>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+ * UPLOAD INGEST
+ *
+ * Extracts an uploaded tar.gz payload *while it is still arriving*.
+ *
+ * The session reads the request body in small chunks and push()es each one here. A consumer job
+ * runs libarchive over those chunks (archive_read_open() with a read callback that pops the
+ * queue), so the payload is never written to disk or held in memory as a whole:
+ *
+ *   socket -> [chunk queue] -> gzip/tar (libarchive) -> entry -> [pool] zstd + validate + store
+ *
+ * Small entries (every HLS segment in practice) are read out of the archive in one piece and
+ * handed to the pool, so decompressing and validating them runs in parallel with inflating the
+ * rest of the payload. Larger entries are streamed to disk by the consumer itself. Each entry is
+ * moved into HLS storage as soon as it has been validated, so the first segments are servable
+ * long before the last byte of the upload has been received. Storing goes through the
+ * BlobStore, which keeps one copy of identical files across uploads; the upload's manifest is
+ * written once every entry is in.
+ *
+ * -> The chunk queue is bounded by WAVY_SERVER_INGEST_QUEUE_KIB. When it is full, push() holds
+ *    on to the session's resume callback instead of calling it, which stops the session from
+ *    reading (and TCP flow control slows the sender down). The consumer fires it once it has
+ *    caught up.
+ *
+ * -> Consumers wait on the network for as long as the transfer takes, so they run on a pool of
+ *    their own (WAVY_SERVER_MAX_UPLOADS threads) and never hold up the pool the entries, and
+ *    everything else the server hands off, run on.
+ *
+ * -> At most WAVY_SERVER_INGEST_MAX_INFLIGHT entries per upload wait in or run on the pool. If
+ *    the pool queue is full the consumer processes the entry itself.
+ *
+ * -> Once the consumer fails (corrupt archive, read error) the rest of the body is simply
+ *    drained and dropped, so the session can still answer the request properly.
+ *
+ * -> An aborted upload (connection lost, chunked upload expired, server shutting down) reports
+ *    nothing, and its audio-id directory is removed with the blobs only it referenced, by the
+ *    consumer once it has stopped or by abort() if it already had.
+ *
+ * -> The completion callback fires once both the body has been fully received (finish()) and
+ *    the consumer is done, from whichever thread gets there last.
+ *
+ * -> An upload may start with a ZSTD dictionary entry (ZSTD_DICT_ENTRY, see zstd_archive.hpp).
+ *    It is loaded into one ZSTD_DDict that the .zst entries after it are all decompressed with,
+ *    and is not stored itself.
+ *
+ * Peak memory per upload is therefore the chunk queue bound plus the in-flight entries,
+ * regardless of the payload size.
+ */
+
+class UploadIngest : public std::enable_shared_from_this<UploadIngest>
+{
+public:
+  // Decides whether an extracted file (by its final name and current path) may be stored
+  using Validator = std::function<bool(const std::string& filename, const std::string& path)>;
+  using Resume    = std::function<void()>;
+  using Done      = std::function<void(bool success, int stored_files)>;
+
+  UploadIngest(WorkerPool& consumers, WorkerPool& pool, BlobStore& blobs, std::string temp_dir,
+               std::string storage_dir, Validator validate)
+      : consumers_(consumers), pool_(pool), blobs_(blobs), temp_dir_(std::move(temp_dir)),
+        storage_dir_(std::move(storage_dir)), validate_(std::move(validate))
+  {
+  }
+
+  UploadIngest(const UploadIngest&)                    = delete;
+  auto operator=(const UploadIngest&) -> UploadIngest& = delete;
+
+  // Queues the consumer; false if too many uploads are running already (nothing has started then)
+  [[nodiscard]] auto start(Done on_done) -> bool
+  {
+    on_done_ = std::move(on_done);
+    if (!consumers_.try_submit([self = shared_from_this()] { self->run(); }))
+    {
+      on_done_ = nullptr;
+      return false;
+    }
+    return true;
+  }
+
+  // Hand over the next piece of the body; on_ready is called when the session may read more
+  void push(std::string chunk, Resume on_ready)
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (chunk.empty() || consumer_done_ || aborted_)
+    {
+      lock.unlock();
+      on_ready();
+      return;
+    }
+
+    queued_bytes_ += chunk.size();
+    queue_.push_back(std::move(chunk));
+    cv_.notify_one();
+
+    if (queued_bytes_ < kQueueLimit)
+    {
+      lock.unlock();
+      on_ready();
+      return;
+    }
+
+    pending_resume_ = std::move(on_ready);
+  }
+
+  // The whole body has been received
+  void finish()
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    body_done_ = true;
+    cv_.notify_one();
+    complete_if_ready(lock);
+  }
+
+  // The connection went away mid-upload: stop extracting, remove what was stored, report nothing
+  void abort()
+  {
+    bool consumer_done;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (aborted_ || reported_)
+      {
+        return; // a reported upload belongs to whoever it was reported to
+      }
+      aborted_        = true;
+      consumer_done   = consumer_done_;
+      on_done_        = nullptr;
+      pending_resume_ = nullptr;
+      queue_.clear();
+      cv_.notify_one();
+    }
+
+    // Otherwise the consumer does it once it notices
+    if (consumer_done && !pool_.try_submit([self = shared_from_this()] { self->discard(); }))
+    {
+      discard();
+    }
+  }
+
+private:
+  static constexpr std::size_t kQueueLimit    = WAVY_SERVER_INGEST_QUEUE_KIB * 1024;
+  static constexpr std::size_t kReadBlock     = 64 * 1024;
+  static constexpr std::size_t kMaxInFlight   = WAVY_SERVER_INGEST_MAX_INFLIGHT;
+  static constexpr std::size_t kMaxEntryBytes = WAVY_SERVER_INGEST_POOLED_ENTRY_MIB * 1024 * 1024;
+  static constexpr std::size_t kMaxDictBytes  = 1024 * 1024; // dispatchers send a few KiB
+
+  WorkerPool& consumers_;
+  WorkerPool& pool_;
+  BlobStore&  blobs_;
+  std::string temp_dir_;
+  std::string storage_dir_;
+  Validator   validate_;
+
+  std::mutex              mutex_;
+  std::condition_variable cv_;
+  std::deque<std::string> queue_;
+  std::size_t             queued_bytes_ = 0;
+  std::string             current_; // chunk libarchive is currently reading from
+  Resume                  pending_resume_;
+  Done                    on_done_;
+  bool                    body_done_     = false;
+  bool                    consumer_done_ = false;
+  bool                    aborted_       = false;
+  bool                    reported_      = false;
+  bool                    success_       = false;
+  int                     stored_files_  = 0;
+
+  // Entries handed to the pool, and what came out of them
+  std::mutex              inflight_mutex_;
+  std::condition_variable inflight_cv_;
+  std::size_t             inflight_ = 0;
+  std::atomic<int>        stored_{0};
+  std::atomic<bool>       store_failed_{false};
+
+  // What has been stored, for the manifest
+  std::mutex                    manifest_mutex_;
+  std::vector<BlobStore::Entry> manifest_;
+
+  // Set before the first other entry is read, so entry jobs only ever see it set or never set
+  std::unique_ptr<ZSTD_DDict, decltype(&ZSTD_freeDDict)> ddict_{nullptr, &ZSTD_freeDDict};
+
+  // One decompression context per pool thread, reused for every entry that thread handles
+  static auto thread_dctx() -> ZSTD_DCtx*
+  {
+    struct Holder
+    {
+      ZSTD_DCtx* dctx = ZSTD_createDCtx();
+      ~Holder() { ZSTD_freeDCtx(dctx); }
+    };
+    thread_local Holder holder;
+    return holder.dctx;
+  }
+
+  static auto is_compressed(const std::string& name) -> bool
+  {
+    return name.ends_with("." + macros::to_string(macros::ZSTD_FILE_EXT));
+  }
+
+  static auto final_name_of(const std::string& name) -> std::string
+  {
+    return is_compressed(name) ? name.substr(0, name.find_last_of('.')) : name;
+  }
+
+  void discard()
+  {
+    LOG_WARNING << SERVER_EXTRACT_LOG << "Upload aborted, removing " << storage_dir_;
+    blobs_.remove_audio(storage_dir_);
+  }
+
+  // Called with the lock held; the callback itself runs unlocked
+  void complete_if_ready(std::unique_lock<std::mutex>& lock)
+  {
+    if (!body_done_ || !consumer_done_ || !on_done_)
+    {
+      return;
+    }
+
+    Done       on_done = std::move(on_done_);
+    const int  stored  = stored_files_;
+    const bool ok      = success_;
+    on_done_           = nullptr;
+    reported_          = true;
+    lock.unlock();
+    on_done(ok, stored);
+  }
+
+  static auto read_callback(struct archive* a, void* client, const void** buffer) -> la_ssize_t
+  {
+    auto* self     = static_cast<UploadIngest*>(client);
+    auto  readable = [self] { return self->aborted_ || !self->queue_.empty() || self->body_done_; };
+
+    std::unique_lock<std::mutex> lock(self->mutex_);
+    // Bounded waits so a server shutdown is noticed even if the client never sends another byte
+    while (!self->cv_.wait_for(lock, std::chrono::milliseconds(250), readable))
+    {
+      if (self->consumers_.stopping())
+      {
+        self->aborted_ = true;
+      }
+    }
+
+    if (self->aborted_)
+    {
+      archive_set_error(a, ECONNRESET, "upload aborted");
+      return ARCHIVE_FATAL;
+    }
+    if (self->queue_.empty())
+    {
+      return 0; // body_done_: end of payload
+    }
+
+    self->current_ = std::move(self->queue_.front());
+    self->queue_.pop_front();
+    self->queued_bytes_ -= self->current_.size();
+
+    Resume resume;
+    if (self->pending_resume_ && self->queued_bytes_ < kQueueLimit / 2)
+    {
+      resume                = std::move(self->pending_resume_);
+      self->pending_resume_ = nullptr;
+    }
+    lock.unlock();
+
+    if (resume)
+    {
+      resume();
+    }
+
+    *buffer = self->current_.data();
+    return static_cast<la_ssize_t>(self->current_.size());
+  }
+
+  void run()
+  {
+    struct archive*       a = archive_read_new();
+    struct archive_entry* entry;
+
+    archive_read_support_filter_gzip(a);
+    archive_read_support_format_tar(a);
+
+    bool ok = archive_read_open(a, this, nullptr, &UploadIngest::read_callback, nullptr) ==
+              ARCHIVE_OK;
+    if (!ok)
+    {
+      LOG_ERROR << SERVER_EXTRACT_LOG << "Failed to open archive: " << archive_error_string(a);
+    }
+
+    int  r     = ARCHIVE_OK;
+    bool first = true; // no regular entry read yet
+    while (ok && (r = archive_read_next_header(a, &entry)) == ARCHIVE_OK)
+    {
+      if (archive_entry_filetype(entry) != AE_IFREG)
+      {
+        archive_read_data_skip(a);
+        continue;
+      }
+
+      if (macros::ZSTD_DICT_ENTRY == archive_entry_pathname(entry))
+      {
+        ok    = first && load_dictionary(a, archive_entry_size(entry));
+        first = false;
+        continue;
+      }
+      first = false;
+
+      // Payloads are flat; never let an entry name escape the audio-id directory
+      std::string name =
+        boost::filesystem::path(archive_entry_pathname(entry)).filename().string();
+      if (name.empty() || name == "." || name == "..")
+      {
+        LOG_WARNING << SERVER_EXTRACT_LOG << "Skipping entry with invalid name";
+        archive_read_data_skip(a);
+        continue;
+      }
+
+      const int64_t size = archive_entry_size(entry);
+      ok                 = size > 0 && static_cast<std::size_t>(size) <= kMaxEntryBytes
+                             ? dispatch_entry(a, name, static_cast<std::size_t>(size))
+                             : stream_entry(a, name);
+    }
+
+    if (ok && r != ARCHIVE_EOF)
+    {
+      LOG_ERROR << SERVER_EXTRACT_LOG << "Corrupt payload: " << archive_error_string(a);
+      ok = false;
+    }
+
+    archive_read_free(a);
+
+    // Everything handed to the pool has to land before the upload can be reported
+    {
+      std::unique_lock<std::mutex> lock(inflight_mutex_);
+      inflight_cv_.wait(lock, [this] { return inflight_ == 0; });
+    }
+
+    // Even for a failed upload: it is what lets the removal release its blobs
+    if (!manifest_.empty() && !BlobStore::write_manifest(storage_dir_, manifest_))
+    {
+      LOG_ERROR << SERVER_EXTRACT_LOG << "Failed to write the manifest of " << storage_dir_;
+      ok = false;
+    }
+
+    boost::system::error_code ec;
+    boost::filesystem::remove_all(temp_dir_, ec);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    consumer_done_ = true;
+    if (aborted_)
+    {
+      lock.unlock();
+      discard();
+      return;
+    }
+    success_      = ok && !store_failed_ && stored_ > 0;
+    stored_files_ = stored_;
+    queue_.clear();
+    queued_bytes_ = 0;
+
+    // Whatever is left of the body is dropped from now on, so let the session keep reading
+    Resume resume   = std::move(pending_resume_);
+    pending_resume_ = nullptr;
+    if (resume)
+    {
+      lock.unlock();
+      resume();
+      lock.lock();
+    }
+
+    complete_if_ready(lock);
+  }
+
+  // Reads the current entry, `size` bytes, into `data`
+  static auto read_entry(struct archive* a, const std::string& name, std::size_t size,
+                         std::string& data) -> bool
+  {
+    data.resize(size);
+    ssize_t len  = 0;
+    size_t  read = 0;
+    while (read < size && (len = archive_read_data(a, data.data() + read, size - read)) > 0)
+    {
+      read += static_cast<size_t>(len);
+    }
+    if (len < 0 || read != size)
+    {
+      LOG_ERROR << SERVER_EXTRACT_LOG << "Failed to read entry " << name << ": "
+                << archive_error_string(a);
+      return false;
+    }
+    return true;
+  }
+
+  // The upload's dictionary; only valid as its first entry, before any job could need it
+  auto load_dictionary(struct archive* a, int64_t size) -> bool
+  {
+    std::string dictionary;
+    if (size <= 0 || static_cast<std::size_t>(size) > kMaxDictBytes ||
+        !read_entry(a, macros::to_string(macros::ZSTD_DICT_ENTRY), static_cast<std::size_t>(size),
+                    dictionary))
+    {
+      LOG_ERROR << SERVER_EXTRACT_LOG << "Invalid ZSTD dictionary entry";
+      return false;
+    }
+
+    ddict_.reset(ZSTD_createDDict(dictionary.data(), dictionary.size()));
+    if (!ddict_)
+    {
+      LOG_ERROR << SERVER_EXTRACT_LOG << "Failed to load the upload's ZSTD dictionary";
+      return false;
+    }
+    LOG_DEBUG << SERVER_EXTRACT_LOG << "Loaded a " << size << " byte ZSTD dictionary";
+    return true;
+  }
+
+  /*
+   * Reads a small entry out of the archive in one go and hands decompression, validation and
+   * storing to the pool (or does it right here if the pool is saturated).
+   */
+  auto dispatch_entry(struct archive* a, const std::string& name, std::size_t size) -> bool
+  {
+    auto data = std::make_shared<std::string>();
+    if (!read_entry(a, name, size, *data))
+    {
+      return false;
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(inflight_mutex_);
+      inflight_cv_.wait(lock, [this] { return inflight_ < kMaxInFlight; });
+      ++inflight_;
+    }
+
+    auto job = [self = shared_from_this(), name, data]
+    {
+      self->store_entry(name, *data);
+
+      std::lock_guard<std::mutex> lock(self->inflight_mutex_);
+      --self->inflight_;
+      self->inflight_cv_.notify_all();
+    };
+
+    if (!pool_.try_submit(job))
+    {
+      job();
+    }
+    return true;
+  }
+
+  // Decompresses (if needed) an entry held in memory into the temp dir, then validates and stores
+  void store_entry(const std::string& name, const std::string& data)
+  {
+    const std::string final_name = final_name_of(name);
+    const std::string temp_path  = temp_dir_ + "/" + final_name;
+
+    bool written;
+    if (is_compressed(name))
+    {
+      ZSTD_FileSink sink;
+      written = ZSTD_FileSink_open(&sink, thread_dctx(), ddict_.get(), temp_path.c_str());
+      if (written)
+      {
+        written = ZSTD_FileSink_write(&sink, data.data(), data.size());
+        written = ZSTD_FileSink_close(&sink) && written;
+      }
+    }
+    else
+    {
+      std::ofstream ofs(temp_path, std::ios::binary);
+      ofs.write(data.data(), static_cast<std::streamsize>(data.size()));
+      written = ofs.good();
+    }
+
+    validate_and_store(name, final_name, temp_path, written);
+  }
+
+  // Streams a large entry straight to the temp dir (decompressing .zst on the fly)
+  auto stream_entry(struct archive* a, const std::string& name) -> bool
+  {
+    const std::string final_name = final_name_of(name);
+    const std::string temp_path  = temp_dir_ + "/" + final_name;
+
+    char    buffer[kReadBlock];
+    ssize_t len;
+    bool    written = true;
+
+    if (is_compressed(name))
+    {
+      ZSTD_FileSink sink;
+      if (!ZSTD_FileSink_open(&sink, thread_dctx(), ddict_.get(), temp_path.c_str()))
+      {
+        return false;
+      }
+      while ((len = archive_read_data(a, buffer, sizeof(buffer))) > 0)
+      {
+        written = written && ZSTD_FileSink_write(&sink, buffer, static_cast<size_t>(len));
+      }
+      written = ZSTD_FileSink_close(&sink) && written;
+    }
+    else
+    {
+      std::ofstream ofs(temp_path, std::ios::binary);
+      if (!ofs)
+      {
+        LOG_ERROR << SERVER_EXTRACT_LOG << "Failed to open file for writing: " << temp_path;
+        return false;
+      }
+      while ((len = archive_read_data(a, buffer, sizeof(buffer))) > 0)
+      {
+        ofs.write(buffer, len);
+      }
+      written = ofs.good();
+    }
+
+    if (len < 0)
+    {
+      LOG_ERROR << SERVER_EXTRACT_LOG << "Failed to read entry " << name << ": "
+                << archive_error_string(a);
+      return false;
+    }
+
+    validate_and_store(name, final_name, temp_path, written);
+    return true;
+  }
+
+  // A file that fails to extract or validate is just dropped; failing to store it is fatal
+  void validate_and_store(const std::string& name, const std::string& final_name,
+                          const std::string& temp_path, bool written)
+  {
+    boost::system::error_code ec;
+    if (!written)
+    {
+      LOG_WARNING << SERVER_EXTRACT_LOG << "Failed to extract, removing: " << name;
+      boost::filesystem::remove(temp_path, ec);
+      return;
+    }
+
+    if (!validate_(final_name, temp_path))
+    {
+      boost::filesystem::remove(temp_path, ec);
+      return;
+    }
+
+    std::optional<BlobStore::Entry> entry = blobs_.store(temp_path, storage_dir_, final_name);
+    if (!entry)
+    {
+      boost::filesystem::remove(temp_path, ec);
+      store_failed_ = true;
+      return;
+    }
+
+    LOG_INFO << SERVER_EXTRACT_LOG << "File stored in HLS storage: " << final_name;
+    {
+      std::lock_guard<std::mutex> lock(manifest_mutex_);
+      manifest_.push_back(std::move(*entry));
+    }
+    ++stored_;
+  }
+};
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "../logger.hpp"
+#include "../macros.hpp"
+#include "../mp4_box.hpp"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * UPLOAD VALIDATION
+ *
+ * Format checks of the files an upload or a live track stores, one per kind of file;
+ * validate_extracted_file() in server.cpp picks the one that applies. Kept apart from the
+ * server so wavy_bench can measure them on their own.
+ */
+
+inline auto validate_m3u8_format(const std::string& content) -> bool
+{
+  return content.find(macros::PLAYLIST_GLOBAL_HEADER) != std::string::npos;
+}
+
+inline auto validate_ts_file(const std::vector<uint8_t>& data) -> bool
+{
+  return !data.empty() && data[0] == TRANSPORT_STREAM_START_BYTE; // MPEG-TS sync byte
+}
+
+inline auto validate_m4s(const std::string& m4s_path) -> bool
+{
+  std::string error;
+  auto        info = mp4::parse_file(m4s_path, error);
+  if (!info)
+  {
+    LOG_ERROR << SERVER_VALIDATE_LOG << "Invalid fMP4 file " << m4s_path << ": " << error;
+    return false;
+  }
+
+  // The fragments inside one file have to be contiguous too; across files that is the
+  // dispatcher's job, as only it knows the playlist order before upload
+  mp4::Timeline timeline;
+  if (!timeline.append(*info, error))
+  {
+    LOG_WARNING << SERVER_VALIDATE_LOG << "Discontinuous fragments in " << m4s_path << ": "
+                << error;
+  }
+
+  LOG_DEBUG << SERVER_VALIDATE_LOG << "Valid fMP4 file: " << m4s_path << " ("
+            << info->fragments.size() << " fragment(s))";
+  return true;
+}
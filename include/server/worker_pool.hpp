@@ -0,0 +1,112 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * WORKER POOL
+ *
+ * Fixed set of threads for CPU and disk bound work (inflating and extracting uploads,
+ * decompressing and validating entries) so none of it ever runs on an io_context thread.
+ *
+ * -> The job queue is bounded. try_submit() never blocks: it returns false when the queue is
+ *    full, and the caller decides what to do (the server answers 503, an upload that is already
+ *    running processes the entry itself).
+ *
+ * -> Jobs are plain callables. Anything that has to touch a session afterwards posts back onto
+ *    that session's strand; the pool knows nothing about networking.
+ *
+ * -> shutdown() stops accepting jobs, lets the threads drain what is already queued and joins
+ *    them. Long running jobs are expected to poll stopping() while they wait on external input.
+ */
+
+class WorkerPool
+{
+public:
+  using Job = std::function<void()>;
+
+  WorkerPool(unsigned int threads, std::size_t queue_capacity) : capacity_(queue_capacity)
+  {
+    for (unsigned int i = 0; i < std::max(1u, threads); ++i)
+    {
+      threads_.emplace_back([this] { work(); });
+    }
+  }
+
+  WorkerPool(const WorkerPool&)                    = delete;
+  auto operator=(const WorkerPool&) -> WorkerPool& = delete;
+
+  ~WorkerPool() { shutdown(); }
+
+  [[nodiscard]] auto try_submit(Job job) -> bool
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stopping_ || jobs_.size() >= capacity_)
+      {
+        return false;
+      }
+      jobs_.push_back(std::move(job));
+    }
+    cv_.notify_one();
+    return true;
+  }
+
+  [[nodiscard]] auto stopping() const -> bool { return stopping_.load(std::memory_order_relaxed); }
+
+  [[nodiscard]] auto size() const -> std::size_t { return threads_.size(); }
+
+  void shutdown()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stopping_)
+      {
+        return;
+      }
+      stopping_ = true;
+    }
+    cv_.notify_all();
+
+    for (std::thread& thread : threads_)
+    {
+      if (thread.joinable())
+      {
+        thread.join();
+      }
+    }
+  }
+
+private:
+  std::size_t              capacity_;
+  std::vector<std::thread> threads_;
+  std::mutex               mutex_;
+  std::condition_variable  cv_;
+  std::deque<Job>          jobs_;
+  std::atomic<bool>        stopping_{false};
+
+  void work()
+  {
+    for (;;)
+    {
+      Job job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+        if (jobs_.empty())
+        {
+          return; // stopping and drained
+        }
+        job = std::move(jobs_.front());
+        jobs_.pop_front();
+      }
+      job();
+    }
+  }
+};
@@ -44,9 +44,9 @@ struct StreamMetadata
 {
   string codec;
   string type;
-  int    bitrate;
-  int    sample_rate;
-  int    channels;
+  int    bitrate     = -1;
+  int    sample_rate = -1;
+  int    channels    = -1;
   string channel_layout;
   string sample_format;
 };
@@ -80,12 +80,30 @@ struct AudioMetadata
 // Parses a fraction (e.g., "6/12")
 auto parseFraction(string_view value) -> pair<int, int>
 {
+  if (value.empty())
+    return {0, 0};
   size_t pos = value.find('/');
   if (pos == string::npos)
     return {stoi(string(value)), 0};
   return {stoi(string(value.substr(0, pos))), stoi(string(value.substr(pos + 1)))};
 }
 
+// Parses one [stream_N] table
+auto parseStreamMetadata(const auto& stream) -> StreamMetadata
+{
+  StreamMetadata result;
+
+  result.codec          = stream[PARENT_STREAM_FIELD_CODEC].value_or(""s);
+  result.type           = stream[PARENT_STREAM_FIELD_TYPE].value_or(""s);
+  result.bitrate        = stream[PARENT_STREAM_FIELD_BITRATE].value_or(-1);
+  result.sample_rate    = stream[PARENT_STREAM_FIELD_SAMPLE_RATE].value_or(-1);
+  result.channels       = stream[PARENT_STREAM_FIELD_CHANNELS].value_or(-1);
+  result.channel_layout = stream[PARENT_STREAM_FIELD_CHANNEL_LAYOUT].value_or(""s);
+  result.sample_format  = stream[PARENT_STREAM_FIELD_SAMPLE_FORMAT].value_or(""s);
+
+  return result;
+}
+
 auto parseAudioMetadataFromTomlTable(const toml::table& metadata) -> AudioMetadata
 {
   AudioMetadata result;
@@ -115,6 +133,16 @@ auto parseAudioMetadataFromTomlTable(const toml::table& metadata) -> AudioMetada
     parseFraction(metadata[PARENT_METADATA][PARENT_METADATA_FIELD_TRACK].value_or(""s));
   result.disc = parseFraction(metadata[PARENT_METADATA][PARENT_METADATA_FIELD_DISC].value_or(""s));
 
+  // Stream Sections (an audio stream and, with cover art, a video one)
+  for (const char* parent : {PARENT_STREAM_0, PARENT_STREAM_1})
+  {
+    StreamMetadata stream = parseStreamMetadata(metadata[parent]);
+    if (stream.type == "Audio")
+      result.audio_stream = std::move(stream);
+    else if (stream.type == "Video")
+      result.video_stream = std::move(stream);
+  }
+
   return result;
 }
 
@@ -125,7 +153,7 @@ auto parseAudioMetadata(const string& filePath) -> AudioMetadata
 }
 
 // Parse Metadata Directly from a TOML String
-auto parseAudioMetadataFromDataString(const string& dataString) -> AudioMetadata
+auto parseAudioMetadataFromDataString(string_view dataString) -> AudioMetadata
 {
   auto metadata = toml::parse(dataString);
   return parseAudioMetadataFromTomlTable(metadata);
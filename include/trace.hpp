@@ -0,0 +1,187 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+
+/*
+ * TRACE DUMPS
+ *
+ * Opt-in dumps of what flows through the client for debugging: the encoded stream as received
+ * (audio.raw) and the PCM handed to the device (final.pcm).
+ *
+ * -> Compiled in only with the WAVY_TRACE CMake option (`make trace`). Without it trace::dump()
+ *    is an empty inline function and none of the code below exists in the binary.
+ *
+ * -> Even when compiled in, nothing is written unless WAVY_TRACE_DIR names a directory at
+ *    startup; the dumps go there.
+ *
+ * -> dump() only copies the bytes into a queue. A background thread does the file I/O, so
+ *    the fetcher and the decoder never wait on the disk. The queue is bounded by
+ *    WAVY_TRACE_QUEUE_MIB; when it is full, dump() waits for the writer rather than drop data.
+ *
+ * Each name is one file, truncated on the first dump of the process and appended to afterwards.
+ */
+
+#ifndef WAVY_TRACE
+#define WAVY_TRACE 0
+#endif
+
+#if WAVY_TRACE
+
+#include "logger.hpp"
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define WAVY_TRACE_QUEUE_MIB 64 // dumped bytes waiting for the writer thread
+
+namespace trace
+{
+
+class DumpWriter
+{
+public:
+  DumpWriter()
+  {
+    if (const char* dir = std::getenv("WAVY_TRACE_DIR"); dir && *dir)
+    {
+      dir_ = dir;
+      std::error_code ec;
+      std::filesystem::create_directories(dir_, ec);
+      thread_ = std::thread([this] { run(); });
+      LOG_INFO << "Trace dumps enabled in " << dir_;
+    }
+  }
+
+  DumpWriter(const DumpWriter&)                    = delete;
+  auto operator=(const DumpWriter&) -> DumpWriter& = delete;
+
+  // Flushes everything still queued
+  ~DumpWriter()
+  {
+    if (!thread_.joinable())
+    {
+      return;
+    }
+    {
+      std::lock_guard lock(mutex_);
+      stopping_ = true;
+    }
+    not_empty_.notify_one();
+    thread_.join();
+  }
+
+  [[nodiscard]] auto enabled() const -> bool { return !dir_.empty(); }
+
+  void append(std::string_view name, const void* data, std::size_t size)
+  {
+    const auto* bytes = static_cast<const char*>(data);
+    Chunk       chunk{std::string(name), std::vector<char>(bytes, bytes + size)};
+
+    std::unique_lock lock(mutex_);
+    not_full_.wait(lock, [&] { return queued_ + size <= kQueueBytes || chunks_.empty(); });
+    queued_ += size;
+    chunks_.push_back(std::move(chunk));
+    not_empty_.notify_one();
+  }
+
+private:
+  struct Chunk
+  {
+    std::string       name;
+    std::vector<char> data;
+  };
+
+  static constexpr std::size_t kQueueBytes =
+    static_cast<std::size_t>(WAVY_TRACE_QUEUE_MIB) * 1024 * 1024;
+
+  std::filesystem::path   dir_;
+  std::thread             thread_;
+  std::mutex              mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+  std::deque<Chunk>       chunks_;
+  std::size_t             queued_   = 0;
+  bool                    stopping_ = false;
+
+  void run()
+  {
+    std::unordered_map<std::string, std::FILE*> files; // only touched by this thread
+
+    for (;;)
+    {
+      std::unique_lock lock(mutex_);
+      not_empty_.wait(lock, [this] { return !chunks_.empty() || stopping_; });
+      if (chunks_.empty())
+      {
+        break; // stopping, and everything is written
+      }
+      Chunk chunk = std::move(chunks_.front());
+      chunks_.pop_front();
+      lock.unlock();
+
+      std::FILE*& file = files[chunk.name];
+      if (!file)
+      {
+        file = std::fopen((dir_ / chunk.name).c_str(), "wb");
+        if (!file)
+        {
+          LOG_ERROR << "Failed to open trace dump " << (dir_ / chunk.name);
+        }
+      }
+      if (file)
+      {
+        std::fwrite(chunk.data.data(), 1, chunk.data.size(), file);
+      }
+
+      lock.lock();
+      queued_ -= chunk.data.size();
+      not_full_.notify_all();
+    }
+
+    for (auto& [name, file] : files)
+    {
+      if (file)
+      {
+        std::fclose(file);
+        LOG_INFO << "Wrote trace dump " << (dir_ / name);
+      }
+    }
+  }
+};
+
+inline auto writer() -> DumpWriter&
+{
+  static DumpWriter instance;
+  return instance;
+}
+
+// Queues `size` bytes for the end of trace file `name`
+inline void dump(std::string_view name, const void* data, std::size_t size)
+{
+  DumpWriter& out = writer();
+  if (out.enabled() && size > 0)
+  {
+    out.append(name, data, size);
+  }
+}
+
+} // namespace trace
+
+#else
+
+namespace trace
+{
+
+inline void dump(std::string_view, const void*, std::size_t) {}
+
+} // namespace trace
+
+#endif
@@ -0,0 +1,395 @@
+#pragma once
+
+#include "logger.hpp"
+#include "macros.hpp"
+#include <algorithm>
+#include <archive.h>
+#include <archive_entry.h>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <fcntl.h>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <zdict.h>
+#include <zstd.h>
+
+/*
+ * PARALLEL ZSTD ARCHIVER
+ *
+ * Builds the dispatcher's upload archive in a single pass over the track directory: every file
+ * is read once, compressed in memory and written straight into the libarchive writer. Nothing
+ * is staged on disk between the segments and the archive.
+ *
+ *   files -> [threads] read + ZSTD_compressCCtx -> [slot ring] -> calling thread -> libarchive
+ *
+ * -> Files are compressed by worker threads, one file per job. HLS segments are small, so whole
+ *    files are the unit of parallelism rather than ZSTD's own workers (ZSTD_c_nbWorkers), which
+ *    only split inputs of several MiB.
+ *
+ * -> Results land in a ring of `window` slots and the calling thread writes them in the order
+ *    the files were given, so the archive is the same whichever worker finishes first. A worker
+ *    only starts file i once file i - window is in the archive, which bounds memory to `window`
+ *    files however large the directory is.
+ *
+ * -> The ZSTD_CCtx of each worker and the buffers of each slot belong to the ZstdArchiver and
+ *    only ever grow, so writing one archive after another (batch mode) allocates nothing once
+ *    the largest file has been seen.
+ *
+ * -> Playlists and the leading packets of transport streams are nearly identical from one file
+ *    to the next, but each file is its own ZSTD frame and small ones start with no history to
+ *    match against. train_dictionary() builds a dictionary from exactly those parts; write()
+ *    sends it as the first entry (ZSTD_DICT_ENTRY) and compresses every file against it, and
+ *    the server loads it once per upload to decompress them.
+ *
+ * Entries are named by their file name, plus ".zst" when compressed, which is what the server
+ * decompresses on ingest.
+ */
+
+class ZstdArchiver
+{
+public:
+  struct File
+  {
+    std::string path;     // file to read
+    std::string name;     // entry name in the archive, without the ".zst" suffix
+    bool        compress; // false: stored as is (fMP4, which ZSTD barely shrinks)
+  };
+
+  explicit ZstdArchiver(std::size_t threads)
+      : cctxs_(std::max<std::size_t>(1, threads), nullptr),
+        slots_(cctxs_.size() * WAVY_DISPATCH_ZSTD_WINDOW)
+  {
+  }
+
+  ZstdArchiver(const ZstdArchiver&)                    = delete;
+  auto operator=(const ZstdArchiver&) -> ZstdArchiver& = delete;
+
+  ~ZstdArchiver()
+  {
+    for (ZSTD_CCtx* cctx : cctxs_)
+    {
+      ZSTD_freeCCtx(cctx);
+    }
+  }
+
+  [[nodiscard]] auto threads() const -> std::size_t { return cctxs_.size(); }
+
+  /*
+   * Trains a dictionary on what the compressed files share: the playlists, whole, and the first
+   * WAVY_DISPATCH_ZSTD_DICT_TS_PACKETS packets of each transport stream (PAT, PMT and the first
+   * PES headers, which every segment repeats). Empty if there is too little to train on.
+   */
+  static auto train_dictionary(const std::vector<File>& files) -> std::string
+  {
+    constexpr std::size_t kPlaylistSample = 64 * 1024;
+    constexpr std::size_t kStreamSample   = WAVY_DISPATCH_ZSTD_DICT_TS_PACKETS * 188;
+    constexpr std::size_t kMinSamples     = 8;
+
+    std::string              samples;
+    std::vector<std::size_t> sizes;
+    for (const File& file : files)
+    {
+      std::size_t limit = 0;
+      if (file.compress && file.name.ends_with(macros::PLAYLIST_EXT))
+      {
+        limit = kPlaylistSample;
+      }
+      else if (file.compress && file.name.ends_with(macros::TRANSPORT_STREAM_EXT))
+      {
+        limit = kStreamSample;
+      }
+
+      const std::size_t before = samples.size();
+      if (limit > 0 && read_prefix(file.path, limit, samples) && samples.size() > before)
+      {
+        sizes.push_back(samples.size() - before);
+      }
+    }
+
+    // ZDICT needs samples worth several times the dictionary to find what repeats
+    const std::size_t capacity =
+      std::min<std::size_t>(WAVY_DISPATCH_ZSTD_DICT_KIB * 1024, samples.size() / 8);
+    if (sizes.size() < kMinSamples || capacity < 1024)
+    {
+      return {};
+    }
+
+    std::string       dictionary(capacity, '\0');
+    const std::size_t size =
+      ZDICT_trainFromBuffer(dictionary.data(), capacity, samples.data(), sizes.data(),
+                            static_cast<unsigned>(sizes.size()));
+    if (ZDICT_isError(size))
+    {
+      LOG_DEBUG << DISPATCH_LOG << "No ZSTD dictionary trained: " << ZDICT_getErrorName(size);
+      return {};
+    }
+    dictionary.resize(size);
+    LOG_DEBUG << DISPATCH_LOG << "Trained a " << size << " byte ZSTD dictionary on "
+              << sizes.size() << " samples (" << samples.size() << " bytes)";
+    return dictionary;
+  }
+
+  /*
+   * Appends one entry per file to `archive`, in the order given, after `dictionary` (if not
+   * empty) as ZSTD_DICT_ENTRY. False, with the error logged, if a file could not be read or
+   * compressed or the writer failed; the archive is then incomplete and should be discarded.
+   */
+  auto write(struct archive* archive, const std::vector<File>& files,
+             std::string_view dictionary = {}) -> bool
+  {
+    next_    = 0;
+    written_ = 0;
+    aborted_ = false;
+
+    if (!dictionary.empty())
+    {
+      cdict_ = ZSTD_createCDict(dictionary.data(), dictionary.size(), WAVY_DISPATCH_ZSTD_LEVEL);
+      if (!cdict_ ||
+          !write_data(archive, macros::to_string(macros::ZSTD_DICT_ENTRY), dictionary.data(),
+                      dictionary.size()))
+      {
+        LOG_ERROR << DISPATCH_LOG << "Failed to add the ZSTD dictionary to the archive";
+        ZSTD_freeCDict(cdict_);
+        cdict_ = nullptr;
+        return false;
+      }
+    }
+
+    std::vector<std::thread> workers;
+    for (std::size_t i = 0; i < std::min(cctxs_.size(), files.size()); ++i)
+    {
+      workers.emplace_back([this, &files, i] { work(i, files); });
+    }
+
+    bool          ok         = true;
+    std::uint64_t original   = 0;
+    std::uint64_t compressed = 0;
+    for (std::size_t i = 0; i < files.size(); ++i)
+    {
+      Slot& slot = slots_[i % slots_.size()];
+      {
+        std::unique_lock lock(mutex_);
+        ready_.wait(lock, [&] { return slot.ready; });
+      }
+
+      ok = slot.ok && write_entry(archive, files[i], slot);
+      if (!ok)
+      {
+        break;
+      }
+      original += slot.input_size;
+      compressed += slot.output_size;
+
+      {
+        std::lock_guard lock(mutex_);
+        slot.ready = false;
+        ++written_;
+      }
+      space_.notify_all();
+    }
+
+    if (!ok)
+    {
+      {
+        std::lock_guard lock(mutex_);
+        aborted_ = true;
+      }
+      space_.notify_all();
+    }
+    for (std::thread& worker : workers)
+    {
+      worker.join();
+    }
+    for (Slot& slot : slots_)
+    {
+      slot.ready = false; // results of files after the failed one
+    }
+    ZSTD_freeCDict(cdict_);
+    cdict_ = nullptr;
+
+    if (ok && original > 0)
+    {
+      // Over 100 when stored fMP4 and the dictionary outweigh what compression saved
+      const long percent =
+        std::lround(100.0 * static_cast<double>(compressed) / static_cast<double>(original));
+      LOG_INFO << DISPATCH_LOG << "Archived " << files.size() << " files with "
+               << workers.size() << " threads: " << original << " -> " << compressed
+               << " bytes (" << percent << "% of the original)";
+    }
+    return ok;
+  }
+
+private:
+  struct Slot
+  {
+    std::vector<char> input;           // grown to the largest file seen
+    std::vector<char> output;          // grown to the largest ZSTD_compressBound seen
+    std::size_t       input_size  = 0; // bytes of `input` that are the file
+    std::size_t       output_size = 0; // bytes of the entry, in `output` or `input`
+    bool              compressed  = false;
+    bool              ok          = false;
+    bool              ready       = false; // guarded by mutex_
+  };
+
+  std::vector<ZSTD_CCtx*>  cctxs_; // one per worker, created on first use
+  std::vector<Slot>        slots_;
+  ZSTD_CDict*              cdict_ = nullptr; // dictionary of the archive being written
+  std::atomic<std::size_t> next_{0}; // next file a worker takes
+  std::mutex               mutex_;
+  std::condition_variable  ready_;       // a slot was filled
+  std::condition_variable  space_;       // an entry was written, or the write was aborted
+  std::size_t              written_ = 0; // entries in the archive
+  bool                     aborted_ = false;
+
+  void work(std::size_t self, const std::vector<File>& files)
+  {
+    for (std::size_t i; (i = next_.fetch_add(1)) < files.size();)
+    {
+      {
+        std::unique_lock lock(mutex_);
+        space_.wait(lock, [&] { return i < written_ + slots_.size() || aborted_; });
+        if (aborted_)
+        {
+          return;
+        }
+      }
+
+      Slot& slot = slots_[i % slots_.size()];
+      slot.ok    = load(files[i].path, slot) && (!files[i].compress || compress(self, slot));
+      if (!slot.ok)
+      {
+        LOG_ERROR << DISPATCH_LOG << "Failed to compress " << files[i].path;
+      }
+
+      {
+        std::lock_guard lock(mutex_);
+        slot.ready = true;
+      }
+      ready_.notify_one();
+    }
+  }
+
+  static auto load(const std::string& path, Slot& slot) -> bool
+  {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+      return false;
+    }
+
+    struct stat st{};
+    bool        ok = ::fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    if (ok)
+    {
+      slot.input_size = static_cast<std::size_t>(st.st_size);
+      if (slot.input.size() < slot.input_size)
+      {
+        slot.input.resize(slot.input_size);
+      }
+      for (std::size_t done = 0; ok && done < slot.input_size;)
+      {
+        const ssize_t n = ::pread(fd, slot.input.data() + done, slot.input_size - done,
+                                  static_cast<off_t>(done));
+        ok              = n > 0;
+        done += ok ? static_cast<std::size_t>(n) : 0;
+      }
+    }
+    ::close(fd);
+
+    slot.compressed  = false;
+    slot.output_size = slot.input_size;
+    return ok;
+  }
+
+  auto compress(std::size_t self, Slot& slot) -> bool
+  {
+    ZSTD_CCtx*& cctx = cctxs_[self];
+    if (!cctx && !(cctx = ZSTD_createCCtx()))
+    {
+      return false;
+    }
+
+    const std::size_t bound = ZSTD_compressBound(slot.input_size);
+    if (slot.output.size() < bound)
+    {
+      slot.output.resize(bound);
+    }
+
+    const std::size_t size =
+      cdict_ ? ZSTD_compress_usingCDict(cctx, slot.output.data(), bound, slot.input.data(),
+                                        slot.input_size, cdict_)
+             : ZSTD_compressCCtx(cctx, slot.output.data(), bound, slot.input.data(),
+                                 slot.input_size, WAVY_DISPATCH_ZSTD_LEVEL);
+    if (ZSTD_isError(size))
+    {
+      LOG_ERROR << DISPATCH_LOG << "ZSTD compression failed: " << ZSTD_getErrorName(size);
+      return false;
+    }
+    slot.compressed  = true;
+    slot.output_size = size;
+    return true;
+  }
+
+  // Appends up to `limit` bytes from the start of the file to `out`
+  static auto read_prefix(const std::string& path, std::size_t limit, std::string& out) -> bool
+  {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+      return false;
+    }
+
+    const std::size_t begin = out.size();
+    out.resize(begin + limit);
+    std::size_t done = 0;
+    for (ssize_t n; done < limit && (n = ::read(fd, out.data() + begin + done, limit - done)) > 0;)
+    {
+      done += static_cast<std::size_t>(n);
+    }
+    ::close(fd);
+    out.resize(begin + done);
+    return true;
+  }
+
+  static auto write_entry(struct archive* archive, const File& file, const Slot& slot) -> bool
+  {
+    const std::string name =
+      slot.compressed ? file.name + "." + macros::to_string(macros::ZSTD_FILE_EXT) : file.name;
+    const char* data = slot.compressed ? slot.output.data() : slot.input.data();
+    return write_data(archive, name, data, slot.output_size);
+  }
+
+  static auto write_data(struct archive* archive, const std::string& name, const char* data,
+                         std::size_t size) -> bool
+  {
+    struct archive_entry* entry = archive_entry_new();
+    archive_entry_set_pathname(entry, name.c_str());
+    archive_entry_set_size(entry, static_cast<la_int64_t>(size));
+    archive_entry_set_filetype(entry, AE_IFREG);
+    archive_entry_set_perm(entry, 0644);
+
+    bool ok = archive_write_header(archive, entry) == ARCHIVE_OK;
+    for (std::size_t done = 0; ok && done < size;)
+    {
+      const la_ssize_t n = archive_write_data(archive, data + done, size - done);
+      ok                 = n > 0;
+      done += ok ? static_cast<std::size_t>(n) : 0;
+    }
+    archive_entry_free(entry);
+
+    if (!ok)
+    {
+      LOG_ERROR << DISPATCH_LOG << "Failed to add " << name << " to archive: "
+                << archive_error_string(archive);
+    }
+    return ok;
+  }
+};
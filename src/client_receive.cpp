@@ -2,87 +2,119 @@
 #error "Wavy-Client requires C++20 or later."
 #endif
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include "../include/abr/ABRManager.hpp"
 #include "../include/decode.hpp"
+#include "../include/disk_cache.hpp"
+#include "../include/fetcher.hpp"
 #include "../include/logger.hpp"
+#include "../include/m3u8.hpp"
 #include "../include/macros.hpp"
 #include "../include/playback.hpp"
+#include "../include/ring_buffer.hpp"
+#include "../include/segment_queue.hpp"
 #include "../include/state.hpp"
 
-#include <boost/asio.hpp>
-#include <boost/asio/ssl/error.hpp>
-#include <boost/asio/ssl/stream.hpp>
-#include <boost/beast/core.hpp>
-#include <boost/beast/http.hpp>
-#include <boost/beast/ssl.hpp>
-
-namespace ssl   = boost::asio::ssl;
-namespace beast = boost::beast;
-namespace http  = beast::http;
-namespace net   = boost::asio;
-using tcp       = net::ip::tcp;
-
-// Perform an HTTPS GET request and return the response body as a string.
-auto perform_https_request(net::io_context& ioc, ssl::context& ctx, const std::string_view& target,
-                           const std::string& server) -> std::string
+using fetcher::FetchRequest;
+using fetcher::SegmentFetcher;
+using fetcher::SegmentRange;
+
+auto to_range(const std::optional<m3u8::ByteRange>& range) -> std::optional<SegmentRange>
 {
-  try
+  if (!range)
   {
-    tcp::resolver resolver(ioc);
-    auto const    results = resolver.resolve(server, WAVY_SERVER_PORT_NO_STR);
-
-    beast::ssl_stream<tcp::socket> stream(ioc, ctx);
-    net::connect(stream.next_layer(), results.begin(), results.end());
-    stream.handshake(ssl::stream_base::client);
-
-    http::request<http::string_body> req{http::verb::get, target, 11};
-    req.set(http::field::host, server);
-    req.set(http::field::user_agent, "WavyClient");
-    http::write(stream, req);
-
-    beast::flat_buffer                 buffer;
-    http::response<http::dynamic_body> res;
-    http::read(stream, buffer, res);
-
-    std::string response_data = boost::beast::buffers_to_string(res.body().data());
-
-    beast::error_code ec;
-    stream.shutdown(ec);
+    return std::nullopt;
+  }
+  return SegmentRange{range->offset, range->length};
+}
 
-    if (ec == net::error::eof)
+// One rendition of a track, as its media playlist describes it
+struct SegmentPlan
+{
+  std::uint64_t               bandwidth = 0; // BANDWIDTH of its variant, 0 without a master
+  std::optional<FetchRequest> init_request;  // fMP4 only
+  std::string                 init_segment;  // filled by fetch_init_segment
+  std::vector<FetchRequest>   requests;      // media segments in playlist order
+  std::vector<std::string>    names;
+  std::vector<double>         durations; // #EXTINF of each segment, in seconds
+  bool                        flac_found = false;
+  bool                        live       = false; // no #EXT-X-ENDLIST yet, see fetch_plan
+  std::string                 playlist_target;    // of the media playlist
+  std::uint64_t               next_sequence = 0;  // media sequence number of the next segment
+};
+
+/*
+ * Fills `plan` from a media playlist whose URIs are relative to `base`. Planning a reload of
+ * the same playlist again only adds the segments it did not list before.
+ */
+void plan_media_playlist(const m3u8::Playlist& playlist, const std::string& base, SegmentPlan& plan)
+{
+  for (std::size_t i = 0; i < playlist.segments.size(); ++i)
+  {
+    const m3u8::Segment& segment = playlist.segments[i];
+    if (playlist.media_sequence + i < plan.next_sequence)
     {
-      ec.clear();
+      continue; // planned from an earlier load
     }
-    else if (ec)
+    if (segment.uri.ends_with(macros::M4S_FILE_EXT))
     {
-      LOG_WARNING << RECEIVER_LOG << "Stream shutdown error: " << ec.message();
+      plan.flac_found = true;
+    }
+    if (segment.uri.ends_with(macros::TRANSPORT_STREAM_EXT) ||
+        segment.uri.ends_with(macros::M4S_FILE_EXT))
+    {
+      plan.requests.push_back({base + std::string(segment.uri), to_range(segment.range)});
+      plan.names.emplace_back(segment.uri);
+      plan.durations.push_back(segment.duration);
     }
-
-    return response_data;
   }
-  catch (const std::exception& e)
+
+  plan.live          = !playlist.end_list;
+  plan.next_sequence = playlist.next_sequence();
+
+  if (plan.flac_found && !plan.init_request)
   {
-    LOG_ERROR << RECEIVER_LOG << "HTTPS request failed: " << e.what();
-    return "";
+    std::string_view            init_uri = "init.mp4";
+    std::optional<SegmentRange> init_range;
+    if (playlist.map)
+    {
+      init_uri   = playlist.map->uri.empty() ? init_uri : playlist.map->uri;
+      init_range = to_range(playlist.map->range);
+    }
+    plan.init_request = FetchRequest{base + std::string(init_uri), init_range};
   }
 }
 
-auto fetch_transport_segments(const std::string& ip_id, const std::string& audio_id,
-                              GlobalState& gs, const std::string& server, bool& flac_found) -> bool
+/*
+ * Resolves a track's playlists into its renditions, lowest bandwidth first. With
+ * `all_variants` unset only the highest one is kept, and only its media playlist is fetched.
+ */
+auto plan_renditions(SegmentFetcher& connection_pool, const std::string& ip_id,
+                     const std::string& audio_id, bool all_variants,
+                     std::vector<SegmentPlan>& renditions) -> bool
 {
-  net::io_context ioc;
-  ssl::context    ctx(ssl::context::tlsv12_client);
-  ctx.set_verify_mode(ssl::verify_none);
-
   LOG_INFO << RECEIVER_LOG << "Request Owner: " << ip_id << " for audio-id: " << audio_id;
 
-  std::string playlist_path =
-    "/hls/" + ip_id + "/" + audio_id + "/" + macros::to_string(macros::MASTER_PLAYLIST);
-  std::string playlist_content = perform_https_request(ioc, ctx, playlist_path, server);
+  const std::string base             = "/hls/" + ip_id + "/" + audio_id + "/";
+  std::string       playlist_content = connection_pool.get(
+    base + macros::to_string(macros::MASTER_PLAYLIST));
 
   if (playlist_content.empty())
   {
@@ -90,147 +122,234 @@ auto fetch_transport_segments(const std::string& ip_id, const std::string& audio
     return false;
   }
 
-  if (playlist_content.find(macros::PLAYLIST_VARIANT_TAG) != std::string::npos)
+  m3u8::Playlist playlist;
+  if (!m3u8::parse(playlist_content, playlist))
   {
-    int                max_bandwidth = 0;
-    std::string        selected_playlist;
-    std::istringstream iss(playlist_content);
-    std::string        line;
+    LOG_ERROR << RECEIVER_LOG << "Not an M3U8 playlist for " << ip_id << "/" << audio_id;
+    return false;
+  }
 
-    while (std::getline(iss, line))
-    {
-      if (line.find(macros::PLAYLIST_VARIANT_TAG) != std::string::npos)
-      {
-        size_t pos = line.find("BANDWIDTH=");
-        if (pos != std::string::npos)
-        {
-          pos += 10;
-          size_t      endPos       = line.find_first_of(", ", pos);
-          std::string bandwidthStr = line.substr(pos, endPos - pos);
-          int         bandwidth    = std::stoi(bandwidthStr);
+  if (!playlist.is_master())
+  {
+    renditions.emplace_back();
+    renditions.back().playlist_target = base + macros::to_string(macros::MASTER_PLAYLIST);
+    plan_media_playlist(playlist, base, renditions.back());
+    return true;
+  }
 
-          std::string streamPlaylist;
-          if (std::getline(iss, streamPlaylist))
-          {
-            if (bandwidth > max_bandwidth)
-            {
-              max_bandwidth     = bandwidth;
-              selected_playlist = streamPlaylist;
-            }
-          }
-        }
-      }
-    }
+  // Views into playlist_content, which outlives them
+  std::vector<m3u8::Variant> variants;
+  std::ranges::copy_if(playlist.variants, std::back_inserter(variants),
+                       [](const m3u8::Variant& variant) { return !variant.uri.empty(); });
 
-    if (selected_playlist.empty())
-    {
-      LOG_ERROR << RECEIVER_LOG << "Could not find a valid stream playlist";
-      return false;
-    }
+  if (variants.empty())
+  {
+    LOG_ERROR << RECEIVER_LOG << "Could not find a valid stream playlist";
+    return false;
+  }
 
-    LOG_INFO << RECEIVER_LOG << "Selected highest bitrate playlist: " << selected_playlist;
+  std::ranges::sort(variants, {}, &m3u8::Variant::bandwidth);
+  if (!all_variants)
+  {
+    variants.erase(variants.begin(), variants.end() - 1);
+    LOG_INFO << RECEIVER_LOG << "Selected highest bitrate playlist: " << variants.back().uri;
+  }
 
-    playlist_path    = "/hls/" + ip_id + "/" + audio_id + "/" + selected_playlist;
-    playlist_content = perform_https_request(ioc, ctx, playlist_path, server);
+  std::vector<FetchRequest> playlist_requests;
+  renditions.resize(variants.size());
+  for (std::size_t i = 0; i < variants.size(); ++i)
+  {
+    renditions[i].bandwidth       = variants[i].bandwidth;
+    renditions[i].playlist_target = base + std::string(variants[i].uri);
+    playlist_requests.push_back({renditions[i].playlist_target, std::nullopt});
   }
 
-  std::istringstream       segment_stream(playlist_content);
-  std::string              line;
-  std::string              init_mp4_data;
-  bool                     has_m4s_segments = false;
-  std::vector<std::string> m4s_segments;
+  // The media playlists of all variants are fetched in parallel
+  m3u8::Playlist media; // reused, so its vectors are only grown once
+  return connection_pool.fetch_all(playlist_requests,
+                                   [&](std::size_t index, std::string content)
+                                   {
+                                     if (content.empty() || !m3u8::parse(content, media))
+                                     {
+                                       LOG_ERROR << RECEIVER_LOG << "Failed to fetch playlist "
+                                                 << variants[index].uri;
+                                       return false;
+                                     }
+                                     plan_media_playlist(media, base, renditions[index]);
+                                     return true;
+                                   });
+}
 
-  while (std::getline(segment_stream, line))
+// fMP4 renditions need their init segment ahead of the first media segment
+auto fetch_init_segment(SegmentFetcher& connection_pool, SegmentPlan& plan) -> bool
+{
+  if (!plan.init_request)
   {
-    if (!line.empty() && line[0] != '#')
-    {
-      if (line.ends_with(macros::M4S_FILE_EXT))
-      {
-        has_m4s_segments = true;
-      }
-    }
+    return true;
   }
 
-  if (has_m4s_segments)
+  plan.init_segment = connection_pool.get(plan.init_request->target, plan.init_request->range);
+  if (plan.init_segment.empty())
   {
-    std::string init_mp4_url = "/hls/" + ip_id + "/" + audio_id + "/init.mp4";
-    init_mp4_data            = perform_https_request(ioc, ctx, init_mp4_url, server);
+    LOG_ERROR << RECEIVER_LOG << "Failed to fetch " << plan.init_request->target;
+    return false;
+  }
+
+  LOG_INFO << RECEIVER_LOG << "Fetched " << plan.init_request->target
+           << ", size: " << plan.init_segment.size() << " bytes.";
+  return true;
+}
+
+/*
+ * Fetches every segment of `plan` into `deliver` (indices into plan.requests), in order.
+ *
+ * A live plan does not end with the segments it has: its media playlist is reloaded with
+ * ?_HLS_msn=<next sequence>, which the server holds until that segment is listed, and whatever
+ * the reload adds is fetched in turn, until the playlist ends. A track whose reloads bring
+ * nothing new WAVY_CLIENT_LIVE_MAX_STALLS times in a row is given up on. False if `deliver`
+ * stopped it.
+ */
+auto fetch_plan(SegmentFetcher& connection_pool, SegmentPlan& plan,
+                const SegmentFetcher::Deliver& deliver) -> bool
+{
+  const std::string base = plan.playlist_target.substr(0, plan.playlist_target.rfind('/') + 1);
+  m3u8::Playlist    playlist; // reused across reloads
+  std::size_t       fetched = 0;
+  int               stalls  = 0;
+  bool              stopped = false;
+
+  for (;;)
+  {
+    const std::size_t first = fetched;
+    connection_pool.fetch_all(
+      plan.requests.size() - first, [&](std::size_t index) { return plan.requests[first + index]; },
+      [&](std::size_t index, std::string body)
+      {
+        stopped = !deliver(first + index, std::move(body));
+        return !stopped;
+      });
+    fetched = plan.requests.size();
+    if (stopped || !plan.live)
+    {
+      return !stopped;
+    }
 
-    if (init_mp4_data.empty())
+    const std::string content =
+      connection_pool.get(plan.playlist_target + "?" +
+                          macros::to_string(macros::PLAYLIST_RELOAD_PARAM) + "=" +
+                          std::to_string(plan.next_sequence));
+    if (content.empty() || !m3u8::parse(content, playlist))
     {
-      LOG_ERROR << RECEIVER_LOG << "Failed to fetch init.mp4 for " << ip_id << "/" << audio_id;
-      return false;
+      LOG_WARNING << RECEIVER_LOG << "Failed to reload live playlist " << plan.playlist_target;
+      return true;
     }
+    plan_media_playlist(playlist, base, plan);
 
-    LOG_INFO << RECEIVER_LOG << "Fetched init.mp4, size: " << init_mp4_data.size() << " bytes.";
-    flac_found = true;
+    stalls = plan.requests.size() > fetched ? 0 : stalls + 1;
+    if (stalls >= WAVY_CLIENT_LIVE_MAX_STALLS)
+    {
+      LOG_WARNING << RECEIVER_LOG << "Live playlist " << plan.playlist_target
+                  << " stopped growing, giving up on it";
+      return true;
+    }
+  }
+}
+
+// The highest-bandwidth rendition of a track, with its init segment
+auto plan_segments(SegmentFetcher& connection_pool, const std::string& ip_id,
+                   const std::string& audio_id, SegmentPlan& plan) -> bool
+{
+  std::vector<SegmentPlan> renditions;
+  if (!plan_renditions(connection_pool, ip_id, audio_id, false, renditions) ||
+      !fetch_init_segment(connection_pool, renditions.back()))
+  {
+    return false;
   }
+  plan = std::move(renditions.back());
+  return true;
+}
 
-  // Re-parse playlist for segments
-  segment_stream.clear();
-  segment_stream.seekg(0, std::ios::beg);
+auto fetch_transport_segments(const std::string& ip_id, const std::string& audio_id,
+                              GlobalState& gs, const std::string& server, DiskCache* cache,
+                              bool& flac_found) -> bool
+{
+  // Every playlist and segment below goes over the same few kept-alive connections
+  SegmentFetcher connection_pool(server);
+  SegmentPlan    plan;
+  connection_pool.set_cache(cache);
 
-  while (std::getline(segment_stream, line))
+  if (!plan_segments(connection_pool, ip_id, audio_id, plan))
   {
-    if (!line.empty() && line[0] != '#')
-    {
-      std::string segment_url = "/hls/" + ip_id + "/" + audio_id + "/" + line;
+    return false;
+  }
+  flac_found = plan.flac_found;
+
+  // The stream as received, for checking what the server sent (WAVY_TRACE builds only)
+  trace::dump("audio.raw", plan.init_segment.data(), plan.init_segment.size());
 
-      if (line.ends_with(macros::TRANSPORT_STREAM_EXT) || line.ends_with(macros::M4S_FILE_EXT))
+  std::vector<std::string> m4s_segments;
+
+  // Several segments are in flight at once, but they still arrive here in playlist order
+  fetch_plan(
+    connection_pool, plan,
+    [&](std::size_t index, std::string segment_data)
+    {
+      const std::string& name = plan.names[index];
+      if (segment_data.empty())
       {
-        std::string segment_data = perform_https_request(ioc, ctx, segment_url, server);
-        if (!segment_data.empty())
-        {
-          if (line.ends_with(macros::M4S_FILE_EXT))
-          {
-            m4s_segments.push_back(std::move(segment_data));
-          }
-          else
-          {
-            gs.transport_segments.push_back(std::move(segment_data));
-          }
+        LOG_WARNING << RECEIVER_LOG << "Failed to fetch segment: " << name;
+        return true;
+      }
 
-          LOG_DEBUG << RECEIVER_LOG << "Fetched segment: " << line;
-        }
-        else
-        {
-          LOG_WARNING << RECEIVER_LOG << "Failed to fetch segment: " << line;
-        }
+      trace::dump("audio.raw", segment_data.data(), segment_data.size());
+      if (name.ends_with(macros::M4S_FILE_EXT))
+      {
+        m4s_segments.push_back(std::move(segment_data));
       }
-    }
-  }
+      else
+      {
+        gs.transport_segments.push_back(std::move(segment_data));
+      }
+
+      LOG_DEBUG << RECEIVER_LOG << "Fetched segment: " << name;
+      return true;
+    });
+
+  LOG_DEBUG << RECEIVER_LOG << "TLS handshakes: " << connection_pool.handshakes() << " ("
+            << connection_pool.resumed_handshakes() << " resumed), cache hits: "
+            << connection_pool.cache_hits() << ", revalidated: " << connection_pool.revalidated();
 
   // Prepend init.mp4 ONCE before all .m4s segments
   if (!m4s_segments.empty())
   {
-    gs.transport_segments.push_back(std::move(init_mp4_data));
+    gs.transport_segments.push_back(std::move(plan.init_segment));
     gs.transport_segments.insert(gs.transport_segments.end(),
                                  std::make_move_iterator(m4s_segments.begin()),
                                  std::make_move_iterator(m4s_segments.end()));
   }
-  /************************************************************************************
-   *
-   * @NOTE
-   *
-   * To check the final file received from the server.
-   *
-   * if (!write_transport_segments_to_file(gs.transport_segments, "audio.raw"))
-   * {
-   *  LOG_ERROR << "Error writing transport segments to file";
-   *  return false;
-   * }
-   ***********************************************************************************/
-
-  if (!DBG_WriteTransportSegmentsToFile(gs.transport_segments, "audio.raw"))
-  {
-    LOG_ERROR << "Error writing transport segments to file";
-    return false;
-  }
 
   LOG_INFO << "Stored " << gs.transport_segments.size() << " transport segments.";
   return true;
 }
 
+// Device format for one of PcmConverter's output formats
+auto to_device_format(AVSampleFormat sample_fmt) -> ma_format
+{
+  switch (sample_fmt)
+  {
+    case AV_SAMPLE_FMT_U8:
+      return ma_format_u8;
+    case AV_SAMPLE_FMT_S16:
+      return ma_format_s16;
+    case AV_SAMPLE_FMT_S32:
+      return ma_format_s32;
+    case AV_SAMPLE_FMT_FLT:
+      return ma_format_f32;
+    default:
+      return ma_format_unknown;
+  }
+}
+
 auto decode_and_play(GlobalState& gs, bool& flac_found) -> bool
 {
   if (gs.transport_segments.empty())
@@ -243,17 +362,32 @@ auto decode_and_play(GlobalState& gs, bool& flac_found) -> bool
 
   MediaDecoder               decoder;
   std::vector<unsigned char> decoded_audio;
-  if (!decoder.decode(gs.transport_segments, decoded_audio))
+  PcmFormat                  pcm_format;
+  if (!decoder.decode(gs.transport_segments, decoded_audio, &pcm_format))
   {
     LOG_ERROR << "Decoding failed";
     return false;
   }
 
+  // The encoded segments are not needed any more; only the decoded audio stays in memory
+  std::vector<std::string>().swap(gs.transport_segments);
+
   try
   {
     LOG_INFO << "Starting audio playback...";
-    AudioPlayer player(decoded_audio, flac_found);
-    player.play();
+    std::optional<AudioPlayer> player;
+    if (pcm_format.sample_fmt != AV_SAMPLE_FMT_NONE)
+    {
+      // The decoder produced PCM and knows its exact layout
+      player.emplace(std::move(decoded_audio), to_device_format(pcm_format.sample_fmt),
+                     static_cast<ma_uint32>(pcm_format.channels),
+                     static_cast<ma_uint32>(pcm_format.sample_rate));
+    }
+    else
+    {
+      player.emplace(std::move(decoded_audio), flac_found);
+    }
+    player->play();
   }
   catch (const std::exception& e)
   {
@@ -264,39 +398,380 @@ auto decode_and_play(GlobalState& gs, bool& flac_found) -> bool
   return true;
 }
 
-auto fetch_client_list(const std::string& server, const std::string& target_ip_id)
-  -> std::vector<std::string>
+// Consecutive tracks of one PCM format share a ring and a device, so nothing separates them
+// in playback; a format change ends the run and the device is reopened for the next one.
+struct PlaybackRun
 {
-  net::io_context ioc;
-  ssl::context    ctx(ssl::context::tlsv12_client);
-  ctx.set_verify_mode(ssl::verify_none);
+  PcmFormat                       format;
+  std::shared_ptr<SpscRingBuffer> pcm;
+  std::atomic<bool>               ready{false}; // prebuffer of the run's first track reached
 
-  std::string response = perform_https_request(ioc, ctx, macros::SERVER_PATH_HLS_CLIENTS, server);
+  void mark_ready()
+  {
+    ready.store(true, std::memory_order_release);
+    ready.notify_all();
+  }
+};
 
-  std::istringstream       iss(response);
-  std::string              line;
-  std::string              current_ip_id;
-  std::vector<std::string> clients;
+// Runs in playing order, from the decoder thread to the thread driving the device
+class RunQueue
+{
+public:
+  void push(std::shared_ptr<PlaybackRun> run)
+  {
+    std::lock_guard lock(mutex_);
+    if (stopped_)
+    {
+      run->pcm->cancel(); // nothing will ever drain it
+      return;
+    }
+    runs_.push_back(std::move(run));
+    cv_.notify_one();
+  }
 
-  while (std::getline(iss, line))
+  // nullptr once closed and empty, or stopped
+  auto pop() -> std::shared_ptr<PlaybackRun>
+  {
+    std::unique_lock lock(mutex_);
+    cv_.wait(lock, [this] { return !runs_.empty() || closed_ || stopped_; });
+    if (stopped_ || runs_.empty())
+    {
+      return nullptr;
+    }
+    std::shared_ptr<PlaybackRun> run = std::move(runs_.front());
+    runs_.pop_front();
+    return run;
+  }
+
+  void close()
+  {
+    std::lock_guard lock(mutex_);
+    closed_ = true;
+    cv_.notify_all();
+  }
+
+  // Playback gave up: pending runs are cancelled, which unblocks their decoder
+  void stop()
+  {
+    std::lock_guard lock(mutex_);
+    stopped_ = true;
+    for (const std::shared_ptr<PlaybackRun>& run : runs_)
+    {
+      run->pcm->cancel();
+    }
+    runs_.clear();
+    cv_.notify_all();
+  }
+
+  [[nodiscard]] auto stopped() -> bool
+  {
+    std::lock_guard lock(mutex_);
+    return stopped_;
+  }
+
+private:
+  std::mutex                               mutex_;
+  std::condition_variable                  cv_;
+  std::deque<std::shared_ptr<PlaybackRun>> runs_;
+  bool                                     closed_  = false;
+  bool                                     stopped_ = false;
+};
+
+/*
+ * Fetches (on a thread of its own) and decodes (on this one) a track into the ring that
+ * open_output hands out.
+ *
+ * When the track has several renditions that can be mixed, each segment is taken from the one
+ * ABRManager picks right before it is requested, from the throughput of the segments before it
+ * and the audio buffered ahead of the device (PCM ring plus queued segments).
+ */
+auto stream_track(SegmentFetcher& connection_pool, const std::string& ip_id,
+                  const std::string& audio_id, std::size_t prebuffer,
+                  const std::function<SpscRingBuffer*(const PcmFormat&)>& open_output,
+                  const std::function<void(const PcmFormat*)>&              on_ready) -> bool
+{
+  std::vector<SegmentPlan> renditions;
+  if (!plan_renditions(connection_pool, ip_id, audio_id, true, renditions))
   {
-    if (line.empty())
-      continue;
+    on_ready(nullptr);
+    return false;
+  }
+
+  // The decoder is opened once per track, so segments can only be mixed across renditions that
+  // line up one to one and need no init segment (MPEG-TS). fMP4 stays on the highest one, and
+  // so does a live track, whose renditions are still growing at their own pace.
+  const bool switchable =
+    std::ranges::all_of(renditions,
+                        [&](const SegmentPlan& rendition)
+                        {
+                          return !rendition.init_request && !rendition.live &&
+                                 rendition.requests.size() == renditions.front().requests.size();
+                        });
+  if (!switchable)
+  {
+    renditions.erase(renditions.begin(), renditions.end() - 1);
+    LOG_INFO << RECEIVER_LOG << "Renditions cannot be switched mid-track, staying on "
+             << renditions.back().bandwidth << " bps";
+  }
+
+  if (!fetch_init_segment(connection_pool, renditions.back()))
+  {
+    on_ready(nullptr);
+    return false;
+  }
+
+  std::vector<std::uint64_t> bandwidths;
+  for (const SegmentPlan& rendition : renditions)
+  {
+    bandwidths.push_back(rendition.bandwidth);
+  }
+  ABRManager abr(std::move(bandwidths));
+
+  const std::vector<double>& durations       = renditions.front().durations;
+  const std::size_t          segment_count   = renditions.front().requests.size();
+  double                     segment_seconds = 0.0; // average, for segments still queued
+  if (segment_count > 0)
+  {
+    segment_seconds = std::accumulate(durations.begin(), durations.end(), 0.0) / segment_count;
+  }
 
-    if (line.find(':') != std::string::npos)
+  SegmentQueue segments(WAVY_CLIENT_SEGMENT_QUEUE_SIZE);
+
+  // Where the decoder writes, and how fast the device drains it, for the buffer level
+  std::atomic<const SpscRingBuffer*> pcm{nullptr};
+  std::atomic<double>                pcm_bytes_per_second{0.0};
+
+  const auto track_output = [&](const PcmFormat& format) -> SpscRingBuffer*
+  {
+    SpscRingBuffer* out = open_output(format);
+    pcm_bytes_per_second.store(static_cast<double>(av_get_bytes_per_sample(format.sample_fmt)) *
+                                 format.channels * format.sample_rate,
+                               std::memory_order_relaxed);
+    pcm.store(out, std::memory_order_release);
+    return out;
+  };
+
+  const auto buffered_seconds = [&]
+  {
+    double                seconds = static_cast<double>(segments.size()) * segment_seconds;
+    const SpscRingBuffer* ring    = pcm.load(std::memory_order_acquire);
+    const double          rate    = pcm_bytes_per_second.load(std::memory_order_relaxed);
+    if (ring && rate > 0.0)
     {
-      current_ip_id = line.substr(0, line.find(':')); // Extract the IP-ID
-      continue;
+      seconds += static_cast<double>(ring->available()) / rate;
     }
+    return seconds;
+  };
 
-    if (current_ip_id == target_ip_id) // Filter by the provided IP-ID
+  // The init segment is queued ahead of the media segments, so it does not count as prebuffer
+  SegmentPlan&      init_plan         = renditions.back();
+  const std::size_t decoder_prebuffer = prebuffer + (init_plan.init_segment.empty() ? 0 : 1);
+
+  std::thread fetch_thread(
+    [&]
     {
-      size_t pos = line.find("- ");
-      if (pos != std::string::npos)
+      trace::dump("audio.raw", init_plan.init_segment.data(), init_plan.init_segment.size());
+      if (!init_plan.init_segment.empty() && !segments.push(std::move(init_plan.init_segment)))
+      {
+        return;
+      }
+
+      const auto queue_segment = [&](const std::string& name, std::string segment_data)
       {
-        std::string client_id = line.substr(pos + 2); // Extract client ID
-        clients.push_back(client_id);
+        if (segment_data.empty())
+        {
+          LOG_WARNING << RECEIVER_LOG << "Failed to fetch segment: " << name;
+          return true;
+        }
+        LOG_DEBUG << RECEIVER_LOG << "Fetched segment: " << name;
+        trace::dump("audio.raw", segment_data.data(), segment_data.size());
+        return segments.push(std::move(segment_data)); // false once the decoder gave up
+      };
+
+      // Only touched from this thread: resolve and observe run inside fetch_all
+      std::vector<std::size_t> chosen(segment_count, 0);
+      std::size_t              current = abr.current();
+
+      if (init_plan.live)
+      {
+        fetch_plan(connection_pool, init_plan, [&](std::size_t index, std::string segment_data)
+                   { return queue_segment(init_plan.names[index], std::move(segment_data)); });
+        segments.close();
+        return;
       }
+
+      connection_pool.fetch_all(
+        segment_count,
+        [&](std::size_t index)
+        {
+          const double buffered = buffered_seconds();
+          chosen[index]         = abr.select(buffered);
+          if (chosen[index] != current)
+          {
+            LOG_INFO << RECEIVER_LOG << "Switching to " << renditions[chosen[index]].bandwidth
+                     << " bps at segment " << index << " ("
+                     << static_cast<std::uint64_t>(abr.estimate()) << " bps measured, "
+                     << buffered << " s buffered)";
+            current = chosen[index];
+          }
+          return renditions[chosen[index]].requests[index];
+        },
+        [&](std::size_t index, std::string segment_data)
+        { return queue_segment(renditions[chosen[index]].names[index], std::move(segment_data)); },
+        [&](std::size_t, std::size_t bytes, std::chrono::steady_clock::duration elapsed)
+        { abr.record_download(bytes, elapsed); });
+
+      LOG_DEBUG << RECEIVER_LOG << "TLS handshakes: " << connection_pool.handshakes() << " ("
+                << connection_pool.resumed_handshakes() << " resumed), cache hits: "
+                << connection_pool.cache_hits() << ", revalidated: "
+                << connection_pool.revalidated();
+      segments.close();
+    });
+
+  MediaDecoder decoder;
+  const bool   decoded = decoder.decode_stream(segments, track_output, decoder_prebuffer, on_ready);
+
+  // Unblocks the fetcher if decoding stopped early
+  segments.cancel();
+  fetch_thread.join();
+  return decoded;
+}
+
+/*
+ * Progressive, gapless playback of a queue of tracks:
+ *
+ *   fetcher thread -> SegmentQueue -> decoder thread -> SpscRingBuffer -> device callback
+ *
+ * Audio starts once `prebuffer` segments of the first track are decoded, instead of after the
+ * whole track, and memory is bounded by the queue and the ring rather than the track length.
+ * The decoder moves on to the next track as soon as the current one is fully in the ring, so the
+ * next track is already decoded (up to the ring size) when the current one ends.
+ */
+auto stream_and_play(const std::string& ip_id, const std::vector<std::string>& audio_ids,
+                     const std::string& server, std::size_t prebuffer, DiskCache* cache) -> bool
+{
+  const auto     started = std::chrono::steady_clock::now();
+  // Tracks are fetched one after the other. Few segments are requested ahead, so each variant
+  // choice is made close to when the segment is needed.
+  SegmentFetcher connection_pool(server, WAVY_CLIENT_FETCH_CONNECTIONS,
+                                 WAVY_CLIENT_ABR_FETCH_AHEAD);
+  connection_pool.set_cache(cache);
+  RunQueue       runs;
+  std::size_t    failed_tracks = 0;
+
+  std::thread decode_thread(
+    [&]
+    {
+      std::shared_ptr<PlaybackRun> run; // the run being filled
+
+      const auto open_output = [&](const PcmFormat& format) -> SpscRingBuffer*
+      {
+        if (!run || run->format != format)
+        {
+          if (run)
+          {
+            run->pcm->finish(); // the device drains it, then reopens in the new format
+            run->mark_ready();
+          }
+          run         = std::make_shared<PlaybackRun>();
+          run->format = format;
+          run->pcm    = std::make_shared<SpscRingBuffer>(
+            static_cast<std::size_t>(WAVY_CLIENT_PCM_RING_MIB) * 1024 * 1024);
+          runs.push(run);
+        }
+        return run->pcm.get();
+      };
+
+      const auto on_ready = [&](const PcmFormat*)
+      {
+        if (run)
+        {
+          run->mark_ready();
+        }
+      };
+
+      for (const std::string& audio_id : audio_ids)
+      {
+        if (runs.stopped())
+        {
+          break;
+        }
+        LOG_INFO << RECEIVER_LOG << "Streaming audio-id: " << audio_id;
+        if (!stream_track(connection_pool, ip_id, audio_id, prebuffer, open_output, on_ready))
+        {
+          LOG_ERROR << "Decoding failed for " << audio_id;
+          ++failed_tracks;
+        }
+      }
+
+      if (run)
+      {
+        run->pcm->finish();
+        run->mark_ready();
+      }
+      runs.close();
+    });
+
+  bool played_any = false;
+  bool failed     = false;
+
+  while (std::shared_ptr<PlaybackRun> run = runs.pop())
+  {
+    run->ready.wait(false, std::memory_order_acquire);
+
+    if (!played_any)
+    {
+      LOG_INFO << "Starting audio playback after "
+               << std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - started)
+                    .count()
+               << " ms (" << run->pcm->available() << " bytes buffered)";
+    }
+
+    try
+    {
+      AudioPlayer player(*run->pcm, to_device_format(run->format.sample_fmt),
+                         static_cast<ma_uint32>(run->format.channels),
+                         static_cast<ma_uint32>(run->format.sample_rate));
+      player.play();
+      played_any = true;
+    }
+    catch (const std::exception& e)
+    {
+      LOG_ERROR << "Audio playback error: " << e.what();
+      run->pcm->cancel(); // unblocks the decoder, and through the queue, the fetcher
+      failed = true;
+      break;
+    }
+  }
+
+  runs.stop();
+  decode_thread.join();
+
+  return played_any && !failed && failed_tracks == 0;
+}
+
+auto fetch_client_list(const std::string& server, const std::string& target_ip_id)
+  -> std::vector<std::string>
+{
+  SegmentFetcher connection_pool(server, 1);
+
+  // Only this owner's audio-ids are sent back, rather than the whole server listing
+  const std::string target =
+    macros::to_string(macros::SERVER_PATH_HLS_CLIENTS) + "?ip=" + target_ip_id;
+  std::string response = connection_pool.get(target);
+
+  std::istringstream       iss(response);
+  std::string              line;
+  std::vector<std::string> clients;
+
+  while (std::getline(iss, line))
+  {
+    // "<ip-id>:" header lines are followed by "  - <audio-id>" entries
+    size_t pos = line.find("  - ");
+    if (pos == 0)
+    {
+      clients.push_back(line.substr(4)); // Extract client ID
     }
   }
 
@@ -322,36 +797,82 @@ auto main(int argc, char* argv[]) -> int
 {
   logger::init_logging();
 
-  if (argc < 3)
+  if (argc < 4)
   {
-    LOG_ERROR << "Usage: " << argv[0] << " <ip-id> <index> <server-ip>";
+    LOG_ERROR << "Usage: " << argv[0]
+              << " <ip-id> <index>[,<index>...] <server-ip> [--prebuffer <segments>] [--download]"
+                 " [--no-cache]";
     return EXIT_FAILURE;
   }
 
-  std::string ip_id  = argv[1];
-  int         index  = std::stoi(argv[2]);
-  std::string server = argv[3];
+  std::string ip_id     = argv[1];
+  std::string indices   = argv[2]; // tracks to play, in order
+  std::string server    = argv[3];
+  std::size_t prebuffer = WAVY_CLIENT_PREBUFFER_SEGMENTS;
+  bool        download  = false; // fetch and decode the whole track before playing it
+  bool        use_cache = true;  // keep fetched files in DiskCache::default_root()
+
+  for (int i = 4; i < argc; ++i)
+  {
+    if (strcmp(argv[i], "--prebuffer") == 0 && i + 1 < argc)
+    {
+      prebuffer = std::stoul(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--download") == 0)
+    {
+      download = true;
+    }
+    else if (strcmp(argv[i], "--no-cache") == 0)
+    {
+      use_cache = false;
+    }
+    else
+    {
+      LOG_ERROR << "Unknown option: " << argv[i];
+      return EXIT_FAILURE;
+    }
+  }
 
   std::vector<std::string> clients = fetch_client_list(server, ip_id);
 
-  if (index < 0 || index >= static_cast<int>(clients.size()))
+  std::vector<std::string> audio_ids;
+  std::istringstream       index_list(indices);
+  std::string              token;
+
+  while (std::getline(index_list, token, ','))
   {
-    LOG_ERROR << "Invalid index. Available range: 0 to " << clients.size() - 1;
-    return EXIT_FAILURE;
+    int index = std::stoi(token);
+    if (index < 0 || index >= static_cast<int>(clients.size()))
+    {
+      LOG_ERROR << "Invalid index. Available range: 0 to " << clients.size() - 1;
+      return EXIT_FAILURE;
+    }
+    audio_ids.push_back(clients[index]);
   }
 
-  std::string audio_id   = clients[index];
-  bool        flac_found = false;
-  GlobalState gs;
+  DiskCache cache(use_cache ? DiskCache::default_root() : std::filesystem::path{},
+                  static_cast<std::uint64_t>(WAVY_CLIENT_CACHE_MIB) * 1024 * 1024);
 
-  if (!fetch_transport_segments(ip_id, audio_id, gs, server, flac_found))
+  if (!download)
   {
-    return EXIT_FAILURE;
+    return stream_and_play(ip_id, audio_ids, server, prebuffer, &cache) ? EXIT_SUCCESS
+                                                                        : EXIT_FAILURE;
   }
 
-  if (!decode_and_play(gs, flac_found))
+  for (const std::string& audio_id : audio_ids)
   {
-    return EXIT_FAILURE;
+    bool        flac_found = false;
+    GlobalState gs;
+
+    if (!fetch_transport_segments(ip_id, audio_id, gs, server, &cache, flac_found))
+    {
+      return EXIT_FAILURE;
+    }
+
+    if (!decode_and_play(gs, flac_found))
+    {
+      return EXIT_FAILURE;
+    }
   }
 
   return EXIT_SUCCESS;
@@ -5,15 +5,33 @@
 #include <boost/asio/ssl.hpp>
 #include <boost/beast.hpp>
 #include <boost/beast/ssl.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <fcntl.h>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <mutex>
+#include <optional>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
-#include "../include/compression.h"
+#include "../include/batch.hpp"
+#include "../include/digest.hpp"
 #include "../include/logger.hpp"
+#include "../include/m3u8.hpp"
 #include "../include/macros.hpp"
+#include "../include/mp4_box.hpp"
+#include "../include/zstd_archive.hpp"
 
 /*
  * DISPATCHER
@@ -56,8 +74,8 @@
  *
  * We are using a modified ZStandard algorithm taken from Facebook's ZSTD repository.
  *
- * The ZSTD compression is a C source file called into the dispatcher which is externed into this
- * dispatcher. It is then bundled into a `hls_data.tar.gz` (check macros.hpp)
+ * Every playlist and transport stream is ZSTD compressed in memory, in parallel, and bundled
+ * into a `hls_data.tar.gz` (check macros.hpp) as it goes. See zstd_archive.hpp.
  *
  * Also considering the fact that .ts are binary (octet-stream) data and .m3u8 is plain-text so
  * compression algorithm like ZSTD is perfect for this.
@@ -65,6 +83,9 @@
  * Each transport stream on average had their content size reduced by ~30%
  * Each playlist file on average had their content size reduced by ~70+%
  *
+ * Small files compress far better against a dictionary trained on the upload itself, which is
+ * sent along as the first archive entry (see zstd_archive.hpp).
+ *
  * This gives pretty good results overall, as the overall file size between simple compression using
  * TAR or GZIP, etc. do not achieve ZSTD+GZIP compression.
  *
@@ -107,33 +128,454 @@ enum class PlaylistFormat
   FMP4
 };
 
+/*
+ * UPLOADER
+ *
+ * Sends archives as chunked uploads (the protocol is described in server/chunked_upload.hpp).
+ * The archive is announced with its size and then sent in the server's chunk size, each chunk
+ * with its SHA-256, over `streams` TLS connections at once.
+ *
+ * -> The connections ask for keep-alive and stay open between archives, so a batch that sends
+ *    many archives through one Uploader pays for its handshakes once, not once per track.
+ *
+ * -> A request whose connection fails is sent again on a fresh one, and a 503 after a growing
+ *    delay, kAttempts times in all. A kept-alive connection the server has closed in the
+ *    meantime only shows when the next request fails on it; that retry is immediate.
+ *
+ * -> The upload-id is kept next to the archive ("<archive>.upload") until the upload is through.
+ *    A rerun after a failure or a crash asks the server how much of it arrived and continues
+ *    from there instead of from zero.
+ *
+ * -> The server answers a chunk only once it has appended it in order, so chunks sent after one
+ *    that keeps failing would wait on it forever. The first stream to give up interrupts the
+ *    others.
+ */
+class Uploader
+{
+public:
+  static constexpr int kAttempts = 5;
+
+  Uploader(std::string server, std::string port,
+           std::size_t streams = WAVY_DISPATCH_UPLOAD_STREAMS)
+      : ssl_ctx_(ssl::context::sslv23), server_(std::move(server)), port_(std::move(port))
+  {
+    ssl_ctx_.set_default_verify_paths();
+    for (std::size_t i = 0; i < std::max<std::size_t>(1, streams); ++i)
+    {
+      connections_.push_back(std::make_unique<Connection>(*this));
+    }
+  }
+
+  Uploader(const Uploader&)                    = delete;
+  auto operator=(const Uploader&) -> Uploader& = delete;
+
+  ~Uploader() { close(); }
+
+  // Uploads the archive; on success `client_id` is the audio-id the server stored it under
+  auto upload(const std::string& archive_path, std::string& client_id) -> bool
+  {
+    std::error_code     ec;
+    const std::uint64_t size = fs::file_size(archive_path, ec);
+    if (ec || size == 0)
+    {
+      LOG_ERROR << DISPATCH_LOG << "Failed to open archive file: " << archive_path;
+      return false;
+    }
+
+    const std::string id_path = session_path(archive_path);
+    Session           session;
+    if (!resume(id_path, size, session) && !create(size, session))
+    {
+      return false;
+    }
+
+    if (session.client_id.empty())
+    {
+      std::ofstream(id_path) << session.id << "\n";
+      if (!send_chunks(archive_path, size, session))
+      {
+        LOG_ERROR << DISPATCH_LOG << "Upload failed, a rerun resumes it: " << archive_path;
+        return false;
+      }
+    }
+
+    fs::remove(id_path, ec);
+    client_id = session.client_id;
+    LOG_INFO << "Parsed Client-ID: " << client_id;
+    LOG_INFO << DISPATCH_LOG << "Upload process completed successfully.";
+    return true;
+  }
+
+  // Where the upload-id of an archive is kept while its upload is unfinished
+  [[nodiscard]] static auto session_path(const std::string& archive_path) -> std::string
+  {
+    return archive_path + ".upload";
+  }
+
+  // Graceful TLS shutdown of every open connection
+  void close()
+  {
+    for (const std::unique_ptr<Connection>& connection : connections_)
+    {
+      connection->close();
+    }
+  }
+
+private:
+  using Request  = http::request<http::string_body>;
+  using Response = http::response<http::string_body>;
+
+  struct Session
+  {
+    std::string   id;
+    std::uint64_t chunk_size = 0;
+    std::uint64_t offset     = 0; // received by the server
+    std::string   client_id;      // set once the server has stored the payload
+  };
+
+  class Connection
+  {
+  public:
+    explicit Connection(Uploader& owner) : owner_(owner), resolver_(context_) {}
+
+    /*
+     * Sends `req` and reads its response, retrying as described above. False if no response
+     * other than a 503 came back, or if `cancel` was set in the meantime.
+     */
+    auto exchange(Request& req, Response& res, const std::atomic<bool>* cancel = nullptr)
+      -> bool
+    {
+      for (int attempt = 1; attempt <= kAttempts && !(cancel && *cancel); ++attempt)
+      {
+        const bool reused = stream_.has_value();
+        if (!reused && !connect())
+        {
+          std::this_thread::sleep_for(std::chrono::seconds(attempt));
+          continue;
+        }
+
+        res = {};
+        if (!round_trip(req, res))
+        {
+          if (!reused)
+          {
+            std::this_thread::sleep_for(std::chrono::seconds(attempt));
+          }
+          continue;
+        }
+
+        if (res.result() != http::status::service_unavailable)
+        {
+          return true;
+        }
+        LOG_WARNING << DISPATCH_LOG << "Server busy, retrying " << req.target();
+        std::this_thread::sleep_for(std::chrono::seconds(attempt));
+      }
+
+      LOG_ERROR << DISPATCH_LOG << "No response to " << req.method_string() << " "
+                << req.target() << " after " << kAttempts << " attempts";
+      return false;
+    }
+
+    // Makes a request blocked on this connection in another thread fail straight away
+    void interrupt()
+    {
+      std::lock_guard lock(mutex_);
+      if (stream_)
+      {
+        ::shutdown(stream_->next_layer().native_handle(), SHUT_RDWR);
+      }
+    }
+
+    void close()
+    {
+      std::lock_guard lock(mutex_);
+      if (!stream_)
+      {
+        return;
+      }
+
+      boost::system::error_code ec;
+      stream_->shutdown(ec);
+      if (ec && ec != boost::asio::error::eof) // eof: the server closed the connection cleanly
+      {
+        LOG_ERROR << DISPATCH_LOG << "SSL shutdown failed: " << ec.message();
+      }
+      stream_.reset();
+    }
+
+  private:
+    Uploader&                                     owner_;
+    net::io_context                               context_;
+    tcp::resolver                                 resolver_;
+    std::mutex                                    mutex_; // stream_ against interrupt()
+    std::optional<beast::ssl_stream<tcp::socket>> stream_;
+
+    auto connect() -> bool
+    {
+      try
+      {
+        std::lock_guard lock(mutex_);
+        stream_.emplace(context_, owner_.ssl_ctx_);
+        stream_->set_verify_mode(boost::asio::ssl::verify_none); // [TODO]: Improve SSL verification
+
+        auto const results = resolver_.resolve(owner_.server_, owner_.port_);
+        net::connect(stream_->next_layer(), results.begin(), results.end());
+        stream_->handshake(ssl::stream_base::client);
+        return true;
+      }
+      catch (const std::exception& e)
+      {
+        LOG_ERROR << DISPATCH_LOG << "Failed to connect to " << owner_.server_ << ":"
+                  << owner_.port_ << ": " << e.what();
+        std::lock_guard lock(mutex_);
+        stream_.reset();
+        return false;
+      }
+    }
+
+    auto round_trip(Request& req, Response& res) -> bool
+    {
+      beast::error_code ec;
+      http::write(*stream_, req, ec);
+      if (ec)
+      {
+        LOG_WARNING << DISPATCH_LOG << "Failed to send request: " << ec.message();
+        reset();
+        return false;
+      }
+
+      beast::flat_buffer buffer;
+      http::read(*stream_, buffer, res, ec);
+      if (ec)
+      {
+        LOG_WARNING << DISPATCH_LOG << "Failed to read response: " << ec.message();
+        reset();
+        return false;
+      }
+
+      if (!res.keep_alive())
+      {
+        close();
+      }
+      return true;
+    }
+
+    void reset()
+    {
+      std::lock_guard lock(mutex_);
+      stream_.reset();
+    }
+  };
+
+  ssl::context                             ssl_ctx_;
+  std::string                              server_, port_;
+  std::vector<std::unique_ptr<Connection>> connections_;
+
+  static auto parse_u64(std::string_view digits, std::uint64_t& value) -> bool
+  {
+    const auto [end, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), value);
+    return !digits.empty() && ec == std::errc{} && end == digits.data() + digits.size();
+  }
+
+  [[nodiscard]] auto request(http::verb verb, const std::string& target) const -> Request
+  {
+    Request req{verb, target, 11};
+    req.set(http::field::host, server_);
+    req.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+    req.keep_alive(true);
+    return req;
+  }
+
+  [[nodiscard]] static auto upload_target(const std::string& id) -> std::string
+  {
+    return macros::to_string(macros::SERVER_PATH_UPLOAD) + "/" + id;
+  }
+
+  // Picks up the upload recorded in `id_path`, if the server still has it
+  auto resume(const std::string& id_path, std::uint64_t size, Session& session) -> bool
+  {
+    std::ifstream file(id_path);
+    if (!(file >> session.id))
+    {
+      return false;
+    }
+
+    Request req = request(http::verb::get, upload_target(session.id));
+    req.prepare_payload();
+    Response res;
+    if (!connections_.front()->exchange(req, res))
+    {
+      return false;
+    }
+
+    if (res.result() == http::status::ok)
+    {
+      session.client_id = std::string(res["Client-ID"]);
+      return !session.client_id.empty();
+    }
+    std::uint64_t length = 0;
+    if (res.result() != http::status::no_content ||
+        !parse_u64(res[macros::UPLOAD_HEADER_OFFSET], session.offset) ||
+        !parse_u64(res[macros::UPLOAD_HEADER_CHUNK_SIZE], session.chunk_size) ||
+        !parse_u64(res[macros::UPLOAD_HEADER_LENGTH], length) || length != size ||
+        session.chunk_size == 0 || session.offset % session.chunk_size != 0)
+    {
+      LOG_INFO << DISPATCH_LOG << "Upload " << session.id << " cannot be resumed, restarting";
+      return false;
+    }
+
+    LOG_INFO << DISPATCH_LOG << "Resuming upload " << session.id << " at " << session.offset
+             << " of " << size << " bytes";
+    return true;
+  }
+
+  auto create(std::uint64_t size, Session& session) -> bool
+  {
+    Request req = request(http::verb::post, macros::to_string(macros::SERVER_PATH_UPLOAD));
+    req.set(macros::UPLOAD_HEADER_LENGTH, std::to_string(size));
+    req.prepare_payload();
+    Response res;
+    if (!connections_.front()->exchange(req, res))
+    {
+      return false;
+    }
+
+    session = {};
+    session.id = std::string(res[macros::UPLOAD_HEADER_ID]);
+    if (res.result() != http::status::created || session.id.empty() ||
+        !parse_u64(res[macros::UPLOAD_HEADER_CHUNK_SIZE], session.chunk_size) ||
+        session.chunk_size == 0)
+    {
+      LOG_ERROR << DISPATCH_LOG << "Upload rejected (" << res.result_int() << "): " << res.body();
+      return false;
+    }
+    return true;
+  }
+
+  // Sends every chunk from the session's offset on, one stream per connection
+  auto send_chunks(const std::string& archive_path, std::uint64_t size, Session& session) -> bool
+  {
+    const int fd = ::open(archive_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+      LOG_ERROR << DISPATCH_LOG << "Failed to open archive file: " << archive_path;
+      return false;
+    }
+
+    const std::uint64_t        chunks = (size + session.chunk_size - 1) / session.chunk_size;
+    std::atomic<std::uint64_t> next{session.offset / session.chunk_size};
+    std::atomic<bool>          failed{false};
+    std::mutex                 mutex; // session.client_id
+
+    auto fail = [&]
+    {
+      if (!failed.exchange(true))
+      {
+        for (const std::unique_ptr<Connection>& connection : connections_)
+        {
+          connection->interrupt();
+        }
+      }
+    };
+
+    auto stream = [&](Connection& connection)
+    {
+      std::string data; // reused for every chunk of this stream
+      for (std::uint64_t index; !failed && (index = next++) < chunks;)
+      {
+        const std::uint64_t offset = index * session.chunk_size;
+        data.resize(std::min(session.chunk_size, size - offset));
+        for (std::size_t done = 0; done < data.size();)
+        {
+          const ssize_t n = ::pread(fd, data.data() + done, data.size() - done,
+                                    static_cast<off_t>(offset + done));
+          if (n <= 0)
+          {
+            LOG_ERROR << DISPATCH_LOG << "Failed to read " << archive_path;
+            fail();
+            return;
+          }
+          done += static_cast<std::size_t>(n);
+        }
+
+        Request req = request(http::verb::put, upload_target(session.id));
+        req.set(http::field::content_type, macros::CONTENT_TYPE_COMPRESSION);
+        req.set(macros::UPLOAD_HEADER_OFFSET, std::to_string(offset));
+        req.set(macros::UPLOAD_HEADER_CHECKSUM, digest::sha256(data.data(), data.size()));
+        req.body() = std::move(data);
+        req.prepare_payload();
+
+        Response res;
+        if (!connection.exchange(req, res, &failed))
+        {
+          fail();
+          return;
+        }
+        data = std::move(req.body());
+
+        if (res.result() == http::status::ok)
+        {
+          std::lock_guard lock(mutex);
+          session.client_id = std::string(res["Client-ID"]);
+        }
+        else if (res.result() != http::status::no_content)
+        {
+          LOG_ERROR << DISPATCH_LOG << "Chunk at " << offset << " rejected (" << res.result_int()
+                    << "): " << res.body();
+          fail();
+          return;
+        }
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for (std::size_t i = 1; i < connections_.size(); ++i)
+    {
+      threads.emplace_back(stream, std::ref(*connections_[i]));
+    }
+    stream(*connections_.front());
+    for (std::thread& thread : threads)
+    {
+      thread.join();
+    }
+    ::close(fd);
+
+    if (failed)
+    {
+      close(); // interrupted connections are no good for the next archive
+      return false;
+    }
+    return !session.client_id.empty();
+  }
+};
+
 class Dispatcher
 {
 public:
-  Dispatcher(std::string server, std::string port, std::string directory, std::string playlist_name)
-      : ssl_ctx_(ssl::context::sslv23), resolver_(context_), stream_(context_, ssl_ctx_),
-        server_(std::move(server)), port_(std::move(port)), directory_(std::move(directory)),
-        playlist_name_(std::move(playlist_name))
+  Dispatcher(std::string directory, std::string playlist_name)
+      : directory_(std::move(directory)), playlist_name_(std::move(playlist_name))
   {
     if (!fs::exists(directory_))
     {
       LOG_ERROR << DISPATCH_LOG << "Directory does not exist: " << directory_;
       throw std::runtime_error("Directory does not exist: " + directory_);
     }
-
-    ssl_ctx_.set_default_verify_paths();
-    stream_.set_verify_mode(boost::asio::ssl::verify_none); // [TODO]: Improve SSL verification
   }
 
-  auto process_and_upload() -> bool
+  /*
+   * Verifies, compresses and uploads the directory; `client_id` is set to its audio-id.
+   * Dispatchers running at the same time (batch mode) each need their own `archiver`.
+   */
+  auto process_and_upload(Uploader& uploader, ZstdArchiver& archiver, std::string& client_id)
+    -> bool
   {
-    if (fs::exists(macros::DISPATCH_ARCHIVE_REL_PATH))
+    // Only ever renamed into place once complete (see compress_files)
+    std::string archive_path = fs::path(directory_) / macros::DISPATCH_ARCHIVE_NAME;
+    if (fs::exists(archive_path))
     {
-      LOG_DEBUG << DISPATCH_LOG << "Payload already exists, checking for "
-                << macros::DISPATCH_ARCHIVE_NAME << "...";
-      std::string archive_path = fs::path(directory_) / macros::DISPATCH_ARCHIVE_NAME;
-      if (fs::exists(archive_path))
-        return upload_to_server(archive_path);
+      LOG_DEBUG << DISPATCH_LOG << "Archive already exists, uploading " << archive_path;
+      return uploader.upload(archive_path, client_id);
     }
 
     std::string master_playlist_path = fs::path(directory_) / playlist_name_;
@@ -154,8 +596,7 @@ public:
     print_hierarchy();
 #endif
 
-    std::string archive_path  = fs::path(directory_) / macros::DISPATCH_ARCHIVE_NAME;
-    bool        applyZSTDComp = true;
+    bool applyZSTDComp = true;
     if (playlist_format == PlaylistFormat::FMP4)
     {
       LOG_DEBUG << DISPATCH_LOG
@@ -164,31 +605,38 @@ public:
       applyZSTDComp = false;
     }
 
-    if (!compress_files(archive_path, applyZSTDComp))
+    if (!compress_files(archive_path, applyZSTDComp, archiver))
     {
       LOG_ERROR << DISPATCH_LOG << "Compression failed.";
       return false;
     }
 
-    return upload_to_server(archive_path);
+    return uploader.upload(archive_path, client_id);
   }
 
 private:
-  net::io_context                context_;
-  PlaylistFormat                 playlist_format = PlaylistFormat::UNKNOWN;
-  ssl::context                   ssl_ctx_;
-  tcp::resolver                  resolver_;
-  beast::ssl_stream<tcp::socket> stream_;
-  std::string                    server_, port_, directory_, playlist_name_;
+  PlaylistFormat playlist_format = PlaylistFormat::UNKNOWN;
+  std::string    directory_, playlist_name_;
 
   std::unordered_map<std::string, std::vector<std::string>> reference_playlists_;
   std::vector<std::string>                                  transport_streams_;
   std::string                                               master_playlist_content_;
 
-  auto verify_master_playlist(const std::string& path) -> bool
+  // Whole file in one read; false if it cannot be opened
+  static auto read_file(const std::string& path, std::string& content) -> bool
   {
-    std::ifstream file(path);
+    std::ifstream file(path, std::ios::binary);
     if (!file.is_open())
+    {
+      return false;
+    }
+    content.assign(std::istreambuf_iterator<char>(file), {});
+    return true;
+  }
+
+  auto verify_master_playlist(const std::string& path) -> bool
+  {
+    if (!read_file(path, master_playlist_content_))
     {
       LOG_ERROR << DISPATCH_LOG << "Failed to open master playlist: " << path;
       return false;
@@ -196,32 +644,31 @@ private:
 
     LOG_INFO << DISPATCH_LOG << "Found master playlist: " << path;
 
-    std::string line;
-    bool        has_stream_inf = false;
-    while (std::getline(file, line))
+    m3u8::Playlist playlist;
+    if (!m3u8::parse(master_playlist_content_, playlist))
     {
-      if (line.find(macros::PLAYLIST_VARIANT_TAG) != std::string::npos)
-      {
-        has_stream_inf = true;
-        if (!std::getline(file, line) || line.empty() ||
-            line.find(macros::PLAYLIST_EXT) == std::string::npos)
-        {
-          LOG_ERROR << DISPATCH_LOG << "Invalid reference playlist in master.";
-          return false;
-        }
-        std::string playlist_path           = fs::path(directory_) / line;
-        reference_playlists_[playlist_path] = {}; // Store referenced playlists
-        LOG_INFO << DISPATCH_LOG << "Found reference playlist: " << playlist_path;
-      }
+      LOG_ERROR << DISPATCH_LOG << "Missing " << macros::PLAYLIST_GLOBAL_HEADER << " in: " << path;
+      return false;
     }
 
-    if (!has_stream_inf)
+    if (!playlist.is_master())
     {
       LOG_WARNING << DISPATCH_LOG << "No valid streams found in master playlist.";
       return false;
     }
 
-    master_playlist_content_ = std::string(std::istreambuf_iterator<char>(file), {});
+    for (const m3u8::Variant& variant : playlist.variants)
+    {
+      if (!variant.uri.ends_with(macros::PLAYLIST_EXT))
+      {
+        LOG_ERROR << DISPATCH_LOG << "Invalid reference playlist in master.";
+        return false;
+      }
+      std::string playlist_path           = fs::path(directory_) / variant.uri;
+      reference_playlists_[playlist_path] = {}; // Store referenced playlists
+      LOG_INFO << DISPATCH_LOG << "Found reference playlist: " << playlist_path;
+    }
+
     LOG_INFO << DISPATCH_LOG << "Master playlist verified successfully.";
     return true;
   }
@@ -230,23 +677,55 @@ private:
   {
     std::vector<std::string> mp4_segments_;
     std::vector<std::string> transport_streams_;
+    std::string              content;  // playlist text, reused across playlists
+    m3u8::Playlist           playlist; // views into `content`
 
     for (auto& [playlist_path, segments] : reference_playlists_)
     {
-      std::ifstream file(playlist_path);
-      if (!file.is_open())
+      if (!read_file(playlist_path, content) || !m3u8::parse(content, playlist))
       {
         LOG_ERROR << DISPATCH_LOG << "Missing referenced playlist: " << playlist_path;
         return false;
       }
 
-      std::string line;
+      mp4::Timeline timeline;         // fMP4 fragments of this playlist, in playback order
+      std::uint32_t trex_default = 0; // default sample duration from the playlist's init segment
 
-      while (std::getline(file, line))
+      // Media files of this playlist that have already been checked
+      std::unordered_set<std::string> validated;
+
+      if (playlist.map)
       {
-        std::string segment_path = fs::path(directory_) / line;
+        if (playlist.map->uri.empty())
+        {
+          LOG_ERROR << DISPATCH_LOG << "Malformed EXT-X-MAP in: " << playlist_path;
+          return false;
+        }
 
-        if (line.find(macros::TRANSPORT_STREAM_EXT) != std::string::npos)
+        const std::string init_path = fs::path(directory_) / playlist.map->uri;
+        std::string       error;
+        auto              init = mp4::parse_file(init_path, error);
+        if (!init || !init->is_init_segment())
+        {
+          LOG_ERROR << DISPATCH_LOG << "Invalid init segment " << init_path << ": "
+                    << (init ? "missing ftyp/moov" : error);
+          return false;
+        }
+        trex_default = init->trex_default_duration;
+      }
+
+      for (const m3u8::Segment& segment : playlist.segments)
+      {
+        std::string segment_path = fs::path(directory_) / segment.uri;
+
+        // A single-file rendition (--single-file) names the same media file once per
+        // #EXT-X-BYTERANGE segment; walk it only once
+        if (!validated.insert(segment_path).second)
+        {
+          continue;
+        }
+
+        if (segment.uri.ends_with(macros::TRANSPORT_STREAM_EXT))
         {
           if (playlist_format == PlaylistFormat::FMP4)
           {
@@ -276,7 +755,7 @@ private:
           transport_streams_.push_back(segment_path);
           LOG_INFO << DISPATCH_LOG << "Found valid transport stream: " << segment_path;
         }
-        else if (line.find(macros::M4S_FILE_EXT) != std::string::npos)
+        else if (segment.uri.ends_with(macros::M4S_FILE_EXT))
         {
           if (playlist_format == PlaylistFormat::TRANSPORT_STREAM)
           {
@@ -286,18 +765,11 @@ private:
           }
           playlist_format = PlaylistFormat::FMP4;
 
-          std::ifstream m4s_file(segment_path, std::ios::binary);
-          if (!m4s_file.is_open())
+          if (!validate_m4s(segment_path, trex_default, timeline))
           {
-            LOG_ERROR << DISPATCH_LOG << "Failed to open .m4s file: " << segment_path;
             return false;
           }
 
-          if (!validate_m4s(segment_path))
-          {
-            LOG_WARNING << DISPATCH_LOG << "M4S segment check failed: " << segment_path;
-          }
-
           mp4_segments_.push_back(segment_path);
           LOG_INFO << DISPATCH_LOG << "Found valid .m4s segment: " << segment_path;
         }
@@ -328,97 +800,84 @@ private:
     return true;
   }
 
-  auto validate_m4s(const std::string& m4s_path) -> bool
+  /*
+   * Walks the segment's boxes (see mp4_box.hpp) and checks that its fragments continue exactly
+   * where the previous segment of the same playlist ended. A broken box structure fails the
+   * dispatch; a decode time gap is only reported, the stream is still playable.
+   */
+  auto validate_m4s(const std::string& m4s_path, std::uint32_t trex_default,
+                    mp4::Timeline& timeline) -> bool
   {
-    std::ifstream file(m4s_path, std::ios::binary);
-    if (!file.is_open())
+    std::string error;
+    auto        info = mp4::parse_file(m4s_path, error, trex_default);
+    if (!info)
     {
-      LOG_ERROR << DISPATCH_LOG << "Failed to open .m4s file: " << m4s_path;
+      LOG_ERROR << DISPATCH_LOG << "Invalid .m4s segment " << m4s_path << ": " << error;
       return false;
     }
 
-    char header[8] = {0};
-    file.read(header, 8); // Read the first 8 bytes
-
-    if (std::string(header, 4) != "ftyp" && std::string(header, 4) != "moof")
+    if (!timeline.append(*info, error))
     {
-      return false;
+      LOG_WARNING << DISPATCH_LOG << "Discontinuous .m4s segment " << m4s_path << ": " << error;
     }
 
-    LOG_INFO << DISPATCH_LOG << "Valid .m4s file: " << m4s_path;
+    LOG_DEBUG << DISPATCH_LOG << "Valid .m4s file: " << m4s_path;
     return true;
   }
 
-  auto compress_files(const std::string& output_archive_path, const bool applyZSTDComp) -> bool
+  auto compress_files(const std::string& output_archive_path, const bool applyZSTDComp,
+                      ZstdArchiver& archiver) -> bool
   {
     LOG_DEBUG << DISPATCH_LOG << "Beginning Compression Job in: " << output_archive_path << " from "
               << fs::absolute(directory_);
-    /* ZSTD_compressFilesInDirectory is a C source function (FFI) */
-    if (applyZSTDComp)
+
+    /*
+     * Every regular file of the directory but the archive itself, in name order so the archive
+     * comes out the same on every run. Since MP4 and M4S files have minimal viability for
+     * compression, they are stored as they are.
+     */
+    std::vector<ZstdArchiver::File> files;
+    std::error_code                 ec;
+    for (const auto& entry : fs::directory_iterator(directory_, ec))
     {
-      if (!ZSTD_compressFilesInDirectory(
-            fs::path(directory_).c_str(),
-            macros::to_string(macros::DISPATCH_ARCHIVE_REL_PATH).c_str()))
+      const std::string name = entry.path().filename().string();
+      if (name.starts_with('.') || name.starts_with(macros::DISPATCH_ARCHIVE_NAME) ||
+          !entry.is_regular_file(ec))
       {
-        LOG_ERROR << DISPATCH_LOG << "Something went wrong with Zstd compression.";
-        return false;
+        continue;
       }
+      files.push_back({entry.path().string(), name, applyZSTDComp});
     }
+    if (ec)
+    {
+      LOG_ERROR << DISPATCH_LOG << "Failed to list " << directory_ << ": " << ec.message();
+      return false;
+    }
+    std::ranges::sort(files, {}, &ZstdArchiver::File::name);
+
+    // Written under a temporary name and renamed when complete, so a dispatch that dies midway
+    // never leaves a truncated archive behind for the next run to upload
+    const std::string partial_archive_path = output_archive_path + ".part";
 
     struct archive* archive = archive_write_new();
     archive_write_add_filter_gzip(archive);
     archive_write_set_format_pax_restricted(archive);
 
-    if (archive_write_open_filename(archive, output_archive_path.c_str()) != ARCHIVE_OK)
+    if (archive_write_open_filename(archive, partial_archive_path.c_str()) != ARCHIVE_OK)
     {
       LOG_ERROR << DISPATCH_LOG << "Failed to create archive: " << output_archive_path;
+      archive_write_free(archive);
       return false;
     }
 
-    auto add_file_to_archive = [&](const std::string& file_path) -> bool
+    // Only the ZSTD compressed files are trained on and compressed with it
+    const std::string dictionary = applyZSTDComp ? ZstdArchiver::train_dictionary(files) : "";
+    if (!archiver.write(archive, files, dictionary))
     {
-      std::ifstream file(file_path, std::ios::binary);
-      if (!file)
-      {
-        LOG_ERROR << DISPATCH_LOG << "Failed to open file: " << file_path;
-        return false;
-      }
-
-      std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-      struct archive_entry* entry = archive_entry_new();
-      archive_entry_set_pathname(entry, fs::path(file_path).filename().string().c_str());
-      archive_entry_set_size(entry, content.size());
-      archive_entry_set_filetype(entry, AE_IFREG);
-      archive_entry_set_perm(entry, 0644);
-      archive_write_header(archive, entry);
-      archive_write_data(archive, content.data(), content.size());
-      archive_entry_free(entry);
-      return true;
-    };
-
-    /* Payload directory is only created if we compress each stream segment into
-     * ZSTD files.
-     *
-     * Since MP4 and M4S files have minimal viability for compression, we just ignore
-     * that operation, meaning the payload target is now just directory_ variable.
-     */
-    fs::path payloadTarget =
-      applyZSTDComp ? fs::path(macros::DISPATCH_ARCHIVE_REL_PATH) : fs::path(directory_);
-
-    LOG_DEBUG << DISPATCH_LOG << "Making payload target: " << payloadTarget;
-
-    for (const auto& entry : fs::directory_iterator(payloadTarget))
-    {
-      if (entry.is_regular_file())
-      {
-        if (!add_file_to_archive(entry.path().string()))
-        {
-          LOG_ERROR << DISPATCH_LOG << "Failed to add file: " << entry.path();
-          archive_write_close(archive);
-          archive_write_free(archive);
-          return false;
-        }
-      }
+      archive_write_close(archive);
+      archive_write_free(archive);
+      fs::remove(partial_archive_path, ec);
+      return false;
     }
 
     // Close the archive
@@ -430,107 +889,172 @@ private:
     }
 
     archive_write_free(archive);
+    fs::rename(partial_archive_path, output_archive_path, ec);
+    if (ec)
+    {
+      LOG_ERROR << DISPATCH_LOG << "Failed to move archive into place: " << ec.message();
+      return false;
+    }
+    fs::remove(Uploader::session_path(output_archive_path), ec); // belonged to an older archive
     LOG_INFO << DISPATCH_LOG << "ZSTD compression of " << directory_ << " to "
              << output_archive_path << " with final GNU tar job done.";
     return true;
   }
 
-  auto upload_to_server(const std::string& archive_path) -> bool
+  void print_hierarchy()
   {
-    try
-    {
-      auto const results = resolver_.resolve(server_, port_);
-      net::connect(stream_.next_layer(), results.begin(), results.end());
-      stream_.handshake(ssl::stream_base::client);
-
-      send_http_request("POST", archive_path);
+    LOG_INFO << "\n HLS Playlist Hierarchy:\n";
+    std::cout << ">> " << playlist_name_ << "\n";
 
-      // **Proper SSL stream shutdown**
-      boost::system::error_code ec;
-      stream_.shutdown(ec);
-      if (ec == boost::asio::error::eof)
-      {
-        // Expected, means server closed the connection cleanly
-        ec.clear();
-      }
-      else if (ec)
+    for (const auto& [playlist, segments] : reference_playlists_)
+    {
+      std::cout << "   ├── > " << fs::path(playlist).filename().string() << "\n";
+      for (const auto& ts : segments)
       {
-        LOG_ERROR << DISPATCH_LOG << "SSL shutdown failed: " << ec.message();
+        std::cout << "   │   ├── @ " << fs::path(ts).filename().string() << "\n";
       }
-
-      LOG_INFO << DISPATCH_LOG << "Upload process completed successfully.";
-      return true;
-    }
-    catch (const std::exception& e)
-    {
-      LOG_ERROR << DISPATCH_LOG << "Upload failed: " << e.what();
-      return false;
     }
   }
+};
 
-  void send_http_request(const std::string& method, const std::string& archive_path)
+/*
+ * BATCH MODE
+ *
+ * `--batch` dispatches a library encoded by `hls_encoder --batch`. It tails the journal in the
+ * library's output directory and uploads every encoded track not yet recorded as dispatched,
+ * then records its audio-id there. Up to `--uploads` tracks are verified, compressed and
+ * uploaded at a time, each upload slot with its own Uploader and its keep-alive connections.
+ *
+ * It keeps polling while the journal shows an encoder run in progress, so it can be started
+ * next to the encoder and upload while the rest of the library is still encoding. Tracks that
+ * fail are left for the next run.
+ *
+ * -> Until it has seen a run in progress it waits up to `--wait` seconds for one to start, so
+ *    it can also be started a little before the encoder.
+ *
+ * -> A run is in progress from its "start" record to its "end" record, or until the encoder pid
+ *    the "start" record carries is gone (a crashed run never writes its "end").
+ */
+static auto is_running(pid_t pid) -> bool
+{
+  return pid > 0 && (::kill(pid, 0) == 0 || errno == EPERM);
+}
+
+static auto dispatch_batch(const std::string& server, const std::string& port,
+                           const fs::path& root, std::size_t uploads, std::chrono::seconds wait)
+  -> int
+{
+  BatchJournal     journal(root / macros::BATCH_JOURNAL);
+  WorkStealingPool pool(uploads);
+
+  // One of each per worker of the pool, which share the cores for compression
+  const std::size_t threads =
+    std::max<std::size_t>(1, std::thread::hardware_concurrency() / pool.size());
+  std::vector<std::unique_ptr<Uploader>>     uploaders;
+  std::vector<std::unique_ptr<ZstdArchiver>> archivers;
+  for (std::size_t i = 0; i < pool.size(); ++i)
   {
-    beast::error_code                         ec;
-    boost::beast::http::file_body::value_type body;
-    body.open(archive_path.c_str(), beast::file_mode::scan, ec);
-    if (ec)
-    {
-      LOG_ERROR << DISPATCH_LOG << "Failed to open archive file: " << archive_path;
-      return;
-    }
+    uploaders.push_back(std::make_unique<Uploader>(server, port));
+    archivers.push_back(std::make_unique<ZstdArchiver>(threads));
+  }
 
-    http::request<http::file_body> req{http::string_to_verb(method), "/", 11};
-    req.set(http::field::host, server_);
-    req.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
-    req.set(http::field::content_type, "application/gzip");
-    req.body() = std::move(body);
-    req.prepare_payload();
+  std::unordered_set<std::string> dispatched;
+  std::unordered_set<std::string> submitted;
+  std::atomic<std::size_t>        done{0}, failed{0};
+  bool                            encoding    = false; // an encoder run started and has not ended
+  bool                            seen_run    = false; // one was in progress at some point
+  pid_t                           encoder_pid = 0;
+  const auto                      wait_until  = std::chrono::steady_clock::now() + wait;
 
-    http::write(stream_, req, ec);
-    if (ec)
-    {
-      LOG_ERROR << DISPATCH_LOG << "Failed to send request: " << ec.message();
-      return;
-    }
+  LOG_INFO << DISPATCH_LOG << "Dispatching " << root << " with " << pool.size()
+           << " uploads in flight";
 
-    // Read response from server
-    beast::flat_buffer                buffer;
-    http::response<http::string_body> res;
-    http::read(stream_, buffer, res, ec);
+  for (;;)
+  {
+    // Checked before the poll, so it still reads everything a crashed encoder recorded
+    const pid_t checked_pid = encoder_pid;
+    const bool  alive       = is_running(checked_pid);
 
-    if (ec)
-    {
-      LOG_ERROR << DISPATCH_LOG << "Failed to read response: " << ec.message();
-      return;
-    }
+    std::vector<std::string> encoded;
+    journal.poll(
+      [&](const BatchJournal::Record& record)
+      {
+        if (record.state == "start")
+        {
+          encoding    = true;
+          encoder_pid = std::atoi(record.value.c_str());
+        }
+        else if (record.state == "end")
+        {
+          encoding = false;
+        }
+        else if (record.state == "encoded")
+        {
+          encoded.push_back(record.key);
+        }
+        else if (record.state == "dispatched")
+        {
+          dispatched.insert(record.key);
+        }
+      });
 
-    // Extract and log Client-ID separately
-    auto client_id_it = res.find("Client-ID");
-    if (client_id_it != res.end())
+    // Only after the whole poll: a track encoded and dispatched earlier has both records
+    for (const std::string& key : encoded)
     {
-      LOG_INFO << "Parsed Client-ID: " << client_id_it->value();
+      if (dispatched.contains(key) || !submitted.insert(key).second)
+      {
+        continue;
+      }
+
+      pool.submit(
+        [&, key](std::size_t worker)
+        {
+          const fs::path dir = root / key;
+          std::string    client_id;
+          bool           ok = false;
+          try
+          {
+            Dispatcher dispatcher(dir.string(), macros::to_string(macros::MASTER_PLAYLIST));
+            ok = dispatcher.process_and_upload(*uploaders[worker], *archivers[worker], client_id);
+          }
+          catch (const std::exception& e)
+          {
+            LOG_ERROR << DISPATCH_LOG << "Error: " << e.what();
+          }
+
+          if (ok)
+          {
+            journal.append("dispatched", key, client_id);
+            LOG_INFO << DISPATCH_LOG << "[" << ++done << "] Dispatched " << key << " as "
+                     << client_id;
+          }
+          else
+          {
+            ++failed;
+            LOG_ERROR << DISPATCH_LOG << "Failed to dispatch " << key;
+          }
+        });
     }
-    else
+
+    if (encoding && encoder_pid == checked_pid && !alive)
     {
-      LOG_WARNING << "Client-ID not found in response headers.";
+      LOG_WARNING << DISPATCH_LOG << "Encoder " << encoder_pid << " is gone without ending its run";
+      encoding = false;
     }
-  }
+    seen_run = seen_run || encoding;
 
-  void print_hierarchy()
-  {
-    LOG_INFO << "\n HLS Playlist Hierarchy:\n";
-    std::cout << ">> " << playlist_name_ << "\n";
-
-    for (const auto& [playlist, segments] : reference_playlists_)
+    if (!encoding && (seen_run || std::chrono::steady_clock::now() >= wait_until))
     {
-      std::cout << "   ├── > " << fs::path(playlist).filename().string() << "\n";
-      for (const auto& ts : segments)
-      {
-        std::cout << "   │   ├── @ " << fs::path(ts).filename().string() << "\n";
-      }
+      break; // everything the encoder will ever record has been read
     }
+    std::this_thread::sleep_for(std::chrono::milliseconds(WAVY_BATCH_POLL_MS));
   }
-};
+
+  pool.wait();
+  LOG_INFO << DISPATCH_LOG << "Batch complete: " << done << " dispatched, " << failed
+           << " failed.";
+  return failed > 0 ? 1 : 0;
+}
 
 auto main(int argc, char* argv[]) -> int
 {
@@ -538,7 +1062,10 @@ auto main(int argc, char* argv[]) -> int
 
   if (argc < 5)
   {
-    LOG_ERROR << "Usage: " << argv[0] << " <server> <port> <directory> <master_playlist>";
+    LOG_ERROR << "Usage: " << argv[0] << " <server> <port> <directory> <master_playlist>\n"
+              << "       " << argv[0]
+              << " <server> <port> <library output directory> --batch [--uploads <n>]"
+              << " [--wait <s>]";
     return 1;
   }
 
@@ -547,10 +1074,31 @@ auto main(int argc, char* argv[]) -> int
   std::string dir             = argv[3];
   std::string master_playlist = argv[4];
 
+  if (master_playlist == "--batch")
+  {
+    std::size_t          uploads = WAVY_BATCH_UPLOADS;
+    std::chrono::seconds wait{WAVY_BATCH_START_WAIT_S};
+    for (int i = 5; i + 1 < argc; ++i)
+    {
+      if (std::string_view(argv[i]) == "--uploads")
+      {
+        uploads = std::max(1, std::atoi(argv[++i]));
+      }
+      else if (std::string_view(argv[i]) == "--wait")
+      {
+        wait = std::chrono::seconds(std::max(0, std::atoi(argv[++i])));
+      }
+    }
+    return dispatch_batch(server, port, dir, uploads, wait);
+  }
+
   try
   {
-    Dispatcher dispatcher(server, port, dir, master_playlist);
-    if (!dispatcher.process_and_upload())
+    Uploader     uploader(server, port);
+    ZstdArchiver archiver(std::thread::hardware_concurrency());
+    Dispatcher   dispatcher(dir, master_playlist);
+    std::string  client_id;
+    if (!dispatcher.process_and_upload(uploader, archiver, client_id))
     {
       LOG_ERROR << DISPATCH_LOG << "Upload process failed.";
       return 1;
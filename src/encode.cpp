@@ -1,4 +1,10 @@
+#include "../include/batch.hpp"
 #include "../include/encode.hpp"
+#include <atomic>
+#include <boost/uuid/random_generator.hpp>
+#include <boost/uuid/uuid_io.hpp>
+#include <cctype>
+#include <unordered_set>
 
 /*
  * @NOTE:
@@ -9,6 +15,201 @@
  *
  */
 
+/*
+ * BATCH MODE
+ *
+ * `--batch` takes a library instead of one file: a directory, searched recursively for audio
+ * files, or a manifest listing one file per line (relative paths are relative to the manifest,
+ * lines starting with '#' are skipped). Every track is encoded into its own directory below the
+ * output directory, named after the file and a hash of its path so reruns find it again.
+ *
+ * Tracks run on a WorkStealingPool (see batch.hpp) of `--jobs` workers, all cores by default.
+ * Finished tracks are recorded in the output directory's journal, which is what a rerun skips
+ * and what `hls_dispatcher --batch` tails to upload them while the rest is still encoding.
+ */
+
+/*
+ * LIVE MODE
+ *
+ * `--live` takes a server (`<host>[:port]`) instead of an output directory. Nothing is written
+ * locally and there is no archive for the dispatcher: the muxer PUTs every segment and every
+ * rewrite of the playlists to the server's /live/<audio-id>/ as it goes (see live_streams.hpp),
+ * under an audio-id generated here, and receivers can play the track while it is encoded.
+ */
+
+static constexpr std::string_view kAudioExtensions[] = {".mp3", ".flac", ".wav", ".ogg", ".opus",
+                                                        ".m4a", ".aac",  ".wv",  ".aiff"};
+
+static auto is_audio_file(const fs::path& path) -> bool
+{
+  std::string ext = path.extension().string();
+  std::transform(ext.begin(), ext.end(), ext.begin(),
+                 [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+  return std::find(std::begin(kAudioExtensions), std::end(kAudioExtensions), ext) !=
+         std::end(kAudioExtensions);
+}
+
+static auto collect_tracks(const fs::path& library, const fs::path& output_root)
+  -> std::vector<fs::path>
+{
+  std::vector<fs::path> tracks;
+  std::error_code       ec;
+
+  if (fs::is_directory(library, ec))
+  {
+    const fs::path skip = fs::weakly_canonical(output_root, ec);
+    for (auto it = fs::recursive_directory_iterator(library, ec);
+         !ec && it != fs::recursive_directory_iterator(); it.increment(ec))
+    {
+      if (it->is_directory(ec) && fs::weakly_canonical(it->path(), ec) == skip)
+      {
+        it.disable_recursion_pending(); // our own output, if it lives inside the library
+      }
+      else if (it->is_regular_file(ec) && is_audio_file(it->path()))
+      {
+        tracks.push_back(it->path());
+      }
+    }
+    std::sort(tracks.begin(), tracks.end());
+    return tracks;
+  }
+
+  std::ifstream manifest(library);
+  if (!manifest)
+  {
+    LOG_ERROR << ENCODER_LOG << "Library is neither a directory nor a readable manifest: "
+              << library;
+    return tracks;
+  }
+  for (std::string line; std::getline(manifest, line);)
+  {
+    if (!line.empty() && line.back() == '\r')
+    {
+      line.pop_back();
+    }
+    if (line.empty() || line[0] == '#')
+    {
+      continue;
+    }
+    const fs::path track = fs::path(line).is_absolute() ? fs::path(line)
+                                                        : library.parent_path() / line;
+    tracks.push_back(track);
+  }
+  return tracks;
+}
+
+// "<stem>-<FNV-1a of the canonical path>", stable across runs and unique within the library
+static auto track_key(const fs::path& track) -> std::string
+{
+  std::error_code   ec;
+  const std::string path = fs::weakly_canonical(track, ec).string();
+
+  std::uint64_t hash = 0xcbf29ce484222325ULL;
+  for (const unsigned char c : path)
+  {
+    hash = (hash ^ c) * 0x100000001b3ULL;
+  }
+
+  std::string key = track.stem().string();
+  for (char& c : key)
+  {
+    if (!std::isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '_' && c != '.')
+    {
+      c = '_';
+    }
+  }
+  char suffix[18];
+  std::snprintf(suffix, sizeof(suffix), "-%016llx", static_cast<unsigned long long>(hash));
+  return key + suffix;
+}
+
+static auto run_batch(const fs::path& library, const fs::path& output_root,
+                      const std::vector<int>& bitrates, bool use_flac, bool single_file,
+                      std::size_t jobs) -> int
+{
+  std::error_code ec;
+  fs::create_directories(output_root, ec);
+  if (ec)
+  {
+    LOG_ERROR << ENCODER_LOG << "Failed to create directory: " << output_root;
+    return 1;
+  }
+
+  // First thing, so a dispatcher started alongside sees the run before the library is walked
+  BatchJournal journal(output_root / macros::BATCH_JOURNAL);
+  journal.append("start", "-", std::to_string(::getpid()));
+
+  const std::vector<fs::path> tracks = collect_tracks(library, output_root);
+  if (tracks.empty())
+  {
+    LOG_ERROR << ENCODER_LOG << "No audio files found in: " << library;
+    journal.append("end", "-", "0");
+    return 1;
+  }
+
+  std::unordered_set<std::string> encoded;
+  journal.poll(
+    [&](const BatchJournal::Record& record)
+    {
+      if (record.state == "encoded")
+      {
+        encoded.insert(record.key);
+      }
+      else if (record.state == "failed")
+      {
+        encoded.erase(record.key);
+      }
+    });
+
+  HLS_Encoder              encoder;
+  WorkStealingPool         pool(jobs);
+  std::atomic<std::size_t> done{0}, failed{0};
+  std::size_t              skipped = 0;
+
+  LOG_INFO << ENCODER_LOG << "Encoding " << tracks.size() << " tracks on " << pool.size()
+           << " workers into " << output_root;
+
+  for (const fs::path& track : tracks)
+  {
+    const std::string key = track_key(track);
+    const fs::path    dir = output_root / key;
+
+    if (encoded.contains(key) && fs::exists(dir / macros::MASTER_PLAYLIST, ec))
+    {
+      ++skipped; // finished by an earlier run
+      continue;
+    }
+
+    pool.submit(
+      [&, track, key, dir](std::size_t)
+      {
+        std::error_code error;
+        fs::remove_all(dir, error); // whatever a crashed run left half written
+        fs::create_directories(dir, error);
+
+        if (!error && encoder.create_hls_segments(track.c_str(), bitrates, dir.c_str(), use_flac,
+                                                  single_file))
+        {
+          journal.append("encoded", key, track.string());
+          LOG_INFO << ENCODER_LOG << "[" << ++done << "] Encoded " << track << " -> " << key;
+          return;
+        }
+
+        fs::remove_all(dir, error);
+        journal.append("failed", key, track.string());
+        ++failed;
+        LOG_ERROR << ENCODER_LOG << "Failed to encode: " << track;
+      });
+  }
+
+  pool.wait();
+  journal.append("end", "-", std::to_string(done.load()));
+
+  LOG_INFO << ENCODER_LOG << "Batch complete: " << done << " encoded, " << skipped
+           << " already done, " << failed << " failed.";
+  return failed > 0 ? 1 : 0;
+}
+
 auto main(int argc, char* argv[]) -> int
 {
   logger::init_logging();
@@ -16,17 +217,41 @@ auto main(int argc, char* argv[]) -> int
   if (argc < 4)
   {
     LOG_ERROR << "Usage: " << argv[0]
-              << " <input file> <output directory> <audio format> [--debug]";
+              << " <input file> <output directory> <audio format> [--debug] [--single-file]\n"
+              << "       " << argv[0]
+              << " <library dir | manifest> <output directory> <audio format> --batch"
+                 " [--jobs <n>] [--debug] [--single-file]\n"
+              << "       " << argv[0] << " <input file> <server[:port]> <audio format> --live"
+                 " [--debug]";
     return 1;
   }
 
-  bool debug_mode = false;
+  bool        debug_mode  = false;
+  bool        single_file = false; // one media file per variant, segments addressed by byte ranges
+  bool        batch       = false; // argv[1] is a library, see run_batch()
+  bool        live        = false; // argv[2] is a server, see LIVE MODE
+  std::size_t jobs        = std::max(1u, std::thread::hardware_concurrency());
   for (int i = 4; i < argc; ++i)
   {
     if (strcmp(argv[i], "--debug") == 0)
     {
       debug_mode = true;
-      break;
+    }
+    else if (strcmp(argv[i], "--single-file") == 0)
+    {
+      single_file = true;
+    }
+    else if (strcmp(argv[i], "--batch") == 0)
+    {
+      batch = true;
+    }
+    else if (strcmp(argv[i], "--live") == 0)
+    {
+      live = true;
+    }
+    else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc)
+    {
+      jobs = std::max(1, std::atoi(argv[++i]));
     }
   }
 
@@ -68,6 +293,39 @@ auto main(int argc, char* argv[]) -> int
   bool        use_flac   = (strcmp(argv[3], "flac") == 0);
   std::string output_dir = std::string(argv[2]);
 
+  if (batch)
+  {
+    return run_batch(argv[1], output_dir, bitrates, use_flac, single_file, jobs);
+  }
+
+  HLS_Encoder encoder;
+  if (live)
+  {
+    if (single_file)
+    {
+      LOG_ERROR << "--live PUTs every segment on its own, it cannot be used with --single-file";
+      return 1;
+    }
+
+    std::string server = output_dir;
+    if (server.find(':') == std::string::npos)
+    {
+      server += ":" + std::string(WAVY_SERVER_PORT_NO_STR);
+    }
+    const std::string audio_id = boost::uuids::to_string(boost::uuids::random_generator()());
+    const std::string url =
+      "https://" + server + macros::to_string(macros::SERVER_PATH_LIVE) + "/" + audio_id;
+
+    LOG_INFO << "Streaming live to " << server << " as audio-id: " << audio_id;
+    if (!encoder.create_hls_segments(argv[1], bitrates, url.c_str(), use_flac, false, true))
+    {
+      LOG_ERROR << "Live encoding failed.";
+      return 1;
+    }
+    LOG_INFO << "Live track " << audio_id << " is complete.";
+    return 0;
+  }
+
   if (fs::exists(output_dir))
   {
     LOG_WARNING << "Output directory exists, rewriting...";
@@ -85,8 +343,11 @@ auto main(int argc, char* argv[]) -> int
     return 1;
   }
 
-  HLS_Encoder encoder;
-  encoder.create_hls_segments(argv[1], bitrates, argv[2], use_flac);
+  if (!encoder.create_hls_segments(argv[1], bitrates, argv[2], use_flac, single_file))
+  {
+    LOG_ERROR << "Encoding failed.";
+    return 1;
+  }
   LOG_INFO << "Encoding seems to be complete.";
 
   return 0;
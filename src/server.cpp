@@ -9,6 +9,7 @@
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/signal_set.hpp>
 #include <boost/asio/ssl/stream.hpp>
+#include <boost/asio/strand.hpp>
 #include <boost/beast.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/iostreams/copy.hpp>
@@ -16,16 +17,32 @@
 #include <boost/iostreams/filtering_streambuf.hpp>
 #include <boost/uuid/random_generator.hpp>
 #include <boost/uuid/uuid_io.hpp>
+#include <charconv>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <sstream>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/un.h>
+#include <thread>
 #include <unistd.h>
 #include <vector>
 
 #include "../include/decompression.h"
-#include "../include/toml/toml_parser.hpp"
+#include "../include/digest.hpp"
+#include "../include/server/blob_store.hpp"
+#include "../include/server/chunked_upload.hpp"
+#include "../include/server/file_range_body.hpp"
+#include "../include/server/live_streams.hpp"
+#include "../include/server/metrics.hpp"
+#include "../include/server/segment_cache.hpp"
+#include "../include/server/storage_catalog.hpp"
+#include "../include/server/track_metadata.hpp"
+#include "../include/server/upload_ingest.hpp"
+#include "../include/server/validate.hpp"
+#include "../include/server/worker_pool.hpp"
 
 /*
  * SERVER
@@ -62,7 +79,11 @@
  * Boost libs ensures that every operation (if not then most) in the server occurs asynchronously
  * without any concurrency issues
  *
- * Although not tried and tested with multiple clients, it should give expected results.
+ * The io_context is run by a pool of worker threads (one per core by default, see ServerConfig)
+ * and every HLS_Session lives on its own strand, so a session's handlers never run concurrently
+ * while different sessions are spread across cores. The server also opens a number of
+ * SO_REUSEPORT acceptors bound to the same port, letting the kernel balance incoming connections
+ * (and therefore TLS handshakes) across them instead of funnelling everything through one socket.
  *
  * Boost should also ensure safety and shared lifetimes of a lot of critical objects.
  *
@@ -81,8 +102,65 @@
 namespace fs    = boost::filesystem;
 namespace beast = boost::beast;
 namespace http  = beast::http;
+namespace net   = boost::asio;
 using boost::asio::ip::tcp;
 
+// Asio does not expose SO_REUSEPORT, so spell it out as a plain boolean socket option
+using reuse_port = net::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+
+/*
+ * Runtime knobs for the server, all optional on the command line:
+ *
+ * --threads <N>   : Worker threads running the io_context (default: hardware concurrency)
+ * --acceptors <N> : SO_REUSEPORT listening sockets on WAVY_SERVER_PORT_NO (default: --threads)
+ * --cache-mib <N> : In-memory segment cache budget in MiB (default: WAVY_SERVER_CACHE_SIZE_MIB)
+ * --workers <N>   : Threads extracting and validating uploads (default: hardware concurrency)
+ * --uploads <N>   : Uploads received and extracted at once (default: WAVY_SERVER_MAX_UPLOADS)
+ */
+struct ServerConfig
+{
+  unsigned int threads   = std::max(1u, std::thread::hardware_concurrency());
+  unsigned int acceptors = 0; // 0 -> same as threads
+  std::size_t  cache_mib = WAVY_SERVER_CACHE_SIZE_MIB;
+  unsigned int workers   = std::max(1u, std::thread::hardware_concurrency());
+  unsigned int uploads   = WAVY_SERVER_MAX_UPLOADS;
+
+  static auto from_args(int argc, char* argv[]) -> ServerConfig
+  {
+    ServerConfig config;
+    for (int i = 1; i + 1 < argc; ++i)
+    {
+      if (strcmp(argv[i], "--threads") == 0)
+      {
+        config.threads = std::max(1, std::stoi(argv[++i]));
+      }
+      else if (strcmp(argv[i], "--acceptors") == 0)
+      {
+        config.acceptors = std::max(1, std::stoi(argv[++i]));
+      }
+      else if (strcmp(argv[i], "--cache-mib") == 0)
+      {
+        config.cache_mib = std::stoul(argv[++i]);
+      }
+      else if (strcmp(argv[i], "--workers") == 0)
+      {
+        config.workers = std::max(1, std::stoi(argv[++i]));
+      }
+      else if (strcmp(argv[i], "--uploads") == 0)
+      {
+        config.uploads = std::max(1, std::stoi(argv[++i]));
+      }
+    }
+
+    if (config.acceptors == 0)
+    {
+      config.acceptors = config.threads;
+    }
+
+    return config;
+  }
+};
+
 auto is_valid_extension(const std::string& filename) -> bool
 {
   return filename.ends_with(macros::PLAYLIST_EXT) ||
@@ -90,273 +168,391 @@ auto is_valid_extension(const std::string& filename) -> bool
          filename.ends_with(macros::M4S_FILE_EXT);
 }
 
-auto validate_m3u8_format(const std::string& content) -> bool
+auto content_type_for(std::string_view filename) -> std::string_view
+{
+  if (filename.ends_with(macros::PLAYLIST_EXT))
+  {
+    return "application/vnd.apple.mpegurl";
+  }
+  if (filename.ends_with(macros::TRANSPORT_STREAM_EXT))
+  {
+    return "video/mp2t";
+  }
+  return macros::CONTENT_TYPE_OCTET_STREAM;
+}
+
+// Value of key in a "a=1&b=2" query string (no percent-decoding, none of our values need it)
+auto query_param(std::string_view query, std::string_view key) -> std::optional<std::string_view>
 {
-  return content.find(macros::PLAYLIST_GLOBAL_HEADER) != std::string::npos;
+  while (!query.empty())
+  {
+    const std::size_t      amp  = query.find('&');
+    const std::string_view pair = query.substr(0, amp);
+    const std::size_t      eq   = pair.find('=');
+    if (pair.substr(0, eq) == key)
+    {
+      return eq == std::string_view::npos ? std::string_view{} : pair.substr(eq + 1);
+    }
+    if (amp == std::string_view::npos)
+    {
+      break;
+    }
+    query.remove_prefix(amp + 1);
+  }
+  return std::nullopt;
 }
 
-auto validate_ts_file(const std::vector<uint8_t>& data) -> bool
+// Weak validator derived from size and mtime (same scheme as most static file servers)
+auto make_etag(const struct stat& st) -> std::string
 {
-  return !data.empty() && data[0] == TRANSPORT_STREAM_START_BYTE; // MPEG-TS sync byte
+  char etag[64];
+  std::snprintf(etag, sizeof(etag), "\"%llx-%llx\"", static_cast<unsigned long long>(st.st_size),
+                static_cast<unsigned long long>(st.st_mtim.tv_sec) * 1000000000ULL +
+                  static_cast<unsigned long long>(st.st_mtim.tv_nsec));
+  return etag;
 }
 
-auto validate_m4s(const std::string& m4s_path) -> bool
+/*
+ * Outcome of a request's Range (and If-Range) header against a file of a known size.
+ * Only single ranges are honoured; a multi-range request gets the whole file with 200, which
+ * RFC 9110 allows and which no HLS client ever needs anyway.
+ */
+struct ByteRange
 {
-  std::ifstream file(m4s_path, std::ios::binary);
-  if (!file.is_open())
+  enum class Kind
   {
-    LOG_ERROR << SERVER_VALIDATE_LOG << "Failed to open .m4s file: " << m4s_path;
-    return false;
-  }
+    Full,          // no (usable) Range: send everything with 200
+    Partial,       // send [first, first + length) with 206
+    Unsatisfiable, // 416 with "Content-Range: bytes */<size>"
+  };
+
+  Kind          kind   = Kind::Full;
+  std::uint64_t first  = 0;
+  std::uint64_t length = 0;
+};
 
-  // Read the first 12 bytes (enough to check for 'ftyp' and a major brand)
-  std::vector<uint8_t> header(12);
-  file.read(reinterpret_cast<char*>(header.data()), header.size());
+auto parse_u64(std::string_view digits, std::uint64_t& value) -> bool
+{
+  const auto [end, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), value);
+  return !digits.empty() && ec == std::errc{} && end == digits.data() + digits.size();
+}
 
-  if (file.gcount() < 12)
+auto resolve_range(std::string_view range, std::string_view if_range, std::string_view etag,
+                   std::uint64_t size) -> ByteRange
+{
+  constexpr std::string_view unit = "bytes=";
+  if (range.empty() || !range.starts_with(unit) || range.find(',') != std::string_view::npos)
   {
-    LOG_ERROR << SERVER_VALIDATE_LOG << ".m4s file too small: " << m4s_path;
-    return false;
+    return {};
   }
 
-  // First 4 bytes: Box size (big-endian)
-  uint32_t box_size = boost::endian::big_to_native(*reinterpret_cast<uint32_t*>(header.data()));
-
-  // Next 4 bytes: Box type (should be 'ftyp')
-  std::string box_type(reinterpret_cast<char*>(header.data() + 4), 4);
-
-  if (box_type != "ftyp")
+  // If-Range: the client's copy is stale, so a partial reply would splice two versions together
+  if (!if_range.empty() && if_range != etag)
   {
-    LOG_ERROR << SERVER_VALIDATE_LOG << "Missing 'ftyp' header in .m4s: " << m4s_path;
-    return false;
+    return {};
   }
 
-  // Ensure the file contains 'moof' (Movie Fragment) and 'mdat' (Media Data)
-  file.seekg(0, std::ios::beg);
-  std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-
-  if (content.find("moof") == std::string::npos || content.find("mdat") == std::string::npos)
+  range.remove_prefix(unit.size());
+  const std::size_t dash = range.find('-');
+  if (dash == std::string_view::npos)
   {
-    LOG_ERROR << SERVER_VALIDATE_LOG
-              << "Invalid .m4s segment (missing 'moof' or 'mdat'): " << m4s_path;
-    return false;
+    return {};
   }
 
-  LOG_INFO << SERVER_VALIDATE_LOG << "Valid .m4s segment: " << m4s_path;
-  return true;
-}
-
-auto extract_payload(const std::string& payload_path, const std::string& extract_path) -> bool
-{
-  LOG_INFO << SERVER_EXTRACT_LOG << "Extracting PAYLOAD: " << payload_path;
-
-  struct archive*       a   = archive_read_new();
-  struct archive*       ext = archive_write_disk_new();
-  struct archive_entry* entry;
+  const std::string_view first_str = range.substr(0, dash);
+  const std::string_view last_str  = range.substr(dash + 1);
+  std::uint64_t          first = 0, last = 0;
 
-  archive_read_support_filter_gzip(a);
-  archive_read_support_format_tar(a);
-  archive_write_disk_set_options(ext, ARCHIVE_EXTRACT_PERM);
-
-  if (archive_read_open_filename(a, payload_path.c_str(), 10240) != ARCHIVE_OK)
+  if (first_str.empty())
   {
-    LOG_ERROR << SERVER_EXTRACT_LOG << "Failed to open archive: " << archive_error_string(a);
-    archive_read_free(a);
-    archive_write_free(ext);
-    return false;
+    // "-n": the final n bytes
+    if (!parse_u64(last_str, last))
+    {
+      return {};
+    }
+    if (last == 0 || size == 0)
+    {
+      return {ByteRange::Kind::Unsatisfiable};
+    }
+    last = std::min(last, size);
+    return {ByteRange::Kind::Partial, size - last, last};
   }
 
-  bool valid_files_found = false;
-
-  while (archive_read_next_header(a, &entry) == ARCHIVE_OK)
+  if (!parse_u64(first_str, first))
   {
-    std::string filename    = archive_entry_pathname(entry);
-    std::string output_file = extract_path + "/" + filename;
+    return {};
+  }
+  if (last_str.empty())
+  {
+    last = size == 0 ? 0 : size - 1; // "a-": through the end
+  }
+  else if (!parse_u64(last_str, last) || last < first)
+  {
+    return {}; // syntactically invalid, ignored
+  }
 
-    LOG_INFO << SERVER_EXTRACT_LOG
-             << "Extracting file: " << fs::relative(output_file, macros::SERVER_STORAGE_DIR);
+  if (first >= size)
+  {
+    return {ByteRange::Kind::Unsatisfiable};
+  }
 
-    archive_entry_set_pathname(entry, output_file.c_str());
+  last = std::min(last, size - 1);
+  return {ByteRange::Kind::Partial, first, last - first + 1};
+}
 
-    if (archive_write_header(ext, entry) == ARCHIVE_OK)
+/*
+ * Whether an If-None-Match header ("*" or a list of entity tags) matches `etag`. The weak
+ * comparison of RFC 9110 applies, so a W/ prefix on either side is ignored.
+ */
+auto etag_matches(std::string_view if_none_match, std::string_view etag) -> bool
+{
+  const auto opaque = [](std::string_view tag)
+  {
+    while (tag.starts_with(' '))
     {
-      std::ofstream ofs(output_file, std::ios::binary);
-      if (!ofs)
-      {
-        LOG_ERROR << SERVER_EXTRACT_LOG << "Failed to open file for writing: " << output_file;
-        continue;
-      }
-
-      char    buffer[8192]; // maybe better off using std::array<>?
-      ssize_t len;
-      while ((len = archive_read_data(a, buffer, sizeof(buffer))) > 0)
-      {
-        ofs.write(buffer, len);
-      }
-      ofs.close();
-
-      valid_files_found = true;
-
-      // If the extracted file is a .zst file, decompress it
-      if (output_file.substr(output_file.find_last_of(".") + 1) == macros::ZSTD_FILE_EXT)
-      {
-        LOG_INFO << "[ZSTD] Decompressing .zst file: "
-                 << fs::relative(output_file, macros::SERVER_TEMP_STORAGE_DIR);
-        if (!ZSTD_decompress_file(output_file.c_str()))
-        {
-          LOG_ERROR << "[ZSTD] Failed to decompress .zst file: " << output_file;
-          continue;
-        }
-
-        std::string decompressed_filename =
-          output_file.substr(0, output_file.find_last_of(".")); // remove .zst extension
-        LOG_INFO << SERVER_EXTRACT_LOG << "Decompressed file: "
-                 << fs::relative(decompressed_filename, macros::SERVER_TEMP_STORAGE_DIR);
+      tag.remove_prefix(1);
+    }
+    while (tag.ends_with(' '))
+    {
+      tag.remove_suffix(1);
+    }
+    if (tag.starts_with("W/"))
+    {
+      tag.remove_prefix(2);
+    }
+    return tag;
+  };
 
-        if (std::remove(output_file.c_str()) == 0)
-        {
-          LOG_INFO << "[ZSTD] Deleted the original .zst file: "
-                   << fs::relative(output_file, macros::SERVER_TEMP_STORAGE_DIR);
-        }
-        else
-        {
-          LOG_ERROR << "[ZSTD] Failed to delete .zst file: "
-                    << fs::relative(output_file, macros::SERVER_TEMP_STORAGE_DIR);
-        }
-      }
+  while (!if_none_match.empty())
+  {
+    const std::size_t      comma = if_none_match.find(',');
+    const std::string_view tag   = opaque(if_none_match.substr(0, comma));
+    if (tag == "*" || (!tag.empty() && tag == opaque(etag)))
+    {
+      return true;
     }
+    if (comma == std::string_view::npos)
+    {
+      break;
+    }
+    if_none_match.remove_prefix(comma + 1);
   }
-
-  archive_read_free(a);
-  archive_write_free(ext);
-
-  return valid_files_found;
+  return false;
 }
 
-auto extract_and_validate(const std::string& gzip_path, const std::string& audio_id,
-                          const std::string& ip_id) -> bool
+auto content_range(const ByteRange& range, std::uint64_t size) -> std::string
 {
-  LOG_INFO << SERVER_EXTRACT_LOG << "Validating and extracting GZIP file: " << gzip_path;
-
-  if (!fs::exists(gzip_path))
+  if (range.kind == ByteRange::Kind::Unsatisfiable)
   {
-    LOG_ERROR << SERVER_EXTRACT_LOG << "File does not exist: " << gzip_path;
-    return false;
+    return "bytes */" + std::to_string(size);
   }
+  return "bytes " + std::to_string(range.first) + "-" +
+         std::to_string(range.first + range.length - 1) + "/" + std::to_string(size);
+}
 
-  std::string temp_extract_path =
-    macros::to_string(macros::SERVER_TEMP_STORAGE_DIR) + "/" + audio_id;
-  fs::create_directories(temp_extract_path);
-
-  if (!extract_payload(gzip_path, temp_extract_path))
+auto load_cached_segment(const std::string& file_path, const struct stat& st,
+                         std::string_view filename) -> CachedSegmentPtr
+{
+  std::ifstream file(file_path, std::ios::binary);
+  if (!file)
   {
-    LOG_ERROR << SERVER_EXTRACT_LOG << "Extraction failed!";
-    return false;
+    return nullptr;
   }
 
-  LOG_INFO << SERVER_EXTRACT_LOG << "Extraction complete, validating files...";
-
-  // Move valid files to storage
-  std::string storage_path =
-    macros::to_string(macros::SERVER_STORAGE_DIR) + "/" + ip_id + "/" + audio_id;
-  fs::create_directories(storage_path);
+  std::string data(static_cast<std::size_t>(st.st_size), '\0');
+  if (!file.read(data.data(), static_cast<std::streamsize>(data.size())))
+  {
+    return nullptr;
+  }
 
-  int valid_file_count = 0;
+  return std::make_shared<const CachedSegment>(std::move(data), content_type_for(filename),
+                                               make_etag(st));
+}
 
-  for (const fs::directory_entry& file : fs::directory_iterator(temp_extract_path))
+/*
+ * Decides whether a file extracted from an upload may be stored (see UploadIngest).
+ * Invalid playlists, transport streams and unknown files are dropped.
+ */
+auto validate_extracted_file(const std::string& fname, const std::string& path) -> bool
+{
+  if (fname.ends_with(macros::PLAYLIST_EXT))
   {
-    std::string          fname = file.path().filename().string();
-    std::ifstream        infile(file.path().string(), std::ios::binary);
-    std::vector<uint8_t> data((std::istreambuf_iterator<char>(infile)), {});
-
-    if (fname.ends_with(macros::PLAYLIST_EXT))
+    std::ifstream infile(path, std::ios::binary);
+    std::string   content((std::istreambuf_iterator<char>(infile)), {});
+    if (!validate_m3u8_format(content))
     {
-      if (!validate_m3u8_format(std::string(data.begin(), data.end())))
-      {
-        LOG_WARNING << SERVER_EXTRACT_LOG << "Invalid M3U8 file, removing: " << fname;
-        fs::remove(file.path());
-        continue;
-      }
+      LOG_WARNING << SERVER_EXTRACT_LOG << "Invalid M3U8 file, removing: " << fname;
+      return false;
     }
-    else if (fname.ends_with(macros::TRANSPORT_STREAM_EXT))
-    {
-      if (!validate_ts_file(data))
-      {
-        LOG_WARNING << SERVER_EXTRACT_LOG << "Invalid TS file, removing: " << fname;
-        fs::remove(file.path());
-        continue;
-      }
-    }
-    else if (fname.ends_with(macros::M4S_FILE_EXT))
+  }
+  else if (fname.ends_with(macros::TRANSPORT_STREAM_EXT))
+  {
+    // Only the sync byte is checked, so there is no need to load the whole segment
+    std::ifstream        infile(path, std::ios::binary);
+    std::vector<uint8_t> head(1);
+    if (!infile.read(reinterpret_cast<char*>(head.data()), 1) || !validate_ts_file(head))
     {
-      if (!validate_m4s(file.path().string())) // Validate .m4s
-      {
-        LOG_WARNING << SERVER_EXTRACT_LOG << "Possibly invalid M4S segment: " << fname;
-      }
+      LOG_WARNING << SERVER_EXTRACT_LOG << "Invalid TS file, removing: " << fname;
+      return false;
     }
-    else if (fname.ends_with(macros::MP4_FILE_EXT))
+  }
+  else if (fname.ends_with(macros::M4S_FILE_EXT) || fname.ends_with(macros::MP4_FILE_EXT))
+  {
+    if (!validate_m4s(path)) // Box structure of .m4s segments and the init.mp4
     {
-      LOG_DEBUG << SERVER_EXTRACT_LOG << "Found MP4 file: " << fname;
+      LOG_WARNING << SERVER_EXTRACT_LOG << "Invalid fMP4 file, removing: " << fname;
+      return false;
     }
-    else
+  }
+  else if (fname == macros::METADATA_FILE)
+  {
+    std::ifstream infile(path);
+    std::string   content((std::istreambuf_iterator<char>(infile)), {});
+    if (!track_metadata::parse(content))
     {
-      LOG_WARNING << SERVER_EXTRACT_LOG << "Skipping unknown file: " << fname;
-      fs::remove(file.path());
-      continue;
+      LOG_WARNING << SERVER_EXTRACT_LOG << "Invalid metadata, removing: " << fname;
+      return false;
     }
-
-    // Move validated file to storage
-    fs::rename(file.path(), storage_path + "/" + fname);
-    LOG_INFO << SERVER_EXTRACT_LOG << "File stored in HLS storage: " << fname;
-    valid_file_count++;
   }
-
-  if (valid_file_count == 0)
+  else
   {
-    LOG_ERROR << SERVER_EXTRACT_LOG << "No valid files remain after validation, extraction failed!";
+    LOG_WARNING << SERVER_EXTRACT_LOG << "Skipping unknown file: " << fname;
     return false;
   }
 
-  LOG_INFO << SERVER_EXTRACT_LOG << "Extraction and validation successful.";
   return true;
 }
 
+/*
+ * Everything the sessions share: owned by main(), outlives every io_context thread and is handed
+ * to each session by reference.
+ *
+ * -> cache   : In-memory segment cache (see segment_cache.hpp)
+ * -> catalog : Index of everything in storage, serves /hls/clients (see storage_catalog.hpp)
+ * -> blobs   : One copy of every distinct uploaded file, shared by reference (see blob_store.hpp)
+ * -> uploads : Chunked uploads in progress, serves /upload (see chunked_upload.hpp)
+ * -> live    : Playlists still being PUT by a live encoder, serves /live (see live_streams.hpp)
+ * -> metrics : Counters and latency histograms, serves /metrics (see metrics.hpp)
+ * -> workers : CPU / disk bound work (upload extraction), never run on io_context threads
+ * -> ingests : The consumer of every upload being received (see upload_ingest.hpp), which waits
+ *              on the network for most of its life and so is kept off `workers`
+ */
+struct ServerState
+{
+  SegmentCache      cache;
+  StorageCatalog    catalog;
+  BlobStore         blobs;
+  ChunkedUploads    uploads;
+  LiveStreams       live;
+  metrics::Registry metrics; // before workers: their jobs record into it until they are joined
+  WorkerPool        workers;
+  WorkerPool        ingests; // after workers: consumers wait on their entry jobs to be joined
+
+  explicit ServerState(const ServerConfig& config)
+      : cache(config.cache_mib * 1024 * 1024, WAVY_SERVER_CACHE_MAX_ENTRY_MIB * 1024 * 1024),
+        catalog(macros::to_string(macros::SERVER_STORAGE_DIR)),
+        blobs(macros::to_string(macros::SERVER_STORAGE_DIR)),
+        workers(config.workers, WAVY_SERVER_WORKER_QUEUE_SIZE),
+        ingests(config.uploads, config.uploads)
+  {
+  }
+};
+
 class HLS_Session : public std::enable_shared_from_this<HLS_Session>
 {
 public:
-  explicit HLS_Session(boost::asio::ssl::stream<tcp::socket> socket, const std::string ip)
-      : socket_(std::move(socket)), ip_id_(std::move(ip))
+  explicit HLS_Session(boost::asio::ssl::stream<tcp::socket> socket, const std::string ip,
+                       ServerState& state)
+      : socket_(std::move(socket)), idle_timer_(socket_.get_executor()),
+        live_timer_(socket_.get_executor()), ip_id_(std::move(ip)), state_(state),
+        accepted_at_(Clock::now())
   {
+    state_.metrics.add(metrics::Counter::SessionsOpened);
   }
 
+  ~HLS_Session() { state_.metrics.add(metrics::Counter::SessionsClosed); }
+
   void start()
   {
-    LOG_INFO << SERVER_LOG << "Starting new session";
+    LOG_DEBUG << SERVER_LOG << "Starting new session";
+
+    // TCP keep-alive probes catch peers that vanish without closing the connection
+    boost::system::error_code      ec;
+    boost::asio::socket_base::keep_alive option(true);
+    socket_.next_layer().set_option(option, ec);
+
     do_handshake();
   }
 
 private:
   boost::asio::ssl::stream<tcp::socket> socket_;
+  net::steady_timer                     idle_timer_;
+  net::steady_timer                     live_timer_;    // bounds a held playlist reload
+  std::uint64_t                         live_hold_ = 0; // LiveStreams::Hold::id, 0 if none
   beast::flat_buffer                    buffer_;
   http::request<http::string_body>      request_;
   std::string                           ip_id_;
+  std::size_t                           requests_served_ = 0;
+  ServerState&                          state_;
+  std::shared_ptr<UploadIngest>         upload_;
+  std::size_t                           upload_bytes_ = 0;
+
+  // Timestamps for the latency histograms (see metrics.hpp)
+  using Clock = std::chrono::steady_clock;
+  Clock::time_point accepted_at_;
+  Clock::time_point handshake_done_at_;
+  Clock::time_point request_parsed_at_;
+  Clock::time_point upload_started_at_;
 
   void do_handshake()
   {
     auto self(shared_from_this());
+    arm_idle_timer();
     socket_.async_handshake(boost::asio::ssl::stream_base::server,
                             [this, self](boost::system::error_code ec)
                             {
+                              idle_timer_.cancel();
                               if (ec)
                               {
+                                state_.metrics.add(metrics::Counter::HandshakeFailures);
                                 LOG_ERROR << SERVER_LOG << "SSL handshake failed: " << ec.message();
                                 return;
                               }
-                              LOG_INFO << SERVER_LOG << "SSL handshake successful";
+                              handshake_done_at_ = Clock::now();
+                              state_.metrics.observe(metrics::Histogram::Handshake,
+                                                     handshake_done_at_ - accepted_at_);
+                              LOG_DEBUG << SERVER_LOG << "SSL handshake successful";
                               do_read();
                             });
   }
 
+  /*
+   * Persistent connections sit idle between requests, so every wait for a new request (and the
+   * handshake) is bounded by WAVY_SERVER_KEEPALIVE_TIMEOUT_S. Closing the socket aborts whatever
+   * operation is pending on it, which ends the session.
+   */
+  void arm_idle_timer()
+  {
+    idle_timer_.expires_after(std::chrono::seconds(WAVY_SERVER_KEEPALIVE_TIMEOUT_S));
+    idle_timer_.async_wait(
+      [this, self = shared_from_this()](boost::system::error_code ec)
+      {
+        if (ec == net::error::operation_aborted)
+        {
+          return;
+        }
+        LOG_DEBUG << SERVER_LOG << "Connection idle for " << WAVY_SERVER_KEEPALIVE_TIMEOUT_S
+                  << "s, closing";
+        boost::system::error_code close_ec;
+        socket_.lowest_layer().close(close_ec);
+      });
+  }
+
+  [[nodiscard]] auto should_keep_alive() const -> bool
+  {
+    return request_.keep_alive() && requests_served_ < WAVY_SERVER_KEEPALIVE_MAX_REQUESTS;
+  }
+
   void resolve_ip()
   {
     try
@@ -374,6 +570,36 @@ private:
     do_read();
   }
 
+  void handle_read_error(boost::system::error_code ec)
+  {
+    // The peer closing a persistent connection between requests is the normal way for it to end
+    if (ec == http::error::end_of_stream || ec == net::error::eof ||
+        ec == net::ssl::error::stream_truncated || ec == net::error::operation_aborted)
+    {
+      LOG_DEBUG << SERVER_LOG << "Connection closed after " << requests_served_ << " request(s)";
+      boost::system::error_code close_ec;
+      socket_.lowest_layer().close(close_ec);
+      return;
+    }
+
+    LOG_ERROR << SERVER_LOG << "Read error: " << ec.message();
+    if (ec == http::error::body_limit)
+    {
+      LOG_ERROR << SERVER_LOG << "Upload size exceeded the limit!";
+      send_response(macros::to_string(macros::SERVER_ERROR_413));
+    }
+  }
+
+  /*
+   * Reads the next request on the connection.
+   *
+   * The header is read first under the idle timer, the body afterwards without it, so a slow
+   * upload is never mistaken for an idle connection.
+   *
+   * Pipelined requests need no special handling: whatever the client sent past the current
+   * message stays in buffer_, and the next do_read() parses it from there before touching the
+   * socket. Responses therefore always go out in request order.
+   */
   void do_read()
   {
     auto self(shared_from_this());
@@ -383,188 +609,941 @@ private:
                        1024); // for now 200MiB is alright, when lossless codecs come
                               // in the picture we will have to think about it.
 
-    http::async_read(
+    arm_idle_timer();
+    http::async_read_header(
       socket_, buffer_, *parser,
-      [this, self, parser](boost::system::error_code ec, std::size_t bytes_transferred)
+      [this, self, parser](boost::system::error_code ec, std::size_t /*header_bytes*/)
       {
+        idle_timer_.cancel();
         if (ec)
         {
-          LOG_ERROR << SERVER_LOG << "Read error: " << ec.message();
-          if (ec == http::error::body_limit)
+          handle_read_error(ec);
+          return;
+        }
+
+        // Later requests on the connection would mostly measure keep-alive idle time
+        request_parsed_at_ = Clock::now();
+        if (requests_served_ == 0)
+        {
+          state_.metrics.observe(metrics::Histogram::RequestHeader,
+                                 request_parsed_at_ - handshake_done_at_);
+        }
+        state_.metrics.add(metrics::Counter::Requests);
+
+        if (is_payload_upload(parser->get()))
+        {
+          start_upload(parser);
+          return;
+        }
+
+        http::async_read(
+          socket_, buffer_, *parser,
+          [this, self, parser](boost::system::error_code ec, std::size_t bytes_transferred)
           {
-            LOG_ERROR << SERVER_LOG << "Upload size exceeded the limit!";
-            send_response(macros::to_string(macros::SERVER_ERROR_413));
-          }
+            if (ec)
+            {
+              handle_read_error(ec);
+              return;
+            }
+            /* bytes_to_mib is a C FFI from common.h */
+            LOG_DEBUG << SERVER_LOG << "Received " << bytes_to_mib(bytes_transferred) << " MiB ("
+                     << bytes_transferred << ") bytes";
+            request_ = parser->release();
+            ++requests_served_;
+            process_request();
+          });
+      });
+  }
+
+  // Payload uploads are the only requests whose body is not buffered in memory
+  static auto is_payload_upload(const http::request<http::string_body>& header) -> bool
+  {
+    const std::string_view target = header.target();
+    const std::string_view path   = target.substr(0, target.find('?'));
+    return header.method() == http::verb::post && path != macros::SERVER_PATH_TOML_UPLOAD &&
+           !path.starts_with(macros::SERVER_PATH_UPLOAD);
+  }
+
+  /*
+   * Streams a tar.gz payload upload into an UploadIngest instead of buffering the body.
+   *
+   * The header parser is converted into a buffer_body parser, and each read fills one
+   * WAVY_SERVER_INGEST_CHUNK_KIB chunk that is handed over to the ingest. The next read is only
+   * issued once the ingest says it has room (see UploadIngest::push), so a fast sender cannot
+   * outrun extraction.
+   */
+  void start_upload(const std::shared_ptr<http::request_parser<http::string_body>>& header_parser)
+  {
+    LOG_INFO << SERVER_UPLD_LOG << "Handling GZIP file upload";
+
+    request_        = {};
+    request_.base() = header_parser->get().base();
+
+    auto parser =
+      std::make_shared<http::request_parser<http::buffer_body>>(std::move(*header_parser));
+    parser->body_limit(WAVY_SERVER_AUDIO_SIZE_LIMIT * 1024 * 1024);
+
+    std::string audio_id = boost::uuids::to_string(boost::uuids::random_generator()());
+
+    upload_started_at_ = request_parsed_at_;
+    upload_bytes_      = 0;
+
+    upload_ = open_ingest(
+      audio_id,
+      [this, self = shared_from_this(), audio_id](bool success, int stored_files)
+      {
+        record_upload_async(state_, ip_id_, audio_id, success, stored_files, upload_started_at_,
+                            [this, self, audio_id](bool stored)
+                            {
+                              net::post(socket_.get_executor(), [this, self, audio_id, stored]
+                                        { finish_upload(audio_id, stored); });
+                            });
+      });
+    if (upload_)
+    {
+      read_upload_chunk(parser);
+    }
+  }
+
+  /*
+   * Creates the temp and storage directories of `audio_id` and starts an UploadIngest that
+   * extracts into them and calls `on_done` when it is through. nullptr if that failed, with the
+   * error response already sent.
+   */
+  auto open_ingest(const std::string& audio_id, UploadIngest::Done on_done)
+    -> std::shared_ptr<UploadIngest>
+  {
+    std::string temp_path    = macros::to_string(macros::SERVER_TEMP_STORAGE_DIR) + "/" + audio_id;
+    std::string storage_path = macros::to_string(macros::SERVER_STORAGE_DIR) + "/" + ip_id_ + "/" +
+                               audio_id;
+
+    boost::system::error_code ec;
+    fs::create_directories(temp_path, ec);
+    fs::create_directories(storage_path, ec);
+    // Keeps the catalog off the directory until record_upload() has stored it
+    const std::string marker =
+      storage_path + "/" + macros::to_string(macros::SERVER_INCOMPLETE_FILE);
+    if (!ec && !std::ofstream(marker))
+    {
+      ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+    }
+    if (ec)
+    {
+      LOG_ERROR << SERVER_UPLD_LOG << "Failed to create storage for " << audio_id << ": "
+                << ec.message();
+      send_response(macros::to_string(macros::SERVER_ERROR_500));
+      return nullptr;
+    }
+
+    // Every entry's validation is timed on the worker that runs it
+    auto validate = [&registry = state_.metrics](const std::string& fname, const std::string& path)
+    {
+      const auto start = Clock::now();
+      const bool valid = validate_extracted_file(fname, path);
+      registry.observe(metrics::Histogram::UploadValidate, Clock::now() - start);
+      return valid;
+    };
+
+    auto ingest = std::make_shared<UploadIngest>(state_.ingests, state_.workers, state_.blobs,
+                                                 temp_path, storage_path, validate);
+    if (!ingest->start(std::move(on_done)))
+    {
+      LOG_WARNING << SERVER_UPLD_LOG << "Too many uploads in progress, rejecting upload";
+      state_.metrics.add(metrics::Counter::UploadsRejected);
+      fs::remove_all(temp_path, ec);
+      fs::remove_all(storage_path, ec);
+      send_response(macros::to_string(macros::SERVER_ERROR_503));
+      return nullptr;
+    }
+    return ingest;
+  }
+
+  void read_upload_chunk(const std::shared_ptr<http::request_parser<http::buffer_body>>& parser)
+  {
+    auto self  = shared_from_this();
+    auto chunk = std::make_shared<std::string>(WAVY_SERVER_INGEST_CHUNK_KIB * 1024, '\0');
+
+    parser->get().body().data = chunk->data();
+    parser->get().body().size = chunk->size();
+
+    http::async_read(
+      socket_, buffer_, *parser,
+      [this, self, parser, chunk](boost::system::error_code ec, std::size_t)
+      {
+        if (ec == http::error::need_buffer)
+        {
+          ec = {}; // chunk is full
+        }
+        if (ec)
+        {
+          upload_->abort();
+          upload_.reset();
+          handle_read_error(ec);
           return;
         }
-        /* bytes_to_mib is a C FFI from common.h */
-        LOG_INFO << SERVER_LOG << "Received " << bytes_to_mib(bytes_transferred) << " MiB ("
-                 << bytes_transferred << ") bytes";
-        request_ = parser->release();
-        process_request();
+
+        chunk->resize(chunk->size() - parser->get().body().size);
+        upload_bytes_ += chunk->size();
+
+        const bool done = parser->is_done();
+        upload_->push(std::move(*chunk),
+                      [this, self, parser, done]
+                      {
+                        net::post(socket_.get_executor(),
+                                  [this, self, parser, done]
+                                  {
+                                    if (!upload_)
+                                    {
+                                      return;
+                                    }
+                                    if (done)
+                                    {
+                                      upload_->finish();
+                                      return;
+                                    }
+                                    read_upload_chunk(parser);
+                                  });
+                      });
       });
+  }
+
+  void finish_upload(const std::string& audio_id, bool stored)
+  {
+    upload_.reset();
+    ++requests_served_;
+
+    LOG_INFO << SERVER_UPLD_LOG << "Received " << bytes_to_mib(upload_bytes_) << " MiB ("
+             << upload_bytes_ << ") bytes";
+
+    if (!stored)
+    {
+      send_response(macros::to_string(macros::SERVER_ERROR_400));
+      return;
+    }
+
+    auto response = std::make_shared<http::response<http::string_body>>();
+    response->result(http::status::ok);
+    response->set("Client-ID", audio_id);
+    write_message(std::move(response));
+  }
+
+  /*
+   * Makes a finished extraction servable, or removes what it stored if it failed. Returns
+   * `success`. Reads, renders and scans the upload's files, so it is run by
+   * record_upload_async() and never on an io_context thread.
+   */
+  static auto record_upload(ServerState& state, const std::string& ip, const std::string& audio_id,
+                            bool success, int stored_files, Clock::time_point started_at) -> bool
+  {
+    state.metrics.observe(metrics::Histogram::UploadExtract, Clock::now() - started_at);
+
+    if (!success)
+    {
+      state.metrics.add(metrics::Counter::UploadsFailed);
+      LOG_ERROR << SERVER_UPLD_LOG << "Extraction or validation failed!";
+      state.blobs.remove_audio(macros::to_string(macros::SERVER_STORAGE_DIR) + "/" + ip + "/" +
+                               audio_id);
+      return false;
+    }
+
+    LOG_INFO << SERVER_EXTRACT_LOG << "Extraction and validation successful (" << stored_files
+             << " files).";
+    state.metrics.add(metrics::Counter::UploadsStored);
+    state.cache.invalidate_prefix(SegmentCache::make_key(ip, audio_id, ""));
+    const std::string dir = macros::to_string(macros::SERVER_STORAGE_DIR) + "/" + ip + "/" +
+                            audio_id;
+    track_metadata::render(dir); // before the catalog scans it; most uploads come with one
+    ::unlink((dir + "/" + macros::to_string(macros::SERVER_INCOMPLETE_FILE)).c_str());
+    state.catalog.add_audio(ip, audio_id);
+    return true;
+  }
+
+  // Runs record_upload() on the workers (inline if they are saturated) and hands `then` its result
+  static void record_upload_async(ServerState& state, const std::string& ip,
+                                  const std::string& audio_id, bool success, int stored_files,
+                                  Clock::time_point started_at, std::function<void(bool)> then)
+  {
+    auto job = [&state, ip, audio_id, success, stored_files, started_at, then = std::move(then)]
+    { then(record_upload(state, ip, audio_id, success, stored_files, started_at)); };
+    if (!state.workers.try_submit(job))
+    {
+      job();
+    }
+  }
+
+  // POST /upload: a chunked upload of Upload-Length bytes starts (see chunked_upload.hpp)
+  void create_chunked_upload()
+  {
+    std::uint64_t length = 0;
+    if (!parse_u64(request_[macros::UPLOAD_HEADER_LENGTH], length) || length == 0)
+    {
+      send_text(http::status::bad_request, "Missing Upload-Length\r\n");
+      return;
+    }
+    if (length > std::uint64_t{WAVY_SERVER_UPLOAD_LIMIT_MIB} * 1024 * 1024)
+    {
+      send_text(http::status::payload_too_large, "Upload too large\r\n");
+      return;
+    }
+
+    const std::string audio_id = boost::uuids::to_string(boost::uuids::random_generator()());
+    auto              upload   = std::make_shared<ChunkedUpload>(audio_id, ip_id_, length);
+
+    // The ingest outlives this session, and the upload holds the ingest
+    auto ingest = open_ingest(
+      audio_id,
+      [&state = state_, weak = std::weak_ptr<ChunkedUpload>(upload), ip = ip_id_, audio_id,
+       started_at = Clock::now()](bool success, int stored_files)
+      {
+        record_upload_async(state, ip, audio_id, success, stored_files, started_at,
+                            [weak](bool stored)
+                            {
+                              if (auto upload = weak.lock())
+                              {
+                                upload->finished(stored);
+                              }
+                            });
+      });
+    if (!ingest)
+    {
+      return;
+    }
+    upload->attach(std::move(ingest));
+    state_.uploads.add(upload);
+
+    LOG_INFO << SERVER_UPLD_LOG << "Chunked upload " << audio_id << " of " << length
+             << " bytes started";
+    auto response = std::make_shared<http::response<http::empty_body>>();
+    response->result(http::status::created);
+    response->set(macros::UPLOAD_HEADER_ID, audio_id);
+    response->set(macros::UPLOAD_HEADER_CHUNK_SIZE, std::to_string(ChunkedUpload::kChunkSize));
+    write_message(std::move(response));
+  }
+
+  // PUT /upload/<id>: one chunk; answered once the upload has taken it
+  void put_upload_chunk(const std::string& id)
+  {
+    std::shared_ptr<ChunkedUpload> upload = state_.uploads.find(id, ip_id_);
+    if (!upload)
+    {
+      send_text(http::status::not_found, "Unknown upload\r\n");
+      return;
+    }
+
+    std::uint64_t offset = 0;
+    if (!parse_u64(request_[macros::UPLOAD_HEADER_OFFSET], offset))
+    {
+      send_text(http::status::bad_request, "Missing Upload-Offset\r\n");
+      return;
+    }
+    // Hashing a whole chunk is no work for an io thread, so it is checked on the way in
+    auto job = [this, self = shared_from_this(), upload, id, offset,
+                checksum = std::string(request_[macros::UPLOAD_HEADER_CHECKSUM]),
+                body     = std::make_shared<std::string>(std::move(request_.body()))]
+    {
+      if (checksum != digest::sha256(body->data(), body->size()))
+      {
+        LOG_WARNING << SERVER_UPLD_LOG << "Checksum mismatch in chunk " << offset << " of " << id;
+        net::post(socket_.get_executor(), [this, self]
+                  { send_text(http::status::bad_request, "Checksum mismatch\r\n"); });
+        return;
+      }
+
+      upload->put(offset, std::move(*body),
+                  [this, self, id, length = upload->length()](ChunkedUpload::Status status,
+                                                              std::uint64_t         received)
+                  {
+                    net::post(socket_.get_executor(), [this, self, id, length, status, received]
+                              { send_upload_status(id, length, status, received); });
+                  });
+    };
+    if (!state_.workers.try_submit(std::move(job)))
+    {
+      LOG_WARNING << SERVER_UPLD_LOG << "Workers saturated, rejecting chunk " << offset << " of "
+                  << id;
+      send_text(http::status::service_unavailable, "Server busy\r\n");
+    }
+  }
+
+  void send_upload_status(const std::string& id, std::uint64_t length,
+                          ChunkedUpload::Status status, std::uint64_t received)
+  {
+    switch (status)
+    {
+      case ChunkedUpload::Status::Received:
+      {
+        auto response = std::make_shared<http::response<http::empty_body>>();
+        response->result(http::status::no_content);
+        response->set(macros::UPLOAD_HEADER_OFFSET, std::to_string(received));
+        // A client resuming from a GET checks these against the upload it has
+        response->set(macros::UPLOAD_HEADER_LENGTH, std::to_string(length));
+        response->set(macros::UPLOAD_HEADER_CHUNK_SIZE, std::to_string(ChunkedUpload::kChunkSize));
+        write_message(std::move(response));
+        return;
+      }
+      case ChunkedUpload::Status::Stored:
+      {
+        auto response = std::make_shared<http::response<http::string_body>>();
+        response->result(http::status::ok);
+        response->set("Client-ID", id);
+        write_message(std::move(response));
+        return;
+      }
+      case ChunkedUpload::Status::Failed:
+        send_text(http::status::bad_request, "Extraction or validation failed\r\n");
+        return;
+      case ChunkedUpload::Status::Invalid:
+        send_text(http::status::bad_request, "Chunk does not fit the upload\r\n");
+        return;
+      case ChunkedUpload::Status::Busy:
+        send_text(http::status::service_unavailable, "Too many chunks ahead\r\n");
+        return;
+    }
+  }
+
+  // "<audio-id>" and "<file>" of "/live/<audio-id>/<file>"
+  static auto live_file_of(std::string_view target)
+    -> std::optional<std::pair<std::string_view, std::string_view>>
+  {
+    if (!target.starts_with(macros::SERVER_PATH_LIVE) ||
+        !target.substr(macros::SERVER_PATH_LIVE.size()).starts_with('/'))
+    {
+      return std::nullopt;
+    }
+    const std::string_view rest  = target.substr(macros::SERVER_PATH_LIVE.size() + 1);
+    const std::size_t      slash = rest.find('/');
+    if (slash == std::string_view::npos)
+    {
+      return std::nullopt;
+    }
+
+    // Nothing outside the owner's storage, and nothing the catalog would not list
+    const std::string_view audio_id = rest.substr(0, slash);
+    const std::string_view filename = rest.substr(slash + 1);
+    if (audio_id.empty() || audio_id.starts_with('.') || filename.starts_with('.') ||
+        filename.find('/') != std::string_view::npos ||
+        !(is_valid_extension(std::string(filename)) || filename.ends_with(macros::MP4_FILE_EXT)))
+    {
+      return std::nullopt;
+    }
+    return std::pair{audio_id, filename};
+  }
+
+  // PUT /live/<audio-id>/<file>: one file of a track still being encoded (see live_streams.hpp)
+  void put_live_file(const std::string& audio_id, const std::string& filename)
+  {
+    auto job = [this, self = shared_from_this(), &state = state_, ip = ip_id_, audio_id,
+                filename, body = std::make_shared<std::string>(std::move(request_.body()))]
+    {
+      const http::status status = store_live_file(state, ip, audio_id, filename, *body);
+      net::post(socket_.get_executor(),
+                [this, self, status]
+                {
+                  if (status != http::status::no_content)
+                  {
+                    send_text(status, "Live file not stored\r\n");
+                    return;
+                  }
+                  auto response = std::make_shared<http::response<http::empty_body>>();
+                  response->result(http::status::no_content);
+                  write_message(std::move(response));
+                });
+    };
+    if (!state_.workers.try_submit(std::move(job)))
+    {
+      LOG_WARNING << SERVER_UPLD_LOG << "Workers saturated, rejecting live file " << filename;
+      send_text(http::status::service_unavailable, "Server busy\r\n");
+    }
+  }
+
+  /*
+   * Stores one live file and makes it servable; runs on a worker. The body is written next to
+   * its destination under a dot name the catalog skips and renamed over it once validated, so
+   * a reader never sees half a segment or half a playlist.
+   */
+  static auto store_live_file(ServerState& state, const std::string& ip,
+                              const std::string& audio_id, const std::string& filename,
+                              const std::string& body) -> http::status
+  {
+    const std::string dir  = macros::to_string(macros::SERVER_STORAGE_DIR) + "/" + ip + "/" +
+                            audio_id;
+    const std::string path = dir + "/" + filename;
+    const std::string part = dir + "/." + filename + ".part";
+
+    // An uploaded track is stored for good, and its files may well be shared blobs
+    boost::system::error_code ec;
+    if (fs::exists(dir + "/" + macros::to_string(macros::SERVER_MANIFEST_FILE), ec))
+    {
+      LOG_WARNING << SERVER_UPLD_LOG << "Refusing live file for uploaded audio-id " << audio_id;
+      return http::status::conflict;
+    }
+    fs::create_directories(dir, ec);
+    {
+      std::ofstream out(part, std::ios::binary | std::ios::trunc);
+      out.write(body.data(), static_cast<std::streamsize>(body.size()));
+      out.close();
+      if (ec || !out)
+      {
+        LOG_ERROR << SERVER_UPLD_LOG << "Failed to write live file " << part;
+        fs::remove(part, ec);
+        return http::status::internal_server_error;
+      }
+    }
+
+    if (!validate_extracted_file(filename, part))
+    {
+      fs::remove(part, ec);
+      return http::status::bad_request;
+    }
+
+    m3u8::Playlist playlist;
+    const bool     is_playlist = filename.ends_with(macros::PLAYLIST_EXT);
+    if (is_playlist && !m3u8::parse(body, playlist))
+    {
+      LOG_WARNING << SERVER_UPLD_LOG << "Unparsable live playlist " << filename;
+      fs::remove(part, ec);
+      return http::status::bad_request;
+    }
+
+    fs::rename(part, path, ec);
+    if (ec)
+    {
+      LOG_ERROR << SERVER_UPLD_LOG << "Failed to store live file " << path << ": "
+                << ec.message();
+      fs::remove(part, ec);
+      return http::status::internal_server_error;
+    }
+
+    // Published before the cache is invalidated, so a reader racing it cannot cache it stale
+    const std::string key = SegmentCache::make_key(ip, audio_id, filename);
+    if (is_playlist && !playlist.is_master())
+    {
+      state.live.published(key, playlist); // after the rename: the woken reloads read it
+    }
+    state.cache.invalidate_prefix(key);
+    if (is_playlist)
+    {
+      state.catalog.add_audio(ip, audio_id);
+    }
+    LOG_DEBUG << SERVER_UPLD_LOG << "[OWNER:" << ip << "] Live file stored: " << filename << " ("
+              << audio_id << ")";
+    return http::status::no_content;
+  }
+
+  /*
+   * POST /toml/upload[?audio_id=<id>]
+   *
+   * A track's metadata.toml (see track_metadata.hpp). With the audio-id of one of the sender's
+   * own tracks it is stored next to it and its JSON projection is served from the catalog;
+   * without one it is only checked.
+   */
+  void handle_toml_upload(std::string_view query)
+  {
+    // Strip the form padding around the TOML without copying the body
+    std::string_view body = request_.body();
+    if (auto pos = body.find(macros::NETWORK_TEXT_DELIM); pos != std::string_view::npos)
+    {
+      body.remove_prefix(pos + macros::NETWORK_TEXT_DELIM.size());
+    }
+    if (auto pos = body.find("--------------------------"); pos != std::string_view::npos)
+    {
+      body = body.substr(0, pos);
+    }
+
+    const std::optional<std::string_view> audio_id = query_param(query, "audio_id");
+    if (!audio_id)
+    {
+      if (!track_metadata::parse(body))
+      {
+        LOG_ERROR << "[TOML] Failed to parse TOML data";
+        send_response(macros::to_string(macros::SERVER_ERROR_400));
+        return;
+      }
+      send_text(http::status::ok, "TOML parsed\r\n");
+      return;
+    }
+    if (audio_id->empty() || audio_id->starts_with('.') ||
+        audio_id->find('/') != std::string_view::npos)
+    {
+      send_text(http::status::bad_request, "Invalid audio_id\r\n");
+      return;
+    }
+
+    auto job = [this, self = shared_from_this(), &state = state_, ip = ip_id_,
+                audio_id = std::string(*audio_id), text = std::string(body)]
+    {
+      const http::status status = store_track_metadata(state, ip, audio_id, text);
+      net::post(socket_.get_executor(),
+                [this, self, status]
+                {
+                  send_text(status, status == http::status::ok ? "TOML stored\r\n"
+                                                               : "TOML not stored\r\n");
+                });
+    };
+    if (!state_.workers.try_submit(std::move(job)))
+    {
+      LOG_WARNING << SERVER_UPLD_LOG << "Workers saturated, rejecting metadata of " << *audio_id;
+      send_text(http::status::service_unavailable, "Server busy\r\n");
+    }
+  }
+
+  // Stores a metadata.toml for a stored audio-id and indexes it; runs on a worker
+  static auto store_track_metadata(ServerState& state, const std::string& ip,
+                                   const std::string& audio_id, const std::string& text)
+    -> http::status
+  {
+    const std::string owner_dir = macros::to_string(macros::SERVER_STORAGE_DIR) + "/" + ip;
+    const std::string dir       = owner_dir + "/" + audio_id;
+    const std::string path      = dir + "/" + macros::to_string(macros::METADATA_FILE);
+
+    boost::system::error_code ec;
+    if (!fs::is_directory(dir, ec))
+    {
+      return http::status::not_found;
+    }
+    if (!track_metadata::parse(text))
+    {
+      return http::status::bad_request;
+    }
+
+    // A fresh file rather than a write through the old one, which may be a shared blob
+    const std::string tmp_path = dir + "/." + macros::to_string(macros::METADATA_FILE) + ".part";
+    {
+      std::ofstream out(tmp_path, std::ios::trunc);
+      out << text;
+      if (!out.good())
+      {
+        LOG_ERROR << SERVER_UPLD_LOG << "Failed to write " << tmp_path;
+        fs::remove(tmp_path, ec);
+        return http::status::internal_server_error;
+      }
+    }
+    fs::rename(tmp_path, path, ec);
+    if (ec || !track_metadata::render(dir))
+    {
+      LOG_ERROR << SERVER_UPLD_LOG << "Failed to store metadata of " << audio_id;
+      fs::remove(tmp_path, ec);
+      return http::status::internal_server_error;
+    }
+
+    // The uploaded copy's blob no longer backs it (collect() removes it once unreferenced)
+    std::vector<BlobStore::Entry> entries = BlobStore::read_manifest(dir);
+    if (std::erase_if(entries, [](const BlobStore::Entry& entry)
+                      { return entry.name == macros::METADATA_FILE; }) > 0)
+    {
+      BlobStore::write_manifest(dir, entries);
+    }
+
+    // The owner directory's mtime is what tells the next startup to rescan it
+    ::utimes(owner_dir.c_str(), nullptr);
+    state.cache.invalidate_prefix(SegmentCache::make_key(ip, audio_id, ""));
+    state.catalog.add_audio(ip, audio_id);
+    LOG_INFO << SERVER_UPLD_LOG << "[OWNER:" << ip << "] Metadata stored for " << audio_id;
+    return http::status::ok;
+  }
+
+  // Keep-Alive header value: the idle timeout, and how many more requests this connection takes
+  [[nodiscard]] auto keep_alive_params() const -> std::string
+  {
+    return "timeout=" + std::to_string(WAVY_SERVER_KEEPALIVE_TIMEOUT_S) +
+           ", max=" + std::to_string(WAVY_SERVER_KEEPALIVE_MAX_REQUESTS - requests_served_);
+  }
+
+  /*
+   * Writes a complete HTTP response and then either waits for the next request on the same
+   * connection or shuts it down, depending on what the client asked for and how many requests
+   * this connection has already served.
+   *
+   * `keep` holds whatever a non-owning body (span_body) points into until the write is done.
+   */
+  template <class Body>
+  void write_message(std::shared_ptr<http::response<Body>> response,
+                     std::shared_ptr<const void>           keep = nullptr)
+  {
+    const bool keep_alive = should_keep_alive();
+
+    response->version(request_.version());
+    response->set(http::field::server, "Wavy Server");
+    response->keep_alive(keep_alive);
+    if (keep_alive)
+    {
+      response->set(http::field::keep_alive, keep_alive_params());
+    }
+    response->prepare_payload();
+    note_response(response->result_int());
+
+    auto self = shared_from_this(); // Keep session alive
+    http::async_write(socket_, *response,
+                      [this, self, response, keep, keep_alive](boost::system::error_code ec,
+                                                               std::size_t bytes_transferred)
+                      { finish_write(ec, bytes_transferred, keep_alive); });
+  }
+
+  /*
+   * Writes a cache hit: status line, the entry's preformatted headers, the per-connection
+   * Connection/Keep-Alive lines and the body, all as one gathered write straight out of the
+   * shared entry. No header formatting, no copies. A Range hit only formats its Content-Range
+   * and Content-Length and sends the slice of the shared body.
+   */
+  void write_cached(CachedSegmentPtr segment, const ByteRange& range = {})
+  {
+    const bool partial    = range.kind == ByteRange::Kind::Partial;
+    const bool keep_alive = should_keep_alive();
+
+    auto connection = std::make_shared<std::string>();
+    if (partial)
+    {
+      connection->append("Content-Range: ")
+        .append(content_range(range, segment->body.size()))
+        .append("\r\nContent-Length: ")
+        .append(std::to_string(range.length))
+        .append("\r\n");
+    }
+    if (keep_alive)
+    {
+      connection->append("Connection: keep-alive\r\nKeep-Alive: ")
+        .append(keep_alive_params())
+        .append("\r\n\r\n");
+    }
+    else
+    {
+      connection->append("Connection: close\r\n\r\n");
+    }
 
-    // Timeout to prevent indefinite read
-    boost::asio::socket_base::keep_alive option(true);
-    socket_.next_layer().set_option(option);
+    const bool             http10      = request_.version() == 10;
+    const std::string_view status_line = partial ? (http10 ? "HTTP/1.0 206 Partial Content\r\n"
+                                                           : "HTTP/1.1 206 Partial Content\r\n")
+                                                 : (http10 ? "HTTP/1.0 200 OK\r\n"
+                                                           : "HTTP/1.1 200 OK\r\n");
+    const std::string& headers = partial ? segment->common_headers : segment->header_block;
+    const net::const_buffer body =
+      partial ? net::buffer(segment->body.data() + range.first, range.length)
+              : net::buffer(segment->body);
+
+    const std::array<net::const_buffer, 4> buffers{
+      net::buffer(status_line.data(), status_line.size()), net::buffer(headers),
+      net::buffer(*connection), body};
+    note_response(partial ? 206 : 200);
+
+    auto self = shared_from_this();
+    net::async_write(socket_, buffers,
+                     [this, self, segment, connection, keep_alive](boost::system::error_code ec,
+                                                                   std::size_t bytes_transferred)
+                     { finish_write(ec, bytes_transferred, keep_alive); });
   }
 
-  void handle_list_ips()
+  // Called as a response starts going out: the end of the time to first byte
+  void note_response(unsigned int status)
   {
-    LOG_INFO << "[List IPs] Handling IP listing request";
-
-    std::string storage_path = macros::to_string(macros::SERVER_STORAGE_DIR);
-    if (!fs::exists(storage_path) || !fs::is_directory(storage_path))
+    if (request_parsed_at_ != Clock::time_point{})
     {
-      LOG_ERROR << "[List IPs] Storage directory not found: " << storage_path;
-      send_response(macros::to_string(macros::SERVER_ERROR_500));
-      return;
+      state_.metrics.observe(metrics::Histogram::TimeToFirstByte,
+                             Clock::now() - request_parsed_at_);
     }
+    state_.metrics.add_response(status);
+  }
 
-    std::ostringstream response_stream;
-    bool               entries_found = false;
+  void finish_write(boost::system::error_code ec, std::size_t bytes_transferred, bool keep_alive)
+  {
+    state_.metrics.add(metrics::Counter::BytesServed, bytes_transferred);
 
-    for (const fs::directory_entry& ip_entry : fs::directory_iterator(storage_path))
+    if (ec)
     {
-      if (fs::is_directory(ip_entry.status()))
-      {
-        std::string ip_id = ip_entry.path().filename().string();
-        response_stream << ip_id << ":\n"; // IP-ID Header
-
-        bool audio_found = false;
-        for (const fs::directory_entry& audio_entry : fs::directory_iterator(ip_entry.path()))
-        {
-          if (fs::is_directory(audio_entry.status()))
-          {
-            response_stream << "  - " << audio_entry.path().filename().string() << "\n"; // Audio-ID
-            audio_found = true;
-          }
-        }
-
-        if (!audio_found)
-        {
-          response_stream << "  (No audio IDs found)\n";
-        }
-
-        entries_found = true;
-      }
+      LOG_ERROR << SERVER_LOG << "Write error: " << ec.message();
+      boost::system::error_code close_ec;
+      socket_.lowest_layer().close(close_ec);
+      return;
     }
 
-    if (!entries_found)
+    if (keep_alive)
     {
-      LOG_WARNING << "[List IPs] No IPs or Audio-IDs found in storage";
-      send_response(macros::to_string(macros::SERVER_ERROR_404));
+      do_read();
       return;
     }
 
-    // Return the list of IP-IDs and their respective Audio-IDs
-    send_response("HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\n" + response_stream.str());
+    do_shutdown();
   }
 
-  void process_request()
+  void send_text(http::status status, std::string body,
+                 std::string_view content_type = "text/plain")
   {
-    if (request_.method() == http::verb::post)
-    {
-      // Check if this is a TOML file upload request.
-      // For example, if the request target is "/toml/upload"...
-      std::string target(request_.target().begin(), request_.target().end());
-      if (target == "/toml/upload")
-      {
-        // Remove padding text before parsing
-        std::string body = request_.body();
-        auto        pos  = body.find(macros::NETWORK_TEXT_DELIM);
-        if (pos != std::string::npos)
-        {
-          body = body.substr(pos + macros::NETWORK_TEXT_DELIM.length());
-        }
+    auto response = std::make_shared<http::response<http::string_body>>();
+    response->result(status);
+    response->set(http::field::content_type, content_type);
+    response->body() = std::move(body);
+    write_message(std::move(response));
+  }
 
-        // Remove bottom padding text
-        std::string bottom_delimiter = "--------------------------";
-        auto        bottom_pos       = body.find(bottom_delimiter);
-        if (bottom_pos != std::string::npos)
-        {
-          body = body.substr(0, bottom_pos);
-        }
+  // The receiver's cached copy is current: the validator goes back, the body does not
+  void send_not_modified(std::string_view etag)
+  {
+    auto response = std::make_shared<http::response<http::empty_body>>();
+    response->result(http::status::not_modified);
+    response->set(http::field::etag, etag);
+    write_message(std::move(response));
+  }
 
-        // Call your TOML parsing function.
-        auto toml_data_opt = parseAudioMetadataFromDataString(body);
-        if (toml_data_opt.path.empty())
-        {
-          LOG_ERROR << "[TOML] Failed to parse TOML data";
-          send_response(macros::to_string(macros::SERVER_ERROR_400));
-          return;
-        }
+  // 416 for a Range that lies entirely past the end of the file
+  void send_unsatisfiable(std::uint64_t size)
+  {
+    auto response = std::make_shared<http::response<http::string_body>>();
+    response->result(http::status::range_not_satisfiable);
+    response->set(http::field::content_range,
+                  content_range(ByteRange{ByteRange::Kind::Unsatisfiable}, size));
+    write_message(std::move(response));
+  }
 
-        send_response("HTTP/1.1 200 OK\r\n\r\nTOML parsed\r\n");
-        return;
-      }
-      handle_upload();
-    }
-    else if (request_.method() == http::verb::get)
+  /*
+   * GET /hls/clients[?ip=<owner>][&offset=<n>][&limit=<n>]
+   *
+   * Served from the storage catalog; the unpaginated listings are pre-serialized there. The
+   * total number of audio-ids matching the filter is returned in X-Total-Count so clients can
+   * page through large catalogs.
+   */
+  void handle_list_ips(std::string_view query)
+  {
+    LOG_DEBUG << "[List IPs] Handling IP listing request";
+
+    std::optional<std::string> ip;
+    std::size_t                offset = 0;
+    std::optional<std::size_t> limit;
+
+    try
     {
-      if (request_.target() == macros::SERVER_PATH_HLS_CLIENTS) // Request for all client IDs
+      if (auto value = query_param(query, "ip"))
       {
-        handle_list_ips();
+        ip = std::string(*value);
       }
-      else
+      if (auto value = query_param(query, "offset"))
+      {
+        offset = std::stoul(std::string(*value));
+      }
+      if (auto value = query_param(query, "limit"))
       {
-        handle_download();
+        limit = std::stoul(std::string(*value));
       }
     }
-    else
+    catch (const std::exception&)
     {
-      send_response(macros::to_string(macros::SERVER_ERROR_405));
+      send_response(macros::to_string(macros::SERVER_ERROR_400));
+      return;
     }
-  }
-
-  void handle_upload()
-  {
-    LOG_INFO << SERVER_UPLD_LOG << "Handling GZIP file upload";
-
-    std::string audio_id  = boost::uuids::to_string(boost::uuids::random_generator()());
-    std::string gzip_path = macros::to_string(macros::SERVER_TEMP_STORAGE_DIR) + "/" + audio_id +
-                            macros::to_string(macros::COMPRESSED_ARCHIVE_EXT);
 
-    fs::create_directories(macros::SERVER_TEMP_STORAGE_DIR);
-    std::ofstream output_file(gzip_path, std::ios::binary);
-    if (!output_file)
+    std::optional<CatalogPage> page = state_.catalog.listing(ip, offset, limit);
+    if (!page)
     {
-      LOG_ERROR << SERVER_UPLD_LOG << "Failed to open output file for writing: " << gzip_path;
-      send_response(macros::to_string(macros::SERVER_ERROR_500));
+      LOG_WARNING << "[List IPs] No IPs or Audio-IDs found in storage";
+      send_response(macros::to_string(macros::SERVER_ERROR_404));
       return;
     }
 
-    output_file.write(request_.body().data(), request_.body().size());
+    // Return the list of IP-IDs and their respective Audio-IDs (shared, never copied)
+    auto response = std::make_shared<http::response<http::span_body<const char>>>();
+    response->result(http::status::ok);
+    response->set(http::field::content_type, "text/plain");
+    response->set("X-Total-Count", std::to_string(page->total));
+    response->body() = http::span_body<const char>::value_type(page->body->data(),
+                                                               page->body->size());
+    write_message(std::move(response), page->body);
+  }
 
-    if (!output_file.good())
+  // GET /hls/<ip>/<audio-id>/meta: the track's metadata as JSON (see track_metadata.hpp)
+  void send_track_metadata(const std::string& ip_addr, const std::string& audio_id)
+  {
+    std::shared_ptr<const std::string> meta = state_.catalog.metadata(ip_addr, audio_id);
+    if (!meta)
     {
-      LOG_ERROR << SERVER_UPLD_LOG << "Failed to write data to file: " << gzip_path;
-      send_response(macros::to_string(macros::SERVER_ERROR_500));
+      send_text(http::status::not_found, "No metadata\r\n");
       return;
     }
 
-    output_file.close();
+    auto response = std::make_shared<http::response<http::span_body<const char>>>();
+    response->result(http::status::ok);
+    response->set(http::field::content_type, "application/json");
+    response->body() = http::span_body<const char>::value_type(meta->data(), meta->size());
+    write_message(std::move(response), meta);
+  }
 
-    if (!fs::exists(gzip_path) || fs::file_size(gzip_path) == 0)
+  // "<id>" of "/upload/<id>"
+  static auto upload_id_of(std::string_view target) -> std::optional<std::string_view>
+  {
+    if (!target.starts_with(macros::SERVER_PATH_UPLOAD) ||
+        !target.substr(macros::SERVER_PATH_UPLOAD.size()).starts_with('/'))
     {
-      LOG_ERROR << SERVER_UPLD_LOG << "GZIP upload failed: File is empty or missing!";
-      send_response("HTTP/1.1 400 Bad Request\r\n\r\nGZIP upload failed");
-      return;
+      return std::nullopt;
     }
+    const std::string_view id = target.substr(macros::SERVER_PATH_UPLOAD.size() + 1);
+    if (id.empty() || id.find('/') != std::string_view::npos)
+    {
+      return std::nullopt;
+    }
+    return id;
+  }
 
-    LOG_INFO << SERVER_UPLD_LOG << "File successfully written: " << gzip_path;
-
-    if (extract_and_validate(gzip_path, audio_id, ip_id_))
+  void process_request()
+  {
+    if (request_.method() == http::verb::post)
     {
-      send_response("HTTP/1.1 200 OK\r\nClient-ID: " + audio_id + "\r\n\r\n");
+      const std::string_view target = request_.target();
+      const std::string_view path   = target.substr(0, target.find('?'));
+      if (path == macros::SERVER_PATH_TOML_UPLOAD)
+      {
+        handle_toml_upload(path.size() < target.size() ? target.substr(path.size() + 1)
+                                                       : std::string_view{});
+        return;
+      }
+      if (path == macros::SERVER_PATH_UPLOAD)
+      {
+        create_chunked_upload();
+        return;
+      }
+      send_response(macros::to_string(macros::SERVER_ERROR_400)); // uploads never get here
     }
-    else
+    else if (request_.method() == http::verb::put && upload_id_of(request_.target()))
     {
-      LOG_ERROR << SERVER_UPLD_LOG << "Extraction or validation failed!";
-      send_response(macros::to_string(macros::SERVER_ERROR_400));
+      put_upload_chunk(std::string(*upload_id_of(request_.target())));
+    }
+    else if (request_.method() == http::verb::put && live_file_of(request_.target()))
+    {
+      const auto [audio_id, filename] = *live_file_of(request_.target());
+      put_live_file(std::string(audio_id), std::string(filename));
     }
+    else if (request_.method() == http::verb::get)
+    {
+      const std::string_view target = request_.target();
+      const std::string_view path   = target.substr(0, target.find('?'));
+      const std::string_view query =
+        path.size() < target.size() ? target.substr(path.size() + 1) : std::string_view{};
 
-    fs::remove(gzip_path);
+      if (path == macros::SERVER_PATH_HLS_CLIENTS) // Request for client IDs
+      {
+        handle_list_ips(query);
+      }
+      else if (auto id = upload_id_of(path))
+      {
+        std::shared_ptr<ChunkedUpload> upload = state_.uploads.find(std::string(*id), ip_id_);
+        if (!upload)
+        {
+          send_text(http::status::not_found, "Unknown upload\r\n");
+          return;
+        }
+        const ChunkedUpload::Progress progress = upload->progress();
+        send_upload_status(upload->id(), upload->length(), progress.status, progress.received);
+      }
+      else if (path == macros::SERVER_PATH_METRICS)
+      {
+        send_text(http::status::ok, state_.metrics.render(state_.cache.stats()),
+                  "text/plain; version=0.0.4");
+      }
+      else
+      {
+        handle_download(path, query);
+      }
+    }
+    else
+    {
+      send_response(macros::to_string(macros::SERVER_ERROR_405));
+    }
   }
 
   /*
@@ -582,10 +1561,10 @@ private:
    * are removed from server's filesystem.
    *
    */
-  void handle_download()
+  void handle_download(std::string_view path, std::string_view query)
   {
     // Parse request target (expected: /hls/<audio_id>/<filename>)
-    std::string              target(request_.target().begin(), request_.target().end());
+    std::string              target(path);
     std::vector<std::string> parts;
     std::istringstream       iss(target);
     std::string              token;
@@ -598,7 +1577,9 @@ private:
       }
     }
 
-    if (parts.size() < 4 || parts[0] != "hls")
+    // Dot names are storage internals (.blobs, .manifest, .incomplete, live .part files) and ".."
+    if (parts.size() < 4 || parts[0] != "hls" ||
+        std::ranges::any_of(parts, [](const std::string& part) { return part.starts_with('.'); }))
     {
       LOG_ERROR << SERVER_DWNLD_LOG << "Invalid request path: " << target;
       send_response(macros::to_string(macros::SERVER_ERROR_400));
@@ -609,155 +1590,382 @@ private:
     std::string audio_id = parts[2];
     std::string filename = parts[3];
 
+    if (filename == macros::SERVER_PATH_META && parts.size() == 4)
+    {
+      send_track_metadata(ip_addr, audio_id);
+      return;
+    }
+
+    if (auto msn = query_param(query, macros::PLAYLIST_RELOAD_PARAM);
+        msn && filename.ends_with(macros::PLAYLIST_EXT))
+    {
+      std::uint64_t sequence = 0;
+      if (!parse_u64(*msn, sequence))
+      {
+        send_text(http::status::bad_request, "Invalid _HLS_msn\r\n");
+        return;
+      }
+      if (hold_live_reload(ip_addr, audio_id, filename, sequence))
+      {
+        return;
+      }
+    }
+    serve_download(ip_addr, audio_id, filename);
+  }
+
+  /*
+   * A blocking reload (?_HLS_msn=<n>) of a live playlist waits on the session's strand until
+   * the playlist lists segment n or the hold times out, whichever comes first, and is then
+   * served like any other download. False if the reload is to be served right away.
+   */
+  auto hold_live_reload(const std::string& ip_addr, const std::string& audio_id,
+                        const std::string& filename, std::uint64_t sequence) -> bool
+  {
+    const std::string key = SegmentCache::make_key(ip_addr, audio_id, filename);
+
+    auto resume = [this, self = shared_from_this(), ip_addr, audio_id, filename](std::uint64_t id)
+    {
+      if (live_hold_ != id)
+      {
+        return; // the other of the two came first
+      }
+      live_hold_ = 0;
+      live_timer_.cancel();
+      serve_download(ip_addr, audio_id, filename);
+    };
+
+    // Set before the waiter's post can run: both happen on this strand
+    auto                    id   = std::make_shared<std::uint64_t>(0);
+    const LiveStreams::Hold hold = state_.live.hold(
+      key, sequence,
+      [this, resume, id] { net::post(socket_.get_executor(), [resume, id] { resume(*id); }); });
+
+    switch (hold.kind)
+    {
+      case LiveStreams::Hold::Kind::Now:
+        return false;
+      case LiveStreams::Hold::Kind::TooFar:
+        send_text(http::status::bad_request, "_HLS_msn too far ahead\r\n");
+        return true;
+      case LiveStreams::Hold::Kind::Held:
+        break;
+    }
+
+    *id        = hold.id;
+    live_hold_ = hold.id;
+    live_timer_.expires_after(hold.timeout);
+    live_timer_.async_wait(
+      [this, resume, key, id = hold.id](boost::system::error_code ec)
+      {
+        if (ec == net::error::operation_aborted)
+        {
+          return;
+        }
+        state_.live.cancel(key, id);
+        resume(id);
+      });
+    return true;
+  }
+
+  void serve_download(const std::string& ip_addr, const std::string& audio_id,
+                      const std::string& filename)
+  {
     // Construct the file path
     std::string file_path = macros::to_string(macros::SERVER_STORAGE_DIR) + "/" + ip_addr + "/" +
                             audio_id + "/" + filename;
 
-    if (!fs::exists(file_path) || !fs::is_regular_file(file_path))
+    const std::string_view range_header  = request_[http::field::range];
+    const std::string_view if_range      = request_[http::field::if_range];
+    const std::string_view if_none_match = request_[http::field::if_none_match];
+
+    // A live playlist changes with every segment and is never cached. Uploaded files are cached
+    // by content, so duplicate uploads share their entries.
+    const std::string path_key  = SegmentCache::make_key(ip_addr, audio_id, filename);
+    const std::string blob      = state_.catalog.blob_of(ip_addr, audio_id, filename);
+    const std::string cache_key = blob.empty() ? path_key : SegmentCache::make_blob_key(blob);
+    const bool        cacheable =
+      !filename.ends_with(macros::PLAYLIST_EXT) || !state_.live.is_live(path_key);
+    if (CachedSegmentPtr cached = cacheable ? state_.cache.find(cache_key) : nullptr)
+    {
+      if (etag_matches(if_none_match, cached->etag))
+      {
+        send_not_modified(cached->etag);
+        return;
+      }
+      const ByteRange range =
+        resolve_range(range_header, if_range, cached->etag, cached->body.size());
+      if (range.kind == ByteRange::Kind::Unsatisfiable)
+      {
+        send_unsatisfiable(cached->body.size());
+        return;
+      }
+      write_cached(std::move(cached), range);
+      LOG_DEBUG << SERVER_DWNLD_LOG << "[OWNER:" << ip_addr << "] Served (cached): " << filename
+                << " (" << audio_id << ")";
+      return;
+    }
+
+    struct stat st{};
+    if (::stat(file_path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
     {
       LOG_ERROR << SERVER_DWNLD_LOG << "File not found: " << file_path;
       send_response(macros::to_string(macros::SERVER_ERROR_404));
       return;
     }
 
-    std::ifstream file(file_path, std::ios::binary);
-    if (!file)
+    const std::string   etag  = make_etag(st);
+    const std::uint64_t size  = static_cast<std::uint64_t>(st.st_size);
+    if (etag_matches(if_none_match, etag))
     {
-      LOG_ERROR << SERVER_DWNLD_LOG << "Failed to open file: " << file_path;
-      send_response(macros::to_string(macros::SERVER_ERROR_500));
+      send_not_modified(etag);
       return;
     }
 
-    std::ostringstream buffer;
-    buffer << file.rdbuf();
-    std::string file_content = buffer.str();
-
-    std::string content_type = macros::to_string(macros::CONTENT_TYPE_OCTET_STREAM);
-    if (filename.ends_with(macros::PLAYLIST_EXT))
+    const ByteRange range = resolve_range(range_header, if_range, etag, size);
+    if (range.kind == ByteRange::Kind::Unsatisfiable)
     {
-      content_type = "application/vnd.apple.mpegurl";
+      send_unsatisfiable(size);
+      return;
     }
-    else if (filename.ends_with(macros::TRANSPORT_STREAM_EXT))
+
+    if (cacheable && state_.cache.admits(static_cast<std::size_t>(st.st_size)))
     {
-      content_type = "video/mp2t";
+      if (CachedSegmentPtr segment = load_cached_segment(file_path, st, filename))
+      {
+        state_.cache.insert(cache_key, segment);
+        write_cached(std::move(segment), range);
+        LOG_DEBUG << SERVER_DWNLD_LOG << "[OWNER:" << ip_addr << "] Served: " << filename << " ("
+                  << audio_id << ")";
+        return;
+      }
     }
 
-    // Use a shared_ptr to keep the response alive until async_write completes
-    auto response = std::make_shared<http::response<http::string_body>>();
-    response->version(request_.version());
-    response->result(http::status::ok);
-    response->set(http::field::server, "Wavy Server");
-    response->set(http::field::content_type, content_type);
-    response->body() = std::move(file_content);
-    response->prepare_payload();
+    /*
+     * The body is streamed straight from the file: file_range_body reads the requested range in
+     * small fixed-size chunks while async_write drains them into the TLS stream, so a request
+     * costs one bounded buffer instead of a heap copy of the whole segment. Single-file
+     * renditions are far too large for the cache and are always served this way, one
+     * #EXT-X-BYTERANGE slice per request.
+     *
+     * There is no sendfile()/splice() fast path: Asio's SSL engine drives OpenSSL through a
+     * memory BIO pair, so kTLS can never be enabled on these sockets and every byte has to be
+     * encrypted in user space anyway.
+     */
+    const bool                  partial = range.kind == ByteRange::Kind::Partial;
+    beast::error_code           ec;
+    file_range_body::value_type body;
+    body.open(file_path.c_str(), partial ? range.first : 0, partial ? range.length : size, ec);
+    if (ec)
+    {
+      LOG_ERROR << SERVER_DWNLD_LOG << "Failed to open file: " << file_path << " ("
+                << ec.message() << ")";
+      send_response(macros::to_string(macros::SERVER_ERROR_500));
+      return;
+    }
 
-    auto self = shared_from_this(); // Keep session alive
-    http::async_write(socket_, *response,
-                      [this, self, response](boost::system::error_code ec, std::size_t)
-                      {
-                        if (ec)
-                        {
-                          LOG_ERROR << SERVER_DWNLD_LOG << "Write error: " << ec.message();
-                        }
-                        socket_.lowest_layer().close();
-                      });
+    // Use a shared_ptr to keep the response (and the open file) alive until async_write completes
+    auto response = std::make_shared<http::response<file_range_body>>();
+    response->result(partial ? http::status::partial_content : http::status::ok);
+    response->set(http::field::content_type, content_type_for(filename));
+    response->set(http::field::etag, etag);
+    response->set(http::field::accept_ranges, "bytes");
+    if (partial)
+    {
+      response->set(http::field::content_range, content_range(range, size));
+    }
+    response->body() = std::move(body);
+    write_message(std::move(response));
 
-    LOG_INFO << SERVER_DWNLD_LOG << "[OWNER:" << ip_addr << "] Served: " << filename << " ("
-             << audio_id << ")";
+    LOG_DEBUG << SERVER_DWNLD_LOG << "[OWNER:" << ip_addr << "] Served: " << filename << " ("
+              << audio_id << ")";
   }
 
+  /*
+   * Sends a preformatted raw HTTP reply (see PROTOCOL_CONSTANTS in macros.hpp).
+   *
+   * These carry no Content-Length, so the end of the body is signalled by closing the connection:
+   * the session always shuts down afterwards.
+   */
   void send_response(const std::string& msg)
   {
     LOG_DEBUG << SERVER_LOG << "Attempting to send " << msg;
+
+    // "HTTP/1.1 NNN ..."
+    unsigned int status = 500;
+    if (msg.size() > 12)
+    {
+      std::from_chars(msg.data() + 9, msg.data() + 12, status);
+    }
+    note_response(status);
+
     auto self(shared_from_this());
-    boost::asio::async_write(socket_, boost::asio::buffer(msg),
-                             [this, self, msg_size = msg.size()](boost::system::error_code ec,
-                                                                 std::size_t bytes_transferred)
+    auto payload = std::make_shared<std::string>(msg);
+    boost::asio::async_write(socket_, boost::asio::buffer(*payload),
+                             [this, self, payload](boost::system::error_code ec,
+                                                   std::size_t               bytes_transferred)
                              {
-                               // Always perform shutdown, even on error
-                               auto do_shutdown = [this, self]()
-                               {
-                                 socket_.async_shutdown(
-                                   [this, self](boost::system::error_code shutdown_ec)
-                                   {
-                                     if (shutdown_ec)
-                                     {
-                                       LOG_ERROR << SERVER_LOG
-                                                 << "Shutdown error: " << shutdown_ec.message();
-                                     }
-                                     socket_.lowest_layer().close();
-                                   });
-                               };
-
+                               state_.metrics.add(metrics::Counter::BytesServed,
+                                                  bytes_transferred);
                                if (ec)
                                {
                                  LOG_ERROR << SERVER_LOG << "Write error: " << ec.message();
-                                 do_shutdown();
-                                 return;
                                }
-
-                               if (bytes_transferred != msg_size)
+                               else if (bytes_transferred != payload->size())
                                {
                                  LOG_ERROR << SERVER_LOG
                                            << "Incomplete write: " << bytes_transferred << " of "
-                                           << msg_size << " bytes";
-                                 do_shutdown();
-                                 return;
+                                           << payload->size() << " bytes";
                                }
 
+                               // Always perform shutdown, even on error
                                do_shutdown();
                              });
   }
+
+  void do_shutdown()
+  {
+    auto self(shared_from_this());
+    socket_.async_shutdown(
+      [this, self](boost::system::error_code shutdown_ec)
+      {
+        if (shutdown_ec && shutdown_ec != net::ssl::error::stream_truncated)
+        {
+          LOG_ERROR << SERVER_LOG << "Shutdown error: " << shutdown_ec.message();
+        }
+        boost::system::error_code close_ec;
+        socket_.lowest_layer().close(close_ec);
+      });
+  }
 };
 
 class HLS_Server
 {
 public:
-  HLS_Server(boost::asio::io_context& io_context, boost::asio::ssl::context& ssl_context,
-             short port)
-      : acceptor_(io_context, tcp::endpoint(tcp::v4(), port)), ssl_context_(ssl_context),
+  HLS_Server(net::io_context& io_context, boost::asio::ssl::context& ssl_context, short port,
+             unsigned int acceptor_count, ServerState& state)
+      : io_context_(io_context), ssl_context_(ssl_context), state_(state),
         signals_(io_context, SIGINT, SIGTERM, SIGHUP)
   {
     ensure_single_instance();
-    LOG_INFO << SERVER_LOG << "Starting HLS server on port " << port;
+    LOG_INFO << SERVER_LOG << "Starting HLS server on port " << port << " with " << acceptor_count
+             << " acceptor(s)";
 
     signals_.async_wait(
       [this](boost::system::error_code /*ec*/, int /*signo*/)
       {
         LOG_INFO << SERVER_LOG << "Termination signal received. Cleaning up...";
         cleanup();
-        std::exit(0);
+        io_context_.stop();
       });
 
-    start_accept();
+    const tcp::endpoint endpoint(tcp::v4(), port);
+    acceptors_.reserve(acceptor_count);
+    for (unsigned int i = 0; i < acceptor_count; ++i)
+    {
+      tcp::acceptor& acceptor = acceptors_.emplace_back(net::make_strand(io_context_)).socket;
+      acceptor.open(endpoint.protocol());
+      acceptor.set_option(tcp::acceptor::reuse_address(true));
+      acceptor.set_option(reuse_port(true));
+      acceptor.bind(endpoint);
+      acceptor.listen(net::socket_base::max_listen_connections);
+    }
+
+    for (Acceptor& acceptor : acceptors_)
+    {
+      start_accept(acceptor);
+    }
   }
 
   ~HLS_Server() { cleanup(); }
 
 private:
-  tcp::acceptor              acceptor_;
+  using Clock = std::chrono::steady_clock;
+
+  // A listening socket, and what it needs to back off when accepting fails
+  struct Acceptor
+  {
+    tcp::acceptor     socket;
+    net::steady_timer retry;
+    Clock::time_point logged_at;      // of the last failure logged
+    std::size_t       suppressed = 0; // failures since, not logged
+
+    explicit Acceptor(const net::strand<net::io_context::executor_type>& strand)
+        : socket(strand), retry(strand)
+    {
+    }
+  };
+
+  net::io_context&           io_context_;
+  std::vector<Acceptor>      acceptors_;
   boost::asio::ssl::context& ssl_context_;
+  ServerState&               state_;
   boost::asio::signal_set    signals_;
   int                        lock_fd_ = -1;
 
-  void start_accept()
+  void start_accept(Acceptor& acceptor)
   {
-    acceptor_.async_accept(
-      [this](boost::system::error_code ec, tcp::socket socket)
+    // Every accepted socket gets its own strand: all of a session's handlers are serialized on it
+    // while the worker threads are free to run other sessions in parallel.
+    acceptor.socket.async_accept(
+      net::make_strand(io_context_),
+      [this, &acceptor](boost::system::error_code ec, tcp::socket socket)
       {
+        if (ec == net::error::operation_aborted)
+        {
+          return;
+        }
         if (ec)
         {
-          LOG_ERROR << SERVER_LOG << "Accept failed: " << ec.message();
+          retry_accept(acceptor, ec);
+          return;
+        }
+
+        boost::system::error_code endpoint_ec;
+        auto                      remote = socket.remote_endpoint(endpoint_ec);
+        if (endpoint_ec)
+        {
+          LOG_WARNING << SERVER_LOG << "Dropping connection: " << endpoint_ec.message();
+          start_accept(acceptor);
           return;
         }
 
-        std::string ip = socket.remote_endpoint().address().to_string();
-        LOG_INFO << SERVER_LOG << "Accepted new connection from " << ip;
+        std::string ip = remote.address().to_string();
+        LOG_DEBUG << SERVER_LOG << "Accepted new connection from " << ip;
 
         auto session = std::make_shared<HLS_Session>(
-          boost::asio::ssl::stream<tcp::socket>(std::move(socket), ssl_context_), ip);
+          boost::asio::ssl::stream<tcp::socket>(std::move(socket), ssl_context_), ip, state_);
         session->start();
-        start_accept();
+        start_accept(acceptor);
+      });
+  }
+
+  /*
+   * A failed accept (EMFILE under load, mostly) would fail again straight away, so the acceptor
+   * waits WAVY_SERVER_ACCEPT_BACKOFF_MS first, and logs at most one failure a second.
+   */
+  void retry_accept(Acceptor& acceptor, const boost::system::error_code& ec)
+  {
+    const Clock::time_point now = Clock::now();
+    if (now - acceptor.logged_at >= std::chrono::seconds(1))
+    {
+      LOG_ERROR << SERVER_LOG << "Accept failed: " << ec.message() << " (" << acceptor.suppressed
+                << " more since the last report)";
+      acceptor.logged_at  = now;
+      acceptor.suppressed = 0;
+    }
+    else
+    {
+      ++acceptor.suppressed;
+    }
+
+    acceptor.retry.expires_after(std::chrono::milliseconds(WAVY_SERVER_ACCEPT_BACKOFF_MS));
+    acceptor.retry.async_wait(
+      [this, &acceptor](boost::system::error_code wait_ec)
+      {
+        if (!wait_ec)
+        {
+          start_accept(acceptor);
+        }
       });
   }
 
@@ -795,12 +2003,29 @@ private:
   }
 };
 
-auto main() -> int
+void run_worker(net::io_context& io_context)
+{
+  for (;;)
+  {
+    try
+    {
+      io_context.run();
+      return;
+    }
+    catch (const std::exception& e)
+    {
+      // A throwing handler must not take the whole worker down with it
+      LOG_ERROR << SERVER_LOG << "Worker exception: " << e.what();
+    }
+  }
+}
+
+auto main(int argc, char* argv[]) -> int
 {
   try
   {
     logger::init_logging();
-    boost::asio::io_context   io_context;
+    const ServerConfig        config = ServerConfig::from_args(argc, argv);
     boost::asio::ssl::context ssl_context(boost::asio::ssl::context::sslv23);
 
     ssl_context.set_options(
@@ -812,8 +2037,54 @@ auto main() -> int
     ssl_context.use_private_key_file(macros::to_string(macros::SERVER_PRIVATE_KEY),
                                      boost::asio::ssl::context::pem);
 
-    HLS_Server server(io_context, ssl_context, WAVY_SERVER_PORT_NO);
-    io_context.run();
+    ServerState state(config);
+    // Uploads a crash cut short leave their blobs referenced until they are removed
+    auto cleanup = [&state, unfinished = state.catalog.load()]
+    {
+      for (const std::string& dir : unfinished)
+      {
+        LOG_WARNING << SERVER_LOG << "Removing unfinished upload " << dir;
+        state.blobs.remove_audio(dir);
+      }
+      state.blobs.collect();
+    };
+    if (!state.workers.try_submit(cleanup))
+    {
+      cleanup();
+    }
+
+    // Declared after the state: sessions still queued in it when it stops use the state as they
+    // are destroyed with it
+    net::io_context io_context(static_cast<int>(config.threads));
+    HLS_Server      server(io_context, ssl_context, WAVY_SERVER_PORT_NO, config.acceptors, state);
+
+    LOG_INFO << SERVER_LOG << "Running io_context on " << config.threads << " worker thread(s), "
+             << config.workers << " extraction worker(s), " << config.uploads
+             << " concurrent upload(s)";
+
+    std::vector<std::thread> workers;
+    workers.reserve(config.threads - 1);
+    for (unsigned int i = 1; i < config.threads; ++i)
+    {
+      workers.emplace_back([&io_context] { run_worker(io_context); });
+    }
+
+    run_worker(io_context);
+
+    for (std::thread& worker : workers)
+    {
+      worker.join();
+    }
+
+    // Uploads still being extracted notice the shutdown and bail out, then their entries drain
+    state.ingests.shutdown();
+    state.workers.shutdown();
+    state.catalog.persist();
+
+    const SegmentCacheStats stats = state.cache.stats();
+    LOG_INFO << SERVER_LOG << "Segment cache: " << stats.hits << " hits, " << stats.misses
+             << " misses, " << stats.evictions << " evictions, " << stats.entries << " entries ("
+             << bytes_to_mib(stats.bytes) << " MiB)";
   }
   catch (std::exception& e)
   {